@@ -59,6 +59,12 @@ bool bitset_get(BitSet *self, uint32_t index) {
     return self->chunks[index / 64] & bitmask;
 }
 
+/* Keep only the bits that are also set in mask, one chunk at a time. Both bitsets must have the same capacity. */
+void bitset_mask(BitSet *self, BitSet *mask) {
+    for (uint32_t c = 0; c < self->nchunks; ++c)
+        self->chunks[c] &= mask->chunks[c];
+}
+
 void bitset_dump(BitSet *self) {
     for (uint32_t i = 0; i < self->capacity; ++i)
         if (bitset_get(self, i))
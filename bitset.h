@@ -27,6 +27,8 @@ void bitset_unset(BitSet *self, uint32_t index);
 
 bool bitset_get(BitSet *self, uint32_t index);
 
+void bitset_mask(BitSet *self, BitSet *mask);
+
 void bitset_dump(BitSet *self);
 
 uint32_t bitset_enumerate(BitSet *self);
@@ -0,0 +1,174 @@
+/* Copyright 2013 Bliksem Labs. See the LICENSE file at the top-level directory of this distribution and at https://github.com/bliksemlabs/rrrr/. */
+
+/* board.c : boarding kernels scanning one time column of a route block */
+
+#include "board.h"
+
+#include <stdio.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BOARD_X86
+#include <immintrin.h>
+#endif
+
+/* Whether a trip of the route is banned. The trips padding the route block may lie beyond the timetable. */
+static inline bool board_trip_banned (board_scan_t *scan, uint32_t t) {
+    uint32_t index = scan->trip_offset + t;
+    return scan->banned_trips != NULL && index < scan->banned_trips->capacity && bitset_get (scan->banned_trips, index);
+}
+
+uint32_t board_best_trip_scalar (board_scan_t *scan, rtime_t *time) {
+    uint32_t best_trip = NONE;
+    rtime_t  best_time = scan->arrive_by ? 0 : UNREACHED;
+    for (uint32_t t = 0; t < scan->n_trips; ++t) {
+        if ( ! (scan->day_mask & scan->trip_masks[t])) continue;
+        if ((scan->trip_attributes[t] & scan->required_attributes) != scan->required_attributes) continue;
+        if (board_trip_banned (scan, t)) continue;
+        uint32_t sum = scan->times[t] + scan->midnight;
+        rtime_t trip_time = sum > UNREACHED ? UNREACHED : sum;
+        if (scan->arrive_by ? trip_time <= scan->prev_time && trip_time > best_time
+                            : trip_time >= scan->prev_time && trip_time < best_time) {
+            best_trip = t;
+            best_time = trip_time;
+        }
+    }
+    *time = best_time;
+    return best_trip;
+}
+
+#ifdef BOARD_X86
+
+/* The banned bits of the 16 trips from trip b on, the first of them in the lowest bit. */
+static inline uint32_t board_banned_bits (board_scan_t *scan, uint32_t b) {
+    uint32_t index = scan->trip_offset + b;
+    uint32_t chunk = index >> 6, shift = index & 63;
+    uint64_t *chunks = scan->banned_trips->chunks;
+    uint64_t bits = chunk < scan->banned_trips->nchunks ? chunks[chunk] >> shift : 0;
+    if (shift > 48 && chunk + 1 < scan->banned_trips->nchunks) bits |= chunks[chunk + 1] << (64 - shift);
+    return bits & 0xFFFF;
+}
+
+/* The vectorised kernels turn every trip into a 16-bit key, 0xFFFF for the trips that cannot be boarded, and find
+   the lowest index holding the smallest key. For depart-after searches the key is the time itself. For arrive-by
+   searches it is the complemented time, so that the latest arrival gives the smallest key. A key of 0xFFFF is never
+   chosen, which matches the scalar kernel: it never picks UNREACHED departures nor arrivals at time 0. */
+
+__attribute__((target("avx2")))
+static uint32_t board_best_trip_avx2 (board_scan_t *scan, rtime_t *time) {
+    const __m256i ones     = _mm256_set1_epi16 (-1);
+    const __m256i zero     = _mm256_setzero_si256 ();
+    const __m256i midnight = _mm256_set1_epi16 (scan->midnight);
+    const __m256i prev     = _mm256_set1_epi16 (scan->prev_time);
+    const __m256i day      = _mm256_set1_epi32 (scan->day_mask);
+    const __m256i required = _mm256_set1_epi16 (scan->required_attributes);
+    const __m256i lane_bit = _mm256_setr_epi16 (1 << 0, 1 << 1, 1 << 2, 1 << 3, 1 << 4, 1 << 5, 1 << 6, 1 << 7, 1 << 8,
+                                                1 << 9, 1 << 10, 1 << 11, 1 << 12, 1 << 13, 1 << 14, (short) (1 << 15));
+    uint32_t best_trip = NONE;
+    uint16_t best_key  = 0xFFFF;
+    for (uint32_t b = 0; b < scan->n_trips; b += 16) {
+        __m256i t = _mm256_adds_epu16 (_mm256_load_si256 ((__m256i *) (scan->times + b)), midnight);
+        /* 32-bit calendar test on two registers, narrowed to 16-bit lanes in trip order */
+        __m256i idle0 = _mm256_cmpeq_epi32 (_mm256_and_si256 (_mm256_loadu_si256 ((__m256i *) (scan->trip_masks + b)), day), zero);
+        __m256i idle1 = _mm256_cmpeq_epi32 (_mm256_and_si256 (_mm256_loadu_si256 ((__m256i *) (scan->trip_masks + b + 8)), day), zero);
+        __m256i idle  = _mm256_permute4x64_epi64 (_mm256_packs_epi32 (idle0, idle1), 0xD8);
+        __m256i attributes = _mm256_cvtepu8_epi16 (_mm_loadu_si128 ((__m128i *) (scan->trip_attributes + b)));
+        __m256i valid = _mm256_cmpeq_epi16 (_mm256_and_si256 (attributes, required), required);
+        valid = _mm256_andnot_si256 (idle, valid);
+        if (scan->banned_trips != NULL) {
+            __m256i banned = _mm256_and_si256 (_mm256_set1_epi16 (board_banned_bits (scan, b)), lane_bit);
+            valid = _mm256_andnot_si256 (_mm256_cmpeq_epi16 (banned, lane_bit), valid);
+        }
+        __m256i key;
+        if (scan->arrive_by) {
+            valid = _mm256_and_si256 (valid, _mm256_cmpeq_epi16 (_mm256_min_epu16 (t, prev), t));
+            key = _mm256_xor_si256 (_mm256_and_si256 (t, valid), ones);
+        } else {
+            valid = _mm256_and_si256 (valid, _mm256_cmpeq_epi16 (_mm256_max_epu16 (t, prev), t));
+            key = _mm256_or_si256 (t, _mm256_andnot_si256 (valid, ones));
+        }
+        __m128i half = _mm_min_epu16 (_mm256_castsi256_si128 (key), _mm256_extracti128_si256 (key, 1));
+        uint16_t block_key = _mm_extract_epi16 (_mm_minpos_epu16 (half), 0);
+        if (block_key < best_key) {
+            uint32_t hits = _mm256_movemask_epi8 (_mm256_cmpeq_epi16 (key, _mm256_set1_epi16 (block_key)));
+            best_key  = block_key;
+            best_trip = b + __builtin_ctz (hits) / 2;
+        }
+    }
+    *time = scan->arrive_by ? (rtime_t) ~best_key : best_key;
+    return best_trip;
+}
+
+__attribute__((target("sse4.1")))
+static uint32_t board_best_trip_sse41 (board_scan_t *scan, rtime_t *time) {
+    const __m128i ones     = _mm_set1_epi16 (-1);
+    const __m128i zero     = _mm_setzero_si128 ();
+    const __m128i midnight = _mm_set1_epi16 (scan->midnight);
+    const __m128i prev     = _mm_set1_epi16 (scan->prev_time);
+    const __m128i day      = _mm_set1_epi32 (scan->day_mask);
+    const __m128i required = _mm_set1_epi16 (scan->required_attributes);
+    const __m128i lane_bit = _mm_setr_epi16 (1 << 0, 1 << 1, 1 << 2, 1 << 3, 1 << 4, 1 << 5, 1 << 6, 1 << 7);
+    uint32_t best_trip = NONE;
+    uint16_t best_key  = 0xFFFF;
+    for (uint32_t b = 0; b < scan->n_trips; b += 8) {
+        __m128i t = _mm_adds_epu16 (_mm_load_si128 ((__m128i *) (scan->times + b)), midnight);
+        __m128i idle0 = _mm_cmpeq_epi32 (_mm_and_si128 (_mm_loadu_si128 ((__m128i *) (scan->trip_masks + b)), day), zero);
+        __m128i idle1 = _mm_cmpeq_epi32 (_mm_and_si128 (_mm_loadu_si128 ((__m128i *) (scan->trip_masks + b + 4)), day), zero);
+        __m128i idle  = _mm_packs_epi32 (idle0, idle1);
+        __m128i attributes = _mm_cvtepu8_epi16 (_mm_loadl_epi64 ((__m128i *) (scan->trip_attributes + b)));
+        __m128i valid = _mm_cmpeq_epi16 (_mm_and_si128 (attributes, required), required);
+        valid = _mm_andnot_si128 (idle, valid);
+        if (scan->banned_trips != NULL) {
+            __m128i banned = _mm_and_si128 (_mm_set1_epi16 (board_banned_bits (scan, b)), lane_bit);
+            valid = _mm_andnot_si128 (_mm_cmpeq_epi16 (banned, lane_bit), valid);
+        }
+        __m128i key;
+        if (scan->arrive_by) {
+            valid = _mm_and_si128 (valid, _mm_cmpeq_epi16 (_mm_min_epu16 (t, prev), t));
+            key = _mm_xor_si128 (_mm_and_si128 (t, valid), ones);
+        } else {
+            valid = _mm_and_si128 (valid, _mm_cmpeq_epi16 (_mm_max_epu16 (t, prev), t));
+            key = _mm_or_si128 (t, _mm_andnot_si128 (valid, ones));
+        }
+        /* minpos yields the smallest key and the lowest lane holding it */
+        __m128i minpos = _mm_minpos_epu16 (key);
+        uint16_t block_key = _mm_extract_epi16 (minpos, 0);
+        if (block_key < best_key) {
+            best_key  = block_key;
+            best_trip = b + _mm_extract_epi16 (minpos, 1);
+        }
+    }
+    *time = scan->arrive_by ? (rtime_t) ~best_key : best_key;
+    return best_trip;
+}
+
+#endif // BOARD_X86
+
+static uint32_t (*board_kernel) (board_scan_t *, rtime_t *) = NULL;
+static const char *board_kernel_selected = "scalar";
+
+/* Pick the widest kernel this CPU supports. Selecting twice is harmless, so no locking is needed. */
+static void board_select_kernel (void) {
+    uint32_t (*kernel) (board_scan_t *, rtime_t *) = board_best_trip_scalar;
+#ifdef BOARD_X86
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("avx2")) {
+        kernel = board_best_trip_avx2;
+        board_kernel_selected = "avx2";
+    } else if (__builtin_cpu_supports ("sse4.1")) {
+        kernel = board_best_trip_sse41;
+        board_kernel_selected = "sse4.1";
+    }
+#endif
+    board_kernel = kernel;
+}
+
+uint32_t board_best_trip (board_scan_t *scan, rtime_t *time) {
+    if (board_kernel == NULL) board_select_kernel ();
+    return board_kernel (scan, time);
+}
+
+const char *board_kernel_name (void) {
+    if (board_kernel == NULL) board_select_kernel ();
+    return board_kernel_selected;
+}
+
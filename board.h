@@ -0,0 +1,43 @@
+/* Copyright 2013 Bliksem Labs. See the LICENSE file at the top-level directory of this distribution and at https://github.com/bliksemlabs/rrrr/. */
+
+/* board.h : find the trip to board at one stop of a route, scanning one time column of its route block */
+
+#ifndef _BOARD_H
+#define _BOARD_H
+
+#include "util.h"
+#include "tdata.h"
+#include "bitset.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct board_scan board_scan_t;
+struct board_scan {
+    rtime_t    *times;              // departures (or arrivals when arrive_by) of all trips at one route stop, 32-byte aligned
+    calendar_t *trip_masks;
+    uint8_t    *trip_attributes;
+    uint32_t    n_trips;            // a multiple of 16, i.e. the route block stride
+    calendar_t  day_mask;           // the service day being searched
+    uint8_t     required_attributes;
+    BitSet     *banned_trips;       // the banned trips among all trips of the timetable, NULL if no trip is banned
+    uint32_t    trip_offset;        // the index of the first trip of the route among all trips of the timetable
+    rtime_t     midnight;           // added to the scheduled times, saturating to UNREACHED
+    rtime_t     prev_time;          // the time at which the stop was reached
+    bool        arrive_by;
+};
+
+/* Return the trip departing soonest at or after prev_time (arriving latest at or before prev_time for arrive-by
+   searches) among the trips running on the service day and having the required attributes, or NONE.
+   On ties the lowest trip index wins, like a linear scan. Real-time delays are not applied, so the caller must only
+   use this on routes without delays or cancellations. */
+uint32_t board_best_trip (board_scan_t *scan, rtime_t *time);
+
+/* The portable implementation, always available. Exposed for testing and benchmarking the vectorised kernels. */
+uint32_t board_best_trip_scalar (board_scan_t *scan, rtime_t *time);
+
+/* The name of the kernel selected for this CPU by board_best_trip. */
+const char *board_kernel_name (void);
+
+#endif // _BOARD_H
+
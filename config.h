@@ -4,27 +4,63 @@
 
 #define RRRR_TEST_CONCURRENCY 4
 #define RRRR_INPUT_FILE "timetable.dat"
+#define RRRR_PATTERNS_FILE "transferpatterns.dat"
+// the name of the shared memory holding real-time data, written by rrrrealtime for processes on its host to follow
+#define RRRR_REALTIME_OVERLAY "/rrrr-realtime"
+// the most stops of trips with real-time delays per stop the overlay can hold, sizing it. Its memory is only committed
+// as it is used, and the slots of trips without delays per stop any more are reclaimed once it is full.
+#ifndef RRRR_REALTIME_STOP_UPDATES
+#define RRRR_REALTIME_STOP_UPDATES (1 << 20)
+#endif
 
+// the most rounds a router can be set up for, which sizes the itineraries and plans it returns
+// router_setup refuses more than this, so raise it here to search more rounds
+#define RRRR_MAX_ROUNDS 8
+// the rounds a router is set up for unless its program is told otherwise, sizing its scratch space, from 1 up to
+// RRRR_MAX_ROUNDS. The initial state is kept in an extra round of its own.
 // runtime increases roughly linearly with this value, though with target pruning it no longer seems to have as much effect
-// this must be set to at least 2, because we re-use one array for the initial state
-#define RRRR_MAX_ROUNDS 6
+#define RRRR_DEFAULT_ROUNDS 6
 
 /* note that these values can cause missed transfers until we have guaranteed / timed transfers */
 
 // specify in seconds
 #define RRRR_WALK_SLACK_SEC  0
+// the walk speeds in meters per second that requests are snapped to, each with its own table of transfer durations
+#define RRRR_WALK_SPEEDS { 1.0, 1.5, 2.0 }
+#define RRRR_N_WALK_SPEEDS 3
 // specify in internal 4-second intervals!
 #define RRRR_XFER_SLACK_4SEC 0
 
+// the most routes, stops, hard banned stops and trips a request can ban, each, sizing the request structure
+#define RRRR_MAX_BANNED 16
+
 // TODO: Max transfer time to avoid unnecessary branching?
 
+// with router_setup_threads, a round is only shared out when it has this many routes to scan or stops to transfer from
+#define RRRR_PARALLEL_MIN_ROUTES 256
+#define RRRR_PARALLEL_MIN_STOPS  512
+// the number of routes or stops a thread takes at a time
+#define RRRR_PARALLEL_CHUNK 16
+
+// the number of departure times a one-to-all search serves at once, one per vector lane (16 fill an AVX2 register)
+#define RRRR_ISOCHRONE_LANES 16
+
+// the most service alerts shown for a single leg of an itinerary
+#define RRRR_MAX_LEG_ALERTS 8
+
 // bind does not work with names (localhost) but does work with * (all interfaces)
 #define CLIENT_ENDPOINT "tcp://127.0.0.1:9292"
 #define WORKER_ENDPOINT "tcp://127.0.0.1:9293"
 
+// rrrrealtime publishes batches of real-time deltas here, to which the workers subscribe
+#define REALTIME_ENDPOINT "tcp://127.0.0.1:9294"
+// the seconds between full batches, from which workers that started late or missed a batch catch up
+#define RRRR_REALTIME_FULL_INTERVAL 60
+
 // use named pipes instead
 // #define CLIENT_ENDPOINT "ipc://client_pipe"
 // #define WORKER_ENDPOINT "ipc://worker_pipe"
+// #define REALTIME_ENDPOINT "ipc://realtime_pipe"
 
 // #define RRRR_INFO
 // #define RRRR_DEBUG // do not name this DEBUG because some IDEs may define DEBUG
@@ -0,0 +1,519 @@
+/* Copyright 2013 Bliksem Labs. See the LICENSE file at the top-level directory of this distribution and at https://github.com/bliksemlabs/rrrr/. */
+
+/* csa.c : the Connection Scan Algorithm, for single searches and profiles */
+
+#include "csa.h"
+#include "router_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* The numbers of rides a Connection Scan search keeps labels for, from 0 up to RRRR_MAX_ROUNDS. */
+#define CSA_LEVELS (RRRR_MAX_ROUNDS + 1)
+/* Marks trips filtered out of a Connection Scan search in router->csa_trip_rides. */
+#define CSA_UNUSABLE 0xFF
+/* A connection on one of the three service days of a search. */
+#define CSA_EVENT(connection, serviceday) ((connection) * 3 + (serviceday))
+
+/* How a stop was reached with some number of rides in a Connection Scan search: by walking from the arrival stop of
+   the connection where the last trip was left, having boarded it at another connection. Both are CSA_EVENTs. */
+typedef struct csa_label csa_label_t;
+struct csa_label {
+    uint32_t enter;     // NONE when the stop was reached by walking from the origin
+    uint32_t exit;
+    uint32_t walk_from;
+    uint32_t n_rides;   // the rides including the last trip, which can be fewer than the label's own number of rides
+};
+
+/* One departure in the profile of a stop in a profile Connection Scan search: leaving the stop at the given time,
+   the soonest arrival at the target with at most r + 1 rides is arrival[r]. It boards at connection enter[r], leaves
+   the trip at exit[r] and walks on to next[r], which is NONE for the target. The same struct holds the arrivals when
+   staying on board a trip, without a time and enter. */
+typedef struct csa_departure csa_departure_t;
+struct csa_departure {
+    rtime_t  time;
+    rtime_t  arrival[RRRR_MAX_ROUNDS];
+    uint32_t enter[RRRR_MAX_ROUNDS];
+    uint32_t exit[RRRR_MAX_ROUNDS];
+    uint32_t next[RRRR_MAX_ROUNDS];
+};
+
+/* Prepare the service days and the trips that can be used, allocating the scratch space on first use. */
+static void csa_setup (router_t *router, router_request_t *req) {
+    tdata_t *tdata = router->tdata;
+    if (router->csa_trip_rides == NULL) {
+        router->csa_trip_rides = (uint8_t *) malloc (sizeof(uint8_t) * tdata->n_trips * 3);
+        if (router->csa_trip_rides == NULL) die ("failed to allocate connection scan scratch space");
+    }
+    router_setup_servicedays (router, req);
+    router_compile_request (router, req);
+    router->origin = req->from;
+    router->target = req->to;
+    /* Fold every filter on routes and trips into one byte per trip and service day, so that the scan only reads that. */
+    for (uint32_t d = 0; d < 3; ++d) {
+        uint8_t *rides = router->csa_trip_rides + d * tdata->n_trips;
+        for (uint32_t route_idx = 0; route_idx < tdata->n_routes; ++route_idx) {
+            route_t *route = tdata->routes + route_idx;
+            bool usable = route_usable (router, route_idx);
+            trip_t *trips = tdata_trips_for_route (tdata, route_idx);
+            calendar_t *trip_masks = tdata_trip_masks_for_route (tdata, route_idx);
+            uint8_t *trip_attributes = tdata_trip_attributes_for_route (tdata, route_idx);
+            for (uint32_t trip = 0; trip < route->n_trips; ++trip) {
+                rides[route->trip_ids_offset + trip] =
+                    usable && trip_usable (router, req, route_idx, trip, trips, trip_masks, trip_attributes, router->servicedays + d) ? 0 : CSA_UNUSABLE;
+            }
+        }
+    }
+}
+
+/* The first connection departing at or after the given time, counting from the midnight of its service day. */
+static uint32_t csa_first_departure (tdata_t *tdata, uint32_t time) {
+    uint32_t lo = 0, hi = tdata->n_connections;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (tdata->connections[mid].dep_time < time) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* The route stop a connection of a trip (a global trip index) departs from. Connections do not say, so it is only
+   looked up for trips with delays per stop, which need it. */
+static uint32_t csa_route_stop (tdata_t *tdata, uint32_t trip, connection_t *c) {
+    if (tdata->trip_delays[trip] != STOP_UPDATES) return 0;
+    uint32_t route_idx = tdata_route_for_trip (tdata, trip);
+    uint32_t *route_stops = tdata_stops_for_route (tdata, route_idx);
+    for (uint32_t route_stop = 0; route_stop + 1 < tdata->routes[route_idx].n_stops; ++route_stop) {
+        if (route_stops[route_stop] == c->dep_stop && tdata_depart (tdata, tdata->trips + trip, route_stop) == c->dep_time)
+            return route_stop;
+    }
+    return 0;
+}
+
+/* Fill in a ride from the connection where a trip is boarded to the one where it is left. */
+static void csa_ride_leg (router_t *router, uint32_t enter, uint32_t exit, struct leg *l) {
+    tdata_t *tdata = router->tdata;
+    connection_t *c0 = tdata->connections + enter / 3;
+    connection_t *c1 = tdata->connections + exit / 3;
+    uint32_t trip = CONNECTION_TRIP(c0);
+    l->s0 = c0->dep_stop;
+    l->s1 = c1->arr_stop;
+    l->t0 = serviceday_time (tdata, c0->dep_time, trip, csa_route_stop (tdata, trip, c0), false, router->servicedays + enter % 3);
+    l->t1 = serviceday_time (tdata, c1->arr_time, trip, csa_route_stop (tdata, trip, c1) + 1, true, router->servicedays + exit % 3);
+    l->route = tdata_route_for_trip (tdata, trip);
+    l->trip  = trip - tdata->routes[l->route].trip_ids_offset;
+}
+
+/* Lower the earliest time at a stop with at most n rides, and with more rides as far as that is an improvement.
+   Times no sooner than the target is reached with as many rides are pruned, as router_route does. */
+static inline void csa_improve (router_t *router, uint32_t n, uint32_t stop, rtime_t time, csa_label_t *label) {
+    rtime_t *times = router->csa_times + stop * CSA_LEVELS;
+    csa_label_t *labels = router->csa_labels + stop * CSA_LEVELS;
+    rtime_t *at_target = router->csa_times + router->target * CSA_LEVELS;
+    for ( ; n < CSA_LEVELS && time < times[n] && (time < at_target[n] || stop == router->target); ++n) {
+        times[n] = time;
+        labels[n] = *label;
+    }
+}
+
+/* Follow the labels back from the target with at most n rides, filling in the legs of an itinerary. */
+static void csa_label_to_itinerary (router_t *router, router_request_t *req, uint32_t n, struct itinerary *itin) {
+    tdata_t *tdata = router->tdata;
+    csa_label_t chain[RRRR_MAX_ROUNDS];
+    uint32_t walk_to[RRRR_MAX_ROUNDS];
+    rtime_t walk_time[RRRR_MAX_ROUNDS];
+    uint32_t n_rides = 0;
+    uint32_t stop = req->to;
+    while (n_rides < RRRR_MAX_ROUNDS) {
+        csa_label_t *label = router->csa_labels + stop * CSA_LEVELS + n;
+        if (label->enter == NONE) break;
+        chain[n_rides] = *label;
+        walk_to[n_rides] = stop;
+        walk_time[n_rides] = router->csa_times[stop * CSA_LEVELS + n];
+        n_rides += 1;
+        stop = tdata->connections[label->enter / 3].dep_stop;
+        n = label->n_rides - 1;
+    }
+    itin->n_rides = n_rides;
+    itin->n_legs = n_rides * 2 + 1;
+    struct leg *l = itin->legs;
+    l->s0 = req->from;
+    l->s1 = stop;
+    l->t0 = req->time;
+    l->t1 = req->time + transfer_duration (router, req->from, stop);
+    l->route = WALK;
+    l->trip  = WALK;
+    for (uint32_t r = n_rides; r-- > 0; ) {
+        l += 1;
+        csa_ride_leg (router, chain[r].enter, chain[r].exit, l);
+        l += 1;
+        l->s0 = chain[r].walk_from;
+        l->s1 = walk_to[r];
+        l->t0 = (l - 1)->t1;
+        l->t1 = walk_time[r];
+        l->route = WALK;
+        l->trip  = WALK;
+    }
+}
+
+/*
+  Answer a request with the Connection Scan Algorithm: one pass over the connections in the timetable in order of
+  departure, merging the three service days, which boards a trip wherever its departure stop is reached in time and
+  improves the stops around every arrival. Labels are kept per number of rides, so the plan holds the soonest arrival
+  for each number of rides that improves on fewer rides, like router_result_to_plan. The connections are sorted by
+  scheduled time, so with real-time delays the journeys found remain valid but one using a delayed trip can be missed.
+  Returns false if the timetable has no connections, for arrive-by and on-board requests and those with a via stop,
+  or if nothing is found.
+*/
+bool router_route_csa (router_t *router, router_request_t *req, struct plan *plan) {
+    tdata_t *tdata = router->tdata;
+    plan->req = *req;
+    plan->n_itineraries = 0;
+    if (tdata->connections == NULL || req->arrive_by || req->start_trip_trip != NONE || req->via != NONE) return false;
+    if (router->csa_times == NULL) {
+        router->csa_times = (rtime_t *) malloc (sizeof(rtime_t) * tdata->n_stops * CSA_LEVELS);
+        router->csa_ride_times = (rtime_t *) malloc (sizeof(rtime_t) * tdata->n_stops * CSA_LEVELS);
+        router->csa_labels = (csa_label_t *) malloc (sizeof(csa_label_t) * tdata->n_stops * CSA_LEVELS);
+        router->csa_trip_enter = (uint32_t *) malloc (sizeof(uint32_t) * tdata->n_trips * 3);
+        if (router->csa_times == NULL || router->csa_ride_times == NULL || router->csa_labels == NULL || router->csa_trip_enter == NULL)
+            die ("failed to allocate connection scan scratch space");
+    }
+    csa_setup (router, req);
+    memset (router->csa_times, 0xFF, sizeof(rtime_t) * tdata->n_stops * CSA_LEVELS);
+    memset (router->csa_ride_times, 0xFF, sizeof(rtime_t) * tdata->n_stops * CSA_LEVELS);
+
+    /* With no rides, only the origin and the stops around it are reached. */
+    csa_label_t label = { NONE, NONE, req->from, 0 };
+    csa_improve (router, 0, req->from, req->time, &label);
+    if ( ! stop_banned (router, req, req->from)) {
+        uint32_t tr     = tdata->stops[req->from    ].transfers_offset;
+        uint32_t tr_end = tdata->stops[req->from + 1].transfers_offset;
+        for ( ; tr < tr_end ; ++tr) {
+            uint32_t time = req->time + router->walk_durations[tr];
+            if (time > RTIME_THREE_DAYS) continue;
+            csa_improve (router, 0, tdata->transfer_target_stops[tr], time, &label);
+        }
+    }
+
+    uint32_t n_rides = request_rounds (router, req);
+    uint32_t limit = req->time_cutoff == UNREACHED ? RTIME_THREE_DAYS : req->time_cutoff;
+    rtime_t *at_target = router->csa_times + req->to * CSA_LEVELS;
+    /* One cursor into the connections per service day, merged in order of departure. */
+    uint32_t next[3];
+    for (uint32_t d = 0; d < 3; ++d) {
+        rtime_t midnight = router->servicedays[d].midnight;
+        next[d] = router->servicedays[d].mask ? csa_first_departure (tdata, req->time > midnight ? req->time - midnight : 0)
+                                              : tdata->n_connections;
+    }
+    while (true) {
+        uint32_t d = 3, key = UINT32_MAX;
+        for (uint32_t i = 0; i < 3; ++i) {
+            if (next[i] == tdata->n_connections) continue;
+            uint32_t k = tdata->connections[next[i]].dep_time + router->servicedays[i].midnight;
+            if (k < key) {
+                key = k;
+                d = i;
+            }
+        }
+        /* Nothing departing after the target is reached with a single ride can improve on any number of rides. */
+        if (d == 3 || key > limit || key >= at_target[1]) break;
+        uint32_t c_idx = next[d]++;
+        connection_t *c = tdata->connections + c_idx;
+        uint32_t trip = CONNECTION_TRIP(c);
+        uint8_t *rides = router->csa_trip_rides + d * tdata->n_trips + trip;
+        if (*rides == CSA_UNUSABLE) continue;
+        serviceday_t *serviceday = router->servicedays + d;
+        uint32_t route_stop = csa_route_stop (tdata, trip, c);
+        /* Either is UNREACHED where the trip skips the stop, but it can still be ridden on. */
+        rtime_t dep = serviceday_time (tdata, c->dep_time, trip, route_stop, false, serviceday);
+        rtime_t arr = serviceday_time (tdata, c->arr_time, trip, route_stop + 1, true, serviceday);
+        /* A trip cannot be ridden through a hard banned stop, but it can be boarded after it. */
+        if (stop_banned_hard (router, req, c->arr_stop)) {
+            *rides = 0;
+            continue;
+        }
+        if ((c->trip & CONNECTION_BOARDING) && dep != UNREACHED && ! stop_banned (router, req, c->dep_stop)) {
+            /* Board with the fewest rides that reach the departure stop in time, if that is fewer than on board. */
+            rtime_t *times = router->csa_times + c->dep_stop * CSA_LEVELS;
+            uint32_t fewer = *rides ? *rides - 1u : n_rides;
+            uint32_t n = 0;
+            while (n < fewer && times[n] > dep) ++n;
+            if (n < fewer && dep < at_target[n + 1]) {
+                *rides = n + 1;
+                router->csa_trip_enter[d * tdata->n_trips + trip] = CSA_EVENT(c_idx, d);
+            }
+        }
+        if (*rides == 0 || arr == UNREACHED || ! (c->trip & CONNECTION_ALIGHTING)) continue;
+        if (stop_banned (router, req, c->arr_stop)) continue;
+        /* Leave the trip and walk on, unless the stop was already reached by riding as soon with as few rides. */
+        rtime_t *ride_times = router->csa_ride_times + c->arr_stop * CSA_LEVELS;
+        uint32_t n = *rides;
+        if (arr >= ride_times[n]) continue;
+        for (uint32_t m = n; m < CSA_LEVELS && arr < ride_times[m]; ++m) ride_times[m] = arr;
+        label = (csa_label_t) { router->csa_trip_enter[d * tdata->n_trips + trip], CSA_EVENT(c_idx, d), c->arr_stop, n };
+        csa_improve (router, n, c->arr_stop, arr, &label);
+        uint32_t tr     = tdata->stops[c->arr_stop    ].transfers_offset;
+        uint32_t tr_end = tdata->stops[c->arr_stop + 1].transfers_offset;
+        for ( ; tr < tr_end ; ++tr) {
+            uint32_t time = arr + router->walk_durations[tr];
+            if (time > RTIME_THREE_DAYS) continue;
+            csa_improve (router, n, tdata->transfer_target_stops[tr], time, &label);
+        }
+    }
+
+    /* Rides must beat walking straight to the target, as in router_route. */
+    for (uint32_t n = 1; n <= n_rides; ++n) {
+        if (at_target[n] >= at_target[n - 1] || at_target[n] > limit) continue;
+        struct itinerary itin;
+        csa_label_to_itinerary (router, req, n, &itin);
+        /* A label used by a trip can have been improved with fewer rides since, which only makes the journey shorter. */
+        while (plan->n_itineraries > 0 && plan->itineraries[plan->n_itineraries - 1].n_rides >= itin.n_rides) plan->n_itineraries -= 1;
+        plan->itineraries[plan->n_itineraries++] = itin;
+    }
+    return plan->n_itineraries > 0;
+}
+
+/* The soonest departure in the profile of a stop at or after the given time, NULL if there is none. */
+static inline csa_departure_t *csa_profile_at (csa_profile_t *profile, rtime_t time) {
+    uint32_t lo = 0, hi = profile->n_departures;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (profile->departures[mid].time >= time) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo > 0 ? profile->departures + lo - 1 : NULL;
+}
+
+/* Add boarding a trip at a stop at the given time to the profile of the stop, as far as it improves on the departures
+   already there, which all leave later. */
+static void csa_profile_add (csa_profile_t *profile, rtime_t time, csa_departure_t *on_board, uint32_t enter, uint32_t n_rides) {
+    csa_departure_t *last = profile->n_departures > 0 ? profile->departures + profile->n_departures - 1 : NULL;
+    /* A delayed trip can be scanned out of order. Leaving it out keeps the departures sorted. */
+    if (last != NULL && time > last->time) return;
+    bool improves = false;
+    for (uint32_t r = 0; r < n_rides; ++r) {
+        if (on_board->arrival[r] < (last != NULL ? last->arrival[r] : UNREACHED)) improves = true;
+    }
+    if ( ! improves) return;
+    if (last == NULL || time < last->time) {
+        if (profile->n_departures == profile->capacity) {
+            profile->capacity = profile->capacity ? profile->capacity * 2 : 8;
+            profile->departures = (csa_departure_t *) realloc (profile->departures, sizeof(csa_departure_t) * profile->capacity);
+            if (profile->departures == NULL) die ("failed to allocate connection scan profiles");
+        }
+        csa_departure_t *departure = profile->departures + profile->n_departures++;
+        if (profile->n_departures > 1) *departure = *(departure - 1);
+        else for (uint32_t r = 0; r < RRRR_MAX_ROUNDS; ++r) departure->arrival[r] = UNREACHED;
+        departure->time = time;
+        last = departure;
+    }
+    for (uint32_t r = 0; r < n_rides; ++r) {
+        if (on_board->arrival[r] >= last->arrival[r]) continue;
+        last->arrival[r] = on_board->arrival[r];
+        last->enter[r] = enter;
+        last->exit[r] = on_board->exit[r];
+        last->next[r] = on_board->next[r];
+    }
+}
+
+/* Follow a departure in a profile with at most r + 1 rides, after walking to its stop from the origin at the given
+   time, filling in the legs of an itinerary. */
+static void csa_departure_to_itinerary (router_t *router, router_request_t *req, rtime_t time, uint32_t stop,
+                                        csa_departure_t *departure, uint32_t r, struct itinerary *itin) {
+    struct leg *l = itin->legs;
+    l->s0 = req->from;
+    l->s1 = stop;
+    l->t0 = time;
+    l->t1 = time + transfer_duration (router, req->from, stop);
+    l->route = WALK;
+    l->trip  = WALK;
+    itin->n_rides = 0;
+    while (departure != NULL && itin->n_rides < RRRR_MAX_ROUNDS) {
+        l += 1;
+        csa_ride_leg (router, departure->enter[r], departure->exit[r], l);
+        l += 1;
+        l->s0 = (l - 1)->s1;
+        l->s1 = departure->next[r] == NONE ? req->to : departure->next[r];
+        l->t0 = (l - 1)->t1;
+        l->t1 = l->t0 + transfer_duration (router, l->s0, l->s1);
+        l->route = WALK;
+        l->trip  = WALK;
+        itin->n_rides += 1;
+        if (departure->next[r] == NONE || r == 0) break;
+        /* The departures at the next stop can only have improved since this one was found. */
+        departure = csa_profile_at (router->csa_profiles + l->s1, l->t1);
+        r -= 1;
+    }
+    itin->n_legs = itin->n_rides * 2 + 1;
+}
+
+/* A departure from the origin in a profile Connection Scan search, walking to the stop of a departure in its profile. */
+typedef struct csa_origin_departure csa_origin_departure_t;
+struct csa_origin_departure {
+    rtime_t time;
+    uint32_t stop;
+    csa_departure_t *departure;
+};
+
+static int compare_origin_departures (const void *a, const void *b) {
+    return ((csa_origin_departure_t *) b)->time - ((csa_origin_departure_t *) a)->time;
+}
+
+/*
+  A profile search with the Connection Scan Algorithm: one pass over the connections from the latest to the earliest
+  departure, building for every stop the Pareto-optimal departures towards the target with each number of rides, like
+  router_route_profile but without a search per departure time. The profile holds every itinerary departing within
+  the request's window that is Pareto-optimal in departure time, arrival time and number of rides, with those leaving
+  after the window reported as departing at its end. Only depart-after requests not starting on board and without a
+  via stop are supported. Delays are handled as in router_route_csa.
+*/
+bool router_route_csa_profile (router_t *router, router_request_t *req, struct profile *profile) {
+    tdata_t *tdata = router->tdata;
+    profile->req = *req;
+    profile->n_itineraries = 0;
+    if (tdata->connections == NULL || req->arrive_by || req->start_trip_trip != NONE || req->via != NONE) return false;
+    if (router->csa_profiles == NULL) {
+        router->csa_profiles = (csa_profile_t *) calloc (tdata->n_stops, sizeof(csa_profile_t));
+        router->csa_trips = (csa_departure_t *) malloc (sizeof(csa_departure_t) * tdata->n_trips * 3);
+        if (router->csa_profiles == NULL || router->csa_trips == NULL) die ("failed to allocate connection scan profiles");
+    }
+    csa_setup (router, req);
+    walk_to_target_setup (router, req);
+    for (uint32_t s = 0; s < tdata->n_stops; ++s) router->csa_profiles[s].n_departures = 0;
+
+    uint32_t n_rides = request_rounds (router, req);
+    uint32_t limit = req->time_cutoff == UNREACHED ? RTIME_THREE_DAYS : req->time_cutoff;
+    /* One cursor into the connections per service day, just past the last one departing in time, merged backward. */
+    uint32_t next[3];
+    for (uint32_t d = 0; d < 3; ++d) {
+        rtime_t midnight = router->servicedays[d].midnight;
+        next[d] = router->servicedays[d].mask && limit >= midnight ? csa_first_departure (tdata, limit - midnight + 1) : 0;
+    }
+    while (true) {
+        uint32_t d = 3, key = 0;
+        for (uint32_t i = 0; i < 3; ++i) {
+            if (next[i] == 0) continue;
+            uint32_t k = tdata->connections[next[i] - 1].dep_time + router->servicedays[i].midnight;
+            if (d == 3 || k > key) {
+                key = k;
+                d = i;
+            }
+        }
+        if (d == 3 || key < req->time) break;
+        uint32_t c_idx = --next[d];
+        connection_t *c = tdata->connections + c_idx;
+        uint32_t trip = CONNECTION_TRIP(c);
+        uint8_t *state = router->csa_trip_rides + d * tdata->n_trips + trip;
+        if (*state == CSA_UNUSABLE) continue;
+        serviceday_t *serviceday = router->servicedays + d;
+        uint32_t route_stop = csa_route_stop (tdata, trip, c);
+        /* Either is UNREACHED where the trip skips the stop, but it can still be ridden on. */
+        rtime_t dep = serviceday_time (tdata, c->dep_time, trip, route_stop, false, serviceday);
+        rtime_t arr = serviceday_time (tdata, c->arr_time, trip, route_stop + 1, true, serviceday);
+        /* The arrivals when staying on board, set up the first time the trip is seen. */
+        csa_departure_t *on_board = router->csa_trips + d * tdata->n_trips + trip;
+        if (*state == 0 || stop_banned_hard (router, req, c->arr_stop)) {
+            for (uint32_t r = 0; r < RRRR_MAX_ROUNDS; ++r) on_board->arrival[r] = UNREACHED;
+            *state = 1;
+        }
+        if ((c->trip & CONNECTION_ALIGHTING) && arr != UNREACHED && ! stop_banned (router, req, c->arr_stop) &&
+            ! stop_banned_hard (router, req, c->arr_stop)) {
+            /* Leave the trip here and walk to the target, */
+            rtime_t walk = router->walk_to_target[c->arr_stop];
+            if (walk != UNREACHED && arr + walk <= limit) {
+                for (uint32_t r = 0; r < n_rides; ++r) {
+                    if (arr + walk >= on_board->arrival[r]) continue;
+                    on_board->arrival[r] = arr + walk;
+                    on_board->exit[r] = CSA_EVENT(c_idx, d);
+                    on_board->next[r] = NONE;
+                }
+            }
+            /* or board another trip at the arrival stop or after walking from it. */
+            uint32_t tr     = tdata->stops[c->arr_stop    ].transfers_offset;
+            uint32_t tr_end = tdata->stops[c->arr_stop + 1].transfers_offset;
+            for (uint32_t t = tr - 1; t != tr_end; ++t) {
+                uint32_t stop = c->arr_stop;
+                uint32_t time = arr;
+                if (t != tr - 1) {
+                    stop = tdata->transfer_target_stops[t];
+                    time += router->walk_durations[t];
+                    if (time > RTIME_THREE_DAYS) continue;
+                }
+                csa_departure_t *transfer = csa_profile_at (router->csa_profiles + stop, time);
+                if (transfer == NULL) continue;
+                for (uint32_t r = 1; r < n_rides; ++r) {
+                    if (transfer->arrival[r - 1] >= on_board->arrival[r]) continue;
+                    on_board->arrival[r] = transfer->arrival[r - 1];
+                    on_board->exit[r] = CSA_EVENT(c_idx, d);
+                    on_board->next[r] = stop;
+                }
+            }
+        }
+        if ((c->trip & CONNECTION_BOARDING) && dep != UNREACHED && ! stop_banned (router, req, c->dep_stop) &&
+            ! stop_banned_hard (router, req, c->dep_stop))
+            csa_profile_add (router->csa_profiles + c->dep_stop, dep, on_board, CSA_EVENT(c_idx, d), n_rides);
+    }
+
+    /* Leave the origin by walking to the stop of each departure in the profiles around it, as late as possible. */
+    rtime_t window_end = req->time + req->time_window > RTIME_THREE_DAYS ? RTIME_THREE_DAYS : req->time + req->time_window;
+    uint32_t n_candidates = 0, capacity = 256;
+    csa_origin_departure_t *candidates = (csa_origin_departure_t *) malloc (sizeof(csa_origin_departure_t) * capacity);
+    if (candidates == NULL) die ("failed to allocate profile departures");
+    uint32_t tr     = tdata->stops[req->from    ].transfers_offset;
+    uint32_t tr_end = tdata->stops[req->from + 1].transfers_offset;
+    for (uint32_t t = tr - 1; t != tr_end; ++t) {
+        uint32_t stop = t == tr - 1 ? req->from : tdata->transfer_target_stops[t];
+        if (t != tr - 1 && stop_banned (router, req, req->from)) break;
+        rtime_t walk = transfer_duration (router, req->from, stop);
+        csa_profile_t *stop_profile = router->csa_profiles + stop;
+        for (uint32_t i = 0; i < stop_profile->n_departures; ++i) {
+            csa_departure_t *departure = stop_profile->departures + i;
+            if (departure->time < req->time + walk) break;
+            if (n_candidates == capacity) {
+                capacity *= 2;
+                candidates = (csa_origin_departure_t *) realloc (candidates, sizeof(csa_origin_departure_t) * capacity);
+                if (candidates == NULL) die ("failed to allocate profile departures");
+            }
+            rtime_t time = departure->time - walk;
+            candidates[n_candidates++] = (csa_origin_departure_t) { time < window_end ? time : window_end, stop, departure };
+        }
+    }
+    /* Going from the latest departure to the earliest, as router_route_profile does, keep the ones that arrive sooner
+       with some number of rides than every later one and than fewer rides. */
+    qsort (candidates, n_candidates, sizeof(csa_origin_departure_t), compare_origin_departures);
+    rtime_t best_arrival[RRRR_MAX_ROUNDS];
+    for (uint32_t r = 0; r < RRRR_MAX_ROUNDS; ++r) best_arrival[r] = UNREACHED;
+    for (uint32_t i = 0; i < n_candidates; ) {
+        /* The best of all ways of leaving at the same time, per number of rides. */
+        uint32_t i_end = i;
+        rtime_t arrival[RRRR_MAX_ROUNDS];
+        uint32_t from[RRRR_MAX_ROUNDS];
+        for (uint32_t r = 0; r < n_rides; ++r) arrival[r] = UNREACHED;
+        for ( ; i_end < n_candidates && candidates[i_end].time == candidates[i].time; ++i_end) {
+            for (uint32_t r = 0; r < n_rides; ++r) {
+                if (candidates[i_end].departure->arrival[r] >= arrival[r]) continue;
+                arrival[r] = candidates[i_end].departure->arrival[r];
+                from[r] = i_end;
+            }
+        }
+        for (uint32_t r = 0; r < n_rides; ++r) {
+            if (arrival[r] >= best_arrival[r] || (r > 0 && arrival[r] >= arrival[r - 1])) continue;
+            csa_origin_departure_t *candidate = candidates + from[r];
+            csa_departure_to_itinerary (router, req, candidate->time, candidate->stop, candidate->departure, r, profile_add_itinerary (profile));
+            for (uint32_t rr = r; rr < RRRR_MAX_ROUNDS; ++rr) {
+                if (arrival[r] < best_arrival[rr]) best_arrival[rr] = arrival[r];
+            }
+        }
+        i = i_end;
+    }
+    free (candidates);
+    walk_to_target_reset (router, req);
+    /* Report itineraries in increasing order of departure time. */
+    for (uint32_t i = 0, j = profile->n_itineraries; i + 1 < j; ++i, --j) {
+        struct itinerary tmp = profile->itineraries[i];
+        profile->itineraries[i] = profile->itineraries[j - 1];
+        profile->itineraries[j - 1] = tmp;
+    }
+    return true;
+}
+
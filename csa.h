@@ -0,0 +1,19 @@
+/* Copyright 2013 Bliksem Labs. See the LICENSE file at the top-level directory of this distribution and at https://github.com/bliksemlabs/rrrr/. */
+
+/* csa.h : the Connection Scan Algorithm over the connections in the timetable */
+
+#ifndef _CSA_H
+#define _CSA_H
+
+#include "router.h"
+
+#include <stdbool.h>
+
+/* Fill in a plan with the soonest arrival for every number of rides of a depart-after request. */
+bool router_route_csa (router_t*, router_request_t*, struct plan*);
+
+/* Fill in a profile with the Pareto-optimal itineraries departing within the time window of the request. */
+bool router_route_csa_profile (router_t*, router_request_t*, struct profile*);
+
+#endif // _CSA_H
+
@@ -0,0 +1,254 @@
+/* Copyright 2013 Bliksem Labs. See the LICENSE file at the top-level directory of this distribution and at https://github.com/bliksemlabs/rrrr/. */
+
+/* isochrone.c : one-to-all searches, one vector lane per departure time */
+
+#include "isochrone.h"
+#include "router_internal.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/* All the labels of one stop, one lane per departure time. The vector extension is supported by both GCC and clang,
+   which map it onto the widest registers -march allows. Comparisons yield all ones in the lanes where they hold. */
+typedef rtime_t lanes_t __attribute__ ((vector_size (RRRR_ISOCHRONE_LANES * sizeof(rtime_t))));
+
+static inline lanes_t lanes_min (lanes_t a, lanes_t b) {
+    lanes_t a_less = (lanes_t) (a < b);
+    return (a & a_less) | (b & ~a_less);
+}
+
+static inline bool lanes_any (lanes_t mask) {
+    uint64_t words[sizeof(lanes_t) / sizeof(uint64_t)];
+    memcpy (words, &mask, sizeof(lanes_t));
+    uint64_t any = 0;
+    for (uint32_t i = 0; i < sizeof(lanes_t) / sizeof(uint64_t); ++i) any |= words[i];
+    return any != 0;
+}
+
+/* Add a duration to every lane. Lanes that overflow, pass three days or the cutoff become UNREACHED. */
+static inline lanes_t lanes_add (lanes_t times, rtime_t duration, rtime_t cutoff) {
+    lanes_t sum = times + duration;
+    return sum | (lanes_t) (sum < times) | (lanes_t) (sum > cutoff);
+}
+
+/* The labels of a one-to-all search, lanes_t per stop. Rides are pruned against the best arrivals by riding rather
+   than against all arrivals, so that a stop reached early on foot still passes on the later rides to its own walks. */
+typedef struct isochrone_labels isochrone_labels_t;
+struct isochrone_labels {
+    lanes_t *best;     // earliest arrival by any means
+    lanes_t *ridden;   // earliest arrival at the end of a ride
+    lanes_t *prev;     // best as of the end of the previous round, from which trips are boarded
+    lanes_t *ride;     // improved ride arrivals of the current round, from which walks leave
+    BitSet  *improved; // the stops whose best label changed in the current round
+};
+
+/* The latest time that can be reached in a one-to-all search. */
+static inline rtime_t isochrone_cutoff (router_request_t *req) {
+    return req->time_cutoff < RTIME_THREE_DAYS ? req->time_cutoff : RTIME_THREE_DAYS;
+}
+
+/* Scan one route for all lanes at once. Each lane rides its own trip. Boarding is only looked up in the lanes where the
+   stop was reached in the previous round before the trip they ride leaves, which are few once the search settles. */
+static void isochrone_scan_route (router_t *router, router_request_t *req, uint32_t route_idx, isochrone_labels_t *labels) {
+    route_t *route = router->tdata->routes + route_idx;
+    route_view_t view;
+    route_view_setup (router, req, route_idx, &view);
+    uint32_t trip[RRRR_ISOCHRONE_LANES];
+    serviceday_t *serviceday[RRRR_ISOCHRONE_LANES];
+    bool on_board = false;
+    rtime_t cutoff = isochrone_cutoff (req);
+    const lanes_t unreached = (lanes_t) {} + UNREACHED;
+    for (uint32_t l = 0; l < RRRR_ISOCHRONE_LANES; ++l) trip[l] = NONE;
+    for (uint32_t route_stop = router->route_scan_start[route_idx]; route_stop < route->n_stops; ++route_stop) {
+        uint32_t stop = view.stops[route_stop];
+        if (stop_banned_hard (router, req, stop)) {
+            for (uint32_t l = 0; l < RRRR_ISOCHRONE_LANES; ++l) trip[l] = NONE;
+            on_board = false;
+            continue;
+        }
+        if (on_board && (view.stop_attributes[route_stop] & rsa_alighting)) {
+            lanes_t arrival = unreached;
+            for (uint32_t l = 0; l < RRRR_ISOCHRONE_LANES; ++l) {
+                if (trip[l] != NONE) arrival[l] = route_stoptime (&view.times, trip[l], route_stop, true, serviceday[l]);
+            }
+            arrival |= (lanes_t) (arrival > cutoff);
+            lanes_t ride_improved = (lanes_t) (arrival < labels->ridden[stop]);
+            if (lanes_any (ride_improved)) {
+                labels->ridden[stop] = lanes_min (labels->ridden[stop], arrival);
+                labels->ride[stop] = lanes_min (labels->ride[stop], arrival | ~ride_improved);
+                bitset_set (router->updated_stops, stop);
+                if (lanes_any ((lanes_t) (arrival < labels->best[stop]))) {
+                    labels->best[stop] = lanes_min (labels->best[stop], arrival);
+                    bitset_set (labels->improved, stop);
+                }
+            }
+        }
+        if ( ! (view.stop_attributes[route_stop] & rsa_boarding) || route_stop + 1 == route->n_stops) continue;
+        if (stop_banned (router, req, stop)) continue;
+        lanes_t prev = labels->prev[stop];
+        if ( ! lanes_any ((lanes_t) (prev != unreached))) continue;
+        lanes_t departure = unreached;
+        for (uint32_t l = 0; l < RRRR_ISOCHRONE_LANES; ++l) {
+            if (trip[l] == NONE) continue;
+            /* Stay on board where the trip skips the stop, as there is nothing better to board than the trip ridden. */
+            departure[l] = route_stoptime (&view.times, trip[l], route_stop, false, serviceday[l]);
+            if (departure[l] == UNREACHED) departure[l] = 0;
+        }
+        lanes_t attempt_board = (lanes_t) (prev < departure);
+        if ( ! lanes_any (attempt_board)) continue;
+        for (uint32_t l = 0; l < RRRR_ISOCHRONE_LANES; ++l) {
+            if ( ! attempt_board[l]) continue;
+            rtime_t board_time;
+            serviceday_t *board_serviceday = NULL;
+            uint32_t board_trip = route_earliest_trip (router, req, route_idx, &view, route_stop, prev[l],
+                                                       &board_time, &board_serviceday);
+            if (board_trip == NONE) continue;
+            trip[l] = board_trip;
+            serviceday[l] = board_serviceday;
+            on_board = true;
+        }
+    }
+}
+
+/* Walk from the stops reached by riding in this round to the nearby stops. */
+static void isochrone_apply_transfers (router_t *router, router_request_t *req, isochrone_labels_t *labels) {
+    tdata_t *tdata = router->tdata;
+    rtime_t cutoff = isochrone_cutoff (req);
+    for (uint32_t stop  = bitset_next_set_bit (router->updated_stops, 0);
+                  stop != BITSET_NONE;
+                  stop  = bitset_next_set_bit (router->updated_stops, stop + 1)) {
+        if (stop_banned (router, req, stop)) continue;
+        uint32_t tr     = tdata->stops[stop    ].transfers_offset;
+        uint32_t tr_end = tdata->stops[stop + 1].transfers_offset;
+        for ( ; tr < tr_end ; ++tr) {
+            uint32_t stop_to = tdata->transfer_target_stops[tr];
+            rtime_t duration = router->walk_durations[tr];
+            lanes_t arrival = lanes_add (labels->ride[stop], duration, cutoff);
+            if (lanes_any ((lanes_t) (arrival < labels->best[stop_to]))) {
+                labels->best[stop_to] = lanes_min (labels->best[stop_to], arrival);
+                bitset_set (labels->improved, stop_to);
+            }
+        }
+        labels->ride[stop] = (lanes_t) {} + UNREACHED;
+    }
+    bitset_reset (router->updated_stops);
+}
+
+/*
+  One-to-all search: the earliest arrival at every stop for up to RRRR_ISOCHRONE_LANES departure times from req->from,
+  found in a single scan of the timetable by keeping one label per departure in the lanes of a vector. There is no
+  target and so no target pruning. The request's time_cutoff, if any, bounds the arrival times instead. Like
+  router_route, rounds board from the labels of the previous round and walks do not chain. Only depart-after requests
+  not starting on board are supported.
+*/
+bool router_route_isochrone (router_t *router, router_request_t *req, rtime_t *departures, uint32_t n_departures,
+                             struct isochrone *iso) {
+    tdata_t *tdata = router->tdata;
+    uint32_t n_stops = tdata->n_stops;
+    iso->req = *req;
+    iso->n_departures = 0;
+    iso->n_stops = n_stops;
+    iso->arrivals = NULL;
+    if (req->arrive_by || req->start_trip_trip != NONE) {
+        fprintf (stderr, "One-to-all searches are only supported for depart-after requests not starting on board.\n");
+        return false;
+    }
+    if (n_departures < 1 || n_departures > RRRR_ISOCHRONE_LANES) {
+        fprintf (stderr, "One-to-all searches take between 1 and %d departure times.\n", RRRR_ISOCHRONE_LANES);
+        return false;
+    }
+    isochrone_labels_t labels = { NULL, NULL, NULL, NULL, bitset_new (n_stops) };
+    if (posix_memalign ((void **) &labels.best,   sizeof(lanes_t), sizeof(lanes_t) * n_stops) != 0 ||
+        posix_memalign ((void **) &labels.ridden, sizeof(lanes_t), sizeof(lanes_t) * n_stops) != 0 ||
+        posix_memalign ((void **) &labels.prev,   sizeof(lanes_t), sizeof(lanes_t) * n_stops) != 0 ||
+        posix_memalign ((void **) &labels.ride,   sizeof(lanes_t), sizeof(lanes_t) * n_stops) != 0)
+        die ("failed to allocate one-to-all search space");
+    lanes_t *best = labels.best;
+    BitSet *improved = labels.improved;
+    const lanes_t unreached = (lanes_t) {} + UNREACHED;
+    for (uint32_t s = 0; s < n_stops; ++s) best[s] = labels.ridden[s] = labels.prev[s] = labels.ride[s] = unreached;
+    /* Unused lanes depart at UNREACHED, and so never reach anything. */
+    lanes_t origin = unreached;
+    for (uint32_t d = 0; d < RRRR_ISOCHRONE_LANES; ++d) {
+        iso->departures[d] = d < n_departures ? departures[d] : UNREACHED;
+        origin[d] = iso->departures[d];
+    }
+    iso->n_departures = n_departures;
+    router_setup_servicedays (router, req);
+    router_compile_request (router, req);
+    router->origin = req->from;
+    router->target = NONE;
+
+    /* The initial labels, at the origin and the stops within walking distance of it. */
+    rtime_t cutoff = isochrone_cutoff (req);
+    best[router->origin] = origin;
+    bitset_set (improved, router->origin);
+    if ( ! stop_banned (router, req, router->origin)) {
+        uint32_t tr     = tdata->stops[router->origin    ].transfers_offset;
+        uint32_t tr_end = tdata->stops[router->origin + 1].transfers_offset;
+        for ( ; tr < tr_end ; ++tr) {
+            uint32_t stop_to = tdata->transfer_target_stops[tr];
+            rtime_t duration = router->walk_durations[tr];
+            best[stop_to] = lanes_min (best[stop_to], lanes_add (origin, duration, cutoff));
+            bitset_set (improved, stop_to);
+        }
+    }
+
+    uint32_t n_rounds = request_rounds (router, req);
+    bitset_reset (router->updated_stops);
+    for (uint32_t round = 0; round <= n_rounds; ++round) {
+        /* The stops improved in the last round are where the routes of this round can be boarded. */
+        bitset_reset (router->updated_routes);
+        for (uint32_t stop  = bitset_next_set_bit (improved, 0);
+                      stop != BITSET_NONE;
+                      stop  = bitset_next_set_bit (improved, stop + 1)) {
+            labels.prev[stop] = best[stop];
+            if (stop_banned (router, req, stop)) continue;
+            flag_routes_for_stop (router, req, stop);
+        }
+        mask_ineligible_routes (router);
+        bitset_reset (improved);
+        if (round == n_rounds || bitset_next_set_bit (router->updated_routes, 0) == BITSET_NONE) break;
+        for (uint32_t route_idx  = bitset_next_set_bit (router->updated_routes, 0);
+                      route_idx != BITSET_NONE;
+                      route_idx  = bitset_next_set_bit (router->updated_routes, route_idx + 1)) {
+            isochrone_scan_route (router, req, route_idx, &labels);
+        }
+        isochrone_apply_transfers (router, req, &labels);
+    }
+    bitset_destroy (improved);
+    free (labels.ridden);
+    free (labels.prev);
+    free (labels.ride);
+    iso->arrivals = (rtime_t *) best;
+    return true;
+}
+
+/*
+  The earliest arrival at a point when leaving at the given departure, walking there from any stop reached within the
+  given radius, or UNREACHED. Stops are found with the hashgrid built over the stop coordinates, so an isochrone map is
+  rasterised by calling this for the center of every cell.
+*/
+rtime_t router_isochrone_at (struct isochrone *iso, HashGrid *hg, coord_t coord, double radius_meters, uint32_t departure) {
+    HashGridResult result;
+    HashGrid_query (hg, &result, coord, radius_meters);
+    rtime_t best = UNREACHED;
+    double distance;
+    for (uint32_t stop = HashGridResult_next_filtered (&result, &distance);
+                  stop != HASHGRID_NONE;
+                  stop = HashGridResult_next_filtered (&result, &distance)) {
+        rtime_t arrival = iso->arrivals[stop * RRRR_ISOCHRONE_LANES + departure];
+        if (arrival == UNREACHED) continue;
+        uint32_t time = arrival + SEC_TO_RTIME((uint32_t)(distance / iso->req.walk_speed));
+        if (time < best) best = time;
+    }
+    return best;
+}
+
+void router_isochrone_free (struct isochrone *iso) {
+    free (iso->arrivals);
+    iso->arrivals = NULL;
+    iso->n_departures = 0;
+}
+
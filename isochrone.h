@@ -0,0 +1,34 @@
+/* Copyright 2013 Bliksem Labs. See the LICENSE file at the top-level directory of this distribution and at https://github.com/bliksemlabs/rrrr/. */
+
+/* isochrone.h : one-to-all searches for a few departure times at once */
+
+#ifndef _ISOCHRONE_H
+#define _ISOCHRONE_H
+
+#include "router.h"
+#include "hashgrid.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* The result of a one-to-all search: the earliest arrival at every stop for each of a few departure times from the
+   same origin. The arrivals of a stop are contiguous, one per departure, so that arrivals[stop * RRRR_ISOCHRONE_LANES
+   + d] is the arrival at stop when leaving at departures[d], or UNREACHED. Release it with router_isochrone_free. */
+struct isochrone {
+    router_request_t req;
+    uint32_t n_departures;
+    rtime_t departures[RRRR_ISOCHRONE_LANES];
+    uint32_t n_stops;
+    rtime_t *arrivals;
+};
+
+/* Find the earliest arrival at every stop for each of the given departure times from the origin of the request. */
+bool router_route_isochrone (router_t*, router_request_t*, rtime_t *departures, uint32_t n_departures, struct isochrone*);
+
+/* The earliest arrival at a point for one of the departures, walking from the stops within the given radius. */
+rtime_t router_isochrone_at (struct isochrone*, HashGrid *hg, coord_t coord, double radius_meters, uint32_t departure);
+
+void router_isochrone_free (struct isochrone*);
+
+#endif // _ISOCHRONE_H
+
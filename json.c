@@ -193,6 +193,9 @@ static void json_leg (struct leg *leg, tdata_t *tdata, router_request_t *req, ti
 
     char servicedate[9] = "\0";
     int64_t departuredelay = 0;
+    alert_t *alerts[RRRR_MAX_LEG_ALERTS];
+    uint32_t n_alerts = 0;
+    uint32_t alerts_generation = 0;
 
     if (leg->route == WALK) mode = "WALK"; else {
         headsign = tdata_headsign_for_route(tdata, leg->route);
@@ -213,6 +216,14 @@ static void json_leg (struct leg *leg, tdata_t *tdata, router_request_t *req, ti
 
         departuredelay = tdata_delay_min (tdata, leg->route, leg->trip);
 
+        /* The leg starts on the service day of the request, or on the day before or after it. */
+        uint32_t cal_day = 0;
+        calendar_t mask = req->day_mask;
+        while (mask >>= 1) cal_day++;
+        alerts_generation = tdata_alerts_read_begin (tdata);
+        n_alerts = tdata_alerts_for_leg (tdata, leg->route, tdata->routes[leg->route].trip_ids_offset + leg->trip, leg->s0,
+                                         cal_day + leg->t0 / RTIME_ONE_DAY - 1, alerts, RRRR_MAX_LEG_ALERTS);
+
         wheelchair_accessible = (trip_attributes & ta_accessible) ? "true" : NULL;
         if ((tdata->routes[leg->route].attributes & m_tram)      == m_tram)      mode = "TRAM";      else
         if ((tdata->routes[leg->route].attributes & m_subway)    == m_subway)    mode = "SUBWAY";    else
@@ -246,6 +257,16 @@ static void json_leg (struct leg *leg, tdata_t *tdata, router_request_t *req, ti
         json_kv("agencyUrl", agency_url);
         json_kv("wheelchairAccessible", wheelchair_accessible);
         json_kv("productCategory", productcategory);
+        json_key_arr("alerts");
+        for (uint32_t a = 0; a < n_alerts; ++a) {
+            json_obj();
+                json_kv("alertHeaderText", alerts[a]->header_text);
+                json_kv("alertDescriptionText", alerts[a]->description_text);
+                json_kv("alertUrl", alerts[a]->url);
+            json_end_obj();
+        }
+        json_end_arr();
+        if (leg->route != WALK) tdata_alerts_read_end (tdata, alerts_generation);
 /*
     "realTime": false,
     "distance": 2656.2383456335,
@@ -337,9 +358,13 @@ static void json_leg (struct leg *leg, tdata_t *tdata, router_request_t *req, ti
 
                 if (visible) {
                     // TODO: use tdata_depart and tdata_arrive to prevent realtime leakage outside the current date
-                    trip_t trip = tdata->trips[tdata->routes[leg->route].trip_ids_offset + leg->trip];
-                    rtime_t arrival = trip.begin_time + tdata->stop_times[trip.stop_times_offset + i].arrival + trip.realtime_delay;
-                    rtime_t departure = trip.begin_time + tdata->stop_times[trip.stop_times_offset + i].departure + trip.realtime_delay;
+                    uint32_t trip_index = tdata->routes[leg->route].trip_ids_offset + leg->trip;
+                    trip_t trip = tdata->trips[trip_index];
+                    int16_t arrival_delay = tdata_stop_delay (tdata, trip_index, i, true);
+                    int16_t departure_delay = tdata_stop_delay (tdata, trip_index, i, false);
+                    if (arrival_delay == CANCELED) continue; // the trip skips this stop
+                    rtime_t arrival = trip.begin_time + tdata->stop_times[trip.stop_times_offset + i].arrival + arrival_delay;
+                    rtime_t departure = trip.begin_time + tdata->stop_times[trip.stop_times_offset + i].departure + departure_delay;
 
                     json_place(NULL, arrival, departure, stop_idx, tdata, date);
                 }
@@ -0,0 +1,302 @@
+/* Copyright 2013 Bliksem Labs. See the LICENSE file at the top-level directory of this distribution and at https://github.com/bliksemlabs/rrrr/. */
+
+/* mcraptor.c : multi-criteria searches (McRAPTOR) */
+
+#include "mcraptor.h"
+#include "router_internal.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/* A trip being ridden along the route that is being scanned. Together these form the route bag of McRAPTOR. */
+typedef struct mc_ride mc_ride_t;
+struct mc_ride {
+    mc_ride_t    *next;
+    mc_label_t   *from;       // the label at the stop where the trip was boarded
+    serviceday_t *serviceday; // the service day on which the trip was boarded
+    uint32_t      trip;
+    rtime_t       board_time;
+    uint16_t      cost;
+};
+
+/* The first label in the bag of the given stop. Bags written in earlier searches are empty. */
+static inline mc_label_t *mc_bag (router_t *router, uint32_t stop) {
+    return router->bag_generation[stop] == router->generation ? router->bags[stop] : NULL;
+}
+
+static inline uint16_t mc_cost_walk (router_request_t *req, uint16_t cost, uint32_t dist_meters) {
+    if (req->criterion != c_walk_meters) return cost;
+    return cost + dist_meters > UINT16_MAX ? UINT16_MAX : cost + dist_meters;
+}
+
+static inline uint16_t mc_cost_ride (router_t *router, router_request_t *req, uint16_t cost, uint32_t route_idx) {
+    if (req->criterion != c_bus_legs || ! (router->tdata->routes[route_idx].attributes & m_bus)) return cost;
+    return cost == UINT16_MAX ? cost : cost + 1;
+}
+
+/* Flag the routes serving a stop for the next round, as long as boarding there is allowed at all. */
+static inline void mc_flag_routes (router_t *router, router_request_t *req, uint32_t stop) {
+    if (stop_banned (router, req, stop)) return;
+    flag_routes_for_stop (router, req, stop);
+}
+
+/*
+  Add a label to the bag of a stop, unless a label already in that bag or in the bag of the target dominates it.
+  All labels found so far have as many rides or fewer, so only their time and cost need to be compared. Labels with as
+  many rides that the new label dominates are dropped from the bag. Returns the new label, or NULL if it was pruned.
+*/
+static mc_label_t *
+mc_bag_insert (router_t *router, router_request_t *req, uint32_t stop, rtime_t time, uint16_t cost, uint8_t n_rides) {
+    /* Reserve all time past three days for special values like UNREACHED. */
+    if (time > RTIME_THREE_DAYS) return NULL;
+    if (req->time_cutoff != UNREACHED && time > req->time_cutoff) return NULL;
+    /* Target pruning: costs and times only grow along an itinerary. */
+    if (stop != router->target) {
+        for (mc_label_t *l = mc_bag (router, router->target); l != NULL; l = l->next) {
+            if (l->time <= time && l->cost <= cost) return NULL;
+        }
+    }
+    if (router->bag_generation[stop] != router->generation) {
+        router->bag_generation[stop] = router->generation;
+        router->bags[stop] = NULL;
+    }
+    for (mc_label_t *l = router->bags[stop]; l != NULL; l = l->next) {
+        if (l->time <= time && l->cost <= cost) return NULL;
+    }
+    for (mc_label_t **link = router->bags + stop; *link != NULL; ) {
+        mc_label_t *l = *link;
+        if (l->n_rides == n_rides && l->time >= time && l->cost >= cost) *link = l->next;
+        else link = &(l->next);
+    }
+    mc_label_t *label = (mc_label_t *) slab_alloc (&router->slab, sizeof(mc_label_t));
+    if (label == NULL) die ("failed to allocate McRAPTOR label");
+    label->stop = stop;
+    label->time = time;
+    label->cost = cost;
+    label->n_rides = n_rides;
+    label->next = router->bags[stop];
+    router->bags[stop] = label;
+    return label;
+}
+
+/* Scan one route in the given round, alighting from the trips being ridden and boarding from the labels of the
+   previous round at each stop in turn. */
+static void mc_scan_route (router_t *router, router_request_t *req, uint32_t route_idx, uint8_t round, mc_label_t **rides_ended) {
+    tdata_t *tdata = router->tdata;
+    route_t route = tdata->routes[route_idx];
+    route_view_t view;
+    route_view_setup (router, req, route_idx, &view);
+    mc_ride_t *rides = NULL;
+    for (uint32_t route_stop = 0; route_stop < route.n_stops; ++route_stop) {
+        uint32_t stop = view.stops[route_stop];
+        /* Transit through a hard banned stop is not allowed, so every trip must be left behind. */
+        if (stop_banned_hard (router, req, stop)) {
+            rides = NULL;
+            continue;
+        }
+        if (view.stop_attributes[route_stop] & rsa_alighting) {
+            for (mc_ride_t *ride = rides; ride != NULL; ride = ride->next) {
+                rtime_t time = route_stoptime (&view.times, ride->trip, route_stop, true, ride->serviceday);
+                /* Catch overflow due to long overnight trips on day 2 */
+                if (time == UNREACHED || time < ride->board_time) continue;
+                mc_label_t *label = mc_bag_insert (router, req, stop, time, ride->cost, round + 1);
+                if (label == NULL) continue;
+                label->back = ride->from;
+                label->back_route = route_idx;
+                label->back_trip = ride->trip;
+                label->board_time = ride->board_time;
+                label->next_ride = *rides_ended;
+                *rides_ended = label;
+            }
+        }
+        if ( ! (view.stop_attributes[route_stop] & rsa_boarding) || route_stop + 1 == route.n_stops) continue;
+        if (stop_banned (router, req, stop)) continue;
+        for (mc_label_t *from = mc_bag (router, stop); from != NULL; from = from->next) {
+            if (from->n_rides != round) continue;
+            rtime_t board_time;
+            serviceday_t *serviceday = NULL;
+            uint32_t trip = route_earliest_trip (router, req, route_idx, &view, route_stop, from->time,
+                                                 &board_time, &serviceday);
+            if (trip == NONE) continue;
+            uint16_t cost = mc_cost_ride (router, req, from->cost, route_idx);
+            /* Riding the same trip boarded upstream at no higher cost is just as good. */
+            bool dominated = false;
+            for (mc_ride_t *ride = rides; ride != NULL; ride = ride->next) {
+                if (ride->trip == trip && ride->serviceday == serviceday && ride->cost <= cost) {
+                    dominated = true;
+                    break;
+                }
+            }
+            if (dominated) continue;
+            mc_ride_t *ride = (mc_ride_t *) slab_alloc (&router->slab, sizeof(mc_ride_t));
+            if (ride == NULL) die ("failed to allocate McRAPTOR ride");
+            ride->from = from;
+            ride->serviceday = serviceday;
+            ride->trip = trip;
+            ride->board_time = board_time;
+            ride->cost = cost;
+            ride->next = rides;
+            rides = ride;
+        }
+    }
+}
+
+/* Walk from the labels reached by riding in the given round to the nearby stops, and flag the routes to scan in the
+   next round. As in apply_transfers, walks are not chained, and a stop is left on foot after every ride improving it
+   at the time, even if a walk has improved on it since. */
+static void mc_apply_transfers (router_t *router, router_request_t *req, mc_label_t *rides_ended) {
+    tdata_t *tdata = router->tdata;
+    bitset_reset (router->updated_routes);
+    for (mc_label_t *from = rides_ended; from != NULL; from = from->next_ride) {
+        uint32_t stop = from->stop;
+        if (stop_banned (router, req, stop)) continue;
+        mc_flag_routes (router, req, stop);
+        uint32_t tr     = tdata->stops[stop    ].transfers_offset;
+        uint32_t tr_end = tdata->stops[stop + 1].transfers_offset;
+        for ( ; tr < tr_end ; ++tr) {
+            uint32_t stop_to = tdata->transfer_target_stops[tr];
+            if (stop_to == stop) continue;
+            uint32_t dist_meters = tdata->transfer_dist_meters[tr] << 4;
+            rtime_t time = from->time + router->walk_durations[tr];
+            if (time < from->time) continue;
+            mc_label_t *label = mc_bag_insert (router, req, stop_to, time, mc_cost_walk (req, from->cost, dist_meters), from->n_rides);
+            if (label == NULL) continue;
+            label->back = from;
+            label->back_route = WALK;
+            label->back_trip = WALK;
+            label->board_time = from->time;
+            mc_flag_routes (router, req, stop_to);
+        }
+    }
+}
+
+/* Follow the chain of labels back to the origin, filling in the legs of an itinerary. Itineraries alternate walk and
+   ride legs like the ones of router_result_to_itinerary, so a ride not preceded or followed by a walk gets an empty
+   walk leg at the stop where it begins or ends. */
+static void mc_label_to_itinerary (struct itinerary *itin, mc_label_t *label) {
+    mc_label_t *chain[RRRR_MAX_ROUNDS * 2 + 2];
+    uint32_t n = 0;
+    for (mc_label_t *l = label; l != NULL && n < RRRR_MAX_ROUNDS * 2 + 2; l = l->back) chain[n++] = l;
+    itin->n_rides = 0;
+    itin->n_legs = 0;
+    struct leg *l = itin->legs;
+    for (uint32_t i = n - 1; i-- > 0; ) {
+        mc_label_t *to = chain[i];
+        mc_label_t *from = chain[i + 1];
+        if (to->back_route != WALK && itin->n_legs % 2 == 0) {
+            l->s0 = l->s1 = from->stop;
+            l->t0 = l->t1 = from->time;
+            l->route = l->trip = WALK;
+            ++l;
+            itin->n_legs += 1;
+        }
+        l->s0 = from->stop;
+        l->s1 = to->stop;
+        l->t0 = to->back_route == WALK ? from->time : to->board_time;
+        l->t1 = to->time;
+        l->route = to->back_route;
+        l->trip  = to->back_trip;
+        ++l;
+        itin->n_legs += 1;
+        if (to->back_route != WALK) itin->n_rides += 1;
+    }
+    if (itin->n_legs % 2 == 0) {
+        l->s0 = l->s1 = label->stop;
+        l->t0 = l->t1 = label->time;
+        l->route = l->trip = WALK;
+        itin->n_legs += 1;
+    }
+}
+
+static int compare_mc_labels (const void *a, const void *b) {
+    mc_label_t *la = *(mc_label_t **) a;
+    mc_label_t *lb = *(mc_label_t **) b;
+    if (la->n_rides != lb->n_rides) return la->n_rides - lb->n_rides;
+    if (la->time != lb->time) return la->time - lb->time;
+    return la->cost - lb->cost;
+}
+
+/*
+  McRAPTOR: keep a bag of labels at each stop that are Pareto-optimal in arrival time, number of rides and the extra
+  criterion of the request, and scan routes with a bag of trips instead of a single one. Labels are allocated from the
+  slab of the router, which is emptied in O(1), and bags are emptied by starting a new generation, so that setting up a
+  search costs nothing like the size of the previous one. Only depart-after requests not starting on board are supported. The via stop is ignored.
+*/
+bool router_route_mc (router_t *router, router_request_t *req, struct profile *profile) {
+    tdata_t *tdata = router->tdata;
+    profile->req = *req;
+    profile->n_itineraries = 0;
+    if (req->arrive_by || req->start_trip_trip != NONE) {
+        fprintf (stderr, "McRAPTOR searches are only supported for depart-after requests not starting on board.\n");
+        return false;
+    }
+    if (router->bags == NULL) {
+        router->bags = (mc_label_t **) malloc (sizeof(mc_label_t *) * tdata->n_stops);
+        router->bag_generation = (uint32_t *) calloc (tdata->n_stops, sizeof(uint32_t));
+        if ( ! (router->bags && router->bag_generation)) die ("failed to allocate McRAPTOR scratch space");
+    }
+    slab_free (&router->slab);
+    if (++router->generation == 0) {
+        /* Only after four billion searches: old generations could be taken for the current one. */
+        memset (router->bag_generation, 0, sizeof(uint32_t) * tdata->n_stops);
+        router->generation = 1;
+    }
+    router_setup_servicedays (router, req);
+    router_compile_request (router, req);
+    router->origin = req->from;
+    router->target = req->to;
+
+    /* The initial labels are at the origin and at the stops within walking distance of it, without any rides. */
+    bitset_reset (router->updated_routes);
+    mc_label_t *origin = mc_bag_insert (router, req, router->origin, req->time, 0, 0);
+    if (origin == NULL) return true;
+    origin->back = NULL;
+    origin->back_route = WALK;
+    origin->back_trip = WALK;
+    origin->board_time = req->time;
+    mc_flag_routes (router, req, router->origin);
+    uint32_t tr     = tdata->stops[router->origin    ].transfers_offset;
+    uint32_t tr_end = tdata->stops[router->origin + 1].transfers_offset;
+    for ( ; tr < tr_end ; ++tr) {
+        uint32_t stop_to = tdata->transfer_target_stops[tr];
+        uint32_t dist_meters = tdata->transfer_dist_meters[tr] << 4;
+        rtime_t time = req->time + router->walk_durations[tr];
+        if (stop_to == router->origin || time < req->time) continue;
+        mc_label_t *label = mc_bag_insert (router, req, stop_to, time, mc_cost_walk (req, 0, dist_meters), 0);
+        if (label == NULL) continue;
+        label->back = origin;
+        label->back_route = WALK;
+        label->back_trip = WALK;
+        label->board_time = req->time;
+        mc_flag_routes (router, req, stop_to);
+    }
+
+    uint32_t n_rounds = request_rounds (router, req);
+    for (uint8_t round = 0; round < n_rounds; ++round) {
+        mask_ineligible_routes (router);
+        if (bitset_next_set_bit (router->updated_routes, 0) == BITSET_NONE) break;
+        mc_label_t *rides_ended = NULL;
+        for (uint32_t route_idx  = bitset_next_set_bit (router->updated_routes, 0);
+                      route_idx != BITSET_NONE;
+                      route_idx  = bitset_next_set_bit (router->updated_routes, route_idx + 1)) {
+            mc_scan_route (router, req, route_idx, round, &rides_ended);
+        }
+        mc_apply_transfers (router, req, rides_ended);
+    }
+
+    /* Every label left in the bag of the target is a Pareto-optimal itinerary. Walking all the way is not reported. */
+    uint32_t n_labels = 0;
+    for (mc_label_t *l = mc_bag (router, router->target); l != NULL; l = l->next) n_labels += 1;
+    mc_label_t **labels = (mc_label_t **) malloc (sizeof(mc_label_t *) * (n_labels + 1));
+    if (labels == NULL) die ("failed to allocate McRAPTOR results");
+    n_labels = 0;
+    for (mc_label_t *l = mc_bag (router, router->target); l != NULL; l = l->next) {
+        if (l->n_rides > 0) labels[n_labels++] = l;
+    }
+    qsort (labels, n_labels, sizeof(mc_label_t *), compare_mc_labels);
+    for (uint32_t i = 0; i < n_labels; ++i) mc_label_to_itinerary (profile_add_itinerary (profile), labels[i]);
+    free (labels);
+    return true;
+}
+
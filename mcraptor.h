@@ -0,0 +1,34 @@
+/* Copyright 2013 Bliksem Labs. See the LICENSE file at the top-level directory of this distribution and at https://github.com/bliksemlabs/rrrr/. */
+
+/* mcraptor.h : multi-criteria searches, keeping a Pareto set of labels at every stop */
+
+#ifndef _MCRAPTOR_H
+#define _MCRAPTOR_H
+
+#include "router.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* A label in a McRAPTOR bag: one Pareto-optimal way of reaching a stop in arrival time, number of rides and the
+   extra criterion of the request. Labels are allocated from the slab of the router and chained back to the origin. */
+typedef struct mc_label mc_label_t;
+struct mc_label {
+    mc_label_t *next;    // The next label in the bag of the same stop
+    mc_label_t *back;    // The label this one extends, at the boarding stop or the walk origin. NULL at the origin.
+    mc_label_t *next_ride; // The next label reached by riding in the same round, even if dropped from its bag since
+    uint32_t stop;       // The stop reached
+    uint32_t back_route; // The index of the route used to reach this stop, or WALK
+    uint32_t back_trip;  // The index of the trip used to reach this stop, or WALK
+    rtime_t  time;       // The time when this stop was reached
+    rtime_t  board_time; // The time at which the trip left the stop of the back label
+    uint16_t cost;       // The value of the extra criterion so far
+    uint8_t  n_rides;    // The number of trips ridden so far
+};
+
+/* Fill in a profile with the itineraries that are Pareto-optimal in arrival time, number of rides and the criterion of
+   the request, in increasing order of number of rides. Only depart-after requests not starting on board are supported. */
+bool router_route_mc (router_t*, router_request_t*, struct profile*);
+
+#endif // _MCRAPTOR_H
+
@@ -40,6 +40,7 @@
 #define ALLOW_HEADERS    "Access-Control-Allow-Headers:Requested-With,Content-Type"
 #define OK_TEXT_PLAIN "HTTP/1.0 200 OK" HEADERS APPLICATION_JSON CRLF ALLOW_ORIGIN CRLF ALLOW_HEADERS CRLF
 #define ERROR_404     "HTTP/1.0 404 Not Found" HEADERS "Content-Length: 16" CRLF "Connection: close" CRLF TEXT_PLAIN END_HEADERS "FOUR ZERO FOUR" CRLF
+#define ERROR_400     "HTTP/1.0 400 Bad Request" HEADERS "Content-Length: 16" CRLF "Connection: close" CRLF TEXT_PLAIN END_HEADERS "FOUR ZERO ZERO" CRLF
 
 #define BUFLEN     1024
 #define PORT       9393
@@ -218,7 +219,13 @@ static void send_request (int nc, void *broker_socket) {
     router_request_t req;
     router_request_initialize (&req);
     router_request_randomize (&req, &tdata); // This prevents segfaults because data is not initialised
-    parse_request_from_qstring(&req, &tdata, &hash_grid, qstring);
+    if ( ! parse_request_from_qstring(&req, &tdata, &hash_grid, qstring)) {
+        printf ("request could not be honoured \n");
+        setsockopt_no_sigpipe(conn_sd);
+        send (conn_sd, ERROR_400, sizeof(ERROR_400) - 1, MSG_NOSIGNAL);
+        remove_conn_later (nc);
+        return;
+    }
     zmsg_t *msg = zmsg_new ();
     zmsg_pushmem (msg, &req, sizeof(req));
     // Prefix the request with the socket descriptor for use upon reply. Worker ignores all frames but the last one.
@@ -8,7 +8,13 @@
 #include <string.h>
 #include <time.h>
 
-void parse_request(router_request_t *req, tdata_t *tdata, HashGrid *hg, int opt, char *optarg) {
+static bool too_many_banned (char *what) {
+    fprintf (stderr, "Too many banned %s, at most %d are allowed.\n", what, RRRR_MAX_BANNED);
+    return false;
+}
+
+/* Apply one option to the request. Returns false if the option can not be honoured, leaving the request incomplete. */
+bool parse_request(router_request_t *req, tdata_t *tdata, HashGrid *hg, int opt, char *optarg) {
     const char delim[2] = ",";
     char *token;
 
@@ -47,6 +53,22 @@ void parse_request(router_request_t *req, tdata_t *tdata, HashGrid *hg, int opt,
     case 'S':
         req->walk_speed = strtod(optarg, NULL);
         break;
+    case 'W':
+        req->time_window = SEC_TO_RTIME(strtol(optarg, NULL, 10) * 60); // in minutes
+        break;
+    case 'C':
+        if (strcmp(optarg, "walk") == 0) req->criterion = c_walk_meters;
+        else if (strcmp(optarg, "bus") == 0) req->criterion = c_bus_legs;
+        else req->criterion = c_none;
+        break;
+    case 'E':
+        if (strcmp(optarg, "trips") == 0) req->engine = e_trip_based;
+        else if (strcmp(optarg, "csa") == 0) req->engine = e_csa;
+        else req->engine = e_raptor;
+        break;
+    case 'X':
+        req->max_transfers = strtol(optarg, NULL, 10);
+        break;
     case 'o':
         req->optimise = 0;
         token = strtok(optarg, delim);
@@ -117,8 +139,8 @@ void parse_request(router_request_t *req, tdata_t *tdata, HashGrid *hg, int opt,
             if (strlen(token) > 0) {
                 long int tmp = strtol(token, NULL, 10);
                 if (tmp >= 0) {
-                    req->banned_route = tmp;
-                    req->n_banned_routes = 1;
+                    if (req->n_banned_routes == RRRR_MAX_BANNED) return too_many_banned ("routes");
+                    req->banned_routes[req->n_banned_routes++] = tmp;
                 }
             }
 
@@ -131,8 +153,8 @@ void parse_request(router_request_t *req, tdata_t *tdata, HashGrid *hg, int opt,
             if (strlen(token) > 0) {
                 long int tmp = strtol(token, NULL, 10);
                 if (tmp >= 0) {
-                    req->banned_stop = tmp;
-                    req->n_banned_stops = 1;
+                    if (req->n_banned_stops == RRRR_MAX_BANNED) return too_many_banned ("stops");
+                    req->banned_stops[req->n_banned_stops++] = tmp;
                 }
             }
 
@@ -146,12 +168,14 @@ void parse_request(router_request_t *req, tdata_t *tdata, HashGrid *hg, int opt,
                 long int tmp_route = strtol(token, NULL, 10);
                 if (tmp_route >= 0) {
                     token = strtok(NULL, delim);
+                    if (token == NULL) break;
                     long int tmp_trip = strtol(token, NULL, 10);
 
                     if (tmp_trip >= 0) {
-                        req->banned_trip_route = tmp_route;
-                        req->banned_trip_offset = tmp_trip;
-                        req->n_banned_trips = 1;
+                        if (req->n_banned_trips == RRRR_MAX_BANNED) return too_many_banned ("trips");
+                        req->banned_trips_route[req->n_banned_trips] = tmp_route;
+                        req->banned_trips_offset[req->n_banned_trips] = tmp_trip;
+                        req->n_banned_trips += 1;
                     }
                 }
             }
@@ -183,8 +207,8 @@ void parse_request(router_request_t *req, tdata_t *tdata, HashGrid *hg, int opt,
             if (strlen(token) > 0) {
                 long int tmp = strtol(token, NULL, 10);
                 if (tmp >= 0) {
-                    req->banned_stop_hard = tmp;
-                    req->n_banned_stops_hard = 1;
+                    if (req->n_banned_stops_hard == RRRR_MAX_BANNED) return too_many_banned ("hard banned stops");
+                    req->banned_stops_hard[req->n_banned_stops_hard++] = tmp;
                 }
             }
 
@@ -192,6 +216,7 @@ void parse_request(router_request_t *req, tdata_t *tdata, HashGrid *hg, int opt,
         }
         break;
     }
+    return true;
 }
 
 #define BUFLEN 255
@@ -216,6 +241,14 @@ bool parse_request_from_qstring(router_request_t *req, tdata_t *tdata, HashGrid
             opt = 's';
         } else if (strcmp(key, "walk-speed") == 0) {
             opt = 'S';
+        } else if (strcmp(key, "window") == 0) {
+            opt = 'W';
+        } else if (strcmp(key, "criterion") == 0) {
+            opt = 'C';
+        } else if (strcmp(key, "engine") == 0) {
+            opt = 'E';
+        } else if (strcmp(key, "max-transfers") == 0) {
+            opt = 'X';
         } else if (strcmp(key, "optimise") == 0) {
             opt = 'o';
         } else if (strcmp(key, "from-idx") == 0) {
@@ -245,7 +278,7 @@ bool parse_request_from_qstring(router_request_t *req, tdata_t *tdata, HashGrid
             printf("unrecognized parameter: key=%s val=%s\n", key, val);
             continue;
         }
-        parse_request(req, tdata, hg, opt, val);
+        if ( ! parse_request(req, tdata, hg, opt, val)) return false;
     }
 
     if (req->time == UNREACHED) {
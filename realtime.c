@@ -3,13 +3,13 @@
 /* realtime.c */
 
 /*
-    Fetch GTFS-RT updates over Websockets
+    Fetch GTFS-RT updates over Websockets and publish them to the workers over 0MQ
     Depends on https://github.com/warmcat/libwebsockets
-    compile with -lwebsockets -lprotobuf-c
+    compile with -lwebsockets -lprotobuf-c -lzmq -lczmq
 
     protoc-c --c_out . gtfs-realtime.proto
     clang -O2 -c gtfs-realtime.pb-c.c -o gtfs-realtime.pb-c.o
-    clang -O2 realtime.c gtfs-realtime.pb-c.o -o rrrrealtime -lwebsockets -lprotobuf-c
+    clang -O2 realtime.c gtfs-realtime.pb-c.o -o rrrrealtime -lwebsockets -lprotobuf-c -lzmq -lczmq
 
 */
 
@@ -21,8 +21,11 @@
 #include <getopt.h>
 #include <string.h>
 #include <signal.h>
+#include <time.h>
 
 #include <libwebsockets.h>
+#include <zmq.h>
+#include <czmq.h>
 
 #include "radixtree.h"
 #include "tdata.h"
@@ -54,7 +57,10 @@ uint8_t msg[MAX_MESSAGE_LENGTH];
 size_t msg_len = 0;
 bool verbose = true;
 RadixTree *tripid_index;
+RadixTree *stopid_index;
 tdata_t tdata;
+void *zpub;
+time_t last_full = 0;
 
 static void msg_add_frame (uint8_t *frame, size_t len) {
     if (msg_len + len > MAX_MESSAGE_LENGTH) {
@@ -76,6 +82,19 @@ static void msg_dump () {
     printf ("\n===============  END OF MESSAGE  ================\n");
 }
 
+/* Send the workers what changed in the message just applied, decoded once here however many workers there are.
+   Now and then all delays go out, so that workers that started late or missed a batch catch up. */
+static void publish_deltas () {
+    bool full = time (NULL) - last_full >= RRRR_REALTIME_FULL_INTERVAL;
+    size_t size;
+    tdata_realtime_batch_t *batch = tdata_realtime_deltas (&tdata, full, &size);
+    if (batch->n_deltas == 0 && ! full) return;
+    zframe_t *frame = zframe_new (batch, size);
+    zframe_send (&frame, zpub, 0);
+    if (full) last_full = time (NULL);
+    V fprintf (stderr, "published %s batch of %d deltas. ", full ? "full" : "incremental", batch->n_deltas);
+}
+
 static bool socket_closed = false;
 static bool force_exit = false;
 
@@ -101,12 +120,16 @@ static int callback_gtfs_rt (struct libwebsocket_context *this,
             if (msg_len == 0) {
                 /* single frame message, nothing in the buffer */
                 fprintf(stderr, "single-frame message. ");
-                if (len > 0) tdata_apply_gtfsrt (&tdata, tripid_index, in, len);
+                if (len > 0) {
+                    tdata_apply_gtfsrt (&tdata, tripid_index, stopid_index, in, len);
+                    publish_deltas ();
+                }
             } else {
                 /* last frame in a multi-frame message */
                 fprintf(stderr, "had previous fragment frames. ");
                 msg_add_frame (in, len);
-                tdata_apply_gtfsrt (&tdata, tripid_index, msg, msg_len);
+                tdata_apply_gtfsrt (&tdata, tripid_index, stopid_index, msg, msg_len);
+                publish_deltas ();
                 fprintf(stderr, "emptying message buffer. ");
                 msg_reset();
             }
@@ -194,7 +217,21 @@ int main(int argc, char **argv) {
     signal(SIGINT, sighandler);
 
     tdata_load (RRRR_INPUT_FILE, &tdata);
+    /* Publish into the overlay the workers read, taking it over if it was made for another timetable. */
+    if ( ! tdata_realtime_attach (&tdata, RRRR_REALTIME_OVERLAY, true)) {
+        fprintf (stderr, "could not attach to real-time overlay %s\n", RRRR_REALTIME_OVERLAY);
+        return 1;
+    }
     tripid_index = rxt_load_strings_from_tdata (tdata.trip_ids, tdata.trip_id_width, tdata.n_trips);
+    stopid_index = rxt_load_strings_from_tdata (tdata.stop_ids, tdata.stop_id_width, tdata.n_stops);
+
+    /* Fan the deltas out to the workers, on this host or any other. */
+    zctx_t *zctx = zctx_new ();
+    zpub = zsocket_new (zctx, ZMQ_PUB);
+    if (zsocket_bind (zpub, REALTIME_ENDPOINT) == -1) {
+        fprintf (stderr, "could not bind real-time publisher to %s\n", REALTIME_ENDPOINT);
+        return 1;
+    }
 
     /*
      * create the websockets context.  This tracks open connections and
@@ -231,6 +268,7 @@ int main(int argc, char **argv) {
 bail:
     fprintf(stderr, "Exiting\n");
     libwebsocket_context_destroy(context);
+    zctx_destroy (&zctx);
     return ret;
 
 usage:
@@ -13,7 +13,7 @@ void reversal (tdata_t *tdata, router_request_t *req, bool verbose) {
 
     /* Initialize router */
     router_t router;
-    router_setup (&router, tdata);
+    router_setup (&router, tdata, RRRR_DEFAULT_ROUNDS);
 
     char result_buf[OUTPUT_LEN];
     router_route (&router, req);
@@ -2,11 +2,13 @@
 
 /* router.c : the main routing algorithm */
 #include "router.h" // first to ensure it works alone
+#include "router_internal.h"
 
 #include "util.h"
 #include "config.h"
 #include "tdata.h"
 #include "bitset.h"
+#include "board.h"
 #include "json.h"
 #include "parse.h"
 #include "polyline.h"
@@ -15,185 +17,521 @@
 #include <string.h>
 #include <time.h>
 #include <stdint.h>
+#include <math.h>
+#include <assert.h>
 
 #define RRRR_RESULT_BUFLEN 16000
 static char result_buf[RRRR_RESULT_BUFLEN];
 
-void router_setup(router_t *router, tdata_t *tdata) {
+static const double walk_speeds[RRRR_N_WALK_SPEEDS] = RRRR_WALK_SPEEDS;
+
+/* Fill in the duration of every transfer for one of the walk speeds, with the given slack added to each. */
+static void walk_table_build (router_t *router, uint32_t speed, uint8_t walk_slack) {
+    tdata_t *tdata = router->tdata;
+    uint32_t n_transfers = tdata->stops[tdata->n_stops].transfers_offset;
+    for (uint32_t tr = 0; tr < n_transfers; ++tr) {
+        /* Transfer distances are stored in units of 16 meters, rounded not truncated, in a uint8_t */
+        uint32_t dist_meters = tdata->transfer_dist_meters[tr] << 4;
+        router->walk_tables[speed][tr] = SEC_TO_RTIME((uint32_t)(dist_meters / walk_speeds[speed] + walk_slack));
+    }
+    router->walk_table_slack[speed] = walk_slack;
+}
+
+void router_setup(router_t *router, tdata_t *tdata, uint32_t max_rounds) {
     srand(time(NULL));
     router->tdata = tdata;
+    /* Itineraries and plans have room for RRRR_MAX_ROUNDS rides, so a router cannot search more rounds than that. */
+    if (max_rounds < 1 || max_rounds > RRRR_MAX_ROUNDS) die("the number of rounds must be between 1 and RRRR_MAX_ROUNDS");
+    router->max_rounds = max_rounds;
     router->best_time = (rtime_t *) malloc(sizeof(rtime_t) * tdata->n_stops);
-    router->states = (router_state_t *) malloc(sizeof(router_state_t) * (tdata->n_stops * RRRR_MAX_ROUNDS));
+    /* One more round than searched, after the others, holds the initial state. */
+    router->times = (rtime_t *) malloc(sizeof(rtime_t) * (tdata->n_stops * (max_rounds + 1)));
+    router->walk_times = (rtime_t *) malloc(sizeof(rtime_t) * (tdata->n_stops * (max_rounds + 1)));
+    router->states = (router_state_t *) malloc(sizeof(router_state_t) * (tdata->n_stops * (max_rounds + 1)));
     router->updated_stops = bitset_new(tdata->n_stops);
     router->updated_routes = bitset_new(tdata->n_routes);
-    if ( ! (router->best_time && router->states && router->updated_stops && router->updated_routes))
+    router->route_scan_start = (uint16_t *) malloc(sizeof(uint16_t) * tdata->n_routes);
+    router->touched_stops = (uint32_t *) malloc(sizeof(uint32_t) * tdata->n_stops);
+    if ( ! (router->best_time && router->times && router->walk_times && router->states && router->updated_stops && router->updated_routes && router->route_scan_start && router->touched_stops))
         die("failed to allocate router scratch space");
+    /* Initialize all scratch state once. From then on, router_reset only clears the stops touched by a search. */
+    for (uint32_t i = 0; i < tdata->n_stops * (max_rounds + 1); ++i) {
+        // We use the time fields to record when stops have been reached.
+        // When times are UNREACHED the other fields in the same state should never be read.
+        router->times[i] = UNREACHED;
+        router->walk_times[i] = UNREACHED;
+    }
+    for (uint32_t s = 0; s < tdata->n_stops; ++s) router->best_time[s] = UNREACHED;
+    router->n_touched_stops = 0;
+    for (uint32_t w = 0; w < RRRR_N_WALK_SPEEDS; ++w) {
+        router->walk_tables[w] = (rtime_t *) malloc(sizeof(rtime_t) * tdata->stops[tdata->n_stops].transfers_offset);
+        if ( ! router->walk_tables[w]) die("failed to allocate router scratch space");
+        walk_table_build (router, w, RRRR_WALK_SLACK_SEC);
+    }
+    router->walk_durations = router->walk_tables[0];
+    router->route_trip_attributes = (uint8_t *) calloc(tdata->n_routes, sizeof(uint8_t));
+    if ( ! router->route_trip_attributes) die("failed to allocate router scratch space");
+    for (uint32_t r = 0; r < tdata->n_routes; ++r) {
+        uint8_t *trip_attributes = tdata_trip_attributes_for_route(tdata, r);
+        for (uint32_t t = 0; t < tdata->routes[r].n_trips; ++t) router->route_trip_attributes[r] |= trip_attributes[t];
+    }
+    router->route_eligible = bitset_new(tdata->n_routes);
+    router->banned_stops = bitset_new(tdata->n_stops);
+    router->banned_stops_hard = bitset_new(tdata->n_stops);
+    router->banned_trips = bitset_new(tdata->n_trips);
+    router->generic_kernels = false;
+    router->round_best_time = NULL;
+    router->last_best_time = NULL;
+    router->bags = NULL;
+    router->bag_generation = NULL;
+    router->generation = 0;
+    slab_init(&router->slab, 0);
+    router->pool = NULL;
+    router->workers = NULL;
+    router->parallel_items = NULL;
+    router->merge_rank = NULL;
+    router->lower_bounds = NULL;
+    router->prune_lower_bounds = false;
+    router->trip_reached = NULL;
+    router->segments = NULL;
+    router->segments_capacity = 0;
+    router->walk_to_target = NULL;
+    router->csa_times = NULL;
+    router->csa_ride_times = NULL;
+    router->csa_labels = NULL;
+    router->csa_trip_rides = NULL;
+    router->csa_trip_enter = NULL;
+    router->csa_profiles = NULL;
+    router->csa_trips = NULL;
+    for (int i = 0; i < 3; ++i) {
+        day_view_t *view = router->day_views + i;
+        /* Start out as the (empty) views of a day on which nothing runs. */
+        view->mask = 0;
+        view->trips_offsets = (uint32_t *) calloc(tdata->n_routes + 1, sizeof(uint32_t));
+        view->n_fifo = (uint16_t *) calloc(tdata->n_routes, sizeof(uint16_t));
+        view->trips = (uint16_t *) malloc(sizeof(uint16_t) * (tdata->n_trips + 1));
+        if ( ! (view->trips_offsets && view->n_fifo && view->trips)) die("failed to allocate router scratch space");
+    }
+    router->day_views_version = tdata->realtime_generation;
 }
 
-static inline void router_reset(router_t router) {
+/* Add a stop whose best time is about to be set for the first time to the touched stops. Profile searches keep one
+   array of best times per round and carry each of them over into the later rounds, so there a stop reached before
+   still has a best time in the last round. */
+static inline void touched_stops_add (router_t *router, uint32_t stop) {
+    if (router->last_best_time != NULL && router->last_best_time[stop] != UNREACHED) return;
+    router->touched_stops[router->n_touched_stops++] = stop;
+}
 
+/* Record a stop the first time its best time is set in a search. Every state written during a search belongs to
+   such a stop, so clearing the touched stops restores the scratch state in time proportional to the explored area. */
+static inline void touch_stop (router_t *router, uint32_t stop) {
+    if (router->best_time[stop] == UNREACHED) touched_stops_add (router, stop);
+}
+
+static inline void router_reset(router_t *router) {
+    uint32_t n_stops = router->tdata->n_stops;
+    for (uint32_t i = 0; i < router->n_touched_stops; ++i) {
+        uint32_t stop = router->touched_stops[i];
+        router->best_time[stop] = UNREACHED;
+        for (uint32_t round = 0; round <= router->max_rounds; ++round) {
+            router->times[round * n_stops + stop] = UNREACHED;
+            router->walk_times[round * n_stops + stop] = UNREACHED;
+        }
+    }
+    router->n_touched_stops = 0;
 }
 
 void router_teardown(router_t *router) {
     free(router->best_time);
+    free(router->times);
+    free(router->walk_times);
     free(router->states);
     bitset_destroy(router->updated_stops);
     bitset_destroy(router->updated_routes);
-}
-
-// TODO? flag_routes_for_stops all at once after doing transfers? this would require another stops
-// bitset for transfer target stops.
-/* Given a stop index, mark all routes that serve it as updated. */
-static inline void flag_routes_for_stop (router_t *router, router_request_t *req, uint32_t stop_index) {
-    uint32_t *routes;
-    uint32_t n_routes = tdata_routes_for_stop (router->tdata, stop_index, &routes);
-    for (uint32_t i = 0; i < n_routes; ++i) {
-        calendar_t route_active_flags = router->tdata->route_active[routes[i]];
-        I printf ("  flagging route %d at stop %d\n", routes[i], stop_index);
-        // CHECK that there are any trips running on this route (another bitfield)
-        // printf("route flags %d", route_active_flags);
-        // printBits(4, &route_active_flags);
-        if ((router->day_mask & route_active_flags) && // seems to provide about 14% increase in throughput
-            (req->mode & router->tdata->routes[routes[i]].attributes) > 0) {
-           bitset_set (router->updated_routes, routes[i]);
-           I printf ("  route running\n");
-        }
+    free(router->route_scan_start);
+    for (uint32_t w = 0; w < RRRR_N_WALK_SPEEDS; ++w) free(router->walk_tables[w]);
+    free(router->route_trip_attributes);
+    bitset_destroy(router->route_eligible);
+    bitset_destroy(router->banned_stops);
+    bitset_destroy(router->banned_stops_hard);
+    bitset_destroy(router->banned_trips);
+    free(router->touched_stops);
+    free(router->round_best_time);
+    free(router->bags);
+    free(router->bag_generation);
+    slab_destroy(&router->slab);
+    free(router->lower_bounds);
+    free(router->trip_reached);
+    free(router->segments);
+    free(router->walk_to_target);
+    free(router->csa_times);
+    free(router->csa_ride_times);
+    free(router->csa_labels);
+    free(router->csa_trip_rides);
+    free(router->csa_trip_enter);
+    if (router->csa_profiles != NULL) {
+        for (uint32_t s = 0; s < router->tdata->n_stops; ++s) free(router->csa_profiles[s].departures);
     }
-}
-
-static inline void unflag_banned_routes (router_t *router, router_request_t *req) {
-     for (uint32_t i = 0; i < req->n_banned_routes; ++i) {
-         bitset_unset (router->updated_routes, req->banned_route);
-     }
+    free(router->csa_profiles);
+    free(router->csa_trips);
+    for (int i = 0; i < 3; ++i) {
+        free(router->day_views[i].trips_offsets);
+        free(router->day_views[i].n_fifo);
+        free(router->day_views[i].trips);
+    }
+    router_setup_threads(router, 1);
 }
 
 static inline void unflag_banned_stops (router_t *router, router_request_t *req) {
      for (uint32_t i = 0; i < req->n_banned_stops; ++i) {
-         bitset_unset (router->updated_stops, req->banned_stop);
+         if (req->banned_stops[i] < router->tdata->n_stops) bitset_unset (router->updated_stops, req->banned_stops[i]);
      }
 }
 
-/* Because the first round begins with so few reached stops, the initial state doesn't get its own full array of states.
-   Instead we reuse one of the later rounds (round 1) for the initial state. This means we need to reset the walks in
-   round 1 back to UNREACHED before using them in routing. Rather than iterating over all of them, we only initialize
-   the stops that can be reached by transfers.
-   Alternatively we could instead initialize walks to UNREACHED at the beginning of the transfer calculation function.
-   We should not however reset the best times for those stops reached from the initial stop on foot. This will prevent
-   finding circuitous itineraries that return to them.
-   */
-static inline void initialize_transfers (router_t *router, uint32_t round, uint32_t stop_index_from) {
-    router_state_t *states = router->states + (round * router->tdata->n_stops);
-    states[stop_index_from].walk_time = UNREACHED;
-    uint32_t t  = router->tdata->stops[stop_index_from    ].transfers_offset;
-    uint32_t tN = router->tdata->stops[stop_index_from + 1].transfers_offset;
-    for ( ; t < tN ; ++t) {
-        uint32_t stop_index_to = router->tdata->transfer_target_stops[t];
-        states[stop_index_to].walk_time = UNREACHED;
-    }
-}
-
-/* Rather than reserving a place to store the transfers used to create the initial state, we look them up as needed. */
-static inline rtime_t
-transfer_duration (tdata_t *tdata, router_request_t *req, uint32_t stop_index_from, uint32_t stop_index_to) {
+uint32_t
+transfer_distance (tdata_t *tdata, uint32_t stop_index_from, uint32_t stop_index_to) {
     if (stop_index_from == stop_index_to) return 0;
     uint32_t t  = tdata->stops[stop_index_from    ].transfers_offset;
     uint32_t tN = tdata->stops[stop_index_from + 1].transfers_offset;
     for ( ; t < tN ; ++t) {
         if (tdata->transfer_target_stops[t] == stop_index_to) {
-            uint32_t distance_meters = tdata->transfer_dist_meters[t] << 4; // actually in units of 16 meters
-            return SEC_TO_RTIME((uint32_t)(distance_meters / req->walk_speed + req->walk_slack));
+            return tdata->transfer_dist_meters[t] << 4; // actually in units of 16 meters
         }
     }
     return UNREACHED;
 }
 
-uint32_t
-transfer_distance (tdata_t *tdata, uint32_t stop_index_from, uint32_t stop_index_to) {
-    if (stop_index_from == stop_index_to) return 0;
-    uint32_t t  = tdata->stops[stop_index_from    ].transfers_offset;
-    uint32_t tN = tdata->stops[stop_index_from + 1].transfers_offset;
-    for ( ; t < tN ; ++t) {
-        if (tdata->transfer_target_stops[t] == stop_index_to) {
-            return tdata->transfer_dist_meters[t] << 4; // actually in units of 16 meters
+
+/* GOAL-DIRECTED PRUNING */
+
+/* Prepare the lower bounds on the time between every cluster of stops and the target of a search, if the timetable has
+   them and they hold for the request's walk speed. For arrive-by searches the bounds run from the target instead.
+   They were found without delays. Delaying a whole trip does not shorten its rides, but a trip with delays per stop
+   can catch up on its delay, so the bounds are lowered by as much as that on every ride. */
+static void router_setup_lower_bounds (router_t *router, router_request_t *req) {
+    tdata_t *tdata = router->tdata;
+    uint32_t n_clusters = tdata->n_lb_clusters;
+    router->prune_lower_bounds = n_clusters > 0 && router->target < tdata->n_stops && req->walk_speed <= tdata->lb_walk_speed;
+    if ( ! router->prune_lower_bounds) return;
+    if (router->lower_bounds == NULL) {
+        router->lower_bounds = (rtime_t *) malloc (sizeof(rtime_t) * n_clusters);
+        if (router->lower_bounds == NULL) die ("failed to allocate lower bound scratch space");
+    }
+    uint32_t target_cluster = tdata->lb_cluster_for_stop[router->target];
+    uint32_t slack = (uint32_t) tdata->realtime_recovery * request_rounds (router, req);
+    for (uint32_t c = 0; c < n_clusters; ++c) {
+        rtime_t bound = req->arrive_by ? tdata->lb_times[c * n_clusters + target_cluster]
+                                       : tdata->lb_times[target_cluster * n_clusters + c];
+        if (bound != UNREACHED) bound = bound > slack ? bound - slack : 0;
+        router->lower_bounds[c] = bound;
+    }
+}
+
+/* Whether a stop reached at the given time can be discarded, because even the lower bound on the time between it and
+   the target would not improve on the best known time at the target, or because the target cannot be reached from
+   it at all. Like target pruning this is only valid for searches with one target. */
+static inline bool
+lower_bound_prunes (router_t *router, router_request_t *req, uint32_t stop, rtime_t time, rtime_t target_time) {
+    if ( ! router->prune_lower_bounds) return false;
+    rtime_t bound = router->lower_bounds[router->tdata->lb_cluster_for_stop[stop]];
+    if (bound == UNREACHED) return true;
+    if (target_time == UNREACHED) return false;
+    return req->arrive_by ? time < (uint32_t) target_time + bound
+                          : (uint32_t) time + bound > target_time;
+}
+
+
+
+/* PARALLEL ROUNDS */
+
+/*
+  With several threads, the routes of a round are shared out between them, and so are the stops transfers leave from.
+  Threads claim better best times right away with an atomic minimum (maximum for arrive-by), so they prune each other
+  as a single thread would. The states are only written afterwards, on one thread, from the improvements each thread
+  collected. Where several improvements reach the same time at a stop, the one a single thread would have kept wins:
+  the route with the lowest index, or for transfers the ride to the stop itself and then the walk from the stop with
+  the lowest index. Results are then the same whatever the number of threads.
+*/
+
+/* An improvement found by a thread. For walks, route and trip are WALK and back_stop is the stop walked from. */
+typedef struct round_candidate round_candidate_t;
+struct round_candidate {
+    uint32_t stop;
+    uint32_t back_stop;
+    uint32_t route;
+    uint32_t trip;
+    rtime_t  time;
+    rtime_t  board_time;
+    bool     first; // whether this was the first time the stop was reached since the last reset
+};
+
+typedef struct round_worker round_worker_t;
+struct round_worker {
+    round_candidate_t *candidates;
+    uint32_t n_candidates;
+    uint32_t capacity;
+};
+
+/* What the threads of a parallel phase share. */
+struct round_task {
+    router_t *router;
+    router_request_t *req;
+    uint8_t round;
+    uint32_t n_items;
+    uint32_t next_item; // the next route or stop to be taken by a thread
+};
+
+static inline rtime_t best_time_get (router_t *router, uint32_t stop) {
+    return __atomic_load_n (router->best_time + stop, __ATOMIC_RELAXED);
+}
+
+static inline round_candidate_t *round_worker_push (round_worker_t *worker) {
+    if (worker->n_candidates == worker->capacity) {
+        worker->capacity = worker->capacity ? worker->capacity * 2 : 1024;
+        worker->candidates = (round_candidate_t *) realloc (worker->candidates, sizeof(round_candidate_t) * worker->capacity);
+        if (worker->candidates == NULL) die ("failed to allocate parallel round scratch space");
+    }
+    return worker->candidates + worker->n_candidates++;
+}
+
+/* Lower (raise for arrive-by) the best time at a stop unless another thread got there first with a time as good, and
+   record the improvement. Returns false if it was not an improvement. */
+static inline bool
+round_worker_offer (router_t *router, round_worker_t *worker, router_request_t *req, uint32_t stop, rtime_t time,
+                    uint32_t route, uint32_t trip, uint32_t back_stop, rtime_t board_time) {
+    rtime_t *best = router->best_time + stop;
+    rtime_t old = __atomic_load_n (best, __ATOMIC_RELAXED);
+    do {
+        if (old != UNREACHED && (req->arrive_by ? time <= old : time >= old)) return false;
+    } while ( ! __atomic_compare_exchange_n (best, &old, time, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    round_candidate_t *c = round_worker_push (worker);
+    c->stop = stop;
+    c->back_stop = back_stop;
+    c->route = route;
+    c->trip = trip;
+    c->time = time;
+    c->board_time = board_time;
+    c->first = (old == UNREACHED);
+    return true;
+}
+
+/* Take the next few items of a parallel phase. Returns the number taken, 0 when there are none left. */
+static inline uint32_t round_task_take (struct round_task *task, uint32_t *first) {
+    uint32_t i = __atomic_fetch_add (&task->next_item, RRRR_PARALLEL_CHUNK, __ATOMIC_RELAXED);
+    if (i >= task->n_items) return 0;
+    *first = i;
+    return i + RRRR_PARALLEL_CHUNK > task->n_items ? task->n_items - i : RRRR_PARALLEL_CHUNK;
+}
+
+/* Gather the set bits into parallel_items. Returns whether there are enough of them to share out. */
+static inline bool round_task_items (router_t *router, BitSet *bits, uint32_t min_items, struct round_task *task) {
+    if (router->pool == NULL) return false;
+    task->n_items = 0;
+    task->next_item = 0;
+    for (uint32_t i  = bitset_next_set_bit (bits, 0);
+                  i != BITSET_NONE;
+                  i  = bitset_next_set_bit (bits, i + 1)) {
+        router->parallel_items[task->n_items++] = i;
+    }
+    return task->n_items >= min_items;
+}
+
+/* Record the stops the threads reached for the first time, as touch_stop would have done. */
+static inline void round_merge_touched (router_t *router, round_candidate_t *c) {
+    if (c->first) touched_stops_add (router, c->stop);
+}
+
+/* Visit the improvements collected by all threads, in thread order. */
+#define FOR_EACH_CANDIDATE(router, c) \
+    for (round_worker_t *w = (router)->workers; w < (router)->workers + threadpool_size ((router)->pool); ++w) \
+        for (round_candidate_t *c = w->candidates; c < w->candidates + w->n_candidates; ++c)
+
+/* The merges go over the improvements twice: once to rank the ones reaching the final best time at each stop, and once
+   to write the winners. The rank of a winner is cleared as it is written, so merge_rank is all NONE again after. */
+static void round_merge_rides (router_t *router, uint8_t round) {
+    rtime_t *times = router->times + (round * router->tdata->n_stops);
+    router_state_t *states = router->states + (round * router->tdata->n_stops);
+    FOR_EACH_CANDIDATE (router, c) {
+        round_merge_touched (router, c);
+        if (c->time == router->best_time[c->stop] && c->route < router->merge_rank[c->stop])
+            router->merge_rank[c->stop] = c->route;
+    }
+    FOR_EACH_CANDIDATE (router, c) {
+        if (c->time != router->best_time[c->stop] || c->route != router->merge_rank[c->stop]) continue;
+        router->merge_rank[c->stop] = NONE;
+        times[c->stop] = c->time;
+        states[c->stop].back_route = c->route;
+        states[c->stop].back_trip  = c->trip;
+        states[c->stop].back_stop  = c->back_stop;
+        states[c->stop].board_time = c->board_time;
+        bitset_set (router->updated_stops, c->stop);
+    }
+}
+
+static void round_transfer_task (void *arg, uint32_t thread) {
+    struct round_task *task = (struct round_task *) arg;
+    router_t *router = task->router;
+    router_request_t *req = task->req;
+    tdata_t *tdata = router->tdata;
+    rtime_t *times = router->times + (task->round * tdata->n_stops);
+    round_worker_t *worker = router->workers + thread;
+    worker->n_candidates = 0;
+    uint32_t first, n;
+    while ((n = round_task_take (task, &first)) > 0) {
+        for (uint32_t i = first; i < first + n; ++i) {
+            uint32_t stop_index_from = router->parallel_items[i];
+            rtime_t time_from = times[stop_index_from];
+            if (time_from == UNREACHED) {
+                printf ("ERROR: transferring from unreached stop %d in round %d. \n", stop_index_from, task->round);
+                continue;
+            }
+            /* The stop itself keeps its ride arrival unless a walk from elsewhere does better. */
+            round_candidate_t *c = round_worker_push (worker);
+            c->stop = c->back_stop = stop_index_from;
+            c->route = c->trip = WALK;
+            c->time = time_from;
+            c->board_time = UNREACHED;
+            c->first = false;
+            uint32_t tr     = tdata->stops[stop_index_from    ].transfers_offset;
+            uint32_t tr_end = tdata->stops[stop_index_from + 1].transfers_offset;
+            for ( ; tr < tr_end ; ++tr) {
+                uint32_t stop_index_to = tdata->transfer_target_stops[tr];
+                rtime_t transfer_duration = router->walk_durations[tr];
+                rtime_t time_to = req->arrive_by ? time_from - transfer_duration
+                                                 : time_from + transfer_duration;
+                if (time_to > RTIME_THREE_DAYS) continue;
+                if (req->arrive_by ? time_to > time_from : time_to < time_from) continue;
+                if (lower_bound_prunes (router, req, stop_index_to, time_to, best_time_get (router, router->target))) continue;
+                round_worker_offer (router, worker, req, stop_index_to, time_to, WALK, WALK, stop_index_from, UNREACHED);
+            }
         }
     }
-    return UNREACHED;
 }
 
+static void round_merge_walks (router_t *router, router_request_t *req, uint8_t round) {
+    rtime_t *walk_times = router->walk_times + (round * router->tdata->n_stops);
+    router_state_t *states = router->states + (round * router->tdata->n_stops);
+    FOR_EACH_CANDIDATE (router, c) {
+        round_merge_touched (router, c);
+        uint32_t rank = c->back_stop == c->stop ? 0 : c->back_stop + 1;
+        if (c->time == router->best_time[c->stop] && rank < router->merge_rank[c->stop])
+            router->merge_rank[c->stop] = rank;
+    }
+    FOR_EACH_CANDIDATE (router, c) {
+        uint32_t rank = c->back_stop == c->stop ? 0 : c->back_stop + 1;
+        if (c->time != router->best_time[c->stop] || rank != router->merge_rank[c->stop]) continue;
+        router->merge_rank[c->stop] = NONE;
+        walk_times[c->stop] = c->time;
+        states[c->stop].walk_from = c->back_stop;
+        flag_routes_for_stop (router, req, c->stop);
+    }
+}
+
+/* Share out large rounds between n_threads threads from now on, or go back to a single thread if n_threads is 1. */
+void router_setup_threads (router_t *router, uint32_t n_threads) {
+    if (router->pool != NULL) {
+        for (uint32_t t = 0; t < threadpool_size (router->pool); ++t) free (router->workers[t].candidates);
+        threadpool_destroy (router->pool);
+        free (router->workers);
+        free (router->parallel_items);
+        free (router->merge_rank);
+        router->pool = NULL;
+        router->workers = NULL;
+        router->parallel_items = NULL;
+        router->merge_rank = NULL;
+    }
+    if (n_threads <= 1) return;
+    tdata_t *tdata = router->tdata;
+    router->workers = (round_worker_t *) calloc (n_threads, sizeof(round_worker_t));
+    router->parallel_items = (uint32_t *) malloc (sizeof(uint32_t) * (tdata->n_routes > tdata->n_stops ? tdata->n_routes : tdata->n_stops));
+    router->merge_rank = (uint32_t *) malloc (sizeof(uint32_t) * tdata->n_stops);
+    if ( ! (router->workers && router->parallel_items && router->merge_rank))
+        die ("failed to allocate parallel round scratch space");
+    for (uint32_t s = 0; s < tdata->n_stops; ++s) router->merge_rank[s] = NONE;
+    router->pool = threadpool_new (n_threads);
+}
 
 /*
  For each updated stop and each destination of a transfer from an updated stop,
  set the associated routes as updated. The routes bitset is cleared before the operation,
  and the stops bitset is cleared after all transfers have been computed and all routes have been set.
  Transfer results are computed within the same round, based on arrival time in the ride phase and
- stored in the walk time member of states.
+ stored in the walk times of the round.
 */
 static inline void
 apply_transfers (router_t *router, router_request_t *req, uint32_t round) {
+    rtime_t *times = router->times + (round * router->tdata->n_stops);
+    rtime_t *walk_times = router->walk_times + (round * router->tdata->n_stops);
     router_state_t *states = router->states + (round * router->tdata->n_stops);
     /* The transfer process will flag routes that should be explored in the next round */
     bitset_reset (router->updated_routes);
+    struct round_task task = { router, req, round, 0, 0 };
+    if (round_task_items (router, router->updated_stops, RRRR_PARALLEL_MIN_STOPS, &task)) {
+        threadpool_run (router->pool, round_transfer_task, &task);
+        round_merge_walks (router, req, round);
+        mask_ineligible_routes (router);
+        bitset_reset (router->updated_stops);
+        return;
+    }
     for (uint32_t stop_index_from  = bitset_next_set_bit (router->updated_stops, 0);
                   stop_index_from != BITSET_NONE;
                   stop_index_from  = bitset_next_set_bit (router->updated_stops, stop_index_from + 1)) {
         I printf ("stop %d was marked as updated \n", stop_index_from);
-        router_state_t *state_from = states + stop_index_from;
-        rtime_t time_from = state_from->time;
+        rtime_t time_from = times[stop_index_from];
         if (time_from == UNREACHED) {
             printf ("ERROR: transferring from unreached stop %d in round %d. \n", stop_index_from, round);
             continue;
         }
-        /* At this point, the best time at the from stop may be different than the state_from->time,
+        /* At this point, the best time at the from stop may be different than its ride time,
            because the best time may have been updated by a transfer. */
         /*
         if (time_from != router->best_time[stop_index_from]) {
             printf ("ERROR: time at stop %d in round %d is not the same as its best time. \n", stop_index_from, round);
             printf ("    from time %s \n", timetext(time_from));
-            printf ("    walk time %s \n", timetext(state_from->walk_time));
+            printf ("    walk time %s \n", timetext(walk_times[stop_index_from]));
             printf ("    best time %s \n", timetext(router->best_time[stop_index_from]));
             continue;
         }
         */
         I printf ("  applying transfer at %d (%s) \n", stop_index_from, tdata_stop_name_for_index(router->tdata, stop_index_from));
         /* First apply a transfer from the stop to itself, if case that's the best way */
-        if (state_from->time == router->best_time[stop_index_from]) {
+        if (time_from == router->best_time[stop_index_from]) {
             /* This state's best time is still its own. No improvements from other transfers. */
-            state_from->walk_time = time_from;
-            state_from->walk_from = stop_index_from;
+            walk_times[stop_index_from] = time_from;
+            states[stop_index_from].walk_from = stop_index_from;
             // assert (router->best_time[stop_index_from] == time_from);
             flag_routes_for_stop (router, req, stop_index_from);
-            unflag_banned_routes (router, req);
         }
         /* Then apply transfers from the stop to nearby stops */
         uint32_t tr     = router->tdata->stops[stop_index_from    ].transfers_offset;
         uint32_t tr_end = router->tdata->stops[stop_index_from + 1].transfers_offset;
         for ( ; tr < tr_end ; ++tr) {
             uint32_t stop_index_to = router->tdata->transfer_target_stops[tr];
-            /* Transfer distances are stored in units of 16 meters, rounded not truncated, in a uint8_t */
-            uint32_t dist_meters = router->tdata->transfer_dist_meters[tr] << 4;
-            rtime_t transfer_duration = SEC_TO_RTIME((uint32_t)(dist_meters / req->walk_speed + req->walk_slack));
+            rtime_t transfer_duration = router->walk_durations[tr];
             rtime_t time_to = req->arrive_by ? time_from - transfer_duration
                                              : time_from + transfer_duration;
             /* Avoid reserved values including UNREACHED */
             if (time_to > RTIME_THREE_DAYS) continue;
             /* Catch wrapping/overflow due to limited range of rtime_t (happens normally on overnight routing but should be avoided rather than caught) */
             if (req->arrive_by ? time_to > time_from : time_to < time_from) continue;
+            if (lower_bound_prunes (router, req, stop_index_to, time_to, router->best_time[router->target])) continue;
             I printf ("    target %d %s (%s) \n", stop_index_to, timetext(router->best_time[stop_index_to]), tdata_stop_name_for_index(router->tdata, stop_index_to));
             I printf ("    transfer time   %s\n", timetext(transfer_duration));
             I printf ("    transfer result %s\n", timetext(time_to));
-            router_state_t *state_to = states + stop_index_to;
-            // TODO verify state_to->walk_time versus router->best_time[stop_index_to]
+            // TODO verify walk_times[stop_index_to] versus router->best_time[stop_index_to]
             if (router->best_time[stop_index_to] == UNREACHED || (req->arrive_by ? time_to > router->best_time[stop_index_to]
                                                                                  : time_to < router->best_time[stop_index_to])) {
                 I printf ("      setting %d to %s\n", stop_index_to, timetext(time_to));
-                state_to->walk_time = time_to;
-                state_to->walk_from = stop_index_from;
+                walk_times[stop_index_to] = time_to;
+                states[stop_index_to].walk_from = stop_index_from;
+                touch_stop (router, stop_index_to);
                 router->best_time[stop_index_to] = time_to;
                 flag_routes_for_stop (router, req, stop_index_to);
-                unflag_banned_routes (router, req);
             }
         }
     }
+    mask_ineligible_routes (router);
     /* Done with all transfers, reset stop-reached bits for the next round */
     bitset_reset (router->updated_stops);
     /*
@@ -204,21 +542,22 @@ apply_transfers (router_t *router, router_request_t *req, uint32_t round) {
 }
 
 static void dump_results(router_t *router) {
-    router_state_t (*states)[router->tdata->n_stops] = (void*) router->states;
+    rtime_t (*times)[router->tdata->n_stops] = (void*) router->times;
+    rtime_t (*walk_times)[router->tdata->n_stops] = (void*) router->walk_times;
     // char id_fmt[10];
     // sprintf(id_fmt, "%%%ds", router->tdata->stop_id_width);
     char *id_fmt = "%30.30s";
     printf("\nRouter states:\n");
     printf(id_fmt, "Stop name");
     printf(" [sindex]");
-    for (uint32_t r = 0; r < RRRR_MAX_ROUNDS; ++r){
+    for (uint32_t r = 0; r < router->max_rounds; ++r){
         printf("  round %d   walk %d", r, r);
     }
     printf("\n");
     for (uint32_t stop = 0; stop < router->tdata->n_stops; ++stop) {
         bool set = false;
-        for (uint32_t round = 0; round < RRRR_MAX_ROUNDS; ++round) {
-            if (states[round][stop].walk_time != UNREACHED) {
+        for (uint32_t round = 0; round < router->max_rounds; ++round) {
+            if (walk_times[round][stop] != UNREACHED) {
                 set = true;
                 break;
             }
@@ -227,9 +566,9 @@ static void dump_results(router_t *router) {
         char *stop_id = tdata_stop_name_for_index (router->tdata, stop);
         printf(id_fmt, stop_id);
         printf(" [%6d]", stop);
-        for (uint32_t round = 0; round < RRRR_MAX_ROUNDS; ++round) {
-            printf(" %8s", timetext(states[round][stop].time));
-            printf(" %8s", timetext(states[round][stop].walk_time));
+        for (uint32_t round = 0; round < router->max_rounds; ++round) {
+            printf(" %8s", timetext(times[round][stop]));
+            printf(" %8s", timetext(walk_times[round][stop]));
         }
         printf("\n");
     }
@@ -274,72 +613,147 @@ static void service_day_dump (serviceday_t *serviceday) {
     printf ("real-time: %s \n\n", serviceday->apply_realtime ? "YES" : "NO");
 }
 
-static inline rtime_t
-tdata_depart (tdata_t* td, trip_t *trip, uint32_t route_stop) {
-    return trip->begin_time + td->stop_times[trip->stop_times_offset + route_stop].departure;
+/* List the trips of every route that run on the days in the mask. A subsequence of the FIFO chain of the departure
+   index is itself ordered at every stop, so the leading entries of each route can still be binary searched. */
+static void day_view_build (tdata_t *tdata, calendar_t mask, day_view_t *view) {
+    uint32_t n = 0;
+    for (uint32_t route_idx = 0; route_idx < tdata->n_routes; ++route_idx) {
+        route_t *route = tdata->routes + route_idx;
+        uint16_t *trip_order = tdata->departure_index + route->trip_ids_offset;
+        calendar_t *trip_masks = tdata_trip_masks_for_route (tdata, route_idx);
+        uint32_t n_fifo = tdata->n_fifo_trips[route_idx];
+        view->trips_offsets[route_idx] = n;
+        for (uint32_t pos = 0; pos < route->n_trips; ++pos) {
+            if (pos == n_fifo) view->n_fifo[route_idx] = n - view->trips_offsets[route_idx];
+            if (mask & trip_masks[trip_order[pos]]) view->trips[n++] = trip_order[pos];
+        }
+        if (n_fifo == route->n_trips) view->n_fifo[route_idx] = n - view->trips_offsets[route_idx];
+    }
+    view->trips_offsets[tdata->n_routes] = n;
+    view->mask = mask;
 }
 
-static inline rtime_t
-tdata_arrive (tdata_t* td, trip_t *trip, uint32_t route_stop) {
-    return trip->begin_time + td->stop_times[trip->stop_times_offset + route_stop].arrival;
+/* Point every service day of the search at a view of its trips. Views already built for one of the masks are kept,
+   so consecutive searches on the same day do not rebuild them, unless the real-time overlay has changed since. */
+static void router_setup_day_views (router_t *router) {
+    bool kept[3] = { false, false, false };
+    bool current = router->day_views_version == router->tdata->realtime_generation;
+    router->day_views_version = router->tdata->realtime_generation;
+    for (int d = 0; d < 3; ++d) {
+        serviceday_t *serviceday = router->servicedays + d;
+        serviceday->view = NULL;
+        for (int i = 0; current && i < 3; ++i) {
+            if (router->day_views[i].mask == serviceday->mask && ! kept[i]) {
+                serviceday->view = router->day_views + i;
+                kept[i] = true;
+                break;
+            }
+        }
+    }
+    for (int d = 0; d < 3; ++d) {
+        serviceday_t *serviceday = router->servicedays + d;
+        if (serviceday->view != NULL) continue;
+        int i = 0;
+        while (kept[i]) ++i;
+        kept[i] = true;
+        serviceday->view = router->day_views + i;
+        day_view_build (router->tdata, serviceday->mask, serviceday->view);
+    }
 }
 
-/* Get the departure or arrival time of the given trip on the given service day, applying realtime data as needed. */
-static inline rtime_t
-tdata_stoptime (tdata_t* tdata, trip_t *trip, uint32_t route_stop, bool arrive, serviceday_t *serviceday) {
-    rtime_t time, time_adjusted;
-    if (arrive) time = tdata_arrive(tdata, trip, route_stop);
-    else           time = tdata_depart(tdata, trip, route_stop);
-    time_adjusted = time + serviceday->midnight;
-    /*
-    printf ("boarding at stop %d, time is: %s \n", route_stop, timetext (time));
-    printf ("   after adjusting: %s \n", timetext (time_adjusted));
-    printf ("   midnight: %d \n", serviceday->midnight);
-    printf ("   delay (4sec): %d \n", trip->realtime_delay);
-    */
-    /* Detect overflow (this will still not catch wrapping due to negative delays on small positive times) */
-    // actually this happens naturally with times like '03:00+1day' transposed to serviceday 'tomorrow'
-    if (time_adjusted < time) return UNREACHED;
-    /* Apply real time delay on the relevant days. */
-    if (serviceday->apply_realtime) time_adjusted += trip->realtime_delay;
-    return time_adjusted;
+/* Set up one serviceday_t for each of: yesterday, today, tomorrow (for overnight searches) */
+void router_setup_servicedays (router_t *router, router_request_t *req) {
+    router->day_mask = req->day_mask;
+    /* Note that yesterday's bit flag will be 0 if today is the first day of the calendar. */
+    // One bit for the calendar day on which realtime data should be applied (applying only on the true current calendar day)
+    calendar_t realtime_mask = 1 << ((time(NULL) - router->tdata->calendar_start_time) / SEC_IN_ONE_DAY);
+    serviceday_t yesterday;
+    yesterday.midnight = 0;
+    yesterday.mask = router->day_mask >> 1;
+    yesterday.apply_realtime = yesterday.mask & realtime_mask;
+    serviceday_t today;
+    today.midnight = RTIME_ONE_DAY;
+    today.mask = router->day_mask;
+    today.apply_realtime = today.mask & realtime_mask;
+    serviceday_t tomorrow;
+    tomorrow.midnight = RTIME_TWO_DAYS;
+    tomorrow.mask = router->day_mask << 1;
+    tomorrow.apply_realtime = tomorrow.mask & realtime_mask;
+    /* Iterate backward over days for arrive-by searches. */
+    if (req->arrive_by) {
+        router->servicedays[0] = tomorrow;
+        router->servicedays[1] = today;
+        router->servicedays[2] = yesterday;
+    } else {
+        router->servicedays[0] = yesterday;
+        router->servicedays[1] = today;
+        router->servicedays[2] = tomorrow;
+    }
+    /* set day_mask to catch all service days (0, 1, 2) */
+    router->day_mask = yesterday.mask | today.mask | tomorrow.mask;
+    router_setup_day_views (router);
+}
+
+/* Snap the walk speed of a request to the nearest of the walk speeds and use its transfer durations from now on. They
+   are only rebuilt when the request asks for another walk slack than they were built for. */
+static void router_setup_walk_durations (router_t *router, router_request_t *req) {
+    uint32_t speed = 0;
+    for (uint32_t w = 1; w < RRRR_N_WALK_SPEEDS; ++w) {
+        if (fabs (walk_speeds[w] - req->walk_speed) < fabs (walk_speeds[speed] - req->walk_speed)) speed = w;
+    }
+    req->walk_speed = walk_speeds[speed];
+    if (router->walk_table_slack[speed] != req->walk_slack) walk_table_build (router, speed, req->walk_slack);
+    router->walk_durations = router->walk_tables[speed];
+}
+
+static void router_setup_scan_kernels (router_t *router, router_request_t *req);
+
+/* Compile the filters of a request once per search: the routes it allows at all into route_eligible, and its banned
+   stops and trips into bitsets, so that the searches test them with a single lookup however many bans it carries.
+   Bans outside the timetable are ignored. Also selects the transfer durations for the walk speed of the request and
+   the route scan kernels. */
+void router_compile_request (router_t *router, router_request_t *req) {
+    tdata_t *tdata = router->tdata;
+    router_setup_walk_durations (router, req);
+    bitset_reset (router->route_eligible);
+    for (uint32_t r = 0; r < tdata->n_routes; ++r) {
+        route_t *route = tdata->routes + r;
+        if ( ! (router->day_mask & tdata->route_active[r]) || ! (req->mode & route->attributes)) continue;
+        /* No trip of the route can have the required attributes if their union does not. */
+        if ((router->route_trip_attributes[r] & req->trip_attributes) != req->trip_attributes) continue;
+        #ifdef FEATURE_AGENCY_FILTER
+        if (req->agency != AGENCY_UNFILTERED && req->agency != route->agency_index) continue;
+        #endif
+        bitset_set (router->route_eligible, r);
+    }
+    /* parse_request refuses requests with more bans than these arrays hold */
+    assert (req->n_banned_routes <= RRRR_MAX_BANNED && req->n_banned_stops <= RRRR_MAX_BANNED &&
+            req->n_banned_stops_hard <= RRRR_MAX_BANNED && req->n_banned_trips <= RRRR_MAX_BANNED);
+    for (uint32_t i = 0; i < req->n_banned_routes; ++i) {
+        if (req->banned_routes[i] < tdata->n_routes) bitset_unset (router->route_eligible, req->banned_routes[i]);
+    }
+    bitset_reset (router->banned_stops);
+    for (uint32_t i = 0; i < req->n_banned_stops; ++i) {
+        if (req->banned_stops[i] < tdata->n_stops) bitset_set (router->banned_stops, req->banned_stops[i]);
+    }
+    bitset_reset (router->banned_stops_hard);
+    for (uint32_t i = 0; i < req->n_banned_stops_hard; ++i) {
+        if (req->banned_stops_hard[i] < tdata->n_stops) bitset_set (router->banned_stops_hard, req->banned_stops_hard[i]);
+    }
+    bitset_reset (router->banned_trips);
+    for (uint32_t i = 0; i < req->n_banned_trips; ++i) {
+        uint32_t route_idx = req->banned_trips_route[i];
+        if (route_idx >= tdata->n_routes || req->banned_trips_offset[i] >= tdata->routes[route_idx].n_trips) continue;
+        bitset_set (router->banned_trips, tdata->routes[route_idx].trip_ids_offset + req->banned_trips_offset[i]);
+    }
+    router_setup_scan_kernels (router, req);
 }
 
 bool router_route(router_t *router, router_request_t *req) {
     // router_request_dump(router, preq);
     uint32_t n_stops = router->tdata->n_stops;
-    router->day_mask = req->day_mask;
-
-    /* One serviceday_t for each of: yesterday, today, tomorrow (for overnight searches) */
-    /* Note that yesterday's bit flag will be 0 if today is the first day of the calendar. */
-    {
-        // One bit for the calendar day on which realtime data should be applied (applying only on the true current calendar day)
-        calendar_t realtime_mask = 1 << ((time(NULL) - router->tdata->calendar_start_time) / SEC_IN_ONE_DAY);
-        serviceday_t yesterday;
-        yesterday.midnight = 0;
-        yesterday.mask = router->day_mask >> 1;
-        yesterday.apply_realtime = yesterday.mask & realtime_mask;
-        serviceday_t today;
-        today.midnight = RTIME_ONE_DAY;
-        today.mask = router->day_mask;
-        today.apply_realtime = today.mask & realtime_mask;
-        serviceday_t tomorrow;
-        tomorrow.midnight = RTIME_TWO_DAYS;
-        tomorrow.mask = router->day_mask << 1;
-        tomorrow.apply_realtime = tomorrow.mask & realtime_mask;
-        /* Iterate backward over days for arrive-by searches. */
-        if (req->arrive_by) {
-            router->servicedays[0] = tomorrow;
-            router->servicedays[1] = today;
-            router->servicedays[2] = yesterday;
-        } else {
-            router->servicedays[0] = yesterday;
-            router->servicedays[1] = today;
-            router->servicedays[2] = tomorrow;
-        }
-        /* set day_mask to catch all service days (0, 1, 2) */
-        router->day_mask = yesterday.mask | today.mask | tomorrow.mask;
-    }
+    router_setup_servicedays (router, req);
+    router_compile_request (router, req);
     // for (int i = 0; i < 3; ++i) service_day_dump (&routers->servicedays[i]);
     // day_mask_dump (router->day_mask);
 
@@ -348,24 +762,11 @@ bool router_route(router_t *router, router_request_t *req) {
     T tdata_dump(router->tdata);
 
     I printf("Initializing router state \n");
-    // Router state is a C99 dynamically dimensioned array of size [RRRR_MAX_ROUNDS][n_stops]
+    router_reset(router);
+    // Router times and states are C99 dynamically dimensioned arrays of size [router->max_rounds + 1][n_stops]
+    rtime_t (*times)[n_stops] = (rtime_t(*)[]) router->times;
+    rtime_t (*walk_times)[n_stops] = (rtime_t(*)[]) router->walk_times;
     router_state_t (*states)[n_stops] = (router_state_t(*)[]) router->states;
-    for (uint32_t round = 0; round < RRRR_MAX_ROUNDS; ++round) {
-        for (uint32_t stop = 0; stop < n_stops; ++stop) {
-            // We use the time fields to record when stops have been reached.
-            // When times are UNREACHED the other fields in the same state should never be read.
-            states[round][stop].time = UNREACHED;
-            states[round][stop].walk_time = UNREACHED;
-            /*
-            states[round][stop].back_stop = NONE;
-            states[round][stop].back_route = NONE;
-            states[round][stop].back_trip = NONE;
-            states[round][stop].board_time = UNREACHED;
-            states[round][stop].back_trip_id = NULL;
-            */
-        }
-    }
-    for (uint32_t s = 0; s < n_stops; ++s) router->best_time[s] = UNREACHED;
 
     /* Stop indexes where the search process begins and ends, independent of arrive_by */
     if (req->arrive_by) {
@@ -375,6 +776,7 @@ bool router_route(router_t *router, router_request_t *req) {
         router->origin = req->from;
         router->target = req->to;
     }
+    router_setup_lower_bounds (router, req);
 
     if (req->start_trip_route != NONE && req->start_trip_trip != NONE) {
         /* We are starting on board a trip, not at a station. */
@@ -384,7 +786,7 @@ bool router_route(router_t *router, router_request_t *req) {
             return false;
         }
         /*
-          We cannot expand the start trip into the temporary round (1) during initialization because we may be able to
+          We cannot expand the start trip into the initial state during initialization because we may be able to
           reach the destination on that starting trip.
           We discover the previous stop and flag only the selected route for exploration in round 0. This would
           interfere with search reversal, but reversal is meaningless/useless in on-board depart trips anyway.
@@ -413,262 +815,447 @@ bool router_route(router_t *router, router_request_t *req) {
             req->from = ONBOARD;
             /* Initialize origin state */
             router->origin = prev_stop; // only origin is used from here on in routing
+            touch_stop (router, router->origin);
             router->best_time[router->origin]   = prev_stop_time;
-            states[1][router->origin].time      = prev_stop_time;
-            states[1][router->origin].walk_time = prev_stop_time;
-            /* When starting on board, only flag one route and do not apply transfers, only a single walk. */
+            times[router->max_rounds][router->origin]      = prev_stop_time;
+            walk_times[router->max_rounds][router->origin] = prev_stop_time;
+            /* When starting on board, only flag one route and do not apply transfers, only a single walk. The route
+               is ridden already, so the filters of the request do not apply to it. */
             bitset_reset (router->updated_stops);
             bitset_reset (router->updated_routes);
             bitset_set (router->updated_routes, req->start_trip_route);
+            router->route_scan_start[req->start_trip_route] = 0;
         }
     }
 
     /* Initialize origin state if not beginning the search on board. */
     if (req->from != ONBOARD) {
-        /* We will use round 1 to hold the initial state for round 0. Round 1 must then be re-initialized before use. */
+        /* The initial state for round 0 is kept in its own round, after the others. */
+        uint32_t initial = router->max_rounds;
+        touch_stop (router, router->origin);
         router->best_time[router->origin] = req->time;
-        states[1][router->origin].time   = req->time;
+        times[initial][router->origin] = req->time;
         // the rest of these should be unnecessary
-        states[1][router->origin].back_stop  = NONE;
-        states[1][router->origin].back_route = NONE;
-        states[1][router->origin].back_trip  = NONE;
-        states[1][router->origin].board_time = UNREACHED;
+        states[initial][router->origin].back_stop  = NONE;
+        states[initial][router->origin].back_route = NONE;
+        states[initial][router->origin].back_trip  = UINT16_MAX;
+        states[initial][router->origin].board_time = UNREACHED;
         /* Hack to communicate the origin time to itinerary renderer. It would be better to just include rtime_t in request structs. */
         // TODO eliminate this now that we have rtimes in requests
-        states[0][router->origin].time = req->time;
+        times[0][router->origin] = req->time;
         bitset_reset(router->updated_stops);
         // This is inefficient, as it depends on iterating over a bitset with only one bit true.
         bitset_set(router->updated_stops, router->origin);
         // Remove the banned stops from the bitset (do we really want to do this here? this could only remove the origin stop.)
         unflag_banned_stops(router, req);
         // Apply transfers to initial state, which also initializes the updated routes bitset.
-        apply_transfers(router, req, 1);
+        apply_transfers(router, req, initial);
         // dump_results(router);
     }
 
     /* apply upper bounds (speeds up second and third reversed searches) */
-    uint32_t n_rounds = req->max_transfers + 1;
-    if (n_rounds > RRRR_MAX_ROUNDS)
-        n_rounds = RRRR_MAX_ROUNDS;
+    uint32_t n_rounds = request_rounds (router, req);
 
-    // Iterate over rounds. In round N, we have made N transfers.
+    // Iterate over rounds. In round N, we have made N transfers. Stop early once no stops were marked.
     for (uint8_t round = 0; round < n_rounds; ++round) {  // < n_rounds to apply upper bound on transfers...
-        router_round(router, req, round);
+        if ( ! router_round(router, req, round)) break;
     } // end for (round)
     return true;
 }
 
-void router_round(router_t *router, router_request_t *req, uint8_t round) {
-    // TODO restrict pointers?
+/* The scheduled time of a trip at one stop of the route being scanned, on a service day. Routes without real-time
+   data have no delays to apply. */
+static inline rtime_t
+kernel_stoptime (route_times_t *rt, bool realtime, uint32_t trip, uint32_t route_stop, bool arrive, serviceday_t *serviceday) {
+    if (realtime) return route_stoptime (rt, trip, route_stop, arrive, serviceday);
+    rtime_t time;
+    if (rt->departures) time = (arrive ? rt->arrivals : rt->departures)[route_stop * rt->stride + trip];
+    else if (arrive)    time = tdata_arrive(rt->tdata, rt->trips + trip, route_stop);
+    else                time = tdata_depart(rt->tdata, rt->trips + trip, route_stop);
+    rtime_t time_adjusted = time + serviceday->midnight;
+    return time_adjusted < time ? UNREACHED : time_adjusted;
+}
+
+/* Check whether a trip passes the filters in the request. Without any trip filters, only canceled trips are left out,
+   and routes without real-time data have none. */
+static inline bool
+kernel_trip_allowed (router_t *router, router_request_t *req, uint32_t route_idx, uint32_t trip, trip_t *trips,
+                     uint8_t *trip_attributes, bool realtime, bool plain) {
+    if ( ! plain) return trip_allowed (router, req, route_idx, trip, trips, trip_attributes);
+    return ! realtime || router->tdata->trip_delays[router->tdata->routes[route_idx].trip_ids_offset + trip] != CANCELED;
+}
+
+/* Scan one route in the given round: board trips at the stops reached in the previous round and improve the stops
+   further along. With a worker, the improvements are collected for round_merge_rides rather than written.
+   This is the body of the route scan kernels below. They pass constants for the search direction, for whether the
+   route has real-time data and for whether the request is plain (no via stop, hard banned stops, banned trips nor
+   required trip attributes), so that the compiler drops the branches on them from the inner loops. */
+static inline __attribute__((always_inline)) void
+router_scan_route_kernel (router_t *router, router_request_t *req, uint8_t round, uint32_t route_idx, round_worker_t *worker,
+                          const bool arrive_by, const bool realtime, const bool plain) {
     uint32_t n_stops = router->tdata->n_stops;
     router_state_t (*states)[n_stops] = (router_state_t(*)[]) router->states;
-    uint8_t last_round = (round == 0) ? 1 : round - 1;
+    rtime_t (*ride_times)[n_stops] = (rtime_t(*)[]) router->times;
+    rtime_t (*walk_times)[n_stops] = (rtime_t(*)[]) router->walk_times;
+    /* Round 0 boards from the initial state, which is kept after the other rounds. */
+    uint8_t last_round = (round == 0) ? router->max_rounds : round - 1;
+    route_t route = router->tdata->routes[route_idx]; // really, 'trip' should be a trip_t to follow this same convention, and trip_idx should be its index
 
-    I printf("round %d\n", round);
-    // Iterate over all routes which contain a stop that was updated in the last round.
-    for (uint32_t route_idx  = bitset_next_set_bit (router->updated_routes, 0);
-                    route_idx != BITSET_NONE;
-                    route_idx  = bitset_next_set_bit (router->updated_routes, route_idx + 1)) {
-        route_t route = router->tdata->routes[route_idx]; // really, 'trip' should be a trip_t to follow this same convention, and trip_idx should be its index
-
-        #ifdef FEATURE_AGENCY_FILTER
-        if (req->agency != AGENCY_UNFILTERED && req->agency != route.agency_index) continue;
-        #endif
+    bool route_overlap = route.min_time < route.max_time - RTIME_ONE_DAY;
+    /*
+    if (route_overlap) printf ("min time %d max time %d overlap %d \n", route.min_time, route.max_time, route_overlap);
+    printf ("route %d has min_time %d and max_time %d. \n", route_idx, route.min_time, route.max_time);
+    printf ("  actual first time: %d \n", tdata_depart(router->tdata, route_idx, 0, 0));
+    printf ("  actual last time:  %d \n", tdata_arrive(router->tdata, route_idx, route.n_trips - 1, route.n_stops - 1));
+    */
+    I printf("  route %d: %s;%s\n", route_idx, tdata_shortname_for_route(router->tdata, route_idx),tdata_headsign_for_route(router->tdata, route_idx));
+    T tdata_dump_route(router->tdata, route_idx, NONE);
+    // For each stop in this route, its global stop index.
+    uint32_t *route_stops = tdata_stops_for_route(router->tdata, route_idx);
+    uint8_t  *route_stop_attributes = tdata_stop_attributes_for_route(router->tdata, route_idx);
+    trip_t   *route_trips = tdata_trips_for_route(router->tdata, route_idx); // TODO use to avoid calculating at every stop
+    uint8_t  *route_trip_attributes = tdata_trip_attributes_for_route(router->tdata, route_idx);
+    calendar_t *trip_masks  = tdata_trip_masks_for_route(router->tdata, route_idx);
+    route_times_t times = { router->tdata, route_trips, NULL, NULL, 0 };
+    route_block_t block;
+    if (tdata_route_block (router->tdata, route_idx, &block)) {
+        /* Read everything but the real-time delays from the route's own contiguous block. */
+        route_stops = block.stops;
+        route_stop_attributes = block.stop_attributes;
+        route_trip_attributes = block.trip_attributes;
+        trip_masks = block.trip_masks;
+        times.departures = block.departures;
+        times.arrivals = block.arrivals;
+        times.stride = block.stride;
+    }
+    /* Without real-time data on this route, boarding can scan the whole time column of its block at once. */
+    bool          vectorised = times.departures != NULL && ! realtime;
+    board_scan_t  scan = { NULL, trip_masks, route_trip_attributes, times.stride, 0, req->trip_attributes,
+                           req->n_banned_trips > 0 ? router->banned_trips : NULL, route.trip_ids_offset,
+                           0, 0, arrive_by };
+    uint32_t      trip = NONE;             // trip index within the route. NONE means not yet boarded.
+    uint32_t      trip_pos = NONE;         // position of that trip in the FIFO chain of its day view, NONE if it overtakes others
+    uint32_t      board_stop = 0;          // stop index where that trip was boarded
+    rtime_t       board_time = 0;          // time when that trip was boarded
+    serviceday_t *board_serviceday = NULL; // Service day on which that trip was boarded
+    /*
+        Iterate over stop indexes within the route. Each one corresponds to a global stop index.
+        Note that the stop times array should be accessed with [trip][route_stop] not [trip][stop].
+        The iteration variable is signed to allow ending the iteration at the beginning of the route.
+    */
+    /* Begin at the first stop at which the route was marked. The stops before it have no labels from the previous
+       round or, in profile searches, only labels left by later departures, which the route was scanned from then.
+       Skipping them saves work but does not change the result. */
+    for (int route_stop = router->route_scan_start[route_idx];
+                            arrive_by ? route_stop >= 0 : route_stop < route.n_stops;
+                            arrive_by ? --route_stop : ++route_stop ) {
+        uint32_t stop = route_stops[route_stop];
+        I printf("    stop %2d [%d] %s %s\n", route_stop, stop,
+            timetext(router->best_time[stop]), tdata_stop_name_for_index (router->tdata, stop));
 
-        bool route_overlap = route.min_time < route.max_time - RTIME_ONE_DAY;
         /*
-        if (route_overlap) printf ("min time %d max time %d overlap %d \n", route.min_time, route.max_time, route_overlap);
-        printf ("route %d has min_time %d and max_time %d. \n", route_idx, route.min_time, route.max_time);
-        printf ("  actual first time: %d \n", tdata_depart(router->tdata, route_idx, 0, 0));
-        printf ("  actual last time:  %d \n", tdata_arrive(router->tdata, route_idx, route.n_trips - 1, route.n_stops - 1));
+            If a stop in in banned_stops_hard, we do not want to transit through this station
+            we reset the current trip to NONE and skip the currect stop.
+            This effectively splits the route in two, and forces a re-board afterwards.
         */
-        I printf("  route %d: %s;%s\n", route_idx, tdata_shortname_for_route(router->tdata, route_idx),tdata_headsign_for_route(router->tdata, route_idx));
-        T tdata_dump_route(router->tdata, route_idx, NONE);
-        // For each stop in this route, its global stop index.
-        uint32_t *route_stops = tdata_stops_for_route(router->tdata, route_idx);
-        uint8_t  *route_stop_attributes = tdata_stop_attributes_for_route(router->tdata, route_idx);
-        trip_t   *route_trips = tdata_trips_for_route(router->tdata, route_idx); // TODO use to avoid calculating at every stop
-        uint8_t  *route_trip_attributes = tdata_trip_attributes_for_route(router->tdata, route_idx);
-        calendar_t *trip_masks  = tdata_trip_masks_for_route(router->tdata, route_idx);
-        uint32_t      trip = NONE;             // trip index within the route. NONE means not yet boarded.
-        uint32_t      board_stop = 0;          // stop index where that trip was boarded
-        rtime_t       board_time = 0;          // time when that trip was boarded
-        serviceday_t *board_serviceday = NULL; // Service day on which that trip was boarded
+        if ( ! plain && stop_banned_hard (router, req, stop)) {
+            trip = NONE;
+            continue;
+        }
+
         /*
-            Iterate over stop indexes within the route. Each one corresponds to a global stop index.
-            Note that the stop times array should be accessed with [trip][route_stop] not [trip][stop].
-            The iteration variable is signed to allow ending the iteration at the beginning of the route.
+            If we are not already on a trip, or if we might be able to board a better trip on
+            this route at this location, indicate that we want to search for a trip.
         */
-        for (int route_stop = req->arrive_by ? route.n_stops - 1 : 0;
-                                req->arrive_by ? route_stop >= 0 : route_stop < route.n_stops;
-                                req->arrive_by ? --route_stop : ++route_stop ) {
-            uint32_t stop = route_stops[route_stop];
-            I printf("    stop %2d [%d] %s %s\n", route_stop, stop,
-                timetext(router->best_time[stop]), tdata_stop_name_for_index (router->tdata, stop));
-
-            /*
-                If a stop in in banned_stop_hard, we do not want to transit through this station
-                we reset the current trip to NONE and skip the currect stop.
-                This effectively splits the route in two, and forces a re-board afterwards.
-            */
-            for (uint32_t bsh = 0; bsh < req->n_banned_stops_hard; bsh++) {
-                if (stop == req->banned_stop_hard) {
-                    trip = NONE;
-                    continue;
+        bool attempt_board = false;
+        rtime_t prev_time = walk_times[last_round][stop];
+        if (prev_time != UNREACHED) { // Only board at placed that have been reached.
+            if (trip == NONE || ( ! plain && req->via == stop)) {
+                attempt_board = true;
+            } else if ( ! plain && req->via != NONE && req->via == board_stop) {
+                attempt_board = false;
+            } else {
+                // removed xfer slack for simplicity
+                // is this repetitively triggering re-boarding searches along a single route?
+                rtime_t trip_time = kernel_stoptime (&times, realtime, trip, route_stop, arrive_by, board_serviceday);
+                if (trip_time == UNREACHED) attempt_board = false;
+                else if (arrive_by ? prev_time > trip_time
+                                        : prev_time < trip_time) {
+                    attempt_board = true;
+                    I printf ("    [reboarding here] trip = %s\n", timetext(trip_time));
                 }
             }
+        }
 
-            /*
-                If we are not already on a trip, or if we might be able to board a better trip on
-                this route at this location, indicate that we want to search for a trip.
-            */
-            bool attempt_board = false;
-            rtime_t prev_time = states[last_round][stop].walk_time;
-            if (prev_time != UNREACHED) { // Only board at placed that have been reached.
-                if (trip == NONE || req->via == stop) {
-                    attempt_board = true;
-                } else if (trip != NONE && req->via != NONE && req->via == board_stop) {
-                    attempt_board = false;
-                } else {
-                    // removed xfer slack for simplicity
-                    // is this repetitively triggering re-boarding searches along a single route?
-                    rtime_t trip_time = tdata_stoptime (router->tdata, &(route_trips[trip]), route_stop, req->arrive_by, board_serviceday);
-                    if (trip_time == UNREACHED) attempt_board = false;
-                    else if (req->arrive_by ? prev_time > trip_time
-                                            : prev_time < trip_time) {
-                        attempt_board = true;
-                        I printf ("    [reboarding here] trip = %s\n", timetext(trip_time));
+        if (!(route_stop_attributes[route_stop] & rsa_boarding)) //Boarding not allowed
+            if (arrive_by ? trip != NONE : attempt_board) //and we're attempting to board
+                continue; //Boarding not allowed and attemping to board
+        if (!(route_stop_attributes[route_stop] & rsa_alighting)) //Alighting not allowed
+            if (arrive_by ? attempt_board : trip != NONE) //and we're seeking to alight
+                continue; //Alighting not allowed and attemping to alight
+
+        /* If we have not yet boarded a trip on this route, see if we can board one.
+            Also handle the case where we hit a stop with an existing better arrival time. */
+        // TODO: check if this is the last stop -- no point boarding there or marking routes
+        if (attempt_board) {
+            I printf ("    attempting boarding at stop %d\n", stop);
+            T tdata_dump_route(router->tdata, route_idx, NONE);
+            /* Find the soonest trip that can be boarded, if any. Trips in the FIFO chain of the departure index are
+                ordered at every stop, even with real-time delays applied, so they can be binary searched.
+                Only the few trips that overtake others need to be scanned linearly. */
+            uint32_t best_trip = NONE;
+            uint32_t best_pos  = NONE; // position of best_trip in the FIFO chain of its day view, if it is part of it
+            rtime_t  best_time = arrive_by ? 0 : UINT16_MAX;
+            serviceday_t  *best_serviceday = NULL;
+            /* Search trips within days. The loop nesting could also be inverted. */
+            for (serviceday_t *serviceday = router->servicedays; serviceday <= router->servicedays + 2; ++serviceday) {
+                /* Check that this route still has any trips running on this day. */
+                if (arrive_by ? prev_time < serviceday->midnight + route.min_time
+                                    : prev_time > serviceday->midnight + route.max_time) continue;
+                /* Check whether there's any chance of improvement by scanning additional days. */
+                /* Note that day list is reversed for arrive-by searches. */
+                if (best_trip != NONE && ! route_overlap) break;
+                /* Only the trips in the view of this day run on it. */
+                day_view_t *view = serviceday->view;
+                uint16_t *trip_order = view->trips + view->trips_offsets[route_idx];
+                uint32_t  n_trips = view->trips_offsets[route_idx + 1] - view->trips_offsets[route_idx];
+                uint32_t  n_fifo = view->n_fifo[route_idx];
+                if (n_trips == 0) continue;
+                if (vectorised) {
+                    rtime_t time;
+                    scan.times = (arrive_by ? times.arrivals : times.departures) + route_stop * times.stride;
+                    scan.day_mask = serviceday->mask;
+                    scan.midnight = serviceday->midnight;
+                    scan.prev_time = prev_time;
+                    uint32_t this_trip = board_best_trip (&scan, &time);
+                    if (this_trip != NONE && (arrive_by ? time > best_time : time < best_time)) {
+                        best_trip = this_trip;
+                        best_pos  = NONE;
+                        best_time = time;
+                        best_serviceday = serviceday;
                     }
+                    continue;
                 }
-            }
-
-            if (!(route_stop_attributes[route_stop] & rsa_boarding)) //Boarding not allowed
-                if (req->arrive_by ? trip != NONE : attempt_board) //and we're attempting to board
-                    continue; //Boarding not allowed and attemping to board
-            if (!(route_stop_attributes[route_stop] & rsa_alighting)) //Alighting not allowed
-                if (req->arrive_by ? attempt_board : trip != NONE) //and we're seeking to alight
-                    continue; //Alighting not allowed and attemping to alight
-
-            /* If we have not yet boarded a trip on this route, see if we can board one.
-                Also handle the case where we hit a stop with an existing better arrival time. */
-            // TODO: check if this is the last stop -- no point boarding there or marking routes
-            if (attempt_board) {
-                I printf ("    attempting boarding at stop %d\n", stop);
-                T tdata_dump_route(router->tdata, route_idx, NONE);
-                /* Scan all trips to find the soonest trip that can be boarded, if any.
-                    Real-time updates can ruin FIFO ordering of trips within routes.
-                    Scanning through the whole list of trips reduces speed by ~20 percent over binary search. */
-                uint32_t best_trip = NONE;
-                rtime_t  best_time = req->arrive_by ? 0 : UINT16_MAX;
-                serviceday_t  *best_serviceday = NULL;
-                /* Search trips within days. The loop nesting could also be inverted. */
-                for (serviceday_t *serviceday = router->servicedays; serviceday <= router->servicedays + 2; ++serviceday) {
-                    /* Check that this route still has any trips running on this day. */
-                    if (req->arrive_by ? prev_time < serviceday->midnight + route.min_time
-                                        : prev_time > serviceday->midnight + route.max_time) continue;
-                    /* Check whether there's any chance of improvement by scanning additional days. */
-                    /* Note that day list is reversed for arrive-by searches. */
-                    if (best_trip != NONE && ! route_overlap) break;
-                    for (uint32_t this_trip = 0; this_trip < route.n_trips; ++this_trip) {
-                        // D printBits(4, & (trip_masks[this_trip]));
-                        // D printBits(4, & (serviceday->mask));
-                        // D printf("\n");
-                        /* skip this trip if it is banned */
-                        for (uint32_t bt = 0; bt < req->n_banned_trips; bt++) if (route_idx == req->banned_trip_route && this_trip == req->banned_trip_offset) continue;
-                        /* skip this trip if it is not running on the current service day */
-                        if ( ! (serviceday->mask & trip_masks[this_trip])) continue;
-                        /* skip this trip if it doesn't have all our required attributes */
-                        if ( ! ((req->trip_attributes & route_trip_attributes[this_trip]) == req->trip_attributes)) continue;
-                        /* skip this trip if the realtime delay equals CANCELED */
-                        if ( route_trips[this_trip].realtime_delay == CANCELED) continue;
-
-                        /* consider the arrival or departure time on the current service day */
-                        rtime_t time = tdata_stoptime (router->tdata, &(route_trips[this_trip]), route_stop, req->arrive_by, serviceday);
-                        // T printf("    board option %d at %s \n", this_trip, ...
-                        if (time == UNREACHED) continue; // rtime overflow due to long overnight trips on day 2
-                        /* Mark trip for boarding if it improves on the last round's post-walk time at this stop.
-                            Note: we should /not/ be comparing to the current best known time at this stop, because
-                            it may have been updated in this round by another trip (in the pre-walk transit phase). */
-                        if (req->arrive_by ? time <= prev_time && time > best_time
-                                            : time >= prev_time && time < best_time) {
+                /* When re-boarding on the same day, a better trip can only be found on the near side of the current
+                   one in the chain. The current trip stays in the range so ties resolve as before. */
+                uint32_t lo = 0, hi = n_fifo;
+                if (trip != NONE && trip_pos != NONE && serviceday == board_serviceday) {
+                    if (arrive_by) lo = trip_pos;
+                    else hi = trip_pos + 1;
+                }
+                uint32_t range_lo = lo, range_hi = hi;
+                /* Find the first trip in the chain leaving at or after prev_time (arriving after prev_time when
+                   searching backward). Overflowing UNREACHED times sort after everything else. */
+                while (lo < hi) {
+                    uint32_t mid = lo + (hi - lo) / 2;
+                    rtime_t time = kernel_stoptime (&times, realtime, trip_order[mid], route_stop, arrive_by, serviceday);
+                    if (arrive_by ? time <= prev_time : time < prev_time) lo = mid + 1;
+                    else hi = mid;
+                }
+                /* Walk away from prev_time until a trip passes the filters. That one is the best on this day. */
+                if (arrive_by) {
+                    for (uint32_t pos = lo; pos-- > range_lo; ) {
+                        uint32_t this_trip = trip_order[pos];
+                        if ( ! kernel_trip_allowed (router, req, route_idx, this_trip, route_trips, route_trip_attributes, realtime, plain)) continue;
+                        rtime_t time = kernel_stoptime (&times, realtime, this_trip, route_stop, true, serviceday);
+                        if (time > best_time) {
                             best_trip = this_trip;
+                            best_pos  = pos;
                             best_time = time;
                             best_serviceday = serviceday;
                         }
-                    } // end for (trips within this route)
-                } // end for (service days: yesterday, today, tomorrow)
-                if (best_trip != NONE) {
-                    I printf("    boarding trip %d at %s \n", best_trip, timetext(best_time));
-                    if ((req->arrive_by ? best_time > req->time : best_time < req->time) && req->from != ONBOARD) {
-                        printf("ERROR: boarded before start time, trip %d stop %d \n", best_trip, stop);
-                    } else {
-                        // use a router_state struct for all this?
-                        board_time = best_time;
-                        board_stop = stop;
-                        board_serviceday = best_serviceday;
-                        trip = best_trip;
+                        break;
                     }
                 } else {
-                    T printf("    no suitable trip to board.\n");
-                }
-                continue; // to the next stop in the route
-            } else if (trip != NONE) { // We have already boarded a trip along this route.
-                rtime_t time = tdata_stoptime (router->tdata, &(route_trips[trip]), route_stop, !req->arrive_by, board_serviceday);
-                if (time == UNREACHED) continue; // overflow due to long overnight trips on day 2
-                T printf("    on board trip %d considering time %s \n", trip, timetext(time));
-                // Target pruning, sec. 3.1 of RAPTOR paper.
-                if ((router->best_time[router->target] != UNREACHED) &&
-                    (req->arrive_by ? time < router->best_time[router->target]
-                                    : time > router->best_time[router->target])) {
-                    T printf("    (target pruning)\n");
-                    // We cannot break out of this route entirely, because re-boarding may occur at a later stop.
-                    continue;
-                }
-                if ((req->time_cutoff != UNREACHED) &&
-                    (req->arrive_by ? time < req->time_cutoff
-                                    : time > req->time_cutoff)) {
-                    continue;
-                }
-                // Do we need best_time at all? yes, because the best time may not have been found in the previous round.
-                bool improved = (router->best_time[stop] == UNREACHED) ||
-                                (req->arrive_by ? time > router->best_time[stop]
-                                                : time < router->best_time[stop]);
-                if (!improved) {
-                    I printf("    (no improvement)\n");
-                    continue; // the current trip does not improve on the best time at this stop
+                    for (uint32_t pos = lo; pos < range_hi; ++pos) {
+                        uint32_t this_trip = trip_order[pos];
+                        if ( ! kernel_trip_allowed (router, req, route_idx, this_trip, route_trips, route_trip_attributes, realtime, plain)) continue;
+                        rtime_t time = kernel_stoptime (&times, realtime, this_trip, route_stop, false, serviceday);
+                        if (time == UNREACHED) break; // rtime overflow due to long overnight trips on day 2
+                        if (time < best_time) {
+                            best_trip = this_trip;
+                            best_pos  = pos;
+                            best_time = time;
+                            best_serviceday = serviceday;
+                        }
+                        break;
+                    }
                 }
-                if (time > RTIME_THREE_DAYS) {
-                    /* Reserve all time past three days for special values like UNREACHED. */
-                } else if (req->arrive_by ? time > req->time : time < req->time) {
-                    /* Wrapping/overflow. This happens due to overnight trips on day 2. Prune them. */
-                    // printf("ERROR: setting state to time before start time. route %d trip %d stop %d \n", route_idx, trip, stop);
-                } else { // TODO should alighting handled here? if ((route_stop_attributes[route_stop] & rsa_alighting) == rsa_alighting)
-                    I printf("    setting stop to %s \n", timetext(time));
-                    router->best_time[stop] = time;
-                    states[round][stop].time = time;
-                    states[round][stop].back_route = route_idx;
-                    states[round][stop].back_trip  = trip;
-                    states[round][stop].back_stop  = board_stop;
-                    states[round][stop].board_time = board_time;
-                    if (req->arrive_by) {
-                        if (board_time < time) printf ("board time non-decreasing\n");
-                    } else {
-                        if (board_time > time) printf ("board time non-increasing\n");
+                /* Scan the overtaking trips that are not part of the chain. */
+                for (uint32_t pos = n_fifo; pos < n_trips; ++pos) {
+                    uint32_t this_trip = trip_order[pos];
+                    if ( ! kernel_trip_allowed (router, req, route_idx, this_trip, route_trips, route_trip_attributes, realtime, plain)) continue;
+                    /* consider the arrival or departure time on the current service day */
+                    rtime_t time = kernel_stoptime (&times, realtime, this_trip, route_stop, arrive_by, serviceday);
+                    if (time == UNREACHED) continue; // rtime overflow due to long overnight trips on day 2
+                    /* Mark trip for boarding if it improves on the last round's post-walk time at this stop.
+                        Note: we should /not/ be comparing to the current best known time at this stop, because
+                        it may have been updated in this round by another trip (in the pre-walk transit phase). */
+                    if (arrive_by ? time <= prev_time && time > best_time
+                                        : time >= prev_time && time < best_time) {
+                        best_trip = this_trip;
+                        best_pos  = NONE;
+                        best_time = time;
+                        best_serviceday = serviceday;
                     }
-                    bitset_set(router->updated_stops, stop);   // mark stop for next round.
+                } // end for (overtaking trips within this route)
+            } // end for (service days: yesterday, today, tomorrow)
+            if (best_trip != NONE) {
+                I printf("    boarding trip %d at %s \n", best_trip, timetext(best_time));
+                if ((arrive_by ? best_time > req->time : best_time < req->time) && req->from != ONBOARD) {
+                    printf("ERROR: boarded before start time, trip %d stop %d \n", best_trip, stop);
+                } else {
+                    // use a router_state struct for all this?
+                    board_time = best_time;
+                    board_stop = stop;
+                    board_serviceday = best_serviceday;
+                    trip = best_trip;
+                    trip_pos = best_pos;
                 }
+            } else {
+                T printf("    no suitable trip to board.\n");
             }
-        } // end for (stop)
-    } // end for (route)
+            continue; // to the next stop in the route
+        } else if (trip != NONE) { // We have already boarded a trip along this route.
+            rtime_t time = kernel_stoptime (&times, realtime, trip, route_stop, !arrive_by, board_serviceday);
+            if (time == UNREACHED) continue; // overflow due to long overnight trips on day 2
+            T printf("    on board trip %d considering time %s \n", trip, timetext(time));
+            // Target pruning, sec. 3.1 of RAPTOR paper.
+            rtime_t target_time = best_time_get (router, router->target);
+            if ((target_time != UNREACHED) &&
+                (arrive_by ? time < target_time
+                                : time > target_time)) {
+                T printf("    (target pruning)\n");
+                // We cannot break out of this route entirely, because re-boarding may occur at a later stop.
+                continue;
+            }
+            if (lower_bound_prunes (router, req, stop, time, target_time)) {
+                T printf("    (lower bound pruning)\n");
+                continue;
+            }
+            if ((req->time_cutoff != UNREACHED) &&
+                (arrive_by ? time < req->time_cutoff
+                                : time > req->time_cutoff)) {
+                continue;
+            }
+            // Do we need best_time at all? yes, because the best time may not have been found in the previous round.
+            rtime_t stop_time = best_time_get (router, stop);
+            bool improved = (stop_time == UNREACHED) ||
+                            (arrive_by ? time > stop_time
+                                            : time < stop_time);
+            if (!improved) {
+                I printf("    (no improvement)\n");
+                continue; // the current trip does not improve on the best time at this stop
+            }
+            if (time > RTIME_THREE_DAYS) {
+                /* Reserve all time past three days for special values like UNREACHED. */
+            } else if (arrive_by ? time > req->time : time < req->time) {
+                /* Wrapping/overflow. This happens due to overnight trips on day 2. Prune them. */
+                // printf("ERROR: setting state to time before start time. route %d trip %d stop %d \n", route_idx, trip, stop);
+            } else if (worker != NULL) {
+                /* Parallel round: claim the best time now, the state is written when the threads are done. */
+                round_worker_offer (router, worker, req, stop, time, route_idx, trip, board_stop, board_time);
+            } else { // TODO should alighting handled here? if ((route_stop_attributes[route_stop] & rsa_alighting) == rsa_alighting)
+                I printf("    setting stop to %s \n", timetext(time));
+                touch_stop (router, stop);
+                router->best_time[stop] = time;
+                ride_times[round][stop] = time;
+                states[round][stop].back_route = route_idx;
+                states[round][stop].back_trip  = trip;
+                states[round][stop].back_stop  = board_stop;
+                states[round][stop].board_time = board_time;
+                if (arrive_by) {
+                    if (board_time < time) printf ("board time non-decreasing\n");
+                } else {
+                    if (board_time > time) printf ("board time non-increasing\n");
+                }
+                bitset_set(router->updated_stops, stop);   // mark stop for next round.
+            }
+        }
+    } // end for (stop)
+}
+
+/* The route scan kernels, one for each combination of search direction, real-time data and plain requests. */
+#define ROUTER_SCAN_KERNEL(name, arrive_by, realtime, plain) \
+static void name (router_t *router, router_request_t *req, uint8_t round, uint32_t route_idx, round_worker_t *worker) { \
+    router_scan_route_kernel (router, req, round, route_idx, worker, arrive_by, realtime, plain); \
+}
+ROUTER_SCAN_KERNEL (scan_depart_static,           false, false, true)
+ROUTER_SCAN_KERNEL (scan_depart_realtime,         false, true,  true)
+ROUTER_SCAN_KERNEL (scan_depart_static_filtered,  false, false, false)
+ROUTER_SCAN_KERNEL (scan_depart_realtime_filtered, false, true, false)
+ROUTER_SCAN_KERNEL (scan_arrive_static,           true,  false, true)
+ROUTER_SCAN_KERNEL (scan_arrive_realtime,         true,  true,  true)
+ROUTER_SCAN_KERNEL (scan_arrive_static_filtered,  true,  false, false)
+ROUTER_SCAN_KERNEL (scan_arrive_realtime_filtered, true, true,  false)
+#undef ROUTER_SCAN_KERNEL
+
+/* [arrive_by][plain][realtime] */
+static const router_scan_kernel_t router_scan_kernels[2][2][2] = {
+    { { scan_depart_static_filtered, scan_depart_realtime_filtered }, { scan_depart_static, scan_depart_realtime } },
+    { { scan_arrive_static_filtered, scan_arrive_realtime_filtered }, { scan_arrive_static, scan_arrive_realtime } }
+};
+
+/* The unspecialised kernel, deciding everything at run time. Only used to benchmark the specialised ones. */
+static void
+scan_generic (router_t *router, router_request_t *req, uint8_t round, uint32_t route_idx, round_worker_t *worker) {
+    bool plain = req->via == NONE && req->n_banned_stops_hard == 0 && req->n_banned_trips == 0 && req->trip_attributes == ta_none;
+    router_scan_route_kernel (router, req, round, route_idx, worker, req->arrive_by,
+                              router->tdata->n_delayed_trips[route_idx] > 0, plain);
+}
+
+/* Pick the route scan kernels for a request, one for the routes without and one for those with real-time data. */
+static void router_setup_scan_kernels (router_t *router, router_request_t *req) {
+    bool plain = req->via == NONE && req->n_banned_stops_hard == 0 && req->n_banned_trips == 0 && req->trip_attributes == ta_none;
+    for (int realtime = 0; realtime < 2; ++realtime) {
+        router->scan_kernels[realtime] = router->generic_kernels ? scan_generic : router_scan_kernels[req->arrive_by][plain][realtime];
+    }
+}
+
+/* Scan one route in the given round with the kernel picked for the request. */
+static inline void
+router_scan_route (router_t *router, router_request_t *req, uint8_t round, uint32_t route_idx, round_worker_t *worker) {
+    router->scan_kernels[router->tdata->n_delayed_trips[route_idx] > 0] (router, req, round, route_idx, worker);
+}
+
+static void round_scan_task (void *arg, uint32_t thread) {
+    struct round_task *task = (struct round_task *) arg;
+    round_worker_t *worker = task->router->workers + thread;
+    worker->n_candidates = 0;
+    uint32_t first, n;
+    while ((n = round_task_take (task, &first)) > 0) {
+        for (uint32_t i = first; i < first + n; ++i)
+            router_scan_route (task->router, task->req, task->round, task->router->parallel_items[i], worker);
+    }
+}
+
+/* Scan the routes of a round on all threads if there are enough of them. Returns false if nothing was done. */
+static bool round_scan_parallel (router_t *router, router_request_t *req, uint8_t round) {
+    struct round_task task = { router, req, round, 0, 0 };
+    if ( ! round_task_items (router, router->updated_routes, RRRR_PARALLEL_MIN_ROUTES, &task)) return false;
+    threadpool_run (router->pool, round_scan_task, &task);
+    round_merge_rides (router, round);
+    return true;
+}
+
+bool router_round(router_t *router, router_request_t *req, uint8_t round) {
+    I printf("round %d\n", round);
+    // Iterate over all routes which contain a stop that was updated in the last round.
+    if ( ! round_scan_parallel (router, req, round)) {
+        for (uint32_t route_idx  = bitset_next_set_bit (router->updated_routes, 0);
+                      route_idx != BITSET_NONE;
+                      route_idx  = bitset_next_set_bit (router->updated_routes, route_idx + 1)) {
+            router_scan_route (router, req, round, route_idx, NULL);
+        } // end for (route)
+    }
     // Remove the banned stops from the bitset, so no transfers will happen there.
     unflag_banned_stops(router, req);
     /* Also updates the list of routes for next round based on stops that were touched in this round. */
     apply_transfers(router, req, round);
     // exit(0);
-    /* Initialize the stops in round 1 that were used as starting points for round 0. */
-    if (round == 0) initialize_transfers (router, 1, router->origin);
     // dump_results(router); // DEBUG
-
+    /* Without any routes to scan, later rounds can not improve any stop. */
+    return bitset_next_set_bit (router->updated_routes, 0) != BITSET_NONE;
 }
 
 /* Reverse the times and stops in a leg. Used for creating arrive-by itineraries. */
@@ -770,91 +1357,102 @@ static bool check_plan_invariants (struct plan *plan) {
     return fail;
 }
 
-void router_result_to_plan (struct plan *plan, router_t *router, router_request_t *req) {
+/* Follow the chain of states backward from the target in the given round, filling in the legs of an itinerary. */
+static void router_result_to_itinerary (struct itinerary *itin, router_t *router, router_request_t *req, uint32_t n_xfers) {
     uint32_t n_stops = router->tdata->n_stops;
-    /* Router states are a 2D array of stride n_stops */
+    rtime_t (*times)[n_stops] = (rtime_t(*)[]) router->times;
+    rtime_t (*walk_times)[n_stops] = (rtime_t(*)[]) router->walk_times;
     router_state_t (*states)[n_stops] = (router_state_t(*)[]) router->states;
+    /* Work backward from the target to the origin */
+    uint32_t stop = (req->arrive_by ? req->from : req->to);
+    itin->n_rides = n_xfers + 1;
+    itin->n_legs = itin->n_rides * 2 + 1; // always same number of legs for same number of transfers
+    struct leg *l = itin->legs; // the slot in which record a leg, reversing them for forward trips
+    if ( ! req->arrive_by) l += itin->n_legs - 1;
+    /* Follow the chain of states backward */
+    for (int round = n_xfers; round >= 0; --round) {
+        if (stop > router->tdata->n_stops) {
+            printf ("ERROR: stopid %d out of range.\n", stop);
+            break;
+        }
+
+        /* Walk phase */
+        router_state_t *walk = &(states[round][stop]);
+        rtime_t walk_time = walk_times[round][stop];
+        if (walk_time == UNREACHED) {
+            printf ("ERROR: stop %d was unreached by walking.\n", stop);
+            break;
+        }
+        uint32_t walk_stop = stop;
+        stop = walk->walk_from;  /* follow the chain of states backward */
+
+        /* Ride phase */
+        router_state_t *ride = &(states[round][stop]);
+        rtime_t ride_time = times[round][stop];
+        if (ride_time == UNREACHED) {
+            printf ("ERROR: stop %d was unreached by riding.\n", stop);
+            break;
+        }
+        uint32_t ride_stop = stop;
+        stop = ride->back_stop;  /* follow the chain of states backward */
+
+        /* Walk phase */
+        l->s0 = walk->walk_from;
+        l->s1 = walk_stop;
+        l->t0 = ride_time; /* Rendering the walk requires already having the ride arrival time */
+        l->t1 = walk_time;
+        l->route = WALK;
+        l->trip  = WALK;
+        if (req->arrive_by) leg_swap (l);
+        l += (req->arrive_by ? 1 : -1); /* next leg */
+
+        /* Ride phase */
+        l->s0 = ride->back_stop;
+        l->s1 = ride_stop;
+        l->t0 = ride->board_time;
+        l->t1 = ride_time;
+        l->route = ride->back_route;
+        l->trip  = ride->back_trip;
+        if (req->arrive_by) leg_swap (l);
+        l += (req->arrive_by ? 1 : -1);   /* next leg */
+
+    }
+    if (req->start_trip_trip != NONE) {
+        /* Results starting on board do not have an initial walk leg. */
+        l->s0 = l->s1 = ONBOARD;
+        l->t0 = l->t1 = req->time;
+        l->route = l->trip = WALK;
+        l += 1; // move back to first transit leg
+        l->s0 = ONBOARD;
+        l->t0 = req->time;
+    } else {
+        /* The initial walk leg leading out of the search origin. This is inferred, not stored explicitly. */
+        uint32_t origin_stop = (req->arrive_by ? req->to : req->from);
+        l->s0 = origin_stop;
+        l->s1 = stop;
+        /* It would also be possible to work from s1 to s0 and compress out the wait time. */
+        l->t0 = times[0][origin_stop];
+        rtime_t duration = transfer_duration (router, l->s0, l->s1);
+        l->t1 = l->t0 + (req->arrive_by ? -duration : +duration);
+        l->route = WALK;
+        l->trip  = WALK;
+        if (req->arrive_by) leg_swap (l);
+    }
+}
+
+void router_result_to_plan (struct plan *plan, router_t *router, router_request_t *req) {
+    uint32_t n_stops = router->tdata->n_stops;
+    /* Router times are a 2D array of stride n_stops */
+    rtime_t (*walk_times)[n_stops] = (rtime_t(*)[]) router->walk_times;
     plan->n_itineraries = 0;
     plan->req = *req; // copy the request into the plan for use in rendering
     struct itinerary *itin = plan->itineraries;
     /* Loop over the rounds to get ending states of itineraries using different numbers of vehicles */
-    for (int n_xfers = 0; n_xfers < RRRR_MAX_ROUNDS; ++n_xfers) {
-        /* Work backward from the target to the origin */
+    for (uint32_t n_xfers = 0; n_xfers < router->max_rounds; ++n_xfers) {
         uint32_t stop = (req->arrive_by ? req->from : req->to);
         /* skip rounds that were not reached */
-        if (states[n_xfers][stop].walk_time == UNREACHED) continue;
-        itin->n_rides = n_xfers + 1;
-        itin->n_legs = itin->n_rides * 2 + 1; // always same number of legs for same number of transfers
-        struct leg *l = itin->legs; // the slot in which record a leg, reversing them for forward trips
-        if ( ! req->arrive_by) l += itin->n_legs - 1;
-        /* Follow the chain of states backward */
-        for (int round = n_xfers; round >= 0; --round) {
-            if (stop > router->tdata->n_stops) {
-                printf ("ERROR: stopid %d out of range.\n", stop);
-                break;
-            }
-
-            /* Walk phase */
-            router_state_t *walk = &(states[round][stop]);
-            if (walk->walk_time == UNREACHED) {
-                printf ("ERROR: stop %d was unreached by walking.\n", stop);
-                break;
-            }
-            uint32_t walk_stop = stop;
-            stop = walk->walk_from;  /* follow the chain of states backward */
-
-            /* Ride phase */
-            router_state_t *ride = &(states[round][stop]);
-            if (ride->time == UNREACHED) {
-                printf ("ERROR: stop %d was unreached by riding.\n", stop);
-                break;
-            }
-            uint32_t ride_stop = stop;
-            stop = ride->back_stop;  /* follow the chain of states backward */
-
-            /* Walk phase */
-            l->s0 = walk->walk_from;
-            l->s1 = walk_stop;
-            l->t0 = ride->time; /* Rendering the walk requires already having the ride arrival time */
-            l->t1 = walk->walk_time;
-            l->route = WALK;
-            l->trip  = WALK;
-            if (req->arrive_by) leg_swap (l);
-            l += (req->arrive_by ? 1 : -1); /* next leg */
-
-            /* Ride phase */
-            l->s0 = ride->back_stop;
-            l->s1 = ride_stop;
-            l->t0 = ride->board_time;
-            l->t1 = ride->time;
-            l->route = ride->back_route;
-            l->trip  = ride->back_trip;
-            if (req->arrive_by) leg_swap (l);
-            l += (req->arrive_by ? 1 : -1);   /* next leg */
-
-        }
-        if (req->start_trip_trip != NONE) {
-            /* Results starting on board do not have an initial walk leg. */
-            l->s0 = l->s1 = ONBOARD;
-            l->t0 = l->t1 = req->time;
-            l->route = l->trip = WALK;
-            l += 1; // move back to first transit leg
-            l->s0 = ONBOARD;
-            l->t0 = req->time;
-        } else {
-            /* The initial walk leg leading out of the search origin. This is inferred, not stored explicitly. */
-            router_state_t *final_walk = &(states[0][stop]);
-            uint32_t origin_stop = (req->arrive_by ? req->to : req->from);
-            l->s0 = origin_stop;
-            l->s1 = stop;
-            /* It would also be possible to work from s1 to s0 and compress out the wait time. */
-            l->t0 = states[0][origin_stop].time;
-            rtime_t duration = transfer_duration (router->tdata, req, l->s0, l->s1);
-            l->t1 = l->t0 + (req->arrive_by ? -duration : +duration);
-            l->route = WALK;
-            l->trip  = WALK;
-            if (req->arrive_by) leg_swap (l);
-        }
+        if (walk_times[n_xfers][stop] == UNREACHED) continue;
+        router_result_to_itinerary (itin, router, req, n_xfers);
         /* Move to the next itinerary in the plan. */
         plan->n_itineraries += 1;
         itin += 1;
@@ -862,7 +1460,7 @@ void router_result_to_plan (struct plan *plan, router_t *router, router_request_
     check_plan_invariants (plan);
 }
 
-static inline char *plan_render_itinerary (struct itinerary *itin, tdata_t *tdata, char *b, char *b_end) {
+static inline char *plan_render_itinerary (struct itinerary *itin, tdata_t *tdata, calendar_t day_mask, char *b, char *b_end) {
     b += sprintf (b, "\nITIN %d rides \n", itin->n_rides);
 
     /* Render the legs of this itinerary, which are in chronological order */
@@ -897,35 +1495,23 @@ static inline char *plan_render_itinerary (struct itinerary *itin, tdata_t *tdat
         leg_mode = "INVALID";
 
         char *alert_msg = NULL;
-        if (leg->route != WALK && tdata->alerts) {
-            for (size_t e = 0; e < tdata->alerts->n_entity; ++e) {
-                TransitRealtime__FeedEntity *entity = tdata->alerts->entity[e];
-                if (entity == NULL) break;
-                TransitRealtime__Alert *alert = entity->alert;
-                if (alert == NULL) break;
-                for (size_t ie = 0; ie < alert->n_informed_entity; ++ie) {
-                    TransitRealtime__EntitySelector *informed_entity = alert->informed_entity[ie];
-                    // TransitRealtime__TripDescriptor *trip = informed_entity->trip;
-
-                    if ( ( (!informed_entity->route_id) || (memcmp(informed_entity->route_id, &leg->route, sizeof(leg->route)) == 0 ) ) &&
-                         ( (!informed_entity->stop_id)  || (memcmp(informed_entity->stop_id, &leg->s0, sizeof(leg->s0)) == 0 ) ) &&
-                         ( (!informed_entity->trip)     || (!informed_entity->trip->trip_id) || (memcmp(informed_entity->trip->trip_id, &leg->trip, sizeof(leg->trip)) == 0 ) )
-                         // TODO: need to have rtime_to_date  for informed_entity->trip->start_date
-                         // TODO: need to have rtime_to_epoch for informed_entity->active_period
-                       ) {
-                        alert_msg = alert->header_text->translation[0]->text;
-                    }
-
-                    if (alert_msg) break;
-                }
-
-                if (alert_msg) break;
-            }
+        uint32_t alerts_generation = 0;
+        if (leg->route != WALK) {
+            /* The leg starts on the service day of the request, or on the day before or after it. */
+            uint32_t cal_day = 0;
+            calendar_t mask = day_mask;
+            while (mask >>= 1) cal_day++;
+            alert_t *alert;
+            alerts_generation = tdata_alerts_read_begin (tdata);
+            if (tdata_alerts_for_leg (tdata, leg->route, tdata->routes[leg->route].trip_ids_offset + leg->trip, leg->s0,
+                                      cal_day + leg->t0 / RTIME_ONE_DAY - 1, &alert, 1) > 0)
+                alert_msg = alert->header_text;
         }
 
         b += sprintf (b, "%s %5d %3d %5d %5d %s %s %+3.1f ;%s;%s;%s;%s;%s;%s;%s\n",
             leg_mode, leg->route, leg->trip, leg->s0, leg->s1, ct0, ct1, delay_min,agency_name, short_name, headsign, productcategory, s0_id, s1_id,
             (alert_msg ? alert_msg : ""));
+        if (leg->route != WALK) tdata_alerts_read_end (tdata, alerts_generation);
 
         /* EXAMPLE
         polyline_for_leg (tdata, leg);
@@ -949,16 +1535,16 @@ static inline uint32_t plan_render(struct plan *plan, tdata_t *tdata, router_req
     if ((req->optimise & o_all) == o_all) {
         /* Iterate over itineraries in this plan, which are in increasing order of number of rides */
         for (struct itinerary *itin = plan->itineraries; itin < plan->itineraries + plan->n_itineraries; ++itin) {
-            b = plan_render_itinerary (itin, tdata, b, b_end);
+            b = plan_render_itinerary (itin, tdata, req->day_mask, b, b_end);
         }
     } else if (plan->n_itineraries > 0) {
         if ((req->optimise & o_transfers) == o_transfers) {
             /* only render the first itinerary, which has the least transfers */
-            b = plan_render_itinerary (plan->itineraries, tdata, b, b_end);
+            b = plan_render_itinerary (plan->itineraries, tdata, req->day_mask, b, b_end);
         }
         if ((req->optimise & o_shortest) == o_shortest) {
             /* only render the last itinerary, which has the most rides and is the shortest in time */
-            b = plan_render_itinerary (&plan->itineraries[plan->n_itineraries - 1], tdata, b, b_end);
+            b = plan_render_itinerary (&plan->itineraries[plan->n_itineraries - 1], tdata, req->day_mask, b, b_end);
         }
     }
     *b = '\0';
@@ -976,6 +1562,464 @@ uint32_t router_result_dump(router_t *router, router_request_t *req, char *buf,
     return plan_render (&plan, router->tdata, req, buf, buflen);
 }
 
+/* Render a plan found by any kind of search like router_result_dump does. */
+uint32_t router_plan_dump (router_t *router, struct plan *plan, char *buf, uint32_t buflen) {
+    return plan_render (plan, router->tdata, &plan->req, buf, buflen);
+}
+
+/* PROFILE SEARCHES (rRAPTOR) */
+
+static int compare_rtime_descending (const void *a, const void *b) {
+    return *(rtime_t *) b - *(rtime_t *) a;
+}
+
+/* Collect the distinct times in the request's window at which leaving the origin lets a passenger catch a trip right
+   away, either at the origin itself or after walking to a nearby stop. The end of the window is always included, so
+   that journeys leaving after it are reported as departing at the end of the window. They are sorted latest first. */
+static rtime_t *profile_departures (router_t *router, router_request_t *req, uint32_t *n_departures) {
+    tdata_t *tdata = router->tdata;
+    rtime_t window_end = req->time + req->time_window > RTIME_THREE_DAYS ? RTIME_THREE_DAYS : req->time + req->time_window;
+    uint32_t n = 0, capacity = 256;
+    rtime_t *departures = (rtime_t *) malloc (sizeof(rtime_t) * capacity);
+    if (departures == NULL) die ("failed to allocate profile departures");
+    departures[n++] = window_end;
+    uint32_t t  = tdata->stops[router->origin    ].transfers_offset;
+    uint32_t tN = tdata->stops[router->origin + 1].transfers_offset;
+    /* The first pass is for the origin itself, which is reached without walking. */
+    for (uint32_t tr = t - 1; tr != tN; ++tr) {
+        uint32_t stop = router->origin;
+        rtime_t walk = 0;
+        if (tr != t - 1) {
+            stop = tdata->transfer_target_stops[tr];
+            walk = router->walk_durations[tr];
+        }
+        uint32_t *routes;
+        uint32_t n_routes = tdata_routes_for_stop (tdata, stop, &routes);
+        for (uint32_t i = 0; i < n_routes; ++i) {
+            uint32_t route_idx = routes[i];
+            route_t *route = tdata->routes + route_idx;
+            if ( ! route_usable (router, route_idx)) continue;
+            uint32_t *route_stops = tdata_stops_for_route (tdata, route_idx);
+            uint8_t *route_stop_attributes = tdata_stop_attributes_for_route (tdata, route_idx);
+            trip_t *trips = tdata_trips_for_route (tdata, route_idx);
+            /* A route can pass the same stop more than once, but there is no point boarding at its last stop. */
+            for (uint32_t route_stop = 0; route_stop + 1 < route->n_stops; ++route_stop) {
+                if (route_stops[route_stop] != stop || ! (route_stop_attributes[route_stop] & rsa_boarding)) continue;
+                for (serviceday_t *serviceday = router->servicedays; serviceday <= router->servicedays + 2; ++serviceday) {
+                    day_view_t *view = serviceday->view;
+                    for (uint32_t pos = view->trips_offsets[route_idx]; pos < view->trips_offsets[route_idx + 1]; ++pos) {
+                        uint32_t trip = view->trips[pos];
+                        if (tdata->trip_delays[route->trip_ids_offset + trip] == CANCELED) continue;
+                        rtime_t time = tdata_stoptime (tdata, trips + trip, route_stop, false, serviceday);
+                        if (time == UNREACHED || time < walk) continue;
+                        rtime_t departure = time - walk;
+                        if (departure < req->time || departure > window_end) continue;
+                        if (n == capacity) {
+                            capacity *= 2;
+                            departures = (rtime_t *) realloc (departures, sizeof(rtime_t) * capacity);
+                            if (departures == NULL) die ("failed to allocate profile departures");
+                        }
+                        departures[n++] = departure;
+                    }
+                }
+            }
+        }
+    }
+    qsort (departures, n, sizeof(rtime_t), compare_rtime_descending);
+    uint32_t n_distinct = 0;
+    for (uint32_t i = 0; i < n; ++i) {
+        if (n_distinct == 0 || departures[n_distinct - 1] != departures[i]) departures[n_distinct++] = departures[i];
+    }
+    *n_departures = n_distinct;
+    return departures;
+}
+
+struct itinerary *profile_add_itinerary (struct profile *profile) {
+    if (profile->n_itineraries == profile->capacity) {
+        profile->capacity = profile->capacity ? profile->capacity * 2 : 16;
+        profile->itineraries = (struct itinerary *) realloc (profile->itineraries, sizeof(struct itinerary) * profile->capacity);
+        if (profile->itineraries == NULL) die ("failed to allocate profile itineraries");
+    }
+    return profile->itineraries + profile->n_itineraries++;
+}
+
+/* Lower the best times of a round of a profile search to those of the round before it, the initial state for round 0,
+   as anything reached with fewer rides also bounds the round. Only the touched stops have best times at all. */
+static void profile_carry_best_times (router_t *router, uint32_t round) {
+    uint32_t n_stops = router->tdata->n_stops;
+    rtime_t *best_time = router->round_best_time + round * n_stops;
+    rtime_t *fewer_rides = router->round_best_time + (round == 0 ? router->max_rounds : round - 1) * n_stops;
+    for (uint32_t i = 0; i < router->n_touched_stops; ++i) {
+        uint32_t stop = router->touched_stops[i];
+        if (fewer_rides[stop] < best_time[stop]) best_time[stop] = fewer_rides[stop];
+    }
+}
+
+/*
+  Range RAPTOR: run one search per distinct departure time in the window, latest first, without resetting the labels
+  in between. A journey found for a later departure remains valid when leaving earlier, so every search only has to
+  explore what improves on the ones before it. Labels are kept per round rather than across rounds, since a later
+  departure with more rides must not hide an earlier one with fewer rides. The initial state has a round of its own,
+  best times included: round 0 must neither board from labels of later rounds nor keep a later departure from boarding
+  at the stops its initial walks reach, even if some ride arrived there sooner.
+  Only depart-after requests not starting on board are supported.
+*/
+bool router_route_profile (router_t *router, router_request_t *req, struct profile *profile) {
+    uint32_t n_stops = router->tdata->n_stops;
+    profile->req = *req;
+    profile->n_itineraries = 0;
+    if (req->arrive_by || req->start_trip_trip != NONE) {
+        fprintf (stderr, "Profile searches are only supported for depart-after requests not starting on board.\n");
+        return false;
+    }
+    router_setup_servicedays (router, req);
+    router_compile_request (router, req);
+    router_reset (router);
+    if (router->round_best_time == NULL) {
+        router->round_best_time = (rtime_t *) malloc (sizeof(rtime_t) * n_stops * (router->max_rounds + 1));
+        if (router->round_best_time == NULL) die ("failed to allocate profile scratch space");
+        for (uint32_t i = 0; i < n_stops * (router->max_rounds + 1); ++i) router->round_best_time[i] = UNREACHED;
+    }
+    rtime_t (*times)[n_stops] = (rtime_t(*)[]) router->times;
+    rtime_t (*walk_times)[n_stops] = (rtime_t(*)[]) router->walk_times;
+    router_state_t (*states)[n_stops] = (router_state_t(*)[]) router->states;
+    rtime_t *best_time = router->best_time; // restored when the profile search is done
+    router->origin = req->from;
+    router->target = req->to;
+    router_setup_lower_bounds (router, req);
+
+    uint32_t n_rounds = request_rounds (router, req);
+    uint32_t initial = router->max_rounds;
+    router->last_best_time = router->round_best_time + (n_rounds - 1) * n_stops;
+    /* The earliest arrival at the target found so far using at most the given number of rides, i.e. round + 1 */
+    rtime_t best_arrival[RRRR_MAX_ROUNDS];
+    for (uint32_t round = 0; round < RRRR_MAX_ROUNDS; ++round) best_arrival[round] = UNREACHED;
+
+    uint32_t n_departures;
+    rtime_t *departures = profile_departures (router, req, &n_departures);
+    router_request_t dep_req = *req;
+    for (uint32_t d = 0; d < n_departures; ++d) {
+        dep_req.time = departures[d];
+        I printf ("profile departure %s\n", timetext(dep_req.time));
+        /* Initialize the origin state as router_route does, against the best times of the initial state. */
+        router->best_time = router->round_best_time + initial * n_stops;
+        touch_stop (router, router->origin);
+        router->best_time[router->origin] = dep_req.time;
+        times[initial][router->origin] = dep_req.time;
+        states[initial][router->origin].back_stop  = NONE;
+        states[initial][router->origin].back_route = NONE;
+        states[initial][router->origin].back_trip  = UINT16_MAX;
+        states[initial][router->origin].board_time = UNREACHED;
+        times[0][router->origin] = dep_req.time;
+        bitset_reset(router->updated_stops);
+        bitset_set(router->updated_stops, router->origin);
+        unflag_banned_stops(router, &dep_req);
+        apply_transfers(router, &dep_req, initial);
+        uint32_t round = 0;
+        while (round < n_rounds) {
+            router->best_time = router->round_best_time + round * n_stops;
+            profile_carry_best_times (router, round);
+            if ( ! router_round(router, &dep_req, round++)) break;
+        }
+        /* Carry the best times over into the rounds that did not run as well, so that the last round holds them all. */
+        for ( ; round < n_rounds; ++round) profile_carry_best_times (router, round);
+        /* All earlier profile entries leave later, so a new one is only dominated by one with as few rides or fewer
+           arriving as early or earlier. Since departures are distinct, it cannot dominate any earlier entry. */
+        for (uint32_t round = 0; round < n_rounds; ++round) {
+            rtime_t arrival = walk_times[round][router->target];
+            if (arrival == UNREACHED || arrival >= best_arrival[round]) continue;
+            router_result_to_itinerary (profile_add_itinerary (profile), router, &dep_req, round);
+            for (uint32_t r = round; r < RRRR_MAX_ROUNDS; ++r) {
+                if (arrival < best_arrival[r]) best_arrival[r] = arrival;
+            }
+        }
+    }
+    free (departures);
+    /* Report itineraries in increasing order of departure time. */
+    for (uint32_t i = 0, j = profile->n_itineraries; i + 1 < j; ++i, --j) {
+        struct itinerary tmp = profile->itineraries[i];
+        profile->itineraries[i] = profile->itineraries[j - 1];
+        profile->itineraries[j - 1] = tmp;
+    }
+    /* Every stop any round or departure reached was touched once, so clearing them restores all scratch state. */
+    for (uint32_t i = 0; i < router->n_touched_stops; ++i) {
+        for (uint32_t round = 0; round <= router->max_rounds; ++round)
+            router->round_best_time[round * n_stops + router->touched_stops[i]] = UNREACHED;
+    }
+    router->last_best_time = NULL;
+    router->best_time = best_time;
+    router_reset (router);
+    return true;
+}
+
+/* The value of the request's criterion for a complete itinerary, which is also the cost of the label it came from. */
+static uint32_t itinerary_cost (tdata_t *tdata, router_request_t *req, struct itinerary *itin) {
+    uint32_t cost = 0;
+    for (struct leg *leg = itin->legs; leg < itin->legs + itin->n_legs; ++leg) {
+        if (leg->route == WALK) {
+            if (req->criterion == c_walk_meters && leg->s0 != ONBOARD) cost += transfer_distance (tdata, leg->s0, leg->s1);
+        } else if (req->criterion == c_bus_legs && (tdata->routes[leg->route].attributes & m_bus)) {
+            cost += 1;
+        }
+    }
+    return cost;
+}
+
+/*
+  Write a plain text representation of a profile to the given buffer, one line with the departure time, arrival time
+  and number of rides for each itinerary followed by its legs. Stops early if the buffer would overflow.
+  Returns the number of bytes written to the buffer.
+*/
+uint32_t router_profile_dump (router_t *router, struct profile *profile, char *buf, uint32_t buflen) {
+    char *b = buf;
+    char *b_end = buf + buflen;
+    b += sprintf (b, "PROFILE %d itineraries\n", profile->n_itineraries);
+    for (struct itinerary *itin = profile->itineraries; itin < profile->itineraries + profile->n_itineraries; ++itin) {
+        /* Each leg is rendered on a line of a few hundred bytes. */
+        if (b_end - b < 512 * (itin->n_legs + 1)) {
+            b += sprintf (b, "\n(%d more itineraries not shown)\n", (int) (profile->itineraries + profile->n_itineraries - itin));
+            break;
+        }
+        char ct0[16];
+        char ct1[16];
+        btimetext(itin->legs[0].t0, ct0);
+        btimetext(itin->legs[itin->n_legs - 1].t1, ct1);
+        b += sprintf (b, "\nDEPART %s ARRIVE %s", ct0, ct1);
+        if (profile->req.criterion != c_none)
+            b += sprintf (b, " COST %d", itinerary_cost (router->tdata, &profile->req, itin));
+        b = plan_render_itinerary (itin, router->tdata, profile->req.day_mask, b, b_end);
+    }
+    *b = '\0';
+    return b - buf;
+}
+
+void router_profile_free (struct profile *profile) {
+    free (profile->itineraries);
+    profile->itineraries = NULL;
+    profile->n_itineraries = profile->capacity = 0;
+}
+
+/* ROUTE ACCESS FOR McRAPTOR AND ONE-TO-ALL SEARCHES */
+
+void route_view_setup (router_t *router, router_request_t *req, uint32_t route_idx, route_view_t *view) {
+    tdata_t *tdata = router->tdata;
+    route_block_t block;
+    view->stops = tdata_stops_for_route (tdata, route_idx);
+    view->stop_attributes = tdata_stop_attributes_for_route (tdata, route_idx);
+    view->times = (route_times_t) { tdata, tdata_trips_for_route (tdata, route_idx), NULL, NULL, 0 };
+    view->scan = (board_scan_t) { NULL, tdata_trip_masks_for_route (tdata, route_idx), tdata_trip_attributes_for_route (tdata, route_idx),
+                                  0, 0, req->trip_attributes,
+                                  req->n_banned_trips > 0 ? router->banned_trips : NULL, tdata->routes[route_idx].trip_ids_offset,
+                                  0, 0, false };
+    if (tdata_route_block (tdata, route_idx, &block)) {
+        view->stops = block.stops;
+        view->stop_attributes = block.stop_attributes;
+        view->scan.trip_attributes = block.trip_attributes;
+        view->scan.trip_masks = block.trip_masks;
+        view->scan.n_trips = block.stride;
+        view->times.departures = block.departures;
+        view->times.arrivals = block.arrivals;
+        view->times.stride = block.stride;
+    }
+    view->vectorised = view->times.departures != NULL && tdata->n_delayed_trips[route_idx] == 0;
+}
+
+/* Find the trip departing soonest at or after the given time at one stop of a route, over all service days,
+   as router_round does for depart-after searches. Returns the trip index within the route, or NONE. */
+uint32_t
+route_earliest_trip (router_t *router, router_request_t *req, uint32_t route_idx, route_view_t *view,
+                     uint32_t route_stop, rtime_t prev_time, rtime_t *board_time, serviceday_t **board_serviceday) {
+    tdata_t *tdata = router->tdata;
+    route_t *route = tdata->routes + route_idx;
+    route_times_t *times = &(view->times);
+    board_scan_t *scan = &(view->scan);
+    bool route_overlap = route->min_time < route->max_time - RTIME_ONE_DAY;
+    uint32_t best_trip = NONE;
+    rtime_t  best_time = UNREACHED;
+    for (serviceday_t *serviceday = router->servicedays; serviceday <= router->servicedays + 2; ++serviceday) {
+        if (prev_time > serviceday->midnight + route->max_time) continue;
+        if (best_trip != NONE && ! route_overlap) break;
+        day_view_t *day_view = serviceday->view;
+        uint16_t *trip_order = day_view->trips + day_view->trips_offsets[route_idx];
+        uint32_t  n_trips = day_view->trips_offsets[route_idx + 1] - day_view->trips_offsets[route_idx];
+        uint32_t  n_fifo = day_view->n_fifo[route_idx];
+        if (n_trips == 0) continue;
+        if (view->vectorised) {
+            rtime_t time;
+            scan->times = times->departures + route_stop * times->stride;
+            scan->day_mask = serviceday->mask;
+            scan->midnight = serviceday->midnight;
+            scan->prev_time = prev_time;
+            uint32_t trip = board_best_trip (scan, &time);
+            if (trip != NONE && time < best_time) {
+                best_trip = trip;
+                best_time = time;
+                *board_serviceday = serviceday;
+            }
+            continue;
+        }
+        /* Binary search the FIFO chain, then scan the overtaking trips. */
+        uint32_t lo = 0, hi = n_fifo;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (route_stoptime (times, trip_order[mid], route_stop, false, serviceday) < prev_time) lo = mid + 1;
+            else hi = mid;
+        }
+        for (uint32_t pos = lo; pos < n_trips; ++pos) {
+            uint32_t trip = trip_order[pos];
+            if ( ! trip_allowed (router, req, route_idx, trip, times->trips, scan->trip_attributes)) continue;
+            rtime_t time = route_stoptime (times, trip, route_stop, false, serviceday);
+            if (time == UNREACHED || time < prev_time) continue;
+            if (time < best_time) {
+                best_trip = trip;
+                best_time = time;
+                *board_serviceday = serviceday;
+            }
+            /* The first usable trip in the chain is the soonest one in the chain. */
+            if (pos < n_fifo) pos = n_fifo - 1;
+        }
+    }
+    *board_time = best_time;
+    return best_trip;
+}
+
+/* Fill in router->walk_to_target for the stops from which the target of a request can be reached on foot. */
+void walk_to_target_setup (router_t *router, router_request_t *req) {
+    tdata_t *tdata = router->tdata;
+    if (router->walk_to_target == NULL) {
+        router->walk_to_target = (rtime_t *) malloc (sizeof(rtime_t) * tdata->n_stops);
+        if (router->walk_to_target == NULL) die ("failed to allocate walks to the target");
+        for (uint32_t s = 0; s < tdata->n_stops; ++s) router->walk_to_target[s] = UNREACHED;
+    }
+    uint32_t tr     = tdata->stops[req->to    ].transfers_offset;
+    uint32_t tr_end = tdata->stops[req->to + 1].transfers_offset;
+    router->walk_to_target[req->to] = 0;
+    for ( ; tr < tr_end; ++tr) {
+        uint32_t stop = tdata->transfer_target_stops[tr];
+        router->walk_to_target[stop] = transfer_duration (router, stop, req->to);
+    }
+}
+
+/* Reset router->walk_to_target when a search is done, visiting only the stops around the target. */
+void walk_to_target_reset (router_t *router, router_request_t *req) {
+    tdata_t *tdata = router->tdata;
+    uint32_t tr     = tdata->stops[req->to    ].transfers_offset;
+    uint32_t tr_end = tdata->stops[req->to + 1].transfers_offset;
+    router->walk_to_target[req->to] = UNREACHED;
+    for ( ; tr < tr_end; ++tr) router->walk_to_target[tdata->transfer_target_stops[tr]] = UNREACHED;
+}
+
+/* TRANSFER PATTERNS */
+
+/* The ride arriving soonest at one stop on a single trip boarded at another stop at or after the given time, over all
+   the routes serving both in that order. Fills in the ride leg and returns false if there is none. */
+static bool
+pattern_direct_ride (router_t *router, router_request_t *req, uint32_t from, uint32_t to, rtime_t time, struct leg *leg) {
+    tdata_t *tdata = router->tdata;
+    uint32_t *routes;
+    uint32_t n_routes = tdata_routes_for_stop (tdata, from, &routes);
+    leg->t1 = UNREACHED;
+    for (uint32_t i = 0; i < n_routes; ++i) {
+        uint32_t route_idx = routes[i];
+        route_t *route = tdata->routes + route_idx;
+        if ( ! route_usable (router, route_idx)) continue;
+        route_view_t view;
+        route_view_setup (router, req, route_idx, &view);
+        /* A route can visit a stop more than once: try boarding at every visit, alighting at the next visit of to. */
+        for (uint32_t board = 0; board + 1 < route->n_stops; ++board) {
+            if (view.stops[board] != from || ! (view.stop_attributes[board] & rsa_boarding)) continue;
+            uint32_t alight = board + 1;
+            while (alight < route->n_stops && view.stops[alight] != to) {
+                if (stop_banned_hard (router, req, view.stops[alight])) break;
+                ++alight;
+            }
+            if (alight == route->n_stops || view.stops[alight] != to || ! (view.stop_attributes[alight] & rsa_alighting)) continue;
+            rtime_t board_time;
+            serviceday_t *serviceday = NULL;
+            uint32_t trip = route_earliest_trip (router, req, route_idx, &view, board, time, &board_time, &serviceday);
+            if (trip == NONE) continue;
+            rtime_t arrival = route_stoptime (&view.times, trip, alight, true, serviceday);
+            if (arrival == UNREACHED || arrival < board_time || arrival >= leg->t1) continue;
+            leg->s0 = from;
+            leg->s1 = to;
+            leg->t0 = board_time;
+            leg->t1 = arrival;
+            leg->route = route_idx;
+            leg->trip = trip;
+        }
+    }
+    return leg->t1 != UNREACHED;
+}
+
+/* Follow one pattern from the origin of a request, taking the soonest ride for every step. Returns false if the
+   pattern cannot be followed at this time or with the request's restrictions. */
+static bool pattern_evaluate (router_t *router, router_request_t *req, uint32_t *pattern, struct itinerary *itin) {
+    uint32_t n_rides = pattern[0];
+    uint32_t stop = req->from;
+    rtime_t time = req->time;
+    itin->n_rides = n_rides;
+    itin->n_legs = n_rides * 2 + 1;
+    struct leg *l = itin->legs;
+    for (uint32_t r = 0; ; ++r) {
+        /* Walk to the next boarding stop, or to the target after the last ride. */
+        uint32_t next = r < n_rides ? pattern[1 + 2 * r] : req->to;
+        rtime_t duration = transfer_duration (router, stop, next);
+        if (duration == UNREACHED || (uint32_t) time + duration > RTIME_THREE_DAYS) return false;
+        l->s0 = stop;
+        l->s1 = next;
+        l->t0 = time;
+        l->t1 = time + duration;
+        l->route = WALK;
+        l->trip  = WALK;
+        time = l->t1;
+        stop = next;
+        l += 1;
+        if (r == n_rides) break;
+        uint32_t alight = pattern[2 + 2 * r];
+        if (stop_banned (router, req, stop) || stop_banned (router, req, alight)) return false;
+        if (stop_banned_hard (router, req, stop) || stop_banned_hard (router, req, alight)) return false;
+        if ( ! pattern_direct_ride (router, req, stop, alight, time, l)) return false;
+        time = l->t1;
+        stop = alight;
+        l += 1;
+    }
+    return req->time_cutoff == UNREACHED || time <= req->time_cutoff;
+}
+
+/*
+  Answer a request from the transfer patterns precomputed for its origin and target, evaluating only those patterns
+  against the timetable, including any real-time delays. The plan holds the soonest arrival for each number of rides
+  that improves on fewer rides, like router_result_to_plan. Returns false if there are no patterns for the pair or
+  none can be followed, in which case the request should be routed as usual. Only depart-after requests not starting
+  on board are supported.
+*/
+bool router_route_patterns (router_t *router, router_request_t *req, transfer_patterns_t *tp, struct plan *plan) {
+    plan->req = *req;
+    plan->n_itineraries = 0;
+    uint32_t *pattern, *end;
+    if (req->arrive_by || req->start_trip_trip != NONE || req->via != NONE) return false;
+    if ( ! tp_patterns (tp, req->from, req->to, &pattern, &end)) return false;
+    router_setup_servicedays (router, req);
+    router_compile_request (router, req);
+    struct itinerary best[RRRR_MAX_ROUNDS];
+    for (uint32_t r = 0; r < RRRR_MAX_ROUNDS; ++r) best[r].n_legs = 0;
+    for ( ; pattern < end; pattern += 1 + 2 * pattern[0]) {
+        uint32_t n_rides = pattern[0];
+        if (n_rides == 0 || n_rides > request_rounds (router, req)) continue;
+        struct itinerary itin;
+        if ( ! pattern_evaluate (router, req, pattern, &itin)) continue;
+        struct itinerary *b = best + n_rides - 1;
+        if (b->n_legs == 0 || itin.legs[itin.n_legs - 1].t1 < b->legs[b->n_legs - 1].t1) *b = itin;
+    }
+    rtime_t arrival = UNREACHED;
+    for (uint32_t r = 0; r < RRRR_MAX_ROUNDS; ++r) {
+        if (best[r].n_legs == 0 || best[r].legs[best[r].n_legs - 1].t1 >= arrival) continue;
+        arrival = best[r].legs[best[r].n_legs - 1].t1;
+        plan->itineraries[plan->n_itineraries++] = best[r];
+    }
+    return plan->n_itineraries > 0;
+}
+
 uint32_t rrrrandom(uint32_t limit) {
     return (uint32_t) (limit * (random() / (RAND_MAX + 1.0)));
 }
@@ -1011,6 +2055,9 @@ void router_request_initialize(router_request_t *req) {
     req->from = req->to = req->via = NONE;
     req->time = UNREACHED;
     req->time_cutoff = UNREACHED;
+    req->time_window = 0;
+    req->criterion = c_none;
+    req->engine = e_raptor;
     req->walk_speed = 1.5; // m/sec
     req->arrive_by = true;
     req->time_rounded = false;
@@ -1023,11 +2070,6 @@ void router_request_initialize(router_request_t *req) {
     req->n_banned_stops = 0;
     req->n_banned_trips = 0;
     req->n_banned_stops_hard = 0;
-    req->banned_route = NONE;
-    req->banned_stop = NONE;
-    req->banned_trip_route = NONE;
-    req->banned_trip_offset = NONE;
-    req->banned_stop_hard = NONE;
     req->start_trip_route = NONE;
     req->start_trip_trip  = NONE;
     req->intermediatestops = false;
@@ -1063,6 +2105,9 @@ void router_request_randomize (router_request_t *req, tdata_t *tdata) {
     req->via = NONE;
     req->arrive_by = rrrrandom(2); // 0 or 1
     req->time_cutoff = UNREACHED;
+    req->time_window = 0;
+    req->criterion = c_none;
+    req->engine = e_raptor;
     req->walk_speed = 1.5; // m/sec
     req->arrive_by = rrrrandom(2); // 0 or 1
     req->max_transfers = RRRR_MAX_ROUNDS - 1;
@@ -1075,11 +2120,6 @@ void router_request_randomize (router_request_t *req, tdata_t *tdata) {
     req->n_banned_stops = 0;
     req->n_banned_trips = 0;
     req->n_banned_stops_hard = 0;
-    req->banned_route = NONE;
-    req->banned_stop = NONE;
-    req->banned_trip_route = NONE;
-    req->banned_trip_offset = NONE;
-    req->banned_stop_hard = NONE;
     req->intermediatestops = false;
 }
 
@@ -1096,11 +2136,13 @@ void router_request_next(router_request_t *req) {
     req->max_transfers = RRRR_MAX_ROUNDS - 1;
 }
 
-void router_state_dump (router_state_t *state) {
+void router_state_dump (router_t *router, uint32_t round, uint32_t stop) {
+    uint32_t i = round * router->tdata->n_stops + stop;
+    router_state_t *state = router->states + i;
     printf ("-- Router State --\n");
-    printf ("walk time:    %s \n", timetext(state->walk_time));
+    printf ("walk time:    %s \n", timetext(router->walk_times[i]));
     printf ("walk from:    %d \n", state->walk_from);
-    printf ("time:         %s \n", timetext(state->time));
+    printf ("time:         %s \n", timetext(router->times[i]));
     printf ("board time:   %s \n", timetext(state->board_time));
     printf ("back route:   ");
     if (state->back_route == NONE) printf ("NONE\n");
@@ -1113,15 +2155,13 @@ void router_state_dump (router_state_t *state) {
    Returns a boolean value indicating whether the request was successfully reversed.
 */
 bool router_request_reverse(router_t *router, router_request_t *req) {
-    router_state_t (*states)[router->tdata->n_stops] = (router_state_t(*)[]) (router->states);
+    rtime_t (*walk_times)[router->tdata->n_stops] = (rtime_t(*)[]) (router->walk_times);
     uint32_t stop = (req->arrive_by ? req->from : req->to);
-    uint32_t max_transfers = req->max_transfers;
-    if (max_transfers >= RRRR_MAX_ROUNDS) // range-check to keep search within states array
-        max_transfers = RRRR_MAX_ROUNDS - 1;
+    uint32_t n_rounds = request_rounds (router, req); // range-check to keep search within states array
     // find the solution with the most transfers and the earliest arrival
     uint32_t round = NONE;
-    for (uint32_t r = 0; r <= max_transfers; ++r) {
-        if (states[r][stop].walk_time != UNREACHED) {
+    for (uint32_t r = 0; r < n_rounds; ++r) {
+        if (walk_times[r][stop] != UNREACHED) {
             round = r;
             if (req->optimise == o_transfers) break; // use the lowest rather than highest number of transfers
         }
@@ -1129,10 +2169,10 @@ bool router_request_reverse(router_t *router, router_request_t *req) {
     // In the case that no solution was found, the request will remain unchanged.
     if (round == NONE) return false;
     //printf ("State present at round %d \n", round);
-    //router_state_dump (&(states[round][stop]));
+    //router_state_dump (router, round, stop);
     req->max_transfers = round;
     req->time_cutoff = req->time;
-    req->time = states[round][stop].walk_time;
+    req->time = walk_times[round][stop];
     req->arrive_by = !(req->arrive_by);
     // router_request_dump(router, req);
     // range-check the resulting request here?
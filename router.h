@@ -10,47 +10,115 @@
 #include <time.h>
 #include "tdata.h"
 #include "bitset.h"
+#include "threadpool.h"
+#include "hashgrid.h"
+#include "transferpatterns.h"
+#include "slab.h"
 #include "util.h"
 #include "config.h"
 
-/* When associated with a stop index, a router_state_t describes a leg of an itinerary. */
+/* When associated with a stop index and a round, a router_state_t describes a leg of an itinerary. The times at which
+   the stops were reached are kept apart from these, in router->times and router->walk_times, since the inner loops of
+   the search mostly read and compare times, and only write a state when a stop improves.
+   TODO rename members to ride_from, walk_from, route, trip ? */
 typedef struct router_state router_state_t;
-/* We could potentially remove the back_time from router_state, but this requires implementing some
-   lookup functions and storing the back_trip_stop rather than the back_stop (global stop index):
-   a trip can pass through a stop more than once.
-   TODO rename members to ride_from, walk_from, route, trip, ride_time, walk_time ? */
 struct router_state {
     uint32_t back_stop;  // The index of the previous stop in the itinerary
     uint32_t back_route; // The index of the route used to travel from back_stop to here, or WALK
-    uint32_t back_trip;  // The index of the trip used to travel from back_stop to here, or WALK
-    rtime_t  time;       // The time when this stop was reached
-    rtime_t  board_time; // The time at which the trip within back_route left back_stop
-    /* Second phase footpath/transfer results */
     uint32_t walk_from;  // The stop from which this stop was reached by walking (2nd phase)
-    rtime_t  walk_time;  // The time when this stop was reached by walking (2nd phase)
+    uint16_t back_trip;  // The index of the trip within back_route used to travel from back_stop to here
+    rtime_t  board_time; // The time at which the trip within back_route left back_stop
+};
+
+
+/* The departures towards the target in the profile of one stop in a CSA profile search, in decreasing order of time.
+   Each one arrives as early as any later one with every number of rides, since a passenger can wait for the later one. */
+typedef struct csa_profile csa_profile_t;
+struct csa_profile {
+    struct csa_departure *departures;
+    uint32_t n_departures;
+    uint32_t capacity;
 };
 
+/* The trips of each route that run on one service day, in the order of the departure index, so that boarding does
+   not have to test the calendar of every trip. Built for the masks of the service days of a search, kept until they change. */
+typedef struct day_view day_view_t;
+struct day_view {
+    calendar_t mask;          // The service day mask the view was built for
+    uint32_t  *trips_offsets; // Per route, the first of its entries in trips [n_routes + 1]
+    uint16_t  *n_fifo;        // Per route, how many of its entries come from the FIFO chain of the departure index
+    uint16_t  *trips;         // Trip indexes within their route
+};
 
 typedef struct service_day {
     rtime_t  midnight;
     calendar_t mask;
     bool     apply_realtime;
+    day_view_t *view;       // The trips running on this day
 } serviceday_t;
 
 // Scratch space for use by the routing algorithm.
 // Making this opaque requires more dynamic allocation.
 typedef struct router router_t;
+
+/* A route scan kernel of router_round, specialised for one kind of request and route. */
+struct router_request;
+struct round_worker;
+typedef void (*router_scan_kernel_t) (router_t *router, struct router_request *req, uint8_t round, uint32_t route_idx,
+                                      struct round_worker *worker);
+
 struct router {
     tdata_t *tdata;         // The transit / timetable data tables
+    uint32_t max_rounds;    // The most rounds a search runs, for which the per-round scratch space below is sized
     rtime_t *best_time;     // The best known time at each stop
-    router_state_t *states; // One router_state_t per stop, per round
+    rtime_t *times;         // The time each stop was reached by riding, per round [round][stop], then the initial state
+    rtime_t *walk_times;    // The time each stop was reached by walking (2nd phase), per round [round][stop], then the initial state
+    router_state_t *states; // How each stop was reached, per round [round][stop], then the initial state
     BitSet *updated_stops;  // Used to track which stops improved during each round
     BitSet *updated_routes; // Used to track which routes might have changed during each round
+    uint16_t *route_scan_start; // Per route in updated_routes, the route stop at which its scan begins
+    rtime_t *walk_durations;    // Per transfer, its duration at the walk speed and slack of the current request
+    rtime_t *walk_tables[RRRR_N_WALK_SPEEDS]; // Per walk speed, the duration of every transfer
+    uint8_t walk_table_slack[RRRR_N_WALK_SPEEDS]; // The walk slack each of the walk tables was built for
+    uint8_t *route_trip_attributes; // Per route, the union of the attributes of its trips
+    BitSet *route_eligible;     // The routes the current request allows at all, by service day, mode, agency, trip attributes and bans
+    BitSet *banned_stops;       // The stops banned by the current request
+    BitSet *banned_stops_hard;  // The stops the current request does not even allow passing through
+    BitSet *banned_trips;       // The trips banned by the current request, by their index among all trips of the timetable
+    router_scan_kernel_t scan_kernels[2]; // The route scan kernels picked for the current request, for routes without and with real-time data
+    bool generic_kernels;       // Benchmarking only: scan routes with the unspecialised kernel instead
+    uint32_t *touched_stops;  // Stops reached since the last reset, whose states must be cleared before the next search
+    uint32_t n_touched_stops;
+    rtime_t *round_best_time; // Profile searches only: the best known time at each stop, per round, then for the initial state. Allocated on first use.
+    rtime_t *last_best_time;  // Profile searches only: the best times of the last round of the current one, NULL otherwise
+    struct mc_label **bags;   // McRAPTOR searches only: the first label in the bag of each stop. Allocated on first use.
+    uint32_t *bag_generation; // The search in which each bag was last written. Older bags are empty.
+    uint32_t generation;      // The current McRAPTOR search, so that starting one does not have to clear the bags
+    slab_t slab;              // The McRAPTOR labels and rides of the current search
+    ThreadPool *pool;             // Threads sharing the routes and transfers of large rounds, NULL to use only one
+    struct round_worker *workers; // Per-thread improvements found during a parallel phase
+    uint32_t *parallel_items;     // The routes or stops to share out in a parallel phase
+    uint32_t *merge_rank;         // The winning improvement at each stop while merging, NONE otherwise
+    rtime_t *lower_bounds;        // Per cluster of stops, a lower bound on the time to the target of the current search
+    bool prune_lower_bounds;      // Whether the current search prunes with the lower bounds
+    uint16_t *trip_reached;       // Trip-Based searches only: per service day and trip, the first route stop reached. Allocated on first use.
+    struct tb_segment *segments;  // Trip-Based searches only: the trip segments queued in the current search, grown as needed
+    uint32_t segments_capacity;
+    rtime_t *walk_to_target;      // Per stop, the walk to the target of a Trip-Based or CSA profile search, UNREACHED where there is none
+    rtime_t *csa_times;           // Connection Scan searches only: per stop and number of rides, the soonest time with at most that many rides. Allocated on first use.
+    rtime_t *csa_ride_times;      // Connection Scan searches only: the same for arriving by riding, before walking on
+    struct csa_label *csa_labels; // Connection Scan searches only: how each of the csa_times was reached
+    uint8_t *csa_trip_rides;      // Connection Scan searches only: per service day and trip, the rides when on board, 0 when not boarded or CSA_UNUSABLE
+    uint32_t *csa_trip_enter;     // Connection Scan searches only: per service day and trip, the connection where it was boarded
+    csa_profile_t *csa_profiles;  // CSA profile searches only: per stop, the Pareto-optimal departures towards the target
+    struct csa_departure *csa_trips; // CSA profile searches only: per service day and trip, the arrivals when staying on board
 
     uint32_t origin;
     uint32_t target;
     calendar_t day_mask;
     serviceday_t servicedays[3];
+    day_view_t day_views[3]; // The trips running on each of the service days, shared out among them by mask
+    uint32_t day_views_version; // The version of the real-time overlay whose departure index the day views were built from
     // We should move more routing state in here, like round and sub-scratch pointers.
 };
 
@@ -70,6 +138,22 @@ typedef enum optimise {
 } optimise_t;
 
 
+/* The criterion traded off against arrival time and number of rides by McRAPTOR searches. */
+typedef enum criterion {
+    c_none        = 0, // plain RAPTOR
+    c_walk_meters = 1, // total distance walked, in meters
+    c_bus_legs    = 2  // number of rides on bus routes
+} criterion_t;
+
+
+/* The algorithm that answers a request. */
+typedef enum engine {
+    e_raptor     = 0, // RAPTOR rounds over routes
+    e_trip_based = 1, // Trip-Based routing over the trip-to-trip transfers in the timetable
+    e_csa        = 2  // the Connection Scan Algorithm over the connections in the timetable
+} engine_t;
+
+
 typedef enum tmode {
     m_tram      =   1,
     m_subway    =   2,
@@ -92,6 +176,9 @@ struct router_request {
     uint32_t start_trip_trip;  // for onboard departure: trip index within that route
     rtime_t time;        // the departure or arrival time at which to search (in internal rtime)
     rtime_t time_cutoff; // the latest (or earliest in arrive_by) acceptable time to reach the destination
+    rtime_t time_window; // profile searches: also consider departures up to this long after time, 0 otherwise
+    uint8_t criterion;   // McRAPTOR searches: the extra criterion to optimise, c_none otherwise
+    uint8_t engine;      // the routing engine to answer with, e_raptor unless the request selects another
     double walk_speed;   // speed at which the user walks, in meters per second
     uint8_t walk_slack;  // an extra delay per transfer, in seconds
     bool arrive_by;      // whether the given time is an arrival time rather than a departure time
@@ -104,15 +191,15 @@ struct router_request {
     #endif
     uint8_t trip_attributes; // select required attributes bitfield (from trips)
     uint8_t optimise;    // restrict the output to specific optimisation flags
-    uint32_t n_banned_routes; // 1
-    uint32_t n_banned_stops; // 1
-    uint32_t n_banned_stops_hard; // 1
-    uint32_t n_banned_trips; // 1
-    uint32_t banned_route; // One route which is banned
-    uint32_t banned_stop; // One stop which is banned
-    uint32_t banned_trip_route; // One trip which is banned, this is its route
-    uint32_t banned_trip_offset; // One trip which is banned, this is its tripoffset
-    uint32_t banned_stop_hard; // One stop which is banned
+    uint32_t n_banned_routes; // the number of entries in use in banned_routes, at most RRRR_MAX_BANNED
+    uint32_t n_banned_stops; // likewise for banned_stops
+    uint32_t n_banned_stops_hard; // likewise for banned_stops_hard
+    uint32_t n_banned_trips; // likewise for banned_trips_route and banned_trips_offset
+    uint32_t banned_routes[RRRR_MAX_BANNED]; // Routes which are banned
+    uint32_t banned_stops[RRRR_MAX_BANNED]; // Stops at which boarding, alighting and transferring are banned
+    uint32_t banned_trips_route[RRRR_MAX_BANNED]; // Trips which are banned, these are their routes
+    uint32_t banned_trips_offset[RRRR_MAX_BANNED]; // Trips which are banned, these are their trip offsets
+    uint32_t banned_stops_hard[RRRR_MAX_BANNED]; // Stops which cannot even be passed through
     bool intermediatestops; // Show intermetiastops in the output
 };
 
@@ -145,9 +232,25 @@ struct plan {
 };
 
 
+/* A profile holds every itinerary departing within the request's time window that is Pareto-optimal in departure
+   time, arrival time and number of rides. Unlike a plan, it is allocated as needed. Itineraries are in increasing
+   order of departure time. McRAPTOR searches fill in a profile too, with the itineraries that are Pareto-optimal in
+   arrival time, number of rides and the extra criterion, in increasing order of number of rides.
+   Zero-initialize it before the first search and release it with router_profile_free. */
+struct profile {
+    router_request_t req;
+    uint32_t n_itineraries;
+    uint32_t capacity;
+    struct itinerary *itineraries;
+};
+
+
 /* FUNCTION PROTOTYPES */
 
-void router_setup(router_t*, tdata_t*);
+/* Set up a router searching up to max_rounds rounds, from 1 to RRRR_MAX_ROUNDS. */
+void router_setup(router_t*, tdata_t*, uint32_t max_rounds);
+
+void router_setup_threads(router_t*, uint32_t n_threads);
 
 bool router_request_from_qstring(router_request_t*, tdata_t *tdata);
 
@@ -165,12 +268,22 @@ void router_teardown(router_t*);
 
 bool router_route(router_t*, router_request_t*);
 
-void router_round(router_t *router, router_request_t *req, uint8_t round);
+bool router_round(router_t *router, router_request_t *req, uint8_t round);
 
 void router_result_to_plan (struct plan *, router_t *, router_request_t *);
 
+bool router_route_profile (router_t*, router_request_t*, struct profile*);
+
+uint32_t router_profile_dump (router_t*, struct profile*, char *buf, uint32_t buflen); // return num of chars written
+
+void router_profile_free (struct profile*);
+
 uint32_t router_result_dump(router_t*, router_request_t*, char *buf, uint32_t buflen); // return num of chars written
 
+uint32_t router_plan_dump (router_t*, struct plan*, char *buf, uint32_t buflen);
+
+bool router_route_patterns (router_t*, router_request_t*, transfer_patterns_t*, struct plan*);
+
 void router_request_from_epoch(router_request_t *req, tdata_t *tdata, time_t epochtime);
 
 time_t req_to_date (router_request_t *req, tdata_t *tdata, struct tm *tm_out);
@@ -0,0 +1,203 @@
+/* Copyright 2013 Bliksem Labs. See the LICENSE file at the top-level directory of this distribution and at https://github.com/bliksemlabs/rrrr/. */
+
+/* router_internal.h : the parts of router.c shared with the other searches (mcraptor.c, isochrone.c, tripbased.c, csa.c) */
+
+#ifndef _ROUTER_INTERNAL_H
+#define _ROUTER_INTERNAL_H
+
+#include "router.h"
+#include "util.h"
+#include "config.h"
+#include "tdata.h"
+#include "bitset.h"
+#include "board.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* The number of rounds a search runs for a request: one more than the transfers it allows, but no more than the router
+   was set up for. */
+static inline uint32_t request_rounds (router_t *router, router_request_t *req) {
+    return req->max_transfers < router->max_rounds ? req->max_transfers + 1 : router->max_rounds;
+}
+
+// TODO? flag_routes_for_stops all at once after doing transfers? this would require another stops
+// bitset for transfer target stops.
+/* Given a stop index, mark all routes that serve it as updated. Also record per route the first route stop in the
+   direction of the search at which it was marked, where its scan can begin, or its whole length if that is unknown.
+   Routes the request does not allow are flagged as well: mask_ineligible_routes drops them all at once afterwards. */
+static inline void flag_routes_for_stop (router_t *router, router_request_t *req, uint32_t stop_index) {
+    uint32_t *routes;
+    uint32_t n_routes = tdata_routes_for_stop (router->tdata, stop_index, &routes);
+    uint16_t *positions = tdata_route_positions_for_stop (router->tdata, stop_index);
+    for (uint32_t i = 0; i < n_routes; ++i) {
+        I printf ("  flagging route %d at stop %d\n", routes[i], stop_index);
+        uint16_t start = positions ? positions[i] : req->arrive_by ? router->tdata->routes[routes[i]].n_stops - 1 : 0;
+        uint16_t *scan_start = router->route_scan_start + routes[i];
+        if ( ! bitset_get (router->updated_routes, routes[i]) || (req->arrive_by ? start > *scan_start : start < *scan_start))
+            *scan_start = start;
+        bitset_set (router->updated_routes, routes[i]);
+    }
+}
+
+/* Keep only the flagged routes which the request allows, as compiled by router_compile_request. */
+static inline void mask_ineligible_routes (router_t *router) {
+    bitset_mask (router->updated_routes, router->route_eligible);
+}
+
+/* Check whether a route can be used at all on the service days of a search, given the filters in the request. */
+static inline bool route_usable (router_t *router, uint32_t route_idx) {
+    return bitset_get (router->route_eligible, route_idx);
+}
+
+/* Whether the request bans boarding, alighting and transferring at a stop. */
+static inline bool stop_banned (router_t *router, router_request_t *req, uint32_t stop) {
+    return req->n_banned_stops > 0 && stop < router->tdata->n_stops && bitset_get (router->banned_stops, stop);
+}
+
+/* Whether the request does not even allow passing through a stop. */
+static inline bool stop_banned_hard (router_t *router, router_request_t *req, uint32_t stop) {
+    return req->n_banned_stops_hard > 0 && stop < router->tdata->n_stops && bitset_get (router->banned_stops_hard, stop);
+}
+
+/* Rather than reserving a place to store the transfers used to create the initial state, we look them up as needed.
+   Durations are those of the current request, as selected by router_setup_walk_durations. */
+static inline rtime_t
+transfer_duration (router_t *router, uint32_t stop_index_from, uint32_t stop_index_to) {
+    tdata_t *tdata = router->tdata;
+    if (stop_index_from == stop_index_to) return 0;
+    uint32_t t  = tdata->stops[stop_index_from    ].transfers_offset;
+    uint32_t tN = tdata->stops[stop_index_from + 1].transfers_offset;
+    for ( ; t < tN ; ++t) {
+        if (tdata->transfer_target_stops[t] == stop_index_to) return router->walk_durations[t];
+    }
+    return UNREACHED;
+}
+
+static inline rtime_t
+tdata_depart (tdata_t* td, trip_t *trip, uint32_t route_stop) {
+    return trip->begin_time + td->stop_times[trip->stop_times_offset + route_stop].departure;
+}
+
+static inline rtime_t
+tdata_arrive (tdata_t* td, trip_t *trip, uint32_t route_stop) {
+    return trip->begin_time + td->stop_times[trip->stop_times_offset + route_stop].arrival;
+}
+
+/* The real-time delay of a trip (a global trip index) at one of its route stops. Only trips with delays per stop
+   look any further than their own delay. */
+static inline int16_t
+trip_stop_delay (tdata_t *tdata, uint32_t trip_index, uint32_t route_stop, bool arrive) {
+    int16_t delay = tdata->trip_delays[trip_index];
+    if (delay != STOP_UPDATES) return delay;
+    stop_update_t *update = tdata->stop_updates + tdata->stop_update_offsets[trip_index] + route_stop;
+    return arrive ? update->arrival : update->departure;
+}
+
+/* Shift a scheduled time of a trip at one of its route stops to the given service day, applying realtime data as
+   needed. A stop the trip skips cannot be reached on it, so it is UNREACHED there. */
+static inline rtime_t
+serviceday_time (tdata_t *tdata, rtime_t time, uint32_t trip_index, uint32_t route_stop, bool arrive, serviceday_t *serviceday) {
+    rtime_t time_adjusted = time + serviceday->midnight;
+    /*
+    printf ("boarding at stop %d, time is: %s \n", route_stop, timetext (time));
+    printf ("   after adjusting: %s \n", timetext (time_adjusted));
+    printf ("   midnight: %d \n", serviceday->midnight);
+    printf ("   delay (4sec): %d \n", tdata->trip_delays[trip_index]);
+    */
+    /* Detect overflow (this will still not catch wrapping due to negative delays on small positive times) */
+    // actually this happens naturally with times like '03:00+1day' transposed to serviceday 'tomorrow'
+    if (time_adjusted < time) return UNREACHED;
+    /* Apply real time delay on the relevant days. */
+    if (serviceday->apply_realtime) {
+        int16_t delay = trip_stop_delay (tdata, trip_index, route_stop, arrive);
+        if (delay == CANCELED) return UNREACHED;
+        time_adjusted += delay;
+    }
+    return time_adjusted;
+}
+
+/* Get the departure or arrival time of the given trip on the given service day, applying realtime data as needed. */
+static inline rtime_t
+tdata_stoptime (tdata_t* tdata, trip_t *trip, uint32_t route_stop, bool arrive, serviceday_t *serviceday) {
+    rtime_t time;
+    if (arrive) time = tdata_arrive(tdata, trip, route_stop);
+    else           time = tdata_depart(tdata, trip, route_stop);
+    return serviceday_time (tdata, time, trip - tdata->trips, route_stop, arrive, serviceday);
+}
+
+/* Where to find the scheduled times of the trips in the route being scanned. When the timetable contains route
+   blocks, the times are read from the materialised columns rather than through the time demand types. */
+typedef struct route_times route_times_t;
+struct route_times {
+    tdata_t *tdata;
+    trip_t  *trips;
+    rtime_t *departures; // [route_stop][trip], NULL if there is no route block
+    rtime_t *arrivals;   // [route_stop][trip]
+    uint32_t stride;
+};
+
+static inline rtime_t
+route_stoptime (route_times_t *rt, uint32_t trip, uint32_t route_stop, bool arrive, serviceday_t *serviceday) {
+    rtime_t time;
+    if (rt->departures) time = (arrive ? rt->arrivals : rt->departures)[route_stop * rt->stride + trip];
+    else if (arrive)    time = tdata_arrive(rt->tdata, rt->trips + trip, route_stop);
+    else                time = tdata_depart(rt->tdata, rt->trips + trip, route_stop);
+    return serviceday_time (rt->tdata, time, rt->trips + trip - rt->tdata->trips, route_stop, arrive, serviceday);
+}
+
+/* Check whether a trip passes the filters in the request, on whichever day it runs. */
+static inline bool
+trip_allowed (router_t *router, router_request_t *req, uint32_t route_idx, uint32_t trip, trip_t *trips, uint8_t *trip_attributes) {
+    /* skip this trip if it is banned */
+    if (req->n_banned_trips > 0 && bitset_get (router->banned_trips, router->tdata->routes[route_idx].trip_ids_offset + trip)) return false;
+    /* skip this trip if it doesn't have all our required attributes */
+    if ( ! ((req->trip_attributes & trip_attributes[trip]) == req->trip_attributes)) return false;
+    /* skip this trip if the realtime delay equals CANCELED */
+    if (router->tdata->trip_delays[router->tdata->routes[route_idx].trip_ids_offset + trip] == CANCELED) return false;
+    return true;
+}
+
+/* Check whether a trip can be boarded on the given service day, given the filters in the request. */
+static inline bool
+trip_usable (router_t *router, router_request_t *req, uint32_t route_idx, uint32_t trip, trip_t *trips,
+             calendar_t *trip_masks, uint8_t *trip_attributes, serviceday_t *serviceday) {
+    /* skip this trip if it is not running on the current service day */
+    if ( ! (serviceday->mask & trip_masks[trip])) return false;
+    return trip_allowed (router, req, route_idx, trip, trips, trip_attributes);
+}
+
+/* Where to find the stops, filters and times of one route, from its route block when the timetable has them. */
+typedef struct route_view route_view_t;
+struct route_view {
+    uint32_t   *stops;
+    uint8_t    *stop_attributes;
+    route_times_t times;
+    board_scan_t  scan;       // also holds the trip masks and attributes
+    bool          vectorised; // whether boarding can use the scan, as in router_scan_route
+};
+
+
+/* Set up router->servicedays for the day of the request, with their views of the trips running on them. */
+void router_setup_servicedays (router_t *router, router_request_t *req);
+
+/* Compile the filters of a request into route_eligible and the ban bitsets, and select its walk durations. */
+void router_compile_request (router_t *router, router_request_t *req);
+
+void route_view_setup (router_t *router, router_request_t *req, uint32_t route_idx, route_view_t *view);
+
+/* The trip departing soonest at or after prev_time at one stop of a route over all service days, or NONE. */
+uint32_t route_earliest_trip (router_t *router, router_request_t *req, uint32_t route_idx, route_view_t *view,
+                              uint32_t route_stop, rtime_t prev_time, rtime_t *board_time, serviceday_t **board_serviceday);
+
+/* Fill in router->walk_to_target around the target of a request, and clear it again once the search is done. */
+void walk_to_target_setup (router_t *router, router_request_t *req);
+
+void walk_to_target_reset (router_t *router, router_request_t *req);
+
+/* Append an empty itinerary to a profile, growing it as needed. */
+struct itinerary *profile_add_itinerary (struct profile *profile);
+
+#endif // _ROUTER_INTERNAL_H
+
@@ -17,16 +17,10 @@
 #include <stdbool.h>
 #include <sys/time.h>
 #include "util.h"
+#include "slab.h"
 
 #define DEFAULT_SLAB_SIZE (1024 * 1024 * 1)
 
-static size_t slab_size;
-static struct slab *head;
-static struct slab *last;
-static size_t total_size;
-static void *cur;  // the current byte within the chain of slabs
-static void *end;  // the last byte within the chain of slabs
-
 /* Slabs are chained into a linked list. All slabs store their beginning address to allow subsequent deallocation. */
 struct slab {
     void *begin; // the beginning of this slab of memory
@@ -34,40 +28,38 @@ struct slab {
 };
 
 /* Allocate a new slab, adding it to the end of the chain and updating current and end position pointers accordingly. */
-struct slab *slab_new () {
+static struct slab *slab_new (slab_t *s) {
     struct slab *slab = malloc (sizeof(struct slab));
     if (slab == NULL) die ("cannot allocate slab.");
-    if (last != NULL) last->next = slab;
-    last = slab;
-    last->begin = malloc (slab_size);
-    if (last->begin == NULL) die ("cannot allocate slab.");
-    last->next = NULL;
-    cur = last->begin;
-    end = cur + slab_size;
-    total_size += slab_size;
-    printf ("allocated new slab at %p. total allocated is now %zd.\n", last->begin, total_size);
-    return last;
+    if (s->last != NULL) s->last->next = slab;
+    s->last = slab;
+    slab->begin = malloc (s->slab_size);
+    if (slab->begin == NULL) die ("cannot allocate slab.");
+    slab->next = NULL;
+    s->cur = slab->begin;
+    s->end = s->cur + s->slab_size;
+    s->total_size += s->slab_size;
+    return slab;
 }
 
-void slab_next () {
-    last = last->next;
-    cur = last->begin;
-    end = cur + slab_size;
+static void slab_next (slab_t *s) {
+    s->last = s->last->next;
+    s->cur = s->last->begin;
+    s->end = s->cur + s->slab_size;
 }
 
-/* Initialize the slab allocator system as a whole. */
-void slab_init (size_t size) {
-    slab_size = (size ? size : DEFAULT_SLAB_SIZE);
-    total_size = 0;
-    last = NULL;
-    head = slab_new ();
+/* Initialize the slab allocator as a whole. */
+void slab_init (slab_t *s, size_t size) {
+    s->slab_size = (size ? size : DEFAULT_SLAB_SIZE);
+    s->total_size = 0;
+    s->last = NULL;
+    s->head = slab_new (s);
 }
 
 /* Deallocate the given slab and all following it in the linked list. */
-void slab_destroy_chain (struct slab *slab) {
+static void slab_destroy_chain (struct slab *slab) {
     while (slab != NULL) {
         struct slab *next = slab->next; // avoid accessing deallocated memory, just in case
-        printf ("deallocating slab at %p.\n", slab->begin);
         free (slab->begin);
         free (slab);
         slab = next;
@@ -75,33 +67,33 @@ void slab_destroy_chain (struct slab *slab) {
 }
 
 /* Deallocate all slabs. */
-void slab_destroy () { slab_destroy_chain (head); }
+void slab_destroy (slab_t *s) {
+    slab_destroy_chain (s->head);
+    s->head = s->last = NULL;
+    s->cur = s->end = NULL;
+    s->total_size = 0;
+}
 
-void slab_free () {
-/*
-    size_t size = slab_size;
-    slab_destroy ();
-    slab_init (size);
-*/
-    printf ("slab free\n");
-    cur = head->begin;
-    end = cur + slab_size;
-    last = head;
+void slab_free (slab_t *s) {
+    s->cur = s->head->begin;
+    s->end = s->cur + s->slab_size;
+    s->last = s->head;
 }
 
 /* Allocating more than the slab size will cause bad things to happen. Do not do that. */
-void *slab_alloc (size_t bytes) {
-    if (bytes > slab_size) return NULL;
-    // align pointer here based on amount to be allocated
-    if (cur + bytes >= end) {
-        if (last->next == NULL) {
-            slab_new ();
+void *slab_alloc (slab_t *s, size_t bytes) {
+    /* Round up so that every allocation stays aligned for pointers and 64-bit fields. */
+    bytes = (bytes + 7) & ~((size_t) 7);
+    if (bytes > s->slab_size) return NULL;
+    if (s->cur + bytes >= s->end) {
+        if (s->last->next == NULL) {
+            slab_new (s);
         } else {
-            slab_next ();
+            slab_next (s);
         }
     }
-    void *ret = cur;
-    cur += bytes;
+    void *ret = s->cur;
+    s->cur += bytes;
     return ret;
 }
 
@@ -144,11 +136,12 @@ int test_slab (int argc, char **argv) {
 
     // slab alloc version
     gettimeofday (&t0, NULL);
-    slab_init (SLAB_SIZE);
+    slab_t slab;
+    slab_init (&slab, SLAB_SIZE);
     for (int p = 0; p < PASSES; ++p) {
-        slab_free ();
+        slab_free (&slab);
         for (int i = 0; i < ALLOCS; ++i) {
-            test_s *ts = slab_alloc (sizeof(test_s));
+            test_s *ts = slab_alloc (&slab, sizeof(test_s));
             ts->a = i;
             ts->b = i;
             ts->c = (i % 2 == 0);
@@ -166,6 +159,7 @@ int test_slab (int argc, char **argv) {
         }
     }
 
+    slab_destroy (&slab);
     fprintf (stderr, "%f sec malloc, %f sec slab, speedup %f\n", mdt, sdt, mdt/sdt);
     return 0;
 }
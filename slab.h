@@ -0,0 +1,34 @@
+/* Copyright 2013 Bliksem Labs. See the LICENSE file at the top-level directory of this distribution and at https://github.com/bliksemlabs/rrrr/. */
+
+/* slab.h : many small allocations carved out of a few large ones, all released at once */
+
+#ifndef _SLAB_H
+#define _SLAB_H
+
+#include <stddef.h>
+
+/* One allocator, owned by whoever uses it, so that several routers can allocate at the same time. */
+typedef struct slab_allocator slab_t;
+struct slab_allocator {
+    size_t slab_size;   // the size in bytes of each slab
+    size_t total_size;  // the number of bytes in all slabs of the chain
+    struct slab *head;  // the first slab of the chain
+    struct slab *last;  // the slab currently being allocated from
+    void *cur;          // the current byte within the chain of slabs
+    void *end;          // the last byte within the current slab
+};
+
+/* Initialize the allocator with slabs of the given size in bytes, or a default size if 0. */
+void slab_init (slab_t *slab, size_t size);
+
+/* Return a block of the given number of bytes aligned on 8 bytes, or NULL if it is larger than a slab. */
+void *slab_alloc (slab_t *slab, size_t bytes);
+
+/* Release every block allocated so far in O(1). The slabs are kept for reuse by later allocations. */
+void slab_free (slab_t *slab);
+
+/* Release the slabs themselves. */
+void slab_destroy (slab_t *slab);
+
+#endif // _SLAB_H
+
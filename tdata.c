@@ -7,20 +7,25 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
+#include <sched.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <time.h>
 
 #include "config.h"
 #include "util.h"
+#include "bitset.h"
 #include "radixtree.h"
 #include "gtfs-realtime.pb-c.h"
 
 // file-visible struct
 typedef struct tdata_header tdata_header_t;
 struct tdata_header {
-    char version_string[8]; // should read "TTABLEV1"
+    char version_string[8]; // should read "TTABLEV2" or "TTABLEV3"
     uint64_t calendar_start_time;
     calendar_t dst_active;
     uint32_t n_stops;
@@ -53,6 +58,12 @@ struct tdata_header {
     uint32_t loc_route_ids;
     uint32_t loc_stop_ids;
     uint32_t loc_trip_ids;
+    /* TTABLEV3 adds the optional sections below, whose location is 0 when they are absent. */
+    uint32_t loc_route_blocks;
+    uint32_t loc_lower_bounds;
+    uint32_t loc_trip_transfers;
+    uint32_t loc_connections;
+    uint32_t loc_stop_route_positions;
 };
 
 inline char *tdata_route_id_for_index(tdata_t *td, uint32_t route_index) {
@@ -242,6 +253,23 @@ void tdata_check_coherent (tdata_t *tdata) {
         }
         if (n_nonincreasing_trips > 0) printf ("route %d has %d trips with negative travel times\n", r, n_nonincreasing_trips);
     }
+    /* Check that the route stop positions lead back to their stops, since scans would otherwise skip boardings. */
+    if (tdata->stop_route_positions != NULL) {
+        uint32_t n_mismatched = 0;
+        for (uint32_t s = 0; s < tdata->n_stops; ++s) {
+            uint32_t *routes;
+            uint32_t n_routes = tdata_routes_for_stop (tdata, s, &routes);
+            uint16_t *positions = tdata_route_positions_for_stop (tdata, s);
+            for (uint32_t i = 0; i < n_routes; ++i) {
+                if (positions[i] >= tdata->routes[routes[i]].n_stops || tdata_stops_for_route (tdata, routes[i])[positions[i]] != s)
+                    n_mismatched += 1;
+            }
+        }
+        if (n_mismatched > 0) {
+            printf ("%d route stop positions do not match their stops, scanning routes from their beginning.\n", n_mismatched);
+            tdata->stop_route_positions = NULL;
+        }
+    }
     /* Check that all transfers are symmetric. */
     int n_transfers_checked = 0;
     for (uint32_t stop_index_from = 0; stop_index_from < tdata->n_stops; ++stop_index_from) {
@@ -276,10 +304,528 @@ void tdata_check_coherent (tdata_t *tdata) {
     printf ("checked %d transfers for symmetry.\n", n_transfers_checked);
 }
 
+/* The real-time overlay holds two versions of the real-time data, each in a buffer of its own. Version g lives in
+   buffer g % 2. The updater prepares version g + 1 in the buffer of version g - 1, announcing this in writing before it
+   touches the buffer, and publishes it by advancing generation. A reader on version g therefore sees consistent data
+   until writing reaches g + 2, which it can check once it is done (a seqlock over two buffers). Every buffer also
+   holds per route the last version in which one of its trips changed, so readers only re-index those routes.
+   Trips with delays per stop own a slot of stop updates, at the same offset in both buffers unless the updater had to
+   compact the stop updates of the version it prepares. */
+#define RT_MAGIC "RRRRRTV2"
+#define RT_STALE UINT32_MAX // a route version no overlay ever has, forcing the route to be re-indexed
+
+typedef struct tdata_realtime_header rt_header_t;
+struct tdata_realtime_header {
+    char     magic[8];            // written last when an overlay is created
+    uint64_t calendar_start_time; // this and the counts identify the timetable the overlay belongs to
+    uint32_t n_routes;
+    uint32_t n_trips;
+    uint32_t stop_updates_capacity;
+    uint32_t n_stop_updates;      // the stop updates handed out to trips so far
+    uint32_t generation;          // the current version
+    uint32_t writing;             // the version being prepared, equal to generation when the updater is idle
+    uint32_t recovery[2];         // per buffer, the realtime_recovery of its version
+};
+
+/* The parts of one buffer, laid out in this order with the delays last for alignment. */
+typedef struct rt_buffer rt_buffer_t;
+struct rt_buffer {
+    uint32_t      *route_versions;
+    uint32_t      *stop_update_offsets; // per trip, NONE for trips without delays per stop
+    stop_update_t *stop_updates;
+    int16_t       *trip_delays;
+};
+
+struct tdata_realtime {
+    rt_header_t *header;
+    size_t    size;
+    uint8_t  *buffers[2];
+    size_t    buffer_size;
+    /* The updater's own bookkeeping: the trips changed in the last version it wrote, which are all that differ
+       between the two buffers once both have been brought in sync, and per trip the version that last changed it
+       and the slot of stop updates it owns, kept when it falls back to a single delay. Once the stop updates were
+       compacted in one buffer, the other is laid out differently and is brought over in full. */
+    uint32_t *changed_trips;
+    uint32_t  n_changed_trips;
+    uint32_t  max_changed_trips;
+    uint32_t *trip_changed;
+    uint32_t *trip_slots;
+    bool      in_sync;
+    bool      compacted;
+    /* The trips that are not on time, with the position of each trip in that list (NONE if it is on time), so that
+       clearing or replacing all real-time data costs as much as there is of it rather than a pass over all trips. */
+    uint32_t *live_trips;
+    uint32_t  n_live_trips;
+    uint32_t *live_positions;
+    /* Per trip the feed message that last named it and the timestamp of the update applied to it, and the timestamp
+       of the last full dataset, to recognise updates that were overtaken by newer ones. */
+    uint32_t *trip_messages;
+    uint32_t  n_messages;
+    uint64_t *trip_timestamps;
+    uint64_t  feed_timestamp;
+    /* The last batch of deltas made for the workers. */
+    tdata_realtime_batch_t *batch;
+    size_t    batch_capacity;
+};
+
+static void rt_buffer (tdata_t *td, uint32_t version, rt_buffer_t *buffer) {
+    uint8_t *p = td->realtime->buffers[version % 2];
+    buffer->route_versions = (uint32_t *) p;
+    buffer->stop_update_offsets = buffer->route_versions + td->n_routes;
+    buffer->stop_updates = (stop_update_t *) (buffer->stop_update_offsets + td->n_trips);
+    buffer->trip_delays = (int16_t *) (buffer->stop_updates + td->realtime->header->stop_updates_capacity);
+}
+
+static size_t rt_size (tdata_t *td, size_t *buffer_size) {
+    *buffer_size = (sizeof(uint32_t) * (td->n_routes + td->n_trips) + sizeof(stop_update_t) * RRRR_REALTIME_STOP_UPDATES +
+                    sizeof(int16_t) * td->n_trips + 7) & ~(size_t) 7;
+    return sizeof(rt_header_t) + 2 * *buffer_size;
+}
+
+static bool rt_matches (tdata_t *td, rt_header_t *header) {
+    return header->calendar_start_time == td->calendar_start_time &&
+           header->n_routes == td->n_routes && header->n_trips == td->n_trips &&
+           header->stop_updates_capacity == RRRR_REALTIME_STOP_UPDATES;
+}
+
+static void rt_init (tdata_realtime_t *rt, void *base, size_t size, size_t buffer_size) {
+    rt->header = (rt_header_t *) base;
+    rt->size = size;
+    rt->buffer_size = buffer_size;
+    rt->buffers[0] = (uint8_t *) base + sizeof(rt_header_t);
+    rt->buffers[1] = rt->buffers[0] + buffer_size;
+    rt->changed_trips = NULL;
+    rt->n_changed_trips = 0;
+    rt->max_changed_trips = 0;
+    rt->trip_changed = NULL;
+    rt->trip_slots = NULL;
+    rt->in_sync = false;
+    rt->compacted = false;
+    rt->live_trips = NULL;
+    rt->n_live_trips = 0;
+    rt->live_positions = NULL;
+    rt->trip_messages = NULL;
+    rt->n_messages = 0;
+    rt->trip_timestamps = NULL;
+    rt->feed_timestamp = 0;
+    rt->batch = NULL;
+    rt->batch_capacity = 0;
+}
+
+/* Fill in a new overlay with all trips on time, in both buffers. The memory comes zeroed from the system and the stop
+   updates are left untouched, so their pages are only committed once they are handed out to trips. */
+static void rt_create (tdata_t *td, rt_header_t *header, size_t buffer_size) {
+    header->calendar_start_time = td->calendar_start_time;
+    header->n_routes = td->n_routes;
+    header->n_trips = td->n_trips;
+    header->stop_updates_capacity = RRRR_REALTIME_STOP_UPDATES;
+    for (uint32_t b = 0; b < 2; ++b) {
+        uint32_t *offsets = (uint32_t *) ((uint8_t *) header + sizeof(rt_header_t) + b * buffer_size) + td->n_routes;
+        for (uint32_t t = 0; t < td->n_trips; ++t) offsets[t] = NONE;
+    }
+    __atomic_thread_fence (__ATOMIC_RELEASE);
+    memcpy (header->magic, RT_MAGIC, 8);
+}
+
+/* Point the readers of this process at one version of the overlay. */
+static void rt_use (tdata_t *td, uint32_t version) {
+    rt_buffer_t buffer;
+    rt_buffer (td, version, &buffer);
+    td->trip_delays = buffer.trip_delays;
+    td->stop_update_offsets = buffer.stop_update_offsets;
+    td->stop_updates = buffer.stop_updates;
+    td->realtime_recovery = td->realtime->header->recovery[version % 2];
+}
+
+/* Start out with an overlay for this process alone, as used when applying real-time data from a file. */
+static void tdata_realtime_setup (tdata_t *td) {
+    size_t buffer_size, size = rt_size (td, &buffer_size);
+    td->realtime = (tdata_realtime_t *) malloc (sizeof(tdata_realtime_t));
+    void *base = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    td->route_versions = (uint32_t *) calloc (td->n_routes, sizeof(uint32_t));
+    if ( ! (td->realtime && base != MAP_FAILED && td->route_versions)) die("failed to allocate real-time overlay");
+    rt_create (td, (rt_header_t *) base, buffer_size);
+    rt_init (td->realtime, base, size, buffer_size);
+    td->realtime_generation = 0;
+    rt_use (td, 0);
+}
+
+static void tdata_realtime_release (tdata_t *td) {
+    tdata_realtime_t *rt = td->realtime;
+    if (rt == NULL) return;
+    munmap (rt->header, rt->size);
+    free (rt->changed_trips);
+    free (rt->trip_changed);
+    free (rt->trip_slots);
+    free (rt->live_trips);
+    free (rt->live_positions);
+    free (rt->trip_messages);
+    free (rt->trip_timestamps);
+    free (rt->batch);
+    free (rt);
+    td->realtime = NULL;
+}
+
+bool tdata_realtime_attach (tdata_t *td, const char *name, bool replace) {
+    size_t buffer_size, size = rt_size (td, &buffer_size);
+    int fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    bool created = fd != -1;
+    if ( ! created) fd = shm_open (name, O_RDWR, 0);
+    if (fd == -1) {
+        fprintf (stderr, "could not open real-time overlay %s\n", name);
+        return false;
+    }
+    if (created && ftruncate (fd, size) == -1) {
+        fprintf (stderr, "could not size real-time overlay %s\n", name);
+        close (fd);
+        shm_unlink (name);
+        return false;
+    }
+    /* Another process may be creating the overlay: give it a moment to size and fill it in. */
+    struct stat st;
+    for (int i = 0; ! created && i < 100 && fstat (fd, &st) == 0 && st.st_size == 0; ++i) usleep (10000);
+    bool mismatch = ! created && (fstat (fd, &st) == -1 || (size_t) st.st_size != size);
+    rt_header_t *header = mismatch ? NULL : mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close (fd);
+    if (header == MAP_FAILED) {
+        fprintf (stderr, "could not map real-time overlay %s\n", name);
+        return false;
+    }
+    if (created) {
+        rt_create (td, header, buffer_size);
+    } else if (header != NULL) {
+        for (int i = 0; i < 100 && strncmp (header->magic, RT_MAGIC, 8) != 0; ++i) usleep (10000);
+        __atomic_thread_fence (__ATOMIC_ACQUIRE);
+        if (strncmp (header->magic, RT_MAGIC, 8) != 0 || ! rt_matches (td, header)) {
+            munmap (header, size);
+            mismatch = true;
+        }
+    }
+    if (mismatch) {
+        if ( ! replace) {
+            fprintf (stderr, "real-time overlay %s was made for another timetable\n", name);
+            return false;
+        }
+        shm_unlink (name);
+        return tdata_realtime_attach (td, name, false);
+    }
+    tdata_realtime_release (td);
+    td->realtime = (tdata_realtime_t *) malloc (sizeof(tdata_realtime_t));
+    if (td->realtime == NULL) die("failed to allocate real-time overlay");
+    rt_init (td->realtime, header, size, buffer_size);
+    /* The departure index was built for another overlay: re-index every route on the first snapshot. */
+    for (uint32_t r = 0; r < td->n_routes; ++r) td->route_versions[r] = RT_STALE;
+    td->realtime_generation = RT_STALE;
+    tdata_realtime_snapshot (td);
+    return true;
+}
+
+/* Bring the updates of one trip over from one buffer to the other. */
+static void rt_copy_trip (tdata_t *td, rt_buffer_t *from, rt_buffer_t *to, uint32_t trip_index) {
+    uint32_t route_index = tdata_route_for_trip (td, trip_index);
+    uint32_t offset = from->stop_update_offsets[trip_index];
+    to->trip_delays[trip_index] = from->trip_delays[trip_index];
+    to->stop_update_offsets[trip_index] = offset;
+    if (offset != NONE) memcpy (to->stop_updates + offset, from->stop_updates + offset,
+                                sizeof(stop_update_t) * td->routes[route_index].n_stops);
+    to->route_versions[route_index] = from->route_versions[route_index];
+}
+
+uint32_t tdata_realtime_begin (tdata_t *td) {
+    tdata_realtime_t *rt = td->realtime;
+    uint32_t current = rt->header->generation;
+    uint32_t next = current + 1;
+    rt_buffer_t from, to;
+    rt_buffer (td, current, &from);
+    rt_buffer (td, next, &to);
+    /* Announce the version before overwriting the buffer that readers of the version before the current one use. */
+    __atomic_store_n (&rt->header->writing, next, __ATOMIC_RELAXED);
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+    if ( ! rt->in_sync) {
+        memcpy (rt->buffers[next % 2], rt->buffers[current % 2], rt->buffer_size);
+        rt->trip_changed = (uint32_t *) calloc (td->n_trips, sizeof(uint32_t));
+        rt->trip_slots = (uint32_t *) malloc (sizeof(uint32_t) * td->n_trips);
+        rt->live_trips = (uint32_t *) malloc (sizeof(uint32_t) * td->n_trips);
+        rt->live_positions = (uint32_t *) malloc (sizeof(uint32_t) * td->n_trips);
+        rt->trip_messages = (uint32_t *) calloc (td->n_trips, sizeof(uint32_t));
+        rt->trip_timestamps = (uint64_t *) calloc (td->n_trips, sizeof(uint64_t));
+        if ( ! (rt->trip_changed && rt->trip_slots && rt->live_trips && rt->live_positions &&
+                rt->trip_messages && rt->trip_timestamps)) die("failed to allocate real-time changes");
+        memcpy (rt->trip_slots, from.stop_update_offsets, sizeof(uint32_t) * td->n_trips);
+        /* The one pass over all trips, finding those an earlier updater left delayed. */
+        for (uint32_t t = 0; t < td->n_trips; ++t) {
+            if (from.trip_delays[t] == 0) {
+                rt->live_positions[t] = NONE;
+            } else {
+                rt->live_positions[t] = rt->n_live_trips;
+                rt->live_trips[rt->n_live_trips++] = t;
+            }
+        }
+        rt->in_sync = true;
+    } else if (rt->compacted) {
+        memcpy (rt->buffers[next % 2], rt->buffers[current % 2], rt->buffer_size);
+        rt->compacted = false;
+    } else {
+        /* The buffer holds the version before the current one, which only differs in the trips changed since. */
+        for (uint32_t i = 0; i < rt->n_changed_trips; ++i) rt_copy_trip (td, &from, &to, rt->changed_trips[i]);
+    }
+    rt->header->recovery[next % 2] = rt->header->recovery[current % 2];
+    rt->n_changed_trips = 0;
+    return next;
+}
+
+/* Note a change to a trip in the version being prepared. */
+static void rt_changed (tdata_t *td, rt_buffer_t *buffer, uint32_t version, uint32_t trip_index) {
+    tdata_realtime_t *rt = td->realtime;
+    buffer->route_versions[tdata_route_for_trip (td, trip_index)] = version;
+    uint32_t position = rt->live_positions[trip_index];
+    if (buffer->trip_delays[trip_index] == 0 && position != NONE) {
+        uint32_t last = rt->live_trips[--rt->n_live_trips];
+        rt->live_trips[position] = last;
+        rt->live_positions[last] = position;
+        rt->live_positions[trip_index] = NONE;
+    } else if (buffer->trip_delays[trip_index] != 0 && position == NONE) {
+        rt->live_positions[trip_index] = rt->n_live_trips;
+        rt->live_trips[rt->n_live_trips++] = trip_index;
+    }
+    if (rt->trip_changed[trip_index] == version) return;
+    rt->trip_changed[trip_index] = version;
+    if (rt->n_changed_trips == rt->max_changed_trips) {
+        rt->max_changed_trips = rt->max_changed_trips ? 2 * rt->max_changed_trips : 1024;
+        rt->changed_trips = (uint32_t *) realloc (rt->changed_trips, sizeof(uint32_t) * rt->max_changed_trips);
+        if (rt->changed_trips == NULL) die("failed to allocate real-time changes");
+    }
+    rt->changed_trips[rt->n_changed_trips++] = trip_index;
+}
+
+bool tdata_realtime_set_delay (tdata_t *td, uint32_t trip_index, int16_t delay) {
+    uint32_t next = td->realtime->header->writing;
+    rt_buffer_t buffer;
+    rt_buffer (td, next, &buffer);
+    if (trip_index >= td->n_trips || buffer.trip_delays[trip_index] == delay) return false;
+    buffer.trip_delays[trip_index] = delay;
+    buffer.stop_update_offsets[trip_index] = NONE;
+    rt_changed (td, &buffer, next, trip_index);
+    return true;
+}
+
+static int compare_slots (const void *a, const void *b) {
+    uint64_t x = *(uint64_t *) a, y = *(uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* Pack the stop updates of the trips that have delays per stop in the version being prepared at the start of the
+   overlay, in the order they were handed out. The trips that fell back to a single delay give up their slots. Readers
+   of the current version use the other buffer, which keeps its layout until the next version copies this one over. */
+static void rt_compact (tdata_t *td, rt_buffer_t *buffer) {
+    tdata_realtime_t *rt = td->realtime;
+    /* Each slot as its offset in the high and its trip in the low half, to sort them by offset. */
+    uint64_t *slots = (uint64_t *) malloc (sizeof(uint64_t) * rt->n_live_trips + 1);
+    if (slots == NULL) die("failed to allocate real-time changes");
+    uint32_t n_slots = 0;
+    for (uint32_t i = 0; i < rt->n_live_trips; ++i) {
+        uint32_t trip_index = rt->live_trips[i];
+        if (buffer->trip_delays[trip_index] == STOP_UPDATES)
+            slots[n_slots++] = (uint64_t) buffer->stop_update_offsets[trip_index] << 32 | trip_index;
+    }
+    qsort (slots, n_slots, sizeof(uint64_t), compare_slots);
+    memset (rt->trip_slots, 0xff, sizeof(uint32_t) * td->n_trips);
+    uint32_t n_stop_updates = 0;
+    for (uint32_t i = 0; i < n_slots; ++i) {
+        uint32_t trip_index = (uint32_t) slots[i], offset = (uint32_t) (slots[i] >> 32);
+        uint32_t n_stops = td->routes[tdata_route_for_trip (td, trip_index)].n_stops;
+        memmove (buffer->stop_updates + n_stop_updates, buffer->stop_updates + offset, sizeof(stop_update_t) * n_stops);
+        buffer->stop_update_offsets[trip_index] = rt->trip_slots[trip_index] = n_stop_updates;
+        n_stop_updates += n_stops;
+    }
+    free (slots);
+    rt->header->n_stop_updates = n_stop_updates;
+    rt->compacted = true;
+}
+
+/* Make sure a trip owns a slot of stop updates in the version being prepared, compacting the overlay when it is full.
+   Returns false when there is no room for the trip even then. */
+static bool rt_reserve_slot (tdata_t *td, uint32_t trip_index) {
+    tdata_realtime_t *rt = td->realtime;
+    if (rt->trip_slots[trip_index] != NONE) return true;
+    uint32_t n_stops = td->routes[tdata_route_for_trip (td, trip_index)].n_stops;
+    if (rt->header->n_stop_updates + n_stops > rt->header->stop_updates_capacity) {
+        rt_buffer_t buffer;
+        rt_buffer (td, rt->header->writing, &buffer);
+        rt_compact (td, &buffer);
+        if (rt->header->n_stop_updates + n_stops > rt->header->stop_updates_capacity) return false;
+    }
+    rt->trip_slots[trip_index] = rt->header->n_stop_updates;
+    rt->header->n_stop_updates += n_stops;
+    return true;
+}
+
+bool tdata_realtime_set_stop_update (tdata_t *td, uint32_t trip_index, uint32_t route_stop, int16_t arrival, int16_t departure) {
+    tdata_realtime_t *rt = td->realtime;
+    uint32_t next = rt->header->writing;
+    rt_buffer_t buffer;
+    rt_buffer (td, next, &buffer);
+    if (trip_index >= td->n_trips) return false;
+    uint32_t n_stops = td->routes[tdata_route_for_trip (td, trip_index)].n_stops;
+    if (route_stop >= n_stops) return false;
+    if (buffer.trip_delays[trip_index] != STOP_UPDATES) {
+        /* Hand out a slot the first time the trip has delays per stop. */
+        if ( ! rt_reserve_slot (td, trip_index)) {
+            fprintf (stderr, "real-time overlay is full, ignoring delays per stop.\n");
+            return false;
+        }
+        int16_t delay = buffer.trip_delays[trip_index] == CANCELED ? 0 : buffer.trip_delays[trip_index];
+        stop_update_t *updates = buffer.stop_updates + rt->trip_slots[trip_index];
+        for (uint32_t s = 0; s < n_stops; ++s) updates[s] = (stop_update_t) { delay, delay };
+        buffer.trip_delays[trip_index] = STOP_UPDATES;
+        buffer.stop_update_offsets[trip_index] = rt->trip_slots[trip_index];
+    } else {
+        stop_update_t *update = buffer.stop_updates + buffer.stop_update_offsets[trip_index] + route_stop;
+        if (update->arrival == arrival && update->departure == departure) return false;
+    }
+    buffer.stop_updates[buffer.stop_update_offsets[trip_index] + route_stop] = (stop_update_t) { arrival, departure };
+    rt_changed (td, &buffer, next, trip_index);
+    return true;
+}
+
+/* The most a trip with delays per stop catches up on its delay between any two of the stops it does not skip. */
+static rtime_t rt_trip_recovery (stop_update_t *updates, uint32_t n_stops) {
+    int32_t most = INT16_MIN, recovery = 0;
+    for (uint32_t s = 0; s < n_stops; ++s) {
+        if (updates[s].arrival == CANCELED) continue;
+        int16_t delays[2] = { updates[s].arrival, updates[s].departure };
+        for (int i = 0; i < 2; ++i) {
+            if (delays[i] > most) most = delays[i];
+            if (most - delays[i] > recovery) recovery = most - delays[i];
+        }
+    }
+    return recovery;
+}
+
+void tdata_realtime_publish (tdata_t *td) {
+    tdata_realtime_t *rt = td->realtime;
+    rt_header_t *header = rt->header;
+    /* Without changes the prepared buffer is left as it was, but readers of it may already have given up on it. */
+    if (rt->n_changed_trips == 0) return;
+    /* Lower bounds on travel times hold for rides that keep their delay. Only ever growing the recovery keeps this
+       cheap; it starts over when the overlay is cleared. */
+    rt_buffer_t buffer;
+    rt_buffer (td, header->writing, &buffer);
+    for (uint32_t i = 0; i < rt->n_changed_trips; ++i) {
+        uint32_t trip_index = rt->changed_trips[i];
+        if (buffer.trip_delays[trip_index] != STOP_UPDATES) continue;
+        rtime_t recovery = rt_trip_recovery (buffer.stop_updates + buffer.stop_update_offsets[trip_index],
+                                             td->routes[tdata_route_for_trip (td, trip_index)].n_stops);
+        if (recovery > header->recovery[header->writing % 2]) header->recovery[header->writing % 2] = recovery;
+    }
+    __atomic_store_n (&header->generation, header->writing, __ATOMIC_RELEASE);
+    tdata_realtime_snapshot (td);
+}
+
+/* Put the trips that are not on time back on time, unless the given message named them. Putting a trip on time takes
+   it out of the live trips, moving the last one into its place, so the list is walked from the end. */
+static void rt_reset_unnamed (tdata_t *td, uint32_t message) {
+    tdata_realtime_t *rt = td->realtime;
+    for (uint32_t i = rt->n_live_trips; i-- > 0; ) {
+        uint32_t trip_index = rt->live_trips[i];
+        if (rt->trip_messages[trip_index] != message) tdata_realtime_set_delay (td, trip_index, 0);
+    }
+}
+
+/* The deltas that give a trip the delays it has in the given buffer, put at the end of the batch. */
+static void rt_add_deltas (tdata_t *td, rt_buffer_t *buffer, uint32_t trip_index) {
+    tdata_realtime_t *rt = td->realtime;
+    int16_t delay = buffer->trip_delays[trip_index];
+    uint32_t n_stops = delay == STOP_UPDATES ? td->routes[tdata_route_for_trip (td, trip_index)].n_stops : 1;
+    size_t size = sizeof(tdata_realtime_batch_t) + sizeof(tdata_realtime_delta_t) * (rt->batch->n_deltas + n_stops);
+    if (size > rt->batch_capacity) {
+        rt->batch_capacity = 2 * size;
+        rt->batch = (tdata_realtime_batch_t *) realloc (rt->batch, rt->batch_capacity);
+        if (rt->batch == NULL) die("failed to allocate real-time deltas");
+    }
+    tdata_realtime_delta_t *deltas = (tdata_realtime_delta_t *) (rt->batch + 1) + rt->batch->n_deltas;
+    rt->batch->n_deltas += n_stops;
+    if (delay != STOP_UPDATES) {
+        deltas[0] = (tdata_realtime_delta_t) { trip_index, ALL_STOPS, delay, delay, 0 };
+        return;
+    }
+    stop_update_t *updates = buffer->stop_updates + buffer->stop_update_offsets[trip_index];
+    for (uint32_t s = 0; s < n_stops; ++s)
+        deltas[s] = (tdata_realtime_delta_t) { trip_index, s, updates[s].arrival, updates[s].departure, 0 };
+}
+
+tdata_realtime_batch_t *tdata_realtime_deltas (tdata_t *td, bool full, size_t *size) {
+    tdata_realtime_t *rt = td->realtime;
+    if (rt->batch == NULL) {
+        rt->batch_capacity = sizeof(tdata_realtime_batch_t) + sizeof(tdata_realtime_delta_t) * 1024;
+        rt->batch = (tdata_realtime_batch_t *) malloc (rt->batch_capacity);
+        if (rt->batch == NULL) die("failed to allocate real-time deltas");
+    }
+    uint32_t version = rt->header->generation;
+    rt_buffer_t buffer;
+    rt_buffer (td, version, &buffer);
+    rt->batch->version = version;
+    rt->batch->n_deltas = 0;
+    rt->batch->full = full;
+    /* The trips changed last are those of the current version until the next one is begun. */
+    uint32_t *trips = full ? rt->live_trips : rt->changed_trips;
+    uint32_t n_trips = full ? rt->n_live_trips : rt->n_changed_trips;
+    for (uint32_t i = 0; trips && i < n_trips; ++i) rt_add_deltas (td, &buffer, trips[i]);
+    *size = sizeof(tdata_realtime_batch_t) + sizeof(tdata_realtime_delta_t) * rt->batch->n_deltas;
+    return rt->batch;
+}
+
+bool tdata_realtime_apply_deltas (tdata_t *td, tdata_realtime_batch_t *batch, size_t size) {
+    if (size < sizeof(tdata_realtime_batch_t) ||
+        size != sizeof(tdata_realtime_batch_t) + sizeof(tdata_realtime_delta_t) * (size_t) batch->n_deltas) return false;
+    tdata_realtime_delta_t *deltas = (tdata_realtime_delta_t *) (batch + 1);
+    for (uint32_t i = 0; i < batch->n_deltas; ++i) if (deltas[i].trip_index >= td->n_trips) return false;
+    tdata_realtime_t *rt = td->realtime;
+    tdata_realtime_begin (td);
+    uint32_t message = ++rt->n_messages;
+    for (uint32_t i = 0; i < batch->n_deltas; ++i) {
+        tdata_realtime_delta_t *delta = deltas + i;
+        rt->trip_messages[delta->trip_index] = message;
+        if (delta->route_stop == ALL_STOPS) tdata_realtime_set_delay (td, delta->trip_index, delta->arrival);
+        else tdata_realtime_set_stop_update (td, delta->trip_index, delta->route_stop, delta->arrival, delta->departure);
+    }
+    if (batch->full) rt_reset_unnamed (td, message);
+    tdata_realtime_publish (td);
+    return true;
+}
+
+uint32_t tdata_realtime_snapshot (tdata_t *td) {
+    tdata_realtime_t *rt = td->realtime;
+    while (true) {
+        uint32_t version = __atomic_load_n (&rt->header->generation, __ATOMIC_ACQUIRE);
+        if (version == td->realtime_generation) return version;
+        rt_buffer_t buffer;
+        rt_buffer (td, version, &buffer);
+        rt_use (td, version);
+        for (uint32_t r = 0; r < td->n_routes; ++r) {
+            uint32_t route_version = buffer.route_versions[r];
+            if (route_version == td->route_versions[r]) continue;
+            tdata_index_route (td, r);
+            td->route_versions[r] = route_version;
+        }
+        if (tdata_realtime_consistent (td, version)) {
+            td->realtime_generation = version;
+            return version;
+        }
+        /* The updater overtook us while re-indexing: nothing read can be trusted. */
+        for (uint32_t r = 0; r < td->n_routes; ++r) td->route_versions[r] = RT_STALE;
+    }
+}
+
+bool tdata_realtime_consistent (tdata_t *td, uint32_t version) {
+    __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    return __atomic_load_n (&td->realtime->header->writing, __ATOMIC_RELAXED) - version < 2;
+}
+
 /* Map an input file into memory and reconstruct pointers to its contents. */
 void tdata_load(char *filename, tdata_t *td) {
 
-    int fd = open(filename, O_RDWR);
+    int fd = open(filename, O_RDONLY);
     if (fd == -1)
         die("could not find input file");
 
@@ -287,14 +833,17 @@ void tdata_load(char *filename, tdata_t *td) {
     if (stat(filename, &st) == -1)
         die("could not stat input file");
 
-    td->base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    /* The timetable is never written to: real-time data goes into the overlay. */
+    td->base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
     td->size = st.st_size;
     if (td->base == (void*)(-1))
         die("could not map input file");
+    close(fd);
 
     void *b = td->base;
     tdata_header_t *header = b;
-    if( strncmp("TTABLEV2", header->version_string, 8) )
+    bool v3 = strncmp("TTABLEV3", header->version_string, 8) == 0;
+    if( ! v3 && strncmp("TTABLEV2", header->version_string, 8) )
         die("the input file does not appear to be a timetable or is of the wrong version");
     td->calendar_start_time = header->calendar_start_time;
     td->dst_active = header->dst_active;
@@ -338,7 +887,41 @@ void tdata_load(char *filename, tdata_t *td) {
     td->trip_active = (uint32_t*) (b + header->loc_trip_active);
     td->route_active = (uint32_t*) (b + header->loc_route_active);
     td->trip_attributes = (uint8_t*) (b + header->loc_trip_attributes);
+    td->route_block_offsets = (v3 && header->loc_route_blocks) ? (uint32_t*) (b + header->loc_route_blocks) : NULL;
+    td->n_lb_clusters = 0;
+    td->lb_walk_speed = 0;
+    td->lb_cluster_for_stop = NULL;
+    td->lb_times = NULL;
+    if (v3 && header->loc_lower_bounds) {
+        /* uint32 n_clusters, float walk speed, uint16 clusters[n_stops] padded to 4 bytes, rtime_t times[n][n] */
+        td->n_lb_clusters = *((uint32_t *) (b + header->loc_lower_bounds));
+        td->lb_walk_speed = *((float *) (b + header->loc_lower_bounds + sizeof(uint32_t)));
+        td->lb_cluster_for_stop = (uint16_t *) (b + header->loc_lower_bounds + 2 * sizeof(uint32_t));
+        td->lb_times = (rtime_t *) (td->lb_cluster_for_stop + ((td->n_stops + 1) & ~1));
+    }
+    td->tt_walk_speed = 0;
+    td->tt_route_events = NULL;
+    td->tt_event_offsets = NULL;
+    td->trip_transfers = NULL;
+    if (v3 && header->loc_trip_transfers) {
+        /* float walk speed, uint32 route events[n_routes + 1], uint32 event offsets[n_events + 1], the transfers */
+        td->tt_walk_speed = *((float *) (b + header->loc_trip_transfers));
+        td->tt_route_events = (uint32_t *) (b + header->loc_trip_transfers + sizeof(float));
+        td->tt_event_offsets = td->tt_route_events + td->n_routes + 1;
+        td->trip_transfers = (trip_transfer_t *) (td->tt_event_offsets + td->tt_route_events[td->n_routes] + 1);
+    }
+    td->n_connections = 0;
+    td->connections = NULL;
+    if (v3 && header->loc_connections) {
+        /* uint32 n_connections, the connections */
+        td->n_connections = *((uint32_t *) (b + header->loc_connections));
+        td->connections = (connection_t *) (b + header->loc_connections + sizeof(uint32_t));
+    }
+    /* uint16 route stop of each entry in stop_routes, padded to 4 bytes */
+    td->stop_route_positions = (v3 && header->loc_stop_route_positions) ? (uint16_t *) (b + header->loc_stop_route_positions) : NULL;
     td->alerts = NULL;
+    td->alerts_generation = 0;
+    td->alerts_readers[0] = td->alerts_readers[1] = 0;
 
     // This should be migrated to n_agencies from the timetable generation in my humble option.
     td->n_agencies = 0;
@@ -349,10 +932,20 @@ void tdata_load(char *filename, tdata_t *td) {
 
     // This is probably a bit slow and is not strictly necessary, but does page in all the timetable entries.
     tdata_check_coherent(td);
+    tdata_realtime_setup(td);
+    tdata_index_departures(td);
     D tdata_dump(td);
 }
 
+static void tdata_alerts_free (tdata_alerts_t *store);
+
 void tdata_close(tdata_t *td) {
+    tdata_realtime_release(td);
+    tdata_alerts_free(td->alerts);
+    free(td->route_versions);
+    free(td->departure_index);
+    free(td->n_fifo_trips);
+    free(td->n_delayed_trips);
     munmap(td->base, td->size);
 }
 
@@ -374,6 +967,11 @@ inline uint32_t tdata_routes_for_stop(tdata_t *td, uint32_t stop, uint32_t **rou
     return stop1.stop_routes_offset - stop0.stop_routes_offset;
 }
 
+inline uint16_t *tdata_route_positions_for_stop(tdata_t *td, uint32_t stop) {
+    if (td->stop_route_positions == NULL) return NULL;
+    return td->stop_route_positions + td->stops[stop].stop_routes_offset;
+}
+
 // TODO used only in dumping routes; trip_index is not used in the expression?
 inline stoptime_t *tdata_timedemand_type(tdata_t *td, uint32_t route_index, uint32_t trip_index) {
     return td->stop_times + td->trips[td->routes[route_index].trip_ids_offset + trip_index].stop_times_offset;
@@ -387,10 +985,150 @@ inline uint8_t *tdata_trip_attributes_for_route (tdata_t *td, uint32_t route_ind
     return td->trip_attributes + td->routes[route_index].trip_ids_offset;
 }
 
-/* Signed delay of the specified trip, in seconds. */
+inline rtime_t tdata_lower_bound (tdata_t *td, uint32_t from_stop, uint32_t to_stop) {
+    if (td->n_lb_clusters == 0) return 0;
+    return td->lb_times[td->lb_cluster_for_stop[to_stop] * td->n_lb_clusters + td->lb_cluster_for_stop[from_stop]];
+}
+
+inline uint32_t tdata_trip_transfers (tdata_t *td, uint32_t route_index, uint32_t trip_index, uint32_t route_stop,
+                                      trip_transfer_t **transfers_ret) {
+    uint32_t event = td->tt_route_events[route_index] + trip_index * td->routes[route_index].n_stops + route_stop;
+    *transfers_ret = td->trip_transfers + td->tt_event_offsets[event];
+    return td->tt_event_offsets[event + 1] - td->tt_event_offsets[event];
+}
+
+/* Locate the parts of a route block, which must match the layout written by timetable.py. */
+inline bool tdata_route_block (tdata_t *td, uint32_t route_index, route_block_t *block) {
+    if (td->route_block_offsets == NULL) return false;
+    route_t route = td->routes[route_index];
+    uint32_t stride = ROUTE_BLOCK_STRIDE(route.n_trips);
+    uint8_t *p = (uint8_t *) td->base + td->route_block_offsets[route_index];
+    block->stops = (uint32_t *) p;
+    p += sizeof(uint32_t) * route.n_stops;
+    block->stop_attributes = p;
+    p += route.n_stops;
+    p = (uint8_t *) (((uintptr_t) p + 3) & ~(uintptr_t) 3);
+    block->trip_attributes = p;
+    p += stride;
+    block->trip_masks = (calendar_t *) p;
+    p += sizeof(calendar_t) * stride;
+    p = (uint8_t *) (((uintptr_t) p + 31) & ~(uintptr_t) 31);
+    block->departures = (rtime_t *) p;
+    block->arrivals = block->departures + route.n_stops * stride;
+    block->stride = stride;
+    return true;
+}
+
+inline int16_t tdata_stop_delay (tdata_t *td, uint32_t trip_index, uint32_t route_stop, bool arrive) {
+    int16_t delay = td->trip_delays[trip_index];
+    if (delay != STOP_UPDATES) return delay;
+    stop_update_t *update = td->stop_updates + td->stop_update_offsets[trip_index] + route_stop;
+    return arrive ? update->arrival : update->departure;
+}
+
+/* Signed delay of the specified trip, in seconds. For trips with delays per stop, the delay at their first stop. */
 inline float tdata_delay_min (tdata_t *td, uint32_t route_index, uint32_t trip_index) {
+    int16_t delay = tdata_stop_delay (td, td->routes[route_index].trip_ids_offset + trip_index, 0, false);
+    return delay == CANCELED ? 0 : RTIME_TO_SEC_SIGNED(delay) / 60.0;
+}
+
+/* True if a trip skips any stop of its route (a global trip index). */
+static bool tdata_trip_skips (tdata_t *td, uint16_t n_stops, uint32_t trip_index) {
+    if (td->trip_delays[trip_index] != STOP_UPDATES) return false;
+    stop_update_t *updates = td->stop_updates + td->stop_update_offsets[trip_index];
+    for (uint16_t s = 0; s < n_stops; ++s) if (updates[s].arrival == CANCELED) return true;
+    return false;
+}
+
+/* True if trip a never arrives or departs later than trip b at any stop of the route, both in the static schedule
+   and with real-time delays applied. This is what allows binary searching trips that follow each other. */
+static bool tdata_trip_precedes (tdata_t *td, uint16_t n_stops, trip_t *a, trip_t *b) {
+    uint32_t index_a = a - td->trips, index_b = b - td->trips;
+    int32_t delay_a = td->trip_delays[index_a];
+    int32_t delay_b = td->trip_delays[index_b];
+    bool per_stop = delay_a == STOP_UPDATES || delay_b == STOP_UPDATES;
+    if (a->begin_time > b->begin_time) return false;
+    if ( ! per_stop) {
+        if (a->begin_time + delay_a > b->begin_time + delay_b) return false;
+        /* Trips sharing a time demand type cannot overtake each other. */
+        if (a->stop_times_offset == b->stop_times_offset) return true;
+    }
+    stoptime_t *st_a = td->stop_times + a->stop_times_offset;
+    stoptime_t *st_b = td->stop_times + b->stop_times_offset;
+    for (uint16_t s = 0; s < n_stops; ++s) {
+        int32_t arr_a = a->begin_time + st_a[s].arrival,   arr_b = b->begin_time + st_b[s].arrival;
+        int32_t dep_a = a->begin_time + st_a[s].departure, dep_b = b->begin_time + st_b[s].departure;
+        if (arr_a > arr_b || dep_a > dep_b) return false;
+        if (per_stop) {
+            if (arr_a + tdata_stop_delay (td, index_a, s, true)  > arr_b + tdata_stop_delay (td, index_b, s, true) ||
+                dep_a + tdata_stop_delay (td, index_a, s, false) > dep_b + tdata_stop_delay (td, index_b, s, false)) return false;
+        } else if (arr_a + delay_a > arr_b + delay_b || dep_a + delay_a > dep_b + delay_b) return false;
+    }
+    return true;
+}
+
+/* Sort the trips of a route by their first departure, then greedily build the longest FIFO chain in that order.
+   Trips that would break the chain (including canceled ones and those skipping a stop) are moved to the exception
+   list behind it. */
+void tdata_index_route (tdata_t *td, uint32_t route_index) {
+    route_t route = td->routes[route_index];
     trip_t *trips = tdata_trips_for_route(td, route_index);
-    return RTIME_TO_SEC_SIGNED(trips[trip_index].realtime_delay) / 60.0;
+    int16_t *delays = td->trip_delays + route.trip_ids_offset;
+    uint16_t *order = td->departure_index + route.trip_ids_offset;
+    /* Trips are usually already sorted in the timetable, making this insertion sort linear. */
+    for (uint16_t t = 0; t < route.n_trips; ++t) {
+        rtime_t first = trips[t].begin_time + td->stop_times[trips[t].stop_times_offset].departure;
+        uint16_t i = t;
+        while (i > 0) {
+            trip_t *prev = trips + order[i - 1];
+            if (prev->begin_time + td->stop_times[prev->stop_times_offset].departure <= first) break;
+            order[i] = order[i - 1];
+            --i;
+        }
+        order[i] = t;
+    }
+    uint16_t exceptions[route.n_trips];
+    uint16_t n_fifo = 0, n_exceptions = 0, n_delayed = 0;
+    trip_t *last = NULL;
+    for (uint16_t i = 0; i < route.n_trips; ++i) {
+        trip_t *trip = trips + order[i];
+        if (delays[order[i]] != 0) ++n_delayed;
+        if (delays[order[i]] != CANCELED && ! tdata_trip_skips (td, route.n_stops, route.trip_ids_offset + order[i]) &&
+            (last == NULL || tdata_trip_precedes (td, route.n_stops, last, trip))) {
+            order[n_fifo++] = order[i];
+            last = trip;
+        } else {
+            exceptions[n_exceptions++] = order[i];
+        }
+    }
+    memcpy (order + n_fifo, exceptions, n_exceptions * sizeof(uint16_t));
+    td->n_fifo_trips[route_index] = n_fifo;
+    td->n_delayed_trips[route_index] = n_delayed;
+}
+
+void tdata_index_departures (tdata_t *td) {
+    td->departure_index = (uint16_t *) malloc (sizeof(uint16_t) * td->n_trips);
+    td->n_fifo_trips = (uint16_t *) malloc (sizeof(uint16_t) * td->n_routes);
+    td->n_delayed_trips = (uint16_t *) malloc (sizeof(uint16_t) * td->n_routes);
+    if ( ! (td->departure_index && td->n_fifo_trips && td->n_delayed_trips))
+        die("failed to allocate departure index");
+    uint32_t n_exceptions = 0;
+    for (uint32_t r = 0; r < td->n_routes; ++r) {
+        tdata_index_route (td, r);
+        n_exceptions += td->routes[r].n_trips - td->n_fifo_trips[r];
+    }
+    I fprintf (stderr, "departure index built, %u trips overtake others.\n", n_exceptions);
+}
+
+/* Routes own contiguous ranges of trips, in order. */
+uint32_t tdata_route_for_trip (tdata_t *td, uint32_t trip_index) {
+    uint32_t lo = 0, hi = td->n_routes;
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (td->routes[mid].trip_ids_offset <= trip_index) lo = mid;
+        else hi = mid;
+    }
+    return lo;
 }
 
 void tdata_dump_route(tdata_t *td, uint32_t route_idx, uint32_t trip_idx) {
@@ -460,11 +1198,162 @@ void tdata_dump(tdata_t *td) {
 #endif
 }
 
+/* Delays beyond two hours are taken to be errors in the feed. */
+#define RT_MAX_DELAY (60 * 120)
+
+/* The delay in seconds of an arrival or departure that was scheduled at the given epoch time. */
+static bool rt_event_delay (TransitRealtime__TripUpdate__StopTimeEvent *event, time_t scheduled, int32_t *delay_sec) {
+    if (event == NULL) return false;
+    if (event->has_delay) *delay_sec = event->delay;
+    else if (event->has_time) *delay_sec = event->time - scheduled;
+    else return false;
+    if (abs(*delay_sec) > RT_MAX_DELAY) {
+        I fprintf (stderr, "    filtering out extreme delay of %d sec.\n", *delay_sec);
+        *delay_sec = 0;
+    }
+    return true;
+}
+
+/* The epoch time of the midnight that begins the given day of the calendar, which may lie outside the calendar. */
+static time_t rt_calendar_day (tdata_t *tdata, int64_t day) {
+    return (time_t) ((int64_t) tdata->calendar_start_time + day * SEC_IN_ONE_DAY);
+}
+
+/* The day of the calendar an epoch time falls on, counting back from its start for times before it. */
+static int64_t rt_day_of (tdata_t *tdata, time_t time) {
+    int64_t since_start = (int64_t) time - (int64_t) tdata->calendar_start_time;
+    return since_start >= 0 ? since_start / SEC_IN_ONE_DAY : -((-since_start + SEC_IN_ONE_DAY - 1) / SEC_IN_ONE_DAY);
+}
+
+/* The midnight that the scheduled times of a trip update count from, against which stop time events given as epoch
+   times are measured. That is the start date of the trip when the feed gives one. Otherwise it is the day before, of
+   or after the given time on which the first such event is closest to the schedule, as trips run past midnight and
+   feeds are published after it. */
+static time_t rt_service_day (tdata_t *tdata, RadixTree *stopid_index, uint32_t trip_index,
+                              TransitRealtime__TripUpdate *trip_update, time_t now) {
+    TransitRealtime__TripDescriptor *descriptor = trip_update->trip;
+    if (descriptor->start_date != NULL) {
+        struct tm ltm;
+        memset (&ltm, 0, sizeof(struct tm));
+        if (strptime (descriptor->start_date, "%Y%m%d", &ltm) != NULL) {
+            /* Noon keeps daylight saving time from moving the date. */
+            ltm.tm_hour = 12;
+            ltm.tm_isdst = -1;
+            return rt_calendar_day (tdata, rt_day_of (tdata, mktime (&ltm)));
+        }
+        I fprintf (stderr, "    start date %s is not in YYYYMMDD format.\n", descriptor->start_date);
+    }
+    int64_t today = rt_day_of (tdata, now);
+    uint32_t route_index = tdata_route_for_trip (tdata, trip_index);
+    route_t *route = tdata->routes + route_index;
+    uint32_t *route_stops = tdata_stops_for_route (tdata, route_index);
+    trip_t *trip = tdata->trips + trip_index;
+    stoptime_t *stop_times = tdata->stop_times + trip->stop_times_offset;
+    for (size_t u = 0; u < trip_update->n_stop_time_update; ++u) {
+        TransitRealtime__TripUpdate__StopTimeUpdate *update = trip_update->stop_time_update[u];
+        if (update->stop_id == NULL) continue;
+        uint32_t stop_index = rxt_find (stopid_index, update->stop_id);
+        uint32_t s = 0;
+        while (s < route->n_stops && route_stops[s] != stop_index) ++s;
+        if (stop_index == RADIX_TREE_NONE || s == route->n_stops) continue;
+        TransitRealtime__TripUpdate__StopTimeEvent *event = update->arrival;
+        rtime_t scheduled = stop_times[s].arrival;
+        if (event == NULL || ! event->has_time) {
+            event = update->departure;
+            scheduled = stop_times[s].departure;
+        }
+        if (event == NULL || ! event->has_time) continue;
+        int64_t best_day = today, best_delay = INT64_MAX;
+        for (int64_t day = today - 1; day <= today + 1; ++day) {
+            int64_t delay = llabs (event->time - ((int64_t) rt_calendar_day (tdata, day) + RTIME_TO_SEC(trip->begin_time + scheduled)));
+            if (delay < best_delay) {
+                best_day = day;
+                best_delay = delay;
+            }
+        }
+        return rt_calendar_day (tdata, best_day);
+    }
+    return rt_calendar_day (tdata, today);
+}
+
+/* Apply the stop time updates of a TripUpdate to a trip. Each update holds for the stops after it until the next one,
+   as in the GTFS-RT specification, and the first one also for the stops before it. A trip that turns out to have the
+   same delay at every stop gets a single delay rather than delays per stop. */
+static void rt_apply_stop_time_updates (tdata_t *tdata, RadixTree *stopid_index, uint32_t trip_index,
+                                        TransitRealtime__TripUpdate *trip_update, time_t service_day) {
+    uint32_t route_index = tdata_route_for_trip (tdata, trip_index);
+    route_t *route = tdata->routes + route_index;
+    uint32_t *route_stops = tdata_stops_for_route (tdata, route_index);
+    trip_t *trip = tdata->trips + trip_index;
+    stoptime_t *stop_times = tdata->stop_times + trip->stop_times_offset;
+    /* Two passes over the updates: one to see whether the trip can keep a single delay, one to apply them. */
+    for (int pass = 0; pass < 2; ++pass) {
+        bool uniform = true, first = true;
+        int16_t delay = 0, stop_delay = 0;
+        uint32_t route_stop = 0;
+        for (size_t u = 0; u < trip_update->n_stop_time_update; ++u) {
+            TransitRealtime__TripUpdate__StopTimeUpdate *update = trip_update->stop_time_update[u];
+            if (update->stop_id == NULL) {
+                if (pass == 0) I fprintf (stderr, "    stop time update without a stop id.\n");
+                continue;
+            }
+            uint32_t stop_index = rxt_find (stopid_index, update->stop_id);
+            uint32_t s = route_stop;
+            while (s < route->n_stops && route_stops[s] != stop_index) ++s;
+            if (stop_index == RADIX_TREE_NONE || s == route->n_stops) {
+                if (pass == 0) I fprintf (stderr, "    stop %s is not on the remaining part of the trip.\n", update->stop_id);
+                continue;
+            }
+            int16_t arrival = CANCELED, departure = CANCELED;
+            if ( ! update->has_schedule_relationship || update->schedule_relationship ==
+                 TRANSIT_REALTIME__TRIP_UPDATE__STOP_TIME_UPDATE__SCHEDULE_RELATIONSHIP__SCHEDULED) {
+                int32_t arrival_sec, departure_sec;
+                bool has_arrival = rt_event_delay (update->arrival, service_day +
+                                   RTIME_TO_SEC(trip->begin_time + stop_times[s].arrival), &arrival_sec);
+                bool has_departure = rt_event_delay (update->departure, service_day +
+                                     RTIME_TO_SEC(trip->begin_time + stop_times[s].departure), &departure_sec);
+                if ( ! has_arrival && ! has_departure) continue;
+                arrival = SEC_TO_RTIME(has_arrival ? arrival_sec : departure_sec);
+                departure = SEC_TO_RTIME(has_departure ? departure_sec : arrival_sec);
+            } else if (update->schedule_relationship ==
+                       TRANSIT_REALTIME__TRIP_UPDATE__STOP_TIME_UPDATE__SCHEDULE_RELATIONSHIP__NO_DATA) {
+                arrival = departure = 0;
+            }
+            if (first) delay = stop_delay = arrival == CANCELED ? 0 : arrival;
+            uniform &= arrival == delay && departure == delay;
+            if (pass == 1) {
+                for ( ; route_stop < s; ++route_stop)
+                    tdata_realtime_set_stop_update (tdata, trip_index, route_stop, stop_delay, stop_delay);
+                tdata_realtime_set_stop_update (tdata, trip_index, s, arrival, departure);
+            }
+            /* A skipped stop leaves the delay as it was for the stops after it. */
+            if (arrival != CANCELED) stop_delay = departure;
+            route_stop = s + 1;
+            first = false;
+        }
+        if (pass == 0 && uniform) {
+            tdata_realtime_set_delay (tdata, trip_index, delay);
+            return;
+        }
+        if (pass == 0 && ! rt_reserve_slot (tdata, trip_index)) {
+            fprintf (stderr, "real-time overlay is full, keeping a single delay for trip %d.\n", trip_index);
+            tdata_realtime_set_delay (tdata, trip_index, delay);
+            return;
+        }
+        if (pass == 1) {
+            for ( ; route_stop < route->n_stops; ++route_stop)
+                tdata_realtime_set_stop_update (tdata, trip_index, route_stop, stop_delay, stop_delay);
+        }
+    }
+}
+
 /*
-  Decodes the GTFS-RT message of lenth len in buffer buf, extracting vehicle position messages
-  and using the delay extension (1003) to update RRRR's per-trip delay information.
+  Decodes the GTFS-RT message of length len in buffer buf, applying the delays of its TripUpdate entities and of its
+  vehicle position entities carrying the OVapi delay extension (1003) to RRRR's real-time overlay. Only the trips
+  named in the message are touched. A full dataset also puts all other trips back on time, which costs as much as
+  there were delayed trips before. Updates older than the one last applied to a trip are dropped.
 */
-void tdata_apply_gtfsrt (tdata_t *tdata, RadixTree *tripid_index, uint8_t *buf, size_t len) {
+void tdata_apply_gtfsrt (tdata_t *tdata, RadixTree *tripid_index, RadixTree *stopid_index, uint8_t *buf, size_t len) {
     TransitRealtime__FeedMessage *msg;
     msg = transit_realtime__feed_message__unpack (NULL, len, buf);
     if (msg == NULL) {
@@ -472,122 +1361,308 @@ void tdata_apply_gtfsrt (tdata_t *tdata, RadixTree *tripid_index, uint8_t *buf,
         return;
     }
     printf("Received feed message with %zu entities.\n", msg->n_entity);
+    tdata_realtime_t *rt = tdata->realtime;
+    TransitRealtime__FeedHeader *header = msg->header;
+    uint64_t feed_timestamp = header->has_timestamp ? header->timestamp : 0;
+    bool full_dataset = ! header->has_incrementality ||
+                        header->incrementality == TRANSIT_REALTIME__FEED_HEADER__INCREMENTALITY__FULL_DATASET;
+    if (full_dataset && feed_timestamp != 0 && feed_timestamp < rt->feed_timestamp) {
+        printf ("    dropping full dataset older than the last one.\n");
+        transit_realtime__feed_message__free_unpacked (msg, NULL);
+        return;
+    }
+    /* Stop times given as epoch times are measured against the service day of their trip, see rt_service_day. */
+    time_t now = feed_timestamp ? (time_t) feed_timestamp : time (NULL);
+    /* The delays go into a new version of the overlay, which readers only see once it is complete. */
+    tdata_realtime_begin (tdata);
+    uint32_t message = ++rt->n_messages;
+    uint32_t n_stale = 0;
     for (size_t e = 0; e < msg->n_entity; ++e) {
         TransitRealtime__FeedEntity *entity = msg->entity[e];
-        if (entity == NULL) goto cleanup;
-        // printf("  entity %d has id %s\n", e, entity->id);
+        if (entity == NULL) continue;
+        TransitRealtime__TripUpdate *trip_update = entity->trip_update;
         TransitRealtime__VehiclePosition *vehicle = entity->vehicle;
-        if (vehicle == NULL) goto cleanup;
-        TransitRealtime__TripDescriptor *trip = vehicle->trip;
-        if (trip == NULL) goto cleanup;
-        char *trip_id = trip->trip_id;
-
-        int32_t delay_sec = 0;
-        if (trip->schedule_relationship == TRANSIT_REALTIME__TRIP_DESCRIPTOR__SCHEDULE_RELATIONSHIP__CANCELED) {
-            delay_sec = CANCELED;
+        TransitRealtime__TripDescriptor *trip = trip_update ? trip_update->trip : vehicle ? vehicle->trip : NULL;
+        if (trip == NULL || trip->trip_id == NULL) continue;
+        uint32_t trip_index = rxt_find (tripid_index, trip->trip_id);
+        if (trip_index == RADIX_TREE_NONE) {
+            I fprintf (stderr, "    trip id was not found in the radix tree.\n");
+            continue;
+        }
+        rt->trip_messages[trip_index] = message;
+        uint64_t timestamp = feed_timestamp;
+        if (trip_update && trip_update->has_timestamp) timestamp = trip_update->timestamp;
+        else if (vehicle && vehicle->has_timestamp) timestamp = vehicle->timestamp;
+        /* Without a timestamp there is no telling, and the update is taken to be the latest. */
+        if (timestamp != 0 && timestamp < rt->trip_timestamps[trip_index]) {
+            ++n_stale;
+            continue;
+        }
+        if (timestamp != 0) rt->trip_timestamps[trip_index] = timestamp;
+
+        if (entity->has_is_deleted && entity->is_deleted) {
+            tdata_realtime_set_delay (tdata, trip_index, 0);
+        } else if (trip->has_schedule_relationship && trip->schedule_relationship ==
+                   TRANSIT_REALTIME__TRIP_DESCRIPTOR__SCHEDULE_RELATIONSHIP__CANCELED) {
+            tdata_realtime_set_delay (tdata, trip_index, CANCELED);
+        } else if (trip_update) {
+            time_t service_day = rt_service_day (tdata, stopid_index, trip_index, trip_update, now);
+            rt_apply_stop_time_updates (tdata, stopid_index, trip_index, trip_update, service_day);
         } else {
+            int32_t delay_sec = 0;
             TransitRealtime__OVapiVehiclePosition *ovapi_vehicle_position = vehicle->ovapi_vehicle_position;
-            if (ovapi_vehicle_position == NULL) printf ("    entity contains no delay message.\n");
+            if (ovapi_vehicle_position == NULL) I fprintf (stderr, "    entity contains no delay message.\n");
             else delay_sec = ovapi_vehicle_position->delay;
-            if (abs(delay_sec) > 60 * 120) {
-                printf ("    filtering out extreme delay of %d sec.\n", delay_sec);
+            if (abs(delay_sec) > RT_MAX_DELAY) {
+                I fprintf (stderr, "    filtering out extreme delay of %d sec.\n", delay_sec);
                 delay_sec = 0;
             }
-        }
-
-        /* Apply delay. */
-        uint32_t trip_index = rxt_find (tripid_index, trip_id);
-        if (trip_index == RADIX_TREE_NONE) {
-            printf ("    trip id was not found in the radix tree.\n");
-        } else {
-            // printf ("    trip_id %s, trip number %d, applying delay of %d sec.\n", trip_id, trip_index, delay_sec);
-            trip_t *trip = tdata->trips + trip_index;
-            trip->realtime_delay = SEC_TO_RTIME(delay_sec);
+            tdata_realtime_set_delay (tdata, trip_index, SEC_TO_RTIME(delay_sec));
         }
     }
-    cleanup:
+    if (full_dataset) {
+        rt_reset_unnamed (tdata, message);
+        if (feed_timestamp != 0) rt->feed_timestamp = feed_timestamp;
+    }
+    if (n_stale > 0) printf ("    dropped %d updates older than those applied before.\n", n_stale);
+    tdata_realtime_publish (tdata);
     transit_realtime__feed_message__free_unpacked (msg, NULL);
 }
 
 void tdata_clear_gtfsrt (tdata_t *tdata) {
-    /* If we had the total number of trips nested loops would not be necessary. */
-    for (uint32_t r = 0; r < tdata->n_routes; ++r) {
-        route_t route = tdata->routes[r];
-        trip_t *trips = tdata_trips_for_route(tdata, r);
-        for (int t = 0; t < route.n_trips; ++t) {
-            trips[t].realtime_delay = 0;
-        }
+    tdata_realtime_t *rt = tdata->realtime;
+    uint32_t version = tdata_realtime_begin (tdata);
+    while (rt->n_live_trips > 0) {
+        uint32_t trip_index = rt->live_trips[rt->n_live_trips - 1];
+        tdata_realtime_set_delay (tdata, trip_index, 0);
+        rt->trip_timestamps[trip_index] = 0;
     }
+    rt->feed_timestamp = 0;
+    /* No trip has delays per stop any more. */
+    rt->header->recovery[version % 2] = 0;
+    tdata_realtime_publish (tdata);
 }
 
-void tdata_apply_gtfsrt_file (tdata_t *tdata, RadixTree *tripid_index, char *filename) {
+void tdata_apply_gtfsrt_file (tdata_t *tdata, RadixTree *tripid_index, RadixTree *stopid_index, char *filename) {
     int fd = open(filename, O_RDONLY);
     if (fd == -1) die("Could not find GTFS_RT input file.\n");
     struct stat st;
     if (stat(filename, &st) == -1) die("Could not stat GTFS_RT input file.\n");
     uint8_t *buf = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
     if (buf == MAP_FAILED) die("Could not map GTFS-RT input file.\n");
-    tdata_apply_gtfsrt (tdata, tripid_index, buf, st.st_size);
+    tdata_apply_gtfsrt (tdata, tripid_index, stopid_index, buf, st.st_size);
     munmap (buf, st.st_size);
 }
 
+/* What an alert informs about: the route, stop and trip (a global trip index) it is limited to, NONE where it is not. */
+typedef struct alert_selector alert_selector_t;
+struct alert_selector {
+    uint32_t alert;
+    uint32_t route;
+    uint32_t stop;
+    uint32_t trip;
+};
+
+/* The selectors are grouped by the key they are found through: the trip if they name one, otherwise the route,
+   otherwise the stop, and a last key for those naming none of these. Keys are numbered trips first, then routes, then
+   stops, and the selectors of key k run from offsets[k] up to offsets[k + 1]. */
+struct tdata_alerts {
+    alert_t *alerts;
+    uint32_t n_alerts;
+    char    *texts;  // the texts of all alerts, one after the other
+    alert_selector_t *selectors;
+    uint32_t *offsets;
+};
+
+static uint32_t alert_key (tdata_t *td, alert_selector_t *selector) {
+    if (selector->trip  != NONE) return selector->trip;
+    if (selector->route != NONE) return td->n_trips + selector->route;
+    if (selector->stop  != NONE) return td->n_trips + td->n_routes + selector->stop;
+    return td->n_trips + td->n_routes + td->n_stops;
+}
+
+static void tdata_alerts_free (tdata_alerts_t *store) {
+    if (store == NULL) return;
+    free (store->alerts);
+    free (store->texts);
+    free (store->selectors);
+    free (store->offsets);
+    free (store);
+}
+
+uint32_t tdata_alerts_read_begin (tdata_t *td) {
+    for (;;) {
+        uint32_t generation = __atomic_load_n (&td->alerts_generation, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch (&td->alerts_readers[generation % 2], 1, __ATOMIC_SEQ_CST);
+        /* A store replaced after this check waits for this reader, one replaced before it is not seen by it. */
+        if (__atomic_load_n (&td->alerts_generation, __ATOMIC_SEQ_CST) == generation) return generation;
+        __atomic_sub_fetch (&td->alerts_readers[generation % 2], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+void tdata_alerts_read_end (tdata_t *td, uint32_t generation) {
+    __atomic_sub_fetch (&td->alerts_readers[generation % 2], 1, __ATOMIC_SEQ_CST);
+}
+
+/* Put a store in use, and free the one it replaces once the readers that may still see it are done. Readers beginning
+   after the new generation count under the other parity, so the wait ends. Only one thread replaces stores. */
+static void tdata_alerts_swap (tdata_t *tdata, tdata_alerts_t *store) {
+    tdata_alerts_t *replaced = tdata->alerts;
+    __atomic_store_n (&tdata->alerts, store, __ATOMIC_SEQ_CST);
+    uint32_t generation = __atomic_fetch_add (&tdata->alerts_generation, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n (&tdata->alerts_readers[generation % 2], __ATOMIC_SEQ_CST) > 0) sched_yield ();
+    tdata_alerts_free (replaced);
+}
+
+static char *alert_text (TransitRealtime__TranslatedString *string) {
+    if (string == NULL || string->n_translation == 0) return NULL;
+    return string->translation[0]->text;
+}
+
+/* Copy a text into the store, returning where it went. */
+static char *alert_copy_text (char **texts, char *text) {
+    if (text == NULL) return NULL;
+    char *copy = *texts;
+    *texts = stpcpy (copy, text) + 1;
+    return copy;
+}
+
+/* The days of the calendar on which any of the periods of an alert falls, all of them if it has none. */
+static calendar_t alert_active_days (tdata_t *tdata, TransitRealtime__Alert *alert) {
+    if (alert->n_active_period == 0) return UINT32_MAX;
+    calendar_t days = 0;
+    for (uint32_t d = 0; d < 32; ++d) {
+        uint64_t day_start = tdata->calendar_start_time + (uint64_t) d * SEC_IN_ONE_DAY;
+        for (size_t p = 0; p < alert->n_active_period; ++p) {
+            TransitRealtime__TimeRange *period = alert->active_period[p];
+            if ((period->has_start && period->start >= day_start + SEC_IN_ONE_DAY) ||
+                (period->has_end && period->end <= day_start)) continue;
+            days |= 1u << d;
+            break;
+        }
+    }
+    return days;
+}
+
+/*
+  Decodes the GTFS-RT alerts message of length len in buffer buf into a new alerts store, which then replaces the one
+  in use. The ids the alerts inform about are looked up once, here, and the days each alert is active on are worked out
+  for the whole calendar.
+*/
 void tdata_apply_gtfsrt_alerts (tdata_t *tdata, RadixTree *routeid_index, RadixTree *stopid_index, RadixTree *tripid_index, uint8_t *buf, size_t len) {
     TransitRealtime__FeedMessage *msg = transit_realtime__feed_message__unpack (NULL, len, buf);
     if (msg == NULL) {
         fprintf (stderr, "error unpacking incoming gtfs-rt message\n");
         return;
     }
-
     printf("Received feed message with %zu entities.\n", msg->n_entity);
+
+    /* Size the store. */
+    uint32_t n_alerts = 0, n_selectors = 0;
+    size_t texts_size = 0;
     for (size_t e = 0; e < msg->n_entity; ++e) {
-        TransitRealtime__FeedEntity *entity = msg->entity[e];
-        if (entity == NULL) goto cleanup;
-        // printf("  entity %d has id %s\n", e, entity->id);
-        TransitRealtime__Alert *alert = entity->alert;
-        if (alert == NULL) goto cleanup;
+        TransitRealtime__Alert *alert = msg->entity[e]->alert;
+        if (alert == NULL) continue;
+        n_alerts += 1;
+        n_selectors += alert->n_informed_entity;
+        char *texts[3] = { alert_text (alert->header_text), alert_text (alert->description_text), alert_text (alert->url) };
+        for (int t = 0; t < 3; ++t) if (texts[t]) texts_size += strlen (texts[t]) + 1;
+    }
+    uint32_t n_keys = tdata->n_trips + tdata->n_routes + tdata->n_stops + 1;
+    tdata_alerts_t *store = (tdata_alerts_t *) malloc (sizeof(tdata_alerts_t));
+    if (store == NULL) die("failed to allocate alerts");
+    store->n_alerts = 0;
+    store->alerts = (alert_t *) malloc (sizeof(alert_t) * n_alerts + 1);
+    store->texts = (char *) malloc (texts_size + 1);
+    store->selectors = (alert_selector_t *) malloc (sizeof(alert_selector_t) * n_selectors + 1);
+    store->offsets = (uint32_t *) calloc (n_keys + 1, sizeof(uint32_t));
+    alert_selector_t *selectors = (alert_selector_t *) malloc (sizeof(alert_selector_t) * n_selectors + 1);
+    if ( ! (store->alerts && store->texts && store->selectors && store->offsets && selectors))
+        die("failed to allocate alerts");
+
+    /* Decode the alerts and resolve what they inform about, counting the selectors per key. */
+    char *texts = store->texts;
+    n_selectors = 0;
+    for (size_t e = 0; e < msg->n_entity; ++e) {
+        TransitRealtime__Alert *alert = msg->entity[e]->alert;
+        if (alert == NULL) continue;
+        alert_t *a = store->alerts + store->n_alerts;
+        a->header_text = alert_copy_text (&texts, alert_text (alert->header_text));
+        a->description_text = alert_copy_text (&texts, alert_text (alert->description_text));
+        a->url = alert_copy_text (&texts, alert_text (alert->url));
+        a->active_days = alert_active_days (tdata, alert);
 
         for (size_t ie = 0; ie < alert->n_informed_entity; ++ie) {
             TransitRealtime__EntitySelector *informed_entity = alert->informed_entity[ie];
-            if (!informed_entity) continue;
-
+            alert_selector_t selector = { store->n_alerts, NONE, NONE, NONE };
             if (informed_entity->route_id) {
-                uint32_t route_index = rxt_find (routeid_index, informed_entity->route_id);
-                if (route_index == RADIX_TREE_NONE) {
-                     printf ("    route id was not found in the radix tree.\n");
+                selector.route = rxt_find (routeid_index, informed_entity->route_id);
+                if (selector.route == RADIX_TREE_NONE) {
+                    printf ("    route id was not found in the radix tree.\n");
+                    continue;
                 }
-                memcpy (informed_entity->route_id, &route_index, sizeof(route_index));
             }
-
             if (informed_entity->stop_id) {
-                uint32_t stop_index = rxt_find (stopid_index, informed_entity->stop_id);
-                if (stop_index == RADIX_TREE_NONE) {
-                     printf ("    stop id was not found in the radix tree.\n");
+                selector.stop = rxt_find (stopid_index, informed_entity->stop_id);
+                if (selector.stop == RADIX_TREE_NONE) {
+                    printf ("    stop id was not found in the radix tree.\n");
+                    continue;
                 }
-                memcpy (informed_entity->stop_id, &stop_index, sizeof(stop_index));
             }
-
             if (informed_entity->trip && informed_entity->trip->trip_id) {
-                uint32_t trip_index = rxt_find (tripid_index, informed_entity->trip->trip_id);
-                if (trip_index == RADIX_TREE_NONE) {
+                selector.trip = rxt_find (tripid_index, informed_entity->trip->trip_id);
+                if (selector.trip == RADIX_TREE_NONE) {
                     printf ("    trip id was not found in the radix tree.\n");
+                    continue;
                 }
-                memcpy (informed_entity->trip->trip_id, &trip_index, sizeof(trip_index));
             }
+            selectors[n_selectors++] = selector;
+            store->offsets[alert_key (tdata, &selector) + 1] += 1;
         }
+        store->n_alerts += 1;
     }
+    transit_realtime__feed_message__free_unpacked (msg, NULL);
 
-    tdata->alerts = msg;
-    return;
+    /* Group the selectors by key: the counts become the offsets at which each key ends, which are counted down while
+       filling in the selectors, so that they end up at the offsets at which each key starts. */
+    for (uint32_t k = 0; k < n_keys; ++k) store->offsets[k + 1] += store->offsets[k];
+    for (uint32_t i = 0; i < n_selectors; ++i) {
+        uint32_t key = alert_key (tdata, selectors + i);
+        store->selectors[--store->offsets[key + 1]] = selectors[i];
+    }
+    memmove (store->offsets, store->offsets + 1, sizeof(uint32_t) * n_keys);
+    store->offsets[n_keys] = n_selectors;
+    free (selectors);
 
-    cleanup:
-    transit_realtime__feed_message__free_unpacked (msg, NULL);
+    tdata_alerts_swap (tdata, store);
 }
 
 void tdata_clear_gtfsrt_alerts (tdata_t *tdata) {
-    if (tdata->alerts) {
-        transit_realtime__feed_message__free_unpacked (tdata->alerts, NULL);
-        tdata->alerts = NULL;
+    tdata_alerts_swap (tdata, NULL);
+}
+
+uint32_t tdata_alerts_for_leg (tdata_t *td, uint32_t route_index, uint32_t trip_index, uint32_t stop_index, uint32_t day,
+                               alert_t **alerts, uint32_t max) {
+    tdata_alerts_t *store = __atomic_load_n (&td->alerts, __ATOMIC_ACQUIRE);
+    if (store == NULL) return 0;
+    uint32_t keys[4] = { trip_index, td->n_trips + route_index, td->n_trips + td->n_routes + stop_index,
+                         td->n_trips + td->n_routes + td->n_stops };
+    uint32_t n = 0;
+    for (int k = 0; k < 4; ++k) {
+        for (uint32_t i = store->offsets[keys[k]]; i < store->offsets[keys[k] + 1]; ++i) {
+            alert_selector_t *selector = store->selectors + i;
+            alert_t *alert = store->alerts + selector->alert;
+            if ((selector->route != NONE && selector->route != route_index) ||
+                (selector->stop  != NONE && selector->stop  != stop_index) ||
+                (selector->trip  != NONE && selector->trip  != trip_index)) continue;
+            if (day < 32 ? ! (alert->active_days & (1u << day)) : alert->active_days != UINT32_MAX) continue;
+            /* An alert may inform about the leg more than once. */
+            uint32_t a = 0;
+            while (a < n && alerts[a] != alert) ++a;
+            if (a == n && n < max) alerts[n++] = alert;
+        }
     }
+    return n;
 }
 
 void tdata_apply_gtfsrt_alerts_file (tdata_t *tdata, RadixTree *routeid_index, RadixTree *stopid_index, RadixTree *tripid_index, char *filename) {
@@ -10,6 +10,7 @@
 #include "gtfs-realtime.pb-c.h"
 
 #include <stddef.h>
+#include <stdbool.h>
 
 typedef uint32_t calendar_t;
 
@@ -40,15 +41,101 @@ typedef struct trip trip_t;
 struct trip {
     uint32_t stop_times_offset; // The offset of the first stoptime of the time demand type used by this trip
     rtime_t  begin_time;        // The absolute start time since at the departure of the first stop
-    int16_t  realtime_delay;    // This is signed to indicate early or late. All zeros upon creation (but serves as padding).
+    int16_t  padding;           // Formerly the real-time delay. Delays now live in the real-time overlay, see trip_delays.
 };
 
+/* The real-time delays of a trip at one of its route stops, for trips whose delay varies along the way. Both are
+   CANCELED at a stop the trip skips, where it can neither be boarded nor left. */
+typedef struct stop_update stop_update_t;
+struct stop_update {
+    int16_t arrival;
+    int16_t departure;
+};
+
+/* A real-time change as sent from the updater to the workers: the delays of a trip at one of its route stops, or of
+   the whole trip when route_stop is ALL_STOPS. A delta holds the delays the trip has after the change, so applying it
+   twice does no harm. */
+#define ALL_STOPS UINT16_MAX
+typedef struct tdata_realtime_delta tdata_realtime_delta_t;
+struct tdata_realtime_delta {
+    uint32_t trip_index;
+    uint16_t route_stop;
+    int16_t  arrival;
+    int16_t  departure;
+    uint16_t padding;
+};
+
+/* The header of a batch of deltas, followed by the deltas themselves, bringing a worker to one version of the
+   updater's overlay. A full batch names every trip that is not on time and puts all others back on time. */
+typedef struct tdata_realtime_batch tdata_realtime_batch_t;
+struct tdata_realtime_batch {
+    uint32_t version;
+    uint32_t n_deltas;
+    uint32_t full;
+};
+
+/* A service alert from GTFS-RT: the texts to show, NULL where the feed gives none, and the days of the calendar on
+   which it is active at some time. */
+typedef struct alert alert_t;
+struct alert {
+    char *header_text;
+    char *description_text;
+    char *url;
+    calendar_t active_days;
+};
+
+/* The service alerts in force, indexed by the routes, stops and trips they inform about. */
+typedef struct tdata_alerts tdata_alerts_t;
+
 typedef struct stoptime stoptime_t;
 struct stoptime {
     rtime_t arrival;
     rtime_t departure;
 };
 
+/* The parts of one route's block in the optional route blocks section, all in one contiguous aligned region.
+   Departure and arrival columns are laid out [route_stop][trip] and already include each trip's begin time.
+   The trip dimension is padded to a multiple of 16 with trips that never run. */
+typedef struct route_block route_block_t;
+struct route_block {
+    uint32_t   *stops;
+    uint8_t    *stop_attributes;
+    uint8_t    *trip_attributes;
+    calendar_t *trip_masks;
+    rtime_t    *departures;
+    rtime_t    *arrivals;
+    uint32_t    stride; // the number of entries per route stop in the time columns
+};
+
+#define ROUTE_BLOCK_STRIDE(n_trips) (((n_trips) + 15) & ~15)
+
+/* A transfer from leaving a trip at one of its stops to boarding another trip, found when building the timetable.
+   The boarded trip runs on the service day of the trip that was left, or the day before or after it. */
+typedef struct trip_transfer trip_transfer_t;
+struct trip_transfer {
+    uint32_t route_idx;
+    uint16_t trip;       // the trip index within the route
+    uint16_t route_stop; // the route stop where the trip is boarded, with the day offset + 1 in the top two bits
+};
+
+#define TRIP_TRANSFER_STOP(tt) ((tt)->route_stop & 0x3FFF)
+#define TRIP_TRANSFER_DAY(tt) ((int32_t) ((tt)->route_stop >> 14) - 1)
+
+/* A ride of a trip between two consecutive stops, for the Connection Scan Algorithm. The connections are sorted by
+   departure time on the service day of their trip, including the begin time of the trip but no real-time delay. */
+typedef struct connection connection_t;
+struct connection {
+    uint32_t dep_stop;
+    uint32_t arr_stop;
+    rtime_t  dep_time;
+    rtime_t  arr_time;
+    uint32_t trip; // the global trip index, with the CONNECTION_BOARDING and CONNECTION_ALIGHTING flags
+};
+
+#define CONNECTION_BOARDING  0x80000000 // the trip can be boarded at the departure stop
+#define CONNECTION_ALIGHTING 0x40000000 // the trip can be left at the arrival stop
+#define CONNECTION_TRIP(c) ((c)->trip & 0x3FFFFFFF)
+
 typedef enum stop_attribute {
     sa_wheelchair_boarding  =   1, // wheelchair accessible
     sa_visual_accessible    =   2, // accessible for blind people
@@ -64,7 +151,8 @@ typedef enum routestop_attribute {
     rsa_alighting    =   4  // a passenger can leave the vehicle at this stop
 } routestop_attribute_t;
 
-// treat entirely as read-only?
+typedef struct tdata_realtime tdata_realtime_t;
+
 typedef struct tdata tdata_t;
 struct tdata {
     void *base;
@@ -112,7 +200,47 @@ struct tdata {
     char *stop_ids;
     uint32_t trip_id_width;
     char *trip_ids;
-    TransitRealtime__FeedMessage *alerts;
+    uint32_t *route_block_offsets; // per route, the file offset of its block. NULL when the timetable has no blocks.
+    /* Lower bounds on the travel time between clusters of stops, from the optional lower bounds section.
+       lb_times[to_cluster * n_lb_clusters + from_cluster] in rtime_t units, UNREACHED when there is no path at all. */
+    uint32_t n_lb_clusters;       // 0 when the timetable has no lower bounds
+    float lb_walk_speed;          // the fastest walk speed in meters per second for which the bounds hold
+    uint16_t *lb_cluster_for_stop;
+    rtime_t *lb_times;
+    /* Trip-to-trip transfers for Trip-Based routing, from the optional trip transfers section. Leaving trip t of route r
+       at route stop i is event tt_route_events[r] + t * n_stops + i, whose transfers run from tt_event_offsets[event]
+       up to the next offset. */
+    float tt_walk_speed;          // the walk speed in meters per second at which the transfers were found, 0 when absent
+    uint32_t *tt_route_events;
+    uint32_t *tt_event_offsets;
+    trip_transfer_t *trip_transfers;
+    uint32_t n_connections;       // the number of connections in the optional connections section, 0 when absent
+    connection_t *connections;
+    uint16_t *stop_route_positions; // per entry of stop_routes, the route stop at which that route serves the stop. NULL when absent.
+    /* The alerts store in use, replaced as a whole when a new alerts feed comes in. Readers count themselves in
+       alerts_readers under the parity of the alerts_generation they began in, and a replaced store is only freed once
+       the readers of its generation are done (see tdata_alerts_read_begin). */
+    tdata_alerts_t *alerts;
+    uint32_t alerts_generation;
+    uint32_t alerts_readers[2];
+    /* Real-time data is kept apart from the timetable, which is mapped read-only, in an overlay of its own (see the
+       tdata_realtime_* functions). trip_delays are the delays of the overlay version in use, per trip in rtime_t units,
+       CANCELED for canceled trips. Trips with delays per stop have STOP_UPDATES instead, and theirs are found in
+       stop_updates from stop_update_offsets[trip] on, one per route stop. */
+    tdata_realtime_t *realtime;
+    int16_t  *trip_delays;
+    uint32_t *stop_update_offsets;
+    stop_update_t *stop_updates;
+    rtime_t  realtime_recovery;   // the most any trip with delays per stop catches up on its delay along the way
+    uint32_t realtime_generation; // the overlay version in use
+    uint32_t *route_versions;     // per route, the overlay version for which its departure index was built
+    /* Departure index, built at load time and kept up to date with the real-time overlay. It is not part of the file.
+       Per route (using the same offsets as the trips) the trip indexes in an order that never decreases in arrival
+       or departure time at any stop of the route, with and without real-time delays: the FIFO chain.
+       It is followed by the trips that would break that order by overtaking, which must be scanned linearly. */
+    uint16_t *departure_index;
+    uint16_t *n_fifo_trips; // per route, the number of leading entries in departure_index forming the FIFO chain
+    uint16_t *n_delayed_trips; // per route, the number of trips with a real-time delay or cancellation
 };
 
 void tdata_load(char* filename, tdata_t*);
@@ -128,6 +256,9 @@ uint8_t *tdata_stop_attributes_for_route(tdata_t *, uint32_t route);
 /* TODO: return number of items and store pointer to beginning, to allow restricted pointers */
 uint32_t tdata_routes_for_stop(tdata_t*, uint32_t stop, uint32_t **routes_ret);
 
+/* The route stop of each of the routes returned by tdata_routes_for_stop, or NULL when the timetable does not say. */
+uint16_t *tdata_route_positions_for_stop(tdata_t*, uint32_t stop);
+
 stoptime_t *tdata_stoptimes_for_route(tdata_t*, uint32_t route_index);
 
 void tdata_dump_route(tdata_t*, uint32_t route_index, uint32_t trip_index);
@@ -188,13 +319,35 @@ char *tdata_agency_url_for_route(tdata_t*, uint32_t route_index);
    be shifted in time to get the true scheduled arrival and departure times. */
 stoptime_t *tdata_timedemand_type(tdata_t*, uint32_t route_index, uint32_t trip_index);
 
+/* Fill in the parts of a route's block. Returns false if the timetable does not contain route blocks. */
+bool tdata_route_block (tdata_t *td, uint32_t route_index, route_block_t *block);
+
+/* A lower bound on the time needed to travel from one stop to another, or UNREACHED if the second stop cannot be
+   reached from the first at all. Returns 0 if the timetable does not contain lower bounds. */
+rtime_t tdata_lower_bound (tdata_t *td, uint32_t from_stop, uint32_t to_stop);
+
+/* The transfers from leaving a trip at one of its route stops. The timetable must contain trip transfers. */
+uint32_t tdata_trip_transfers (tdata_t *td, uint32_t route_index, uint32_t trip_index, uint32_t route_stop,
+                               trip_transfer_t **transfers_ret);
+
 /* Get a pointer to the array of trip structs for this route. */
 trip_t *tdata_trips_for_route(tdata_t *td, uint32_t route_index);
 
-void tdata_apply_gtfsrt (tdata_t *tdata, RadixTree *tripid_index, uint8_t *buf, size_t len);
+/* (Re)build the departure index for one route, or for all routes. */
+void tdata_index_route (tdata_t *td, uint32_t route_index);
+
+void tdata_index_departures (tdata_t *td);
+
+/* The index of the route containing the given trip (a global trip index). */
+uint32_t tdata_route_for_trip (tdata_t *td, uint32_t trip_index);
 
-void tdata_apply_gtfsrt_file (tdata_t *tdata, RadixTree *tripid_index, char *filename);
+/* Apply a GTFS-RT message of TripUpdates or vehicle positions, as a full dataset or differentially as its header says.
+   Stops in stop time updates are found through their stop id. */
+void tdata_apply_gtfsrt (tdata_t *tdata, RadixTree *tripid_index, RadixTree *stopid_index, uint8_t *buf, size_t len);
 
+void tdata_apply_gtfsrt_file (tdata_t *tdata, RadixTree *tripid_index, RadixTree *stopid_index, char *filename);
+
+/* Put all trips back on time, forgetting the timestamps of the updates applied so far. */
 void tdata_clear_gtfsrt (tdata_t *tdata);
 
 void tdata_apply_gtfsrt_alerts (tdata_t *tdata, RadixTree *routeid_index, RadixTree *stopid_index, RadixTree *tripid_index, uint8_t *buf, size_t len);
@@ -203,6 +356,56 @@ void tdata_apply_gtfsrt_alerts_file (tdata_t *tdata, RadixTree *routeid_index, R
 
 void tdata_clear_gtfsrt_alerts (tdata_t *tdata);
 
+/* The alerts on boarding a trip (a global trip index) of a route at a stop on a day of the calendar, put in alerts up
+   to max of them. Returns how many were found. They remain valid until tdata_alerts_read_end. */
+uint32_t tdata_alerts_for_leg (tdata_t *td, uint32_t route_index, uint32_t trip_index, uint32_t stop_index, uint32_t day,
+                               alert_t **alerts, uint32_t max);
+
+/* Look up alerts between these two calls, passing the generation returned by the first to the second. A new alerts feed
+   waits for the readers that began before it to end before it frees the alerts it replaces. */
+uint32_t tdata_alerts_read_begin (tdata_t *td);
+
+void tdata_alerts_read_end (tdata_t *td, uint32_t generation);
+
+/* Attach to the real-time overlay shared under the given name (see shm_open), creating it if it does not exist yet.
+   An overlay made for another timetable is replaced when replace is set, otherwise it is left alone and false is
+   returned. Until attached, a process has an overlay of its own. */
+bool tdata_realtime_attach (tdata_t *td, const char *name, bool replace);
+
+/* Prepare the next version of the real-time overlay, starting from the current one. Only one process may update an
+   overlay. Returns the version being prepared. */
+uint32_t tdata_realtime_begin (tdata_t *td);
+
+/* Set the delay of a trip (a global trip index) in the version being prepared. Returns true if it changed. */
+bool tdata_realtime_set_delay (tdata_t *td, uint32_t trip_index, int16_t delay);
+
+/* Set the delays of a trip at one of its route stops in the version being prepared, CANCELED for both if it skips the
+   stop. Its other stops keep the delay the trip had. Returns true if anything changed, false if the overlay is full. */
+bool tdata_realtime_set_stop_update (tdata_t *td, uint32_t trip_index, uint32_t route_stop, int16_t arrival, int16_t departure);
+
+/* Make the version being prepared the current one, atomically for all readers. */
+void tdata_realtime_publish (tdata_t *td);
+
+/* The batch of deltas leading up to the current version from the one before, or from scratch when full is set, for
+   the updater to send to the workers. It is kept in a buffer of the updater, valid until the next call, whose size in
+   bytes is put in size. */
+tdata_realtime_batch_t *tdata_realtime_deltas (tdata_t *td, bool full, size_t *size);
+
+/* Apply a batch of deltas from the updater as the next version of this process's overlay. Returns false if the batch
+   is malformed, in which case nothing is applied. */
+bool tdata_realtime_apply_deltas (tdata_t *td, tdata_realtime_batch_t *batch, size_t size);
+
+/* Switch to the current version of the real-time overlay, updating the departure index of the routes that changed
+   since the version in use. Returns the version now in use. */
+uint32_t tdata_realtime_snapshot (tdata_t *td);
+
+/* True if the given version has not been overwritten by the updater since it was taken. Everything read while routing
+   on that version is then consistent; otherwise the request should be routed again on a new snapshot. */
+bool tdata_realtime_consistent (tdata_t *td, uint32_t version);
+
+/* The real-time delay of a trip (a global trip index) at one of its route stops, CANCELED if it skips the stop. */
+int16_t tdata_stop_delay (tdata_t *td, uint32_t trip_index, uint32_t route_stop, bool arrive);
+
 /* The signed delay of the specified trip in seconds. */
 float tdata_delay_min (tdata_t *td, uint32_t route_index, uint32_t trip_index);
 
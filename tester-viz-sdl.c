@@ -282,18 +282,20 @@ int drawGLScene( GLvoid )
 
 
     router_state_t (*states)[router->tdata->n_stops] = (router_state_t(*)[]) (router->states);
+    rtime_t (*times)[router->tdata->n_stops] = (rtime_t(*)[]) (router->times);
+    rtime_t (*walk_times)[router->tdata->n_stops] = (rtime_t(*)[]) (router->walk_times);
 
     for (uint32_t i = 0; i < tdata->n_stops; i++) {
         if (router->best_time[i] != UNREACHED) {
             GLfloat cnt1 = lon2x_d(tdata->stop_coords[i].lon);
             GLfloat cnt2 = lat2y_d(tdata->stop_coords[i].lat);
 
-            int8_t round = RRRR_MAX_ROUNDS;
+            int8_t round = router->max_rounds;
             do {
                 round--;
                 /* fan-out transfer locations */
                 /*
-                if (states[round][i].time != UNREACHED && states[round][i].back_stop != NONE) {
+                if (times[round][i] != UNREACHED && states[round][i].back_stop != NONE) {
                     glBegin(GL_LINES);
                     glVertex2f(cnt1,cnt2);
                     GLfloat x = lon2x_d(tdata->stop_coords[states[round][i].back_stop].lon);
@@ -305,7 +307,7 @@ int drawGLScene( GLvoid )
                 */
 
                 /* visualise the transfers taken by feet */
-                if (states[round][i].walk_time != UNREACHED && states[round][i].walk_from != NONE && states[round][i].time > states[round][i].walk_time) {
+                if (walk_times[round][i] != UNREACHED && states[round][i].walk_from != NONE && times[round][i] > walk_times[round][i]) {
                     glColor3f(0.4f, 0.4f, 0.4f);
                     glBegin(GL_LINES);
                     glVertex2f(cnt1,cnt2);
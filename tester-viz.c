@@ -89,7 +89,7 @@ int main(int argc, char **argv) {
 
     while (opt >= 0) {
         opt = getopt_long(argc, argv, "adrhD:s:S:o:f:t:V:m:Q:x:y:z:w:A:g:G:T:v", long_options, NULL);
-        parse_request(&req, &tdata, NULL, opt, optarg);
+        if ( ! parse_request(&req, &tdata, NULL, opt, optarg)) exit(-1);
     }
 
     if (req.from == NONE || req.to == NONE) goto usage;
@@ -112,14 +112,14 @@ int main(int argc, char **argv) {
     // load gtfs-rt file from disk
     if (gtfsrt_file != NULL || gtfsrt_alerts_file != NULL) {
         RadixTree *tripid_index  = rxt_load_strings_from_tdata (tdata.trip_ids, tdata.trip_id_width, tdata.n_trips);
+        RadixTree *stopid_index  = rxt_load_strings_from_tdata (tdata.stop_ids, tdata.stop_id_width, tdata.n_stops);
         if (gtfsrt_file != NULL) {
             tdata_clear_gtfsrt (&tdata);
-            tdata_apply_gtfsrt_file (&tdata, tripid_index, gtfsrt_file);
+            tdata_apply_gtfsrt_file (&tdata, tripid_index, stopid_index, gtfsrt_file);
         }
 
         if (gtfsrt_alerts_file != NULL) {
             RadixTree *routeid_index = rxt_load_strings_from_tdata (tdata.route_ids, tdata.route_id_width, tdata.n_routes);
-            RadixTree *stopid_index  = rxt_load_strings_from_tdata (tdata.stop_ids, tdata.stop_id_width, tdata.n_stops);
             tdata_clear_gtfsrt_alerts(&tdata);
             tdata_apply_gtfsrt_alerts_file (&tdata, routeid_index, stopid_index, tripid_index, gtfsrt_alerts_file);
         }
@@ -127,7 +127,7 @@ int main(int argc, char **argv) {
 
     // initialize router
     router_t router;
-    router_setup(&router, &tdata);
+    router_setup(&router, &tdata, RRRR_DEFAULT_ROUNDS);
     //tdata_dump(&tdata); // debug timetable file format
 
     char result_buf[OUTPUT_LEN];
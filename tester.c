@@ -13,6 +13,10 @@
 #include "rrrr.h"
 #include "tdata.h"
 #include "router.h"
+#include "mcraptor.h"
+#include "isochrone.h"
+#include "tripbased.h"
+#include "csa.h"
 #include "parse.h"
 #include "json.h"
 
@@ -20,6 +24,7 @@
 // also look up stop ids
 
 #define OUTPUT_LEN 8000
+#define PROFILE_OUTPUT_LEN 64000
 
 static struct option long_options[] = {
     { "arrive",        no_argument, NULL, 'a' },
@@ -29,6 +34,9 @@ static struct option long_options[] = {
     { "date",          required_argument, NULL, 'D' },
     { "walk-slack",    required_argument, NULL, 's' },
     { "walk-speed",    required_argument, NULL, 'S' },
+    { "window",        required_argument, NULL, 'W' },
+    { "criterion",     required_argument, NULL, 'C' },
+    { "engine",        required_argument, NULL, 'E' },
     { "optimise",      required_argument, NULL, 'o' },
     { "from-idx",      required_argument, NULL, 'f' },
     { "to-idx",        required_argument, NULL, 't' },
@@ -43,6 +51,11 @@ static struct option long_options[] = {
     { "gtfsrt",        required_argument, NULL, 'g' },
     { "gtfsrt-alerts", required_argument, NULL, 'G' },
     { "timetable",     required_argument, NULL, 'T' },
+    { "threads",       required_argument, NULL, 'P' },
+    { "rounds",        required_argument, NULL, 'R' },
+    { "max-transfers", required_argument, NULL, 'X' },
+    { "isochrone",     no_argument, NULL, 'I' },
+    { "patterns",      required_argument, NULL, 'p' },
     { "verbose",     no_argument, NULL, 'v' },
     { NULL, 0, 0, 0 } /* end */
 };
@@ -56,10 +69,14 @@ int main(int argc, char **argv) {
     char *gtfsrt_file = NULL;
     char *gtfsrt_alerts_file = NULL;
     bool verbose = false;
+    uint32_t n_threads = 1;
+    uint32_t max_rounds = RRRR_DEFAULT_ROUNDS;
+    bool isochrone = false;
+    char *patterns_file = NULL;
 
     int opt = 0;
     while (opt >= 0) {
-        opt = getopt_long(argc, argv, "adrhD:s:S:o:f:t:V:m:Q:x:y:z:w:A:g:G:T:v", long_options, NULL);
+        opt = getopt_long(argc, argv, "adrhD:s:S:W:C:E:o:f:t:V:m:Q:x:y:z:w:A:g:G:T:P:R:X:Ivp:", long_options, NULL);
         if (opt < 0) continue;
         switch (opt) {
         case 'T':
@@ -71,6 +88,18 @@ int main(int argc, char **argv) {
         case 'G':
             gtfsrt_alerts_file = optarg;
             break;
+        case 'P':
+            n_threads = strtol(optarg, NULL, 10);
+            break;
+        case 'R':
+            max_rounds = strtol(optarg, NULL, 10);
+            break;
+        case 'I':
+            isochrone = true;
+            break;
+        case 'p':
+            patterns_file = optarg;
+            break;
         case 'v':
             verbose = true;
             break;
@@ -87,18 +116,18 @@ int main(int argc, char **argv) {
     optind = 0;
     opt = 0;
     while (opt >= 0) {
-        opt = getopt_long(argc, argv, "adrhD:s:S:o:f:t:V:m:Q:x:y:z:w:A:g:G:T:v", long_options, NULL);
-        parse_request(&req, &tdata, NULL, opt, optarg);
+        opt = getopt_long(argc, argv, "adrhD:s:S:W:C:E:o:f:t:V:m:Q:x:y:z:w:A:g:G:T:P:R:X:Ivp:", long_options, NULL);
+        if ( ! parse_request(&req, &tdata, NULL, opt, optarg)) exit(-1);
     }
 
-    if (req.from == NONE || req.to == NONE) goto usage;
+    if (req.from == NONE || (req.to == NONE && ! isochrone)) goto usage;
 
     if (req.from == req.to) {
         fprintf(stderr, "Dude, you are already there.\n");
         exit(-1);
     }
 
-    if (req.from >= tdata.n_stops || req.to >= tdata.n_stops) {
+    if (req.from >= tdata.n_stops || (req.to >= tdata.n_stops && ! isochrone)) {
         fprintf(stderr, "Invalid stopids in from and/or to.\n");
         exit(-1);
     }
@@ -111,14 +140,14 @@ int main(int argc, char **argv) {
     // load gtfs-rt file from disk
     if (gtfsrt_file != NULL || gtfsrt_alerts_file != NULL) {
         RadixTree *tripid_index  = rxt_load_strings_from_tdata (tdata.trip_ids, tdata.trip_id_width, tdata.n_trips);
+        RadixTree *stopid_index  = rxt_load_strings_from_tdata (tdata.stop_ids, tdata.stop_id_width, tdata.n_stops);
         if (gtfsrt_file != NULL) {
             tdata_clear_gtfsrt (&tdata);
-            tdata_apply_gtfsrt_file (&tdata, tripid_index, gtfsrt_file);
+            tdata_apply_gtfsrt_file (&tdata, tripid_index, stopid_index, gtfsrt_file);
         }
 
         if (gtfsrt_alerts_file != NULL) {
             RadixTree *routeid_index = rxt_load_strings_from_tdata (tdata.route_ids, tdata.route_id_width, tdata.n_routes);
-            RadixTree *stopid_index  = rxt_load_strings_from_tdata (tdata.stop_ids, tdata.stop_id_width, tdata.n_stops);
             tdata_clear_gtfsrt_alerts(&tdata);
             tdata_apply_gtfsrt_alerts_file (&tdata, routeid_index, stopid_index, tripid_index, gtfsrt_alerts_file);
         }
@@ -126,10 +155,92 @@ int main(int argc, char **argv) {
 
     // initialize router
     router_t router;
-    router_setup(&router, &tdata);
+    router_setup(&router, &tdata, max_rounds);
+    router_setup_threads(&router, n_threads);
     //tdata_dump(&tdata); // debug timetable file format
 
     char result_buf[OUTPUT_LEN];
+    if (isochrone) {
+        /* One-to-all search, departing every minute or spread over the window, listing the arrivals at every stop. */
+        rtime_t departures[RRRR_ISOCHRONE_LANES];
+        uint32_t step = req.time_window > RRRR_ISOCHRONE_LANES ? req.time_window / RRRR_ISOCHRONE_LANES : SEC_TO_RTIME(60);
+        for (uint32_t d = 0; d < RRRR_ISOCHRONE_LANES; ++d) departures[d] = req.time + d * step;
+        struct isochrone iso;
+        if (verbose) router_request_dump (&router, &req);
+        if (router_route_isochrone (&router, &req, departures, RRRR_ISOCHRONE_LANES, &iso)) {
+            for (uint32_t stop = 0; stop < iso.n_stops; ++stop) {
+                rtime_t *arrivals = iso.arrivals + stop * RRRR_ISOCHRONE_LANES;
+                if (arrivals[0] == UNREACHED && arrivals[iso.n_departures - 1] == UNREACHED) continue;
+                printf ("%-40.40s", tdata_stop_name_for_index (&tdata, stop));
+                for (uint32_t d = 0; d < iso.n_departures; ++d) printf (" %s", timetext (arrivals[d]));
+                printf ("\n");
+            }
+        }
+        router_isochrone_free (&iso);
+        router_teardown(&router);
+        tdata_close(&tdata);
+        exit(EXIT_SUCCESS);
+    }
+    if (req.engine == e_trip_based) {
+        /* Answer with Trip-Based routing, falling back on RAPTOR for requests it does not support. */
+        struct plan plan;
+        if (verbose) router_request_dump (&router, &req);
+        if (router_route_trips (&router, &req, &plan)) {
+            router_plan_dump (&router, &plan, result_buf, OUTPUT_LEN);
+            printf("%s", result_buf);
+            router_teardown(&router);
+            tdata_close(&tdata);
+            exit(EXIT_SUCCESS);
+        }
+        fprintf(stderr, "No Trip-Based result for this request, searching with RAPTOR instead.\n");
+    }
+    if (req.engine == e_csa && req.time_window == 0) {
+        /* Answer with a connection scan, falling back on RAPTOR for requests it does not support. */
+        struct plan plan;
+        if (verbose) router_request_dump (&router, &req);
+        if (router_route_csa (&router, &req, &plan)) {
+            router_plan_dump (&router, &plan, result_buf, OUTPUT_LEN);
+            printf("%s", result_buf);
+            router_teardown(&router);
+            tdata_close(&tdata);
+            exit(EXIT_SUCCESS);
+        }
+        fprintf(stderr, "No connection scan result for this request, searching with RAPTOR instead.\n");
+    }
+    if (patterns_file != NULL) {
+        /* Answer from the precomputed transfer patterns, falling back on a full search when they cannot. */
+        transfer_patterns_t tp;
+        struct plan plan;
+        if (verbose) router_request_dump (&router, &req);
+        if (tp_load (patterns_file, &tp, &tdata) && router_route_patterns (&router, &req, &tp, &plan)) {
+            router_plan_dump (&router, &plan, result_buf, OUTPUT_LEN);
+            printf("%s", result_buf);
+            tp_close (&tp);
+            router_teardown(&router);
+            tdata_close(&tdata);
+            exit(EXIT_SUCCESS);
+        }
+        tp_close (&tp);
+        fprintf(stderr, "No transfer patterns for this request, searching instead.\n");
+    }
+    if (req.time_window > 0 || req.criterion != c_none) {
+        /* Profile or McRAPTOR search, which already yield the Pareto-optimal itineraries. */
+        struct profile profile = { .n_itineraries = 0, .capacity = 0, .itineraries = NULL };
+        char *profile_buf = malloc (PROFILE_OUTPUT_LEN);
+        if (verbose) router_request_dump (&router, &req);
+        bool found = req.criterion != c_none ? router_route_mc (&router, &req, &profile)
+                                             : (req.engine == e_csa && router_route_csa_profile (&router, &req, &profile)) ||
+                                               router_route_profile (&router, &req, &profile);
+        if (profile_buf && found) {
+            router_profile_dump (&router, &profile, profile_buf, PROFILE_OUTPUT_LEN);
+            printf("%s", profile_buf);
+        }
+        free (profile_buf);
+        router_profile_free (&profile);
+        router_teardown(&router);
+        tdata_close(&tdata);
+        exit(EXIT_SUCCESS);
+    }
     router_route (&router, &req);
     if (verbose) {
         router_request_dump (&router, &req);
@@ -164,7 +275,7 @@ int main(int argc, char **argv) {
     exit(EXIT_SUCCESS);
 
     usage:
-    printf("Usage:\n%s [-r(andomize)] [--from-idx from_stop] [--to-idx to_stop] [-a(rrive)] [-d(epart)] [-D YYYY-MM-DDThh:mm:ss] [-g gtfsrt.pb] [-T timetable.dat]\n", argv[0]);
+    printf("Usage:\n%s [-r(andomize)] [--from-idx from_stop] [--to-idx to_stop] [-a(rrive)] [-d(epart)] [-D YYYY-MM-DDThh:mm:ss] [--window minutes] [--criterion walk|bus] [--engine raptor|trips|csa] [--threads n] [--rounds n] [--max-transfers n] [--isochrone] [--patterns transferpatterns.dat] [-g gtfsrt.pb] [-T timetable.dat]\n", argv[0]);
     exit(-2);
 }
 
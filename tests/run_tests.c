@@ -7,6 +7,9 @@ Suite *make_hashgrid_suite (void);
 Suite *make_radixtree_suite (void);
 Suite *make_speed_suite (void);
 Suite *make_polyline_suite (void);
+Suite *make_profile_suite (void);
+Suite *make_engines_suite (void);
+Suite *make_realtime_suite (void);
 Suite *make_master_suite (void) {
     Suite *s = suite_create ("Master");
     return s;
@@ -21,6 +24,9 @@ int main (void) {
     srunner_add_suite (sr, make_radixtree_suite ());
     srunner_add_suite (sr, make_speed_suite ());
     srunner_add_suite (sr, make_polyline_suite ());
+    srunner_add_suite (sr, make_profile_suite ());
+    srunner_add_suite (sr, make_engines_suite ());
+    srunner_add_suite (sr, make_realtime_suite ());
     srunner_set_log (sr, "test.log");
     srunner_run_all (sr, CK_VERBOSE); // CK_NORMAL
     number_failed = srunner_ntests_failed (sr);
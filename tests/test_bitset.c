@@ -13,10 +13,25 @@ START_TEST (test_bitset) {
     bitset_destroy(bs);
 } END_TEST
 
+START_TEST (test_bitset_mask) {
+    BitSet *bs = bitset_new(200);
+    BitSet *mask = bitset_new(200);
+    for (uint32_t i = 0; i < 200; i += 2)
+        bitset_set(bs, i);
+    for (uint32_t i = 0; i < 200; i += 3)
+        bitset_set(mask, i);
+    bitset_mask(bs, mask);
+    for (uint32_t i = 0; i < 200; i++)
+        ck_assert (bitset_get(bs, i) == (i % 6 == 0));
+    bitset_destroy(mask);
+    bitset_destroy(bs);
+} END_TEST
+
 Suite *make_bitset_suite (void) {
     Suite *s = suite_create ("BitSet");
     TCase *tc_core = tcase_create ("Core");
     tcase_add_test  (tc_core, test_bitset);
+    tcase_add_test  (tc_core, test_bitset_mask);
     suite_add_tcase (s, tc_core);
     return s;
 }
@@ -0,0 +1,91 @@
+#include <check.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include "../tdata.h"
+#include "../router.h"
+#include "../tripbased.h"
+#include "../csa.h"
+#include "../config.h"
+
+#define N_REQUESTS 200
+
+typedef bool (*engine_fn) (router_t*, router_request_t*, struct plan*);
+
+/* The soonest arrival at the target over all itineraries of a plan, or UNREACHED if it has none. */
+static rtime_t plan_arrival (struct plan *plan) {
+    rtime_t arrival = UNREACHED;
+    for (uint32_t i = 0; i < plan->n_itineraries; ++i) {
+        struct itinerary *itin = plan->itineraries + i;
+        if (itin->n_legs > 0 && itin->legs[itin->n_legs - 1].t1 < arrival) arrival = itin->legs[itin->n_legs - 1].t1;
+    }
+    return arrival;
+}
+
+/* Route random depart-after requests with RAPTOR and with another engine. The other engines follow every ride with a
+   walk, while router_route does not walk on from a stop that was reached sooner on foot, so they may arrive sooner
+   but never later. Their itineraries must go from the origin to the target in legs that follow on from each other.
+   The engine needs an optional section of the timetable, which is given as present or not. */
+static void check_engine (engine_fn route, const char *name, bool (*present) (tdata_t*)) {
+    tdata_t tdata;
+    tdata_load (RRRR_INPUT_FILE, &tdata);
+    if ( ! present (&tdata)) {
+        printf ("the timetable cannot be routed with %s, skipping.\n", name);
+        tdata_close (&tdata);
+        return;
+    }
+    router_t router;
+    router_setup (&router, &tdata, RRRR_DEFAULT_ROUNDS);
+    srand(time(NULL));
+    static struct plan plan, engine_plan;
+    for (int i = 0; i < N_REQUESTS; ++i) {
+        router_request_t req;
+        router_request_initialize (&req);
+        router_request_randomize (&req, &tdata);
+        req.arrive_by = false;
+        // Trip-Based only walks at the speed its transfers were found at, without slack
+        req.walk_speed = tdata.tt_walk_speed;
+        req.walk_slack = 0;
+        if (req.from == req.to) continue;
+        router_request_t engine_req = req;
+        route (&router, &engine_req, &engine_plan);
+        router_route (&router, &req);
+        router_result_to_plan (&plan, &router, &req);
+        rtime_t arrival = plan_arrival (&plan), engine_arrival = plan_arrival (&engine_plan);
+        ck_assert_msg (engine_arrival <= arrival, "Request from %d to %d at %d arrives at %d with %s but at %d with RAPTOR.",
+                       req.from, req.to, req.time, engine_arrival, name, arrival);
+        for (struct itinerary *itin = engine_plan.itineraries; itin < engine_plan.itineraries + engine_plan.n_itineraries; ++itin) {
+            struct leg *legs = itin->legs;
+            ck_assert_msg (legs[0].s0 == req.from, "%s itinerary does not begin at the origin.", name);
+            ck_assert_msg (legs[itin->n_legs - 1].s1 == req.to, "%s itinerary does not end at the target.", name);
+            for (uint32_t l = 0; l + 1 < itin->n_legs; ++l) {
+                ck_assert_msg (legs[l].s1 == legs[l + 1].s0, "%s leg %d does not begin where leg %d ends.", name, l + 1, l);
+                ck_assert_msg (legs[l].t1 <= legs[l + 1].t0, "%s leg %d begins before leg %d ends.", name, l + 1, l);
+            }
+        }
+    }
+    router_teardown (&router);
+    tdata_close (&tdata);
+}
+
+static bool has_trip_transfers (tdata_t *tdata) { return tdata->trip_transfers != NULL; }
+
+static bool has_connections (tdata_t *tdata) { return tdata->connections != NULL; }
+
+START_TEST (test_engines_trips) {
+    check_engine (router_route_trips, "Trip-Based", has_trip_transfers);
+} END_TEST
+
+START_TEST (test_engines_csa) {
+    check_engine (router_route_csa, "CSA", has_connections);
+} END_TEST
+
+Suite *make_engines_suite (void) {
+    Suite *s = suite_create ("Engines");
+    TCase *tc_core = tcase_create ("Core");
+    tcase_add_test (tc_core, test_engines_trips);
+    tcase_add_test (tc_core, test_engines_csa);
+    tcase_set_timeout (tc_core, 30);
+    suite_add_tcase (s, tc_core);
+    return s;
+}
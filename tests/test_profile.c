@@ -0,0 +1,53 @@
+#include <check.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include "../tdata.h"
+#include "../router.h"
+#include "../config.h"
+
+#define N_REQUESTS 100
+
+/* Every itinerary of a profile must go from the origin to the target in legs that follow on from each other. */
+START_TEST (test_profile_legs) {
+    tdata_t tdata;
+    tdata_load (RRRR_INPUT_FILE, &tdata);
+    router_t router;
+    router_setup (&router, &tdata, RRRR_DEFAULT_ROUNDS);
+    srand(time(NULL));
+    router_request_t req;
+    router_request_initialize (&req);
+    for (int i = 0; i < N_REQUESTS; ++i) {
+        router_request_randomize (&req, &tdata);
+        req.arrive_by = false;
+        req.time_window = SEC_TO_RTIME(3600);
+        struct profile profile = { 0 };
+        ck_assert (router_route_profile (&router, &req, &profile));
+        for (struct itinerary *itin = profile.itineraries; itin < profile.itineraries + profile.n_itineraries; ++itin) {
+            struct leg *legs = itin->legs;
+            ck_assert_msg (legs[0].s0 == req.from, "Profile itinerary does not begin at the origin.");
+            ck_assert_msg (legs[itin->n_legs - 1].s1 == req.to, "Profile itinerary does not end at the target.");
+            for (uint32_t l = 0; l < itin->n_legs; ++l) {
+                ck_assert_msg (legs[l].t0 <= legs[l].t1, "Profile leg %d from %d to %d ends before it begins (%d..%d).",
+                               l, legs[l].s0, legs[l].s1, legs[l].t0, legs[l].t1);
+                if (l + 1 == itin->n_legs) continue;
+                ck_assert_msg (legs[l].s1 == legs[l + 1].s0, "Profile leg %d does not begin where leg %d ends.", l + 1, l);
+                ck_assert_msg (legs[l].t1 <= legs[l + 1].t0, "Profile leg %d begins before leg %d ends.", l + 1, l);
+            }
+            if (itin > profile.itineraries)
+                ck_assert_msg (itin[-1].legs[0].t0 <= legs[0].t0, "Profile itineraries are not in order of departure.");
+        }
+        router_profile_free (&profile);
+    }
+    router_teardown (&router);
+    tdata_close (&tdata);
+} END_TEST
+
+Suite *make_profile_suite (void) {
+    Suite *s = suite_create ("Profile");
+    TCase *tc_core = tcase_create ("Core");
+    tcase_add_test (tc_core, test_profile_legs);
+    tcase_set_timeout (tc_core, 30);
+    suite_add_tcase (s, tc_core);
+    return s;
+}
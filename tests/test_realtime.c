@@ -0,0 +1,193 @@
+#include <check.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "../tdata.h"
+#include "../radixtree.h"
+#include "../gtfs-realtime.pb-c.h"
+#include "../config.h"
+
+#define N_VERSIONS 100
+
+/* Change the delays of a few random trips, whole or at single stops, in the version being prepared. */
+static void random_updates (tdata_t *tdata) {
+    uint32_t n_updates = rand() % 200;
+    for (uint32_t i = 0; i < n_updates; ++i) {
+        uint32_t trip = rand() % tdata->n_trips;
+        uint32_t n_stops = tdata->routes[tdata_route_for_trip (tdata, trip)].n_stops;
+        switch (rand() % 4) {
+        case 0: tdata_realtime_set_delay (tdata, trip, 0); break;
+        case 1: tdata_realtime_set_delay (tdata, trip, rand() % 100); break;
+        case 2: tdata_realtime_set_delay (tdata, trip, CANCELED); break;
+        default: {
+            int16_t delay = rand() % 60;
+            if (rand() % 5 == 0) tdata_realtime_set_stop_update (tdata, trip, rand() % n_stops, CANCELED, CANCELED);
+            else tdata_realtime_set_stop_update (tdata, trip, rand() % n_stops, delay, delay + rand() % 5);
+        }
+        }
+    }
+}
+
+/* The number of trips whose delays differ between two timetables at any of their stops. */
+static uint32_t trips_differing (tdata_t *a, tdata_t *b) {
+    uint32_t n_differing = 0;
+    for (uint32_t trip = 0; trip < a->n_trips; ++trip) {
+        uint32_t n_stops = a->routes[tdata_route_for_trip (a, trip)].n_stops;
+        for (uint32_t s = 0; s < n_stops; ++s) {
+            if (tdata_stop_delay (a, trip, s, true) != tdata_stop_delay (b, trip, s, true) ||
+                tdata_stop_delay (a, trip, s, false) != tdata_stop_delay (b, trip, s, false)) {
+                n_differing += 1;
+                break;
+            }
+        }
+    }
+    return n_differing;
+}
+
+/* A follower applying the batches of deltas of an updater must end up with the same delays. Once a batch is lost,
+   the next full batch brings the follower back in step. Malformed batches are refused. */
+START_TEST (test_realtime_deltas) {
+    tdata_t updater, follower;
+    tdata_load (RRRR_INPUT_FILE, &updater);
+    tdata_load (RRRR_INPUT_FILE, &follower);
+    srand(time(NULL));
+    bool lost = false;
+    for (int v = 0; v < N_VERSIONS; ++v) {
+        tdata_realtime_begin (&updater);
+        random_updates (&updater);
+        tdata_realtime_publish (&updater);
+        bool full = v % 10 == 9;
+        size_t size;
+        tdata_realtime_batch_t *batch = tdata_realtime_deltas (&updater, full, &size);
+        if (v % 10 == 4) {
+            lost = true;
+            continue;
+        }
+        /* Deltas travel in a frame of their own, not in the buffer of the updater. */
+        void *frame = malloc (size);
+        memcpy (frame, batch, size);
+        ck_assert_msg (tdata_realtime_apply_deltas (&follower, frame, size), "Batch of version %d was refused.", v);
+        free (frame);
+        tdata_realtime_snapshot (&follower);
+        if (lost && ! full) continue;
+        lost = false;
+        uint32_t n_differing = trips_differing (&updater, &follower);
+        ck_assert_msg (n_differing == 0, "%d trips have other delays after the %s batch of version %d.",
+                       n_differing, full ? "full" : "incremental", v);
+    }
+    tdata_realtime_batch_t malformed = { 0, 5, 0 };
+    ck_assert_msg ( ! tdata_realtime_apply_deltas (&follower, &malformed, sizeof(malformed)),
+                    "A batch shorter than its deltas was applied.");
+    tdata_close (&updater);
+    tdata_close (&follower);
+} END_TEST
+
+/* The header texts of the alerts on a leg, in alphabetical order. */
+static char *leg_alerts (tdata_t *tdata, uint32_t route, uint32_t trip, uint32_t stop, uint32_t day) {
+    static char texts[16];
+    alert_t *alerts[8];
+    uint32_t generation = tdata_alerts_read_begin (tdata);
+    uint32_t n_alerts = tdata_alerts_for_leg (tdata, route, trip, stop, day, alerts, 8);
+    for (uint32_t i = 0; i < n_alerts; ++i) texts[i] = alerts[i]->header_text[0];
+    tdata_alerts_read_end (tdata, generation);
+    texts[n_alerts] = '\0';
+    for (uint32_t i = 1; i < n_alerts; ++i)
+        for (uint32_t j = i; j > 0 && texts[j - 1] > texts[j]; --j) {
+            char swap = texts[j]; texts[j] = texts[j - 1]; texts[j - 1] = swap;
+        }
+    return texts;
+}
+
+/* A leg is subject to the alerts informing about its trip, its route, its boarding stop or its route at that stop, and
+   to those informing about none of these, but only on the days they are active. */
+START_TEST (test_realtime_alerts) {
+    tdata_t tdata;
+    tdata_load (RRRR_INPUT_FILE, &tdata);
+    RadixTree *routeid_index = rxt_load_strings_from_tdata (tdata.route_ids, tdata.route_id_width, tdata.n_routes);
+    RadixTree *stopid_index  = rxt_load_strings_from_tdata (tdata.stop_ids, tdata.stop_id_width, tdata.n_stops);
+    RadixTree *tripid_index  = rxt_load_strings_from_tdata (tdata.trip_ids, tdata.trip_id_width, tdata.n_trips);
+    uint32_t route = 5, other_route = 6;
+    uint32_t trip = tdata.routes[route].trip_ids_offset + 1, other_trip = tdata.routes[other_route].trip_ids_offset;
+    uint32_t stop = tdata_stops_for_route (&tdata, route)[2], other_stop = tdata_stops_for_route (&tdata, route)[3];
+
+    /* A informs about the route, B about the stop on day 3 only, C about the trip, D only about an agency and E about
+       the other route at the other stop. */
+    enum { N_ALERTS = 5 };
+    static char *headers[N_ALERTS] = { "A", "B", "C", "D", "E" };
+    TransitRealtime__FeedEntity entities[N_ALERTS], *entity_ptrs[N_ALERTS];
+    TransitRealtime__Alert alerts[N_ALERTS];
+    TransitRealtime__EntitySelector selectors[N_ALERTS], *selector_ptrs[N_ALERTS];
+    TransitRealtime__TranslatedString texts[N_ALERTS];
+    TransitRealtime__TranslatedString__Translation translations[N_ALERTS], *translation_ptrs[N_ALERTS];
+    for (int a = 0; a < N_ALERTS; ++a) {
+        transit_realtime__feed_entity__init (&entities[a]);
+        transit_realtime__alert__init (&alerts[a]);
+        transit_realtime__entity_selector__init (&selectors[a]);
+        transit_realtime__translated_string__init (&texts[a]);
+        transit_realtime__translated_string__translation__init (&translations[a]);
+        translations[a].text = headers[a];
+        translation_ptrs[a] = &translations[a];
+        texts[a].n_translation = 1;
+        texts[a].translation = &translation_ptrs[a];
+        selector_ptrs[a] = &selectors[a];
+        alerts[a].header_text = &texts[a];
+        alerts[a].n_informed_entity = 1;
+        alerts[a].informed_entity = &selector_ptrs[a];
+        entities[a].id = headers[a];
+        entities[a].alert = &alerts[a];
+        entity_ptrs[a] = &entities[a];
+    }
+    selectors[0].route_id = tdata_route_id_for_index (&tdata, route);
+    selectors[1].stop_id = tdata_stop_id_for_index (&tdata, stop);
+    TransitRealtime__TimeRange day_3, *day_3_ptr = &day_3;
+    transit_realtime__time_range__init (&day_3);
+    day_3.has_start = day_3.has_end = true;
+    day_3.start = tdata.calendar_start_time + 3 * SEC_IN_ONE_DAY + 3600;
+    day_3.end = day_3.start + 7200;
+    alerts[1].n_active_period = 1;
+    alerts[1].active_period = &day_3_ptr;
+    TransitRealtime__TripDescriptor trip_descriptor;
+    transit_realtime__trip_descriptor__init (&trip_descriptor);
+    trip_descriptor.trip_id = tdata_trip_id_for_index (&tdata, trip);
+    selectors[2].trip = &trip_descriptor;
+    selectors[3].agency_id = tdata_agency_id_for_route (&tdata, route);
+    selectors[4].route_id = tdata_route_id_for_index (&tdata, other_route);
+    selectors[4].stop_id = tdata_stop_id_for_index (&tdata, other_stop);
+
+    TransitRealtime__FeedHeader header;
+    transit_realtime__feed_header__init (&header);
+    header.gtfs_realtime_version = "1.0";
+    TransitRealtime__FeedMessage msg;
+    transit_realtime__feed_message__init (&msg);
+    msg.header = &header;
+    msg.n_entity = N_ALERTS;
+    msg.entity = entity_ptrs;
+    size_t len = transit_realtime__feed_message__get_packed_size (&msg);
+    uint8_t *buf = malloc (len);
+    transit_realtime__feed_message__pack (&msg, buf);
+
+    /* Applying the same alerts again replaces them rather than adding to them. */
+    for (int i = 0; i < 2; ++i) {
+        tdata_apply_gtfsrt_alerts (&tdata, routeid_index, stopid_index, tripid_index, buf, len);
+        ck_assert_str_eq (leg_alerts (&tdata, route, trip, stop, 3), "ABCD");
+        ck_assert_str_eq (leg_alerts (&tdata, route, trip, stop, 4), "ACD");
+        ck_assert_str_eq (leg_alerts (&tdata, route, trip + 1, other_stop, 3), "AD");
+        ck_assert_str_eq (leg_alerts (&tdata, other_route, other_trip, other_stop, 3), "DE");
+        ck_assert_str_eq (leg_alerts (&tdata, other_route, other_trip, stop, 3), "BD");
+    }
+    tdata_clear_gtfsrt_alerts (&tdata);
+    ck_assert_str_eq (leg_alerts (&tdata, route, trip, stop, 3), "");
+    free (buf);
+    tdata_close (&tdata);
+} END_TEST
+
+Suite *make_realtime_suite (void) {
+    Suite *s = suite_create ("Realtime");
+    TCase *tc_core = tcase_create ("Core");
+    tcase_add_test (tc_core, test_realtime_deltas);
+    tcase_add_test (tc_core, test_realtime_alerts);
+    tcase_set_timeout (tc_core, 30);
+    suite_add_tcase (s, tc_core);
+    return s;
+}
@@ -6,6 +6,7 @@
 #include "../hashgrid.h"
 #include "../tdata.h"
 #include "../router.h"
+#include "../board.h"
 #include "../config.h"
 
 #define N_REQUESTS 100
@@ -56,7 +57,7 @@ START_TEST (test_speed_random) {
     tdata_t tdata;
     tdata_load (RRRR_INPUT_FILE, &tdata);
     router_t router;
-    router_setup (&router, &tdata);
+    router_setup (&router, &tdata, RRRR_DEFAULT_ROUNDS);
     // ensure different random requests on different runs
     srand(time(NULL)); 
     stats_init (N_REQUESTS);
@@ -75,6 +76,92 @@ START_TEST (test_speed_random) {
     stats_calculate (); 
 } END_TEST
 
+/* Boarding on one very frequent route: the vectorised kernel against the scalar one, on the same random scans. */
+#define BOARD_N_TRIPS 2048
+#define BOARD_N_SCANS 20000
+
+START_TEST (test_speed_board) {
+    rtime_t *times;
+    ck_assert (posix_memalign ((void **) &times, 32, sizeof(rtime_t) * BOARD_N_TRIPS) == 0);
+    calendar_t masks[BOARD_N_TRIPS];
+    uint8_t attributes[BOARD_N_TRIPS];
+    srand(time(NULL));
+    for (int t = 0; t < BOARD_N_TRIPS; ++t) {
+        times[t] = SEC_TO_RTIME(4 * 3600 + 30 * t + rand() % 120);
+        masks[t] = rand() % 4 ? 0xFFFFFFFF : (calendar_t) rand();
+        attributes[t] = rand() % 2;
+    }
+    /* Bans among the trips of a larger timetable, in which the route starts at an arbitrary offset. */
+    BitSet *banned = bitset_new (BOARD_N_TRIPS + 64);
+    for (int b = 0; b < 8; ++b) bitset_set (banned, rand() % (BOARD_N_TRIPS + 64));
+    board_scan_t scans[64];
+    for (int i = 0; i < 64; ++i) {
+        board_scan_t scan = { times, masks, attributes, BOARD_N_TRIPS, 1 << (rand() % 32), rand() % 2,
+                              rand() % 4 ? NULL : banned, rand() % 64, SEC_TO_RTIME(rand() % 2 * 24 * 3600),
+                              SEC_TO_RTIME(rand() % (48 * 3600)), rand() % 2 };
+        scans[i] = scan;
+    }
+    uint32_t check_scalar = 0, check_kernel = 0;
+    rtime_t time;
+    stats_begin_clock ();
+    for (int i = 0; i < BOARD_N_SCANS; ++i) check_scalar += board_best_trip_scalar (scans + i % 64, &time) + time;
+    long dt_scalar = stats_end_clock ();
+    stats_begin_clock ();
+    for (int i = 0; i < BOARD_N_SCANS; ++i) check_kernel += board_best_trip (scans + i % 64, &time) + time;
+    long dt_kernel = stats_end_clock ();
+    printf ("boarding %d trips %d times: scalar %ld usec, %s %ld usec (%0.1fx)\n", BOARD_N_TRIPS, BOARD_N_SCANS,
+            dt_scalar, board_kernel_name (), dt_kernel, (double) dt_scalar / dt_kernel);
+    ck_assert_msg (check_scalar == check_kernel, "Boarding kernel disagrees with the scalar version.");
+    bitset_destroy (banned);
+    free (times);
+} END_TEST
+
+/* The same random requests routed with the route scan kernels specialised per request and with the generic one.
+   The passes alternate as specialised, generic, generic, specialised so that neither profits more from warm caches. */
+#define KERNEL_N_REQUESTS 200
+
+static uint32_t result_hash (const char *result) {
+    uint32_t hash = 5381;
+    while (*result) hash = hash * 33 + (unsigned char) *result++;
+    return hash;
+}
+
+START_TEST (test_speed_kernels) {
+    tdata_t tdata;
+    tdata_load (RRRR_INPUT_FILE, &tdata);
+    router_t router;
+    router_setup (&router, &tdata, RRRR_DEFAULT_ROUNDS);
+    router_request_t *reqs = malloc (sizeof(router_request_t) * KERNEL_N_REQUESTS);
+    uint32_t *hashes = malloc (sizeof(uint32_t) * KERNEL_N_REQUESTS * 2);
+    srand(time(NULL));
+    for (int i = 0; i < KERNEL_N_REQUESTS; ++i) {
+        router_request_initialize (reqs + i);
+        router_request_randomize (reqs + i, &tdata);
+    }
+    static char result[16000];
+    long dt[2] = { 0, 0 };
+    for (int pass = 0; pass < 4; ++pass) {
+        int generic = pass == 1 || pass == 2;
+        router.generic_kernels = generic;
+        for (int i = 0; i < KERNEL_N_REQUESTS; ++i) {
+            router_request_t req = reqs[i];
+            stats_begin_clock ();
+            router_route (&router, &req);
+            dt[generic] += stats_end_clock ();
+            router_result_dump (&router, &req, result, sizeof(result));
+            hashes[generic * KERNEL_N_REQUESTS + i] = result_hash (result);
+        }
+    }
+    printf ("routing %d requests twice: generic kernel %ld usec, specialised kernels %ld usec (%0.2fx)\n",
+            KERNEL_N_REQUESTS, dt[1], dt[0], (double) dt[1] / dt[0]);
+    for (int i = 0; i < KERNEL_N_REQUESTS; ++i)
+        ck_assert_msg (hashes[i] == hashes[KERNEL_N_REQUESTS + i], "Specialised route scan kernels disagree with the generic one.");
+    free (hashes);
+    free (reqs);
+    router_teardown (&router);
+    tdata_close (&tdata);
+} END_TEST
+
 START_TEST (test_speed_mmri) {
 
 } END_TEST
@@ -85,6 +172,13 @@ Suite *make_speed_suite (void) {
     tcase_add_test (tc_rand, test_speed_random);
     tcase_set_timeout (tc_rand, 15);
     suite_add_tcase (s, tc_rand);
+    TCase *tc_board = tcase_create ("Board");
+    tcase_add_test (tc_board, test_speed_board);
+    suite_add_tcase (s, tc_board);
+    TCase *tc_kernels = tcase_create ("Kernels");
+    tcase_add_test (tc_kernels, test_speed_kernels);
+    tcase_set_timeout (tc_kernels, 15);
+    suite_add_tcase (s, tc_kernels);
 //    TCase *tc_mmri = tcase_create ("MMRI");
 //    tcase_add_test  (tc_mmri, test_speed_mmri);
 //    suite_add_tcase (s, tc_mmri);
@@ -0,0 +1,107 @@
+/* Copyright 2013 Bliksem Labs. See the LICENSE file at the top-level directory of this distribution and at https://github.com/bliksemlabs/rrrr/. */
+
+/* threadpool.c : a fixed set of threads all running the same task, for splitting up the work of one request */
+#include "threadpool.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+struct threadpool {
+    uint32_t n_threads;
+    pthread_t *threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t start;  // signalled when a new task is posted
+    pthread_cond_t finish; // signalled when the last helper is done with a task
+    threadpool_task_t task;
+    void *arg;
+    uint32_t generation;   // incremented for every task posted, so that helpers never run the same one twice
+    uint32_t n_running;    // helpers still working on the current task
+    bool stop;
+};
+
+/* What each helper thread is started with. */
+struct helper {
+    ThreadPool *pool;
+    uint32_t thread;
+};
+
+static void *threadpool_helper (void *arg) {
+    struct helper *helper = (struct helper *) arg;
+    ThreadPool *self = helper->pool;
+    uint32_t generation = 0;
+    pthread_mutex_lock (&self->mutex);
+    for (;;) {
+        while (self->generation == generation && ! self->stop) pthread_cond_wait (&self->start, &self->mutex);
+        if (self->stop) break;
+        generation = self->generation;
+        threadpool_task_t task = self->task;
+        void *task_arg = self->arg;
+        pthread_mutex_unlock (&self->mutex);
+        task (task_arg, helper->thread);
+        pthread_mutex_lock (&self->mutex);
+        if (--self->n_running == 0) pthread_cond_signal (&self->finish);
+    }
+    pthread_mutex_unlock (&self->mutex);
+    free (helper);
+    return NULL;
+}
+
+ThreadPool *threadpool_new (uint32_t n_threads) {
+    ThreadPool *self = (ThreadPool *) malloc (sizeof(ThreadPool));
+    if (n_threads < 1) n_threads = 1;
+    if (self == NULL) die ("failed to allocate thread pool");
+    self->n_threads = n_threads;
+    self->threads = (pthread_t *) malloc (sizeof(pthread_t) * n_threads);
+    if (self->threads == NULL) die ("failed to allocate thread pool");
+    pthread_mutex_init (&self->mutex, NULL);
+    pthread_cond_init (&self->start, NULL);
+    pthread_cond_init (&self->finish, NULL);
+    self->task = NULL;
+    self->arg = NULL;
+    self->generation = 0;
+    self->n_running = 0;
+    self->stop = false;
+    for (uint32_t t = 1; t < n_threads; ++t) {
+        struct helper *helper = (struct helper *) malloc (sizeof(struct helper));
+        if (helper == NULL) die ("failed to allocate thread pool");
+        helper->pool = self;
+        helper->thread = t;
+        if (pthread_create (self->threads + t, NULL, threadpool_helper, helper) != 0) die ("failed to start pool thread");
+    }
+    return self;
+}
+
+uint32_t threadpool_size (ThreadPool *self) {
+    return self->n_threads;
+}
+
+void threadpool_run (ThreadPool *self, threadpool_task_t task, void *arg) {
+    pthread_mutex_lock (&self->mutex);
+    self->task = task;
+    self->arg = arg;
+    self->n_running = self->n_threads - 1;
+    self->generation += 1;
+    pthread_cond_broadcast (&self->start);
+    pthread_mutex_unlock (&self->mutex);
+    /* The calling thread takes its share as thread 0. */
+    task (arg, 0);
+    pthread_mutex_lock (&self->mutex);
+    while (self->n_running > 0) pthread_cond_wait (&self->finish, &self->mutex);
+    pthread_mutex_unlock (&self->mutex);
+}
+
+void threadpool_destroy (ThreadPool *self) {
+    pthread_mutex_lock (&self->mutex);
+    self->stop = true;
+    pthread_cond_broadcast (&self->start);
+    pthread_mutex_unlock (&self->mutex);
+    for (uint32_t t = 1; t < self->n_threads; ++t) pthread_join (self->threads[t], NULL);
+    pthread_mutex_destroy (&self->mutex);
+    pthread_cond_destroy (&self->start);
+    pthread_cond_destroy (&self->finish);
+    free (self->threads);
+    free (self);
+}
+
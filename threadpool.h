@@ -0,0 +1,27 @@
+/* Copyright 2013 Bliksem Labs. See the LICENSE file at the top-level directory of this distribution and at https://github.com/bliksemlabs/rrrr/. */
+
+/* threadpool.h : a fixed set of threads all running the same task, for splitting up the work of one request */
+
+#ifndef _THREADPOOL_H
+#define _THREADPOOL_H
+
+#include <stdint.h>
+
+typedef struct threadpool ThreadPool;
+
+/* The task receives the shared argument and the index of the thread running it, in [0, n_threads). */
+typedef void (*threadpool_task_t) (void *arg, uint32_t thread);
+
+/* Start n_threads - 1 helper threads. The thread calling threadpool_run is the last one. */
+ThreadPool *threadpool_new (uint32_t n_threads);
+
+uint32_t threadpool_size (ThreadPool *self);
+
+/* Run the task once on every thread of the pool, including the calling thread, and return when all are done. */
+void threadpool_run (ThreadPool *self, threadpool_task_t task, void *arg);
+
+/* Stop and join the helper threads. */
+void threadpool_destroy (ThreadPool *self);
+
+#endif // _THREADPOOL_H
+
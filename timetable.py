@@ -9,8 +9,17 @@ import sqlite3
 import operator
 from pytz import timezone
 import pytz
+import heapq
+import math
+import bisect
 
 MAX_DISTANCE = 801
+# Lower bounds for goal-directed pruning hold for requests walking at most this fast (m/sec)
+LOWER_BOUND_WALK_SPEED = 2.5
+# and cover at most this many clusters of stops, i.e. 2 bytes squared of this in the file.
+MAX_LOWER_BOUND_CLUSTERS = 1024
+# Trip-to-trip transfers for Trip-Based routing are found walking at this speed (m/sec), the router's default
+TRIP_TRANSFER_WALK_SPEED = 1.5
 
 if len(sys.argv) < 2 :
     USAGE = """usage: timetable.py inputfile.gtfsdb [calendar start date] 
@@ -150,12 +159,12 @@ def write_string_table(strings) :
 # make this into a method on a Header class 
 # On 64-bit architectures using gcc long int is at least an int64_t.
 # We were using L in platform dependent mode, which just happened to work. TODO switch to platform independent mode?
-struct_header = Struct('8sQ30I') 
+struct_header = Struct('8sQ35I') 
 def write_header () :
     """ Write out a file header containing offsets to the beginning of each subsection. 
     Must match struct transit_data_header in transitdata.c """
     out.seek(0)
-    htext = "TTABLEV2"
+    htext = "TTABLEV3"
     packed = struct_header.pack(htext,
         calendar_start_time,
         dst_mask,
@@ -188,6 +197,11 @@ def write_header () :
         loc_route_ids,
         loc_stop_ids,
         loc_trip_ids,
+        loc_route_blocks,
+        loc_lower_bounds,
+        loc_trip_transfers,
+        loc_connections,
+        loc_stop_route_positions,
     )
     out.write(packed)
 
@@ -226,11 +240,13 @@ nameloc_for_name = {}
 nameloc_for_idx = []
 namesize = 0
 platformcode_for_idx = []
+coords_for_idx = []
 for sid, name, lat, lon, platform_code in db.stops() :
     platform_code = platform_code or ''
     idx_for_stop_id[sid] = idx
     stop_id_for_idx.append(sid)
     write2floats(lat, lon)
+    coords_for_idx.append((lat, lon))
     platformcode_for_idx.append(platform_code)
     if name in nameloc_for_name:
         nameloc = nameloc_for_name[name]
@@ -372,14 +388,17 @@ write_text_comment("STOPS BY ROUTE")
 loc_route_stops = tell()
 offset = 0
 route_stops_offsets = []
+all_route_stops = []
 for idx, route in enumerate(route_for_idx) :
     route_stops_offsets.append(offset)
     for sid in route.pattern.stop_ids :
         if sid in idx_for_stop_id :
             writeint(idx_for_stop_id[sid])
+            all_route_stops.append(idx_for_stop_id[sid])
         else :
             print "route references unknown stop %s" % sid
             writeint(-1)
+            all_route_stops.append(0xFFFFFFFF)
         offset += 1 
 route_stops_offsets.append(offset) # sentinel
 assert len(route_stops_offsets) == nroutes + 1
@@ -387,6 +406,7 @@ assert len(route_stops_offsets) == nroutes + 1
 print "saving attributes of stops in each route"
 write_text_comment("STOPS ATTRIBUTES BY ROUTE")
 loc_route_stop_attributes = tell()
+all_route_stop_attributes = []
 offset = 0
 route_stops_attributes_offsets = []
 for idx, route in enumerate(route_for_idx) :
@@ -400,6 +420,7 @@ for idx, route in enumerate(route_for_idx) :
         if drop_off_type != 1:
             attr |= 4
         writebyte(attr)
+        all_route_stop_attributes.append(attr)
     offset += 1 
 route_stops_attributes_offsets.append(offset) # sentinel
 assert len(route_stops_attributes_offsets) == nroutes + 1
@@ -418,6 +439,7 @@ loc_timedemandgroups = tell()
 offset = 0
 timedemandgroups_offsets = {} # the offset into the stoptimes for each timedemandgroup ID
 timedemandgroups_written = {}
+stoptimes_written = [] # (arrival, departure) in 4-second units for every stoptime written, used for the route blocks
 timedemandgroup_t = Struct('HH')
 n_nonincreasing_groups = 0
 for idx, route in enumerate(route_for_idx) :
@@ -430,6 +452,7 @@ for idx, route in enumerate(route_for_idx) :
             timedemandgroups_written[str(times)] = offset
             for totaldrivetime, stopwaittime in times:
                 out.write(timedemandgroup_t.pack(totaldrivetime >> 2, (totaldrivetime + stopwaittime) >> 2))
+                stoptimes_written.append((totaldrivetime >> 2, (totaldrivetime + stopwaittime) >> 2))
                 offset += 1
             prev_time = None
             # coherency check: stoptimes should be increasing
@@ -454,6 +477,7 @@ trip_t = Struct('IHH') # Beware, Python structs do not have padding at the end.
 all_trip_ids = []
 trip_ids_offsets = [] # also serves as offsets into per-trip "service active" bitfields
 tioffset = 0
+trips_for_route = [] # (stoptimes offset, begin time) for each trip in each route, used for the route blocks
 for idx, route in enumerate(route_for_idx) :
     if idx > 0 and idx % 1000 == 0 :
         print 'wrote %d routes' % idx
@@ -462,13 +486,16 @@ for idx, route in enumerate(route_for_idx) :
     trips_offsets.append(toffset)
     trip_ids_offsets.append(tioffset)
     trip_ids = route.sorted_trip_ids()
+    route_trips = []
     # print idx, route, len(trip_ids)
     for timedemandgroupref, first_departure in db.fetch_timedemandgroups(trip_ids) :
         # 2**16 / 60 / 60 is only 18 hours
         # by right-shifting all times two bits we get 72 hours (3 days) at 4 second resolution
         # The last struct member is a realtime offset. The space is not wasted since it would be needed as struct padding anyway.
         out.write(trip_t.pack(timedemandgroups_offsets[timedemandgroupref], first_departure >> 2, 0))
+        route_trips.append((timedemandgroups_offsets[timedemandgroupref], first_departure >> 2))
         toffset += 1 
+    trips_for_route.append(route_trips)
     all_trip_ids.extend(trip_ids)
     tioffset += len(trip_ids)
 trips_offsets.append(toffset) # sentinel
@@ -479,30 +506,36 @@ assert len(trip_ids_offsets) == nroutes + 1
 print "writing trip attributes" 
 write_text_comment("TRIP ATTRIBUTES")
 loc_trip_attributes = tell()
+trip_attributes_for_route = []
 for idx, route in enumerate(route_for_idx):
+    route_trip_attributes = []
     for attributes in route.getattributes():
         trip_attr = 0
         if 'wheelchair_accessible' in attributes and attributes['wheelchair_accessible']:
             trip_attr |= 1
         writebyte(trip_attr)
+        route_trip_attributes.append(trip_attr)
+    trip_attributes_for_route.append(route_trip_attributes)
 
 print "saving a list of routes serving each stop"
 write_text_comment("ROUTES BY STOP")
 loc_stop_routes = tell()
 stop_routes = {}
 for idx, route in enumerate(route_for_idx) :
-    for sid in route.pattern.stop_ids :
+    for route_stop, sid in enumerate(route.pattern.stop_ids) :
         if sid not in stop_routes :
             stop_routes[sid] = []
-        stop_routes[sid].append(idx)
+        stop_routes[sid].append((idx, route_stop))
 offset = 0
 stop_routes_offsets = []
+stop_route_positions = [] # the route stop of each entry, for the optional route stop positions section
 for idx in range(nstops) :
     stop_routes_offsets.append(offset)
     sid = stop_id_for_idx[idx]
     if sid in stop_routes :
-        for route_idx in stop_routes[sid] :
+        for route_idx, route_stop in stop_routes[sid] :
             writeint(route_idx)
+            stop_route_positions.append(route_stop)
             offset += 1 
 stop_routes_offsets.append(offset) # sentinel
 assert len(stop_routes_offsets) == nstops + 1
@@ -529,6 +562,8 @@ write_text_comment("TRANSFER DISTANCES")
 loc_transfer_dist_meters = tell()
 offset = 0
 transfers_offsets = []
+all_transfers = [] # (from stop index, to stop index, distance in meters as the router sees it), used for the lower bounds
+                   # and the trip-to-trip transfers
 for from_idx, from_sid in enumerate(stop_id_for_idx) :
     transfers_offsets.append(offset)
     for from_sid, to_sid, ttype, ttime in db.gettransfers(from_sid,maxdistance=MAX_DISTANCE):
@@ -537,6 +572,7 @@ for from_idx, from_sid in enumerate(stop_id_for_idx) :
         to_idx = idx_for_stop_id[to_sid]
         # Store distances in units of 16 meters (rounding by adding 8)
         writebyte((int(ttime) + 8) >> 4)
+        all_transfers.append((from_idx, to_idx, ((int(ttime) + 8) >> 4) << 4))
         offset += 1
 transfers_offsets.append(offset) # sentinel
 assert len(transfers_offsets) == nstops + 1
@@ -679,8 +715,251 @@ print "writing trip ids to string table"
 write_text_comment("TRIP IDS")
 loc_trip_ids = write_string_table(all_trip_ids)
 
+# Optional section: one aligned block per route, so a route can be scanned without leaving its own memory.
+# The trip dimension is padded to a multiple of 16 (the stride) with trips that never run, and departures and arrivals
+# include the begin time of each trip (wrapping like rtime_t). Block layout, which must match tdata_route_block in tdata.c:
+#   uint32 stops[n_stops], uint8 stop attributes[n_stops], padding to 4 bytes,
+#   uint8 trip attributes[stride], uint32 trip masks[stride], padding to 32 bytes,
+#   uint16 departures[n_stops][stride], uint16 arrivals[n_stops][stride]
+# The section is located by a table of absolute file offsets, one per route, which follows the blocks.
+print "writing route blocks"
+write_text_comment("ROUTE BLOCKS")
+route_block_offsets = []
+for idx, route in enumerate(route_for_idx) :
+    align(64)
+    route_block_offsets.append(out.tell())
+    n_stops = route_n_stops[idx]
+    route_trips = trips_for_route[idx]
+    stride = (len(route_trips) + 15) & ~15
+    padding = stride - len(route_trips)
+    trip_ids = all_trip_ids[trip_ids_offsets[idx]:trip_ids_offsets[idx + 1]]
+    out.write(struct.pack('%dI' % n_stops, *all_route_stops[route_stops_offsets[idx]:route_stops_offsets[idx + 1]]))
+    out.write(struct.pack('%dB' % n_stops, *all_route_stop_attributes[route_stops_offsets[idx]:route_stops_offsets[idx + 1]]))
+    align(4)
+    out.write(struct.pack('%dB' % stride, *(trip_attributes_for_route[idx] + [0] * padding)))
+    masks = [bitmask_for_sid.get(service_id_for_trip_id[tid], 0) for tid in trip_ids]
+    out.write(struct.pack('%dI' % stride, *(masks + [0] * padding)))
+    align(32)
+    for column in (1, 0) : # departures, then arrivals
+        for s in range(n_stops) :
+            times = [(begin_time + stoptimes_written[stoptimes_offset + s][column]) & 0xFFFF for stoptimes_offset, begin_time in route_trips]
+            out.write(struct.pack('%dH' % stride, *(times + [0xFFFF] * padding)))
+write_text_comment("ROUTE BLOCK OFFSETS")
+loc_route_blocks = tell()
+for offset in route_block_offsets :
+    writeint(offset)
+
+# Optional section: lower bounds on the travel time between clusters of nearby stops, for goal-directed pruning.
+# Stops are clustered on a grid, whose cells are doubled in size until there are at most MAX_LOWER_BOUND_CLUSTERS.
+# The bound between two clusters is the shortest path in a graph ignoring departure times, where each pair of
+# consecutive stops on a route is linked by its fastest ride and each footpath is walked at LOWER_BOUND_WALK_SPEED
+# without slack. Stops in the same cluster are free to reach from each other. Layout, which must match tdata_load:
+#   uint32 n_clusters, float32 walk speed, uint16 cluster of each stop[nstops], padding to 4 bytes,
+#   uint16 bounds[to cluster][from cluster] in 4-second units, 0xFFFF when there is no path at all
+print "computing lower bounds between clusters of stops"
+cell_meters = 250.0
+while True :
+    cluster_for_cell = {}
+    cluster_for_stop = []
+    for lat, lon in coords_for_idx :
+        cell = (int(math.floor(lat * 111111.0 / cell_meters)),
+                int(math.floor(lon * 111111.0 * math.cos(math.radians(lat)) / cell_meters)))
+        cluster_for_stop.append(cluster_for_cell.setdefault(cell, len(cluster_for_cell)))
+    if len(cluster_for_cell) <= MAX_LOWER_BOUND_CLUSTERS :
+        break
+    cell_meters *= 2
+n_clusters = len(cluster_for_cell)
+print '%d clusters of stops in cells of %d meters' % (n_clusters, cell_meters)
+fastest = {} # (from cluster, to cluster) -> the shortest time between them along a single edge
+def add_lower_bound_edge(from_stop, to_stop, duration) :
+    key = (cluster_for_stop[from_stop], cluster_for_stop[to_stop])
+    if key[0] != key[1] and duration < fastest.get(key, 0xFFFF) :
+        fastest[key] = duration
+for idx, route in enumerate(route_for_idx) :
+    route_stops = all_route_stops[route_stops_offsets[idx]:route_stops_offsets[idx + 1]]
+    for s in range(len(route_stops) - 1) :
+        if route_stops[s] == 0xFFFFFFFF or route_stops[s + 1] == 0xFFFFFFFF :
+            continue
+        ride = min(stoptimes_written[stoptimes_offset + s + 1][0] - stoptimes_written[stoptimes_offset + s][1]
+                   for stoptimes_offset, begin_time in trips_for_route[idx])
+        add_lower_bound_edge(route_stops[s], route_stops[s + 1], max(ride, 0))
+for from_idx, to_idx, dist_meters in all_transfers :
+    add_lower_bound_edge(from_idx, to_idx, int(dist_meters / LOWER_BOUND_WALK_SPEED) >> 2)
+edges_into = [[] for c in range(n_clusters)]
+for (from_cluster, to_cluster), duration in fastest.iteritems() :
+    edges_into[to_cluster].append((from_cluster, duration))
+write_text_comment("LOWER BOUNDS")
+loc_lower_bounds = tell()
+out.write(struct.pack('If', n_clusters, LOWER_BOUND_WALK_SPEED))
+out.write(struct.pack('%dH' % nstops, *cluster_for_stop))
+align(4)
+for to_cluster in range(n_clusters) :
+    # Dijkstra backward from the destination cluster, saturating below 0xFFFF which means unreachable
+    bounds = [0xFFFF] * n_clusters
+    bounds[to_cluster] = 0
+    queue = [(0, to_cluster)]
+    while queue :
+        bound, cluster = heapq.heappop(queue)
+        if bound > bounds[cluster] :
+            continue
+        for from_cluster, duration in edges_into[cluster] :
+            if bound + duration < bounds[from_cluster] :
+                bounds[from_cluster] = min(bound + duration, 0xFFFE)
+                heapq.heappush(queue, (bounds[from_cluster], from_cluster))
+    out.write(struct.pack('%dH' % n_clusters, *bounds))
+del fastest, edges_into
+
+# Optional section: trip-to-trip transfers for Trip-Based routing. From every stop where a trip can be left, each route
+# that can be boarded there or after one footpath (walked at TRIP_TRANSFER_WALK_SPEED without slack) gets a transfer to
+# its soonest trip on every day the arriving trip runs, which may run on the service day before or after. Transfers to
+# a later stop of the same route, U-turns and transfers that reach no stop sooner than staying on the trip or taking its
+# transfers at later stops already do (counting only transfers that hold on every day the trip runs) are left out.
+# Layout, which must match tdata_load and tdata_trip_transfers:
+#   float32 walk speed, uint32 first event of each route[nroutes + 1],
+#   uint32 first transfer of each event[n_events + 1], where the event of leaving a trip at one of its stops is
+#   the first event of its route + trip * n_stops + route stop,
+#   then per transfer uint32 route, uint16 trip, uint16 route stop with the day offset + 1 in the top two bits
+def reduced_trip_transfers(route_stops, route_stop_attributes, trip_times, trip_masks, walks_from) :
+    """ Yield the list of (route, trip, route stop, day offset) transfers of every event, in the order of the events.
+    trip_times holds the (arrivals, departures) of each trip of each route in 4-second units. """
+    DAY = 86400 >> 2
+    boardings_at = [[] for stop in walks_from] # (route, route stop) at which each stop can be boarded
+    departures_at = [] # per route and route stop, the sorted (departure, trip) of its running trips
+    for idx, stops in enumerate(route_stops) :
+        for s in range(len(stops) - 1) :
+            if stops[s] != 0xFFFFFFFF and route_stop_attributes[idx][s] & 2 :
+                boardings_at[stops[s]].append((idx, s))
+        departures_at.append([sorted((times[1][s], trip) for trip, times in enumerate(trip_times[idx]) if trip_masks[idx][trip])
+                              for s in range(len(stops))])
+    def soonest_trips(idx, s, time, mask) :
+        # Merge the departures seen from the arriving trip's service day, on the day before, the same day and the day
+        # after, taking each trip that is the soonest on some remaining day the arriving trip runs, for up to a day.
+        departures = departures_at[idx][s]
+        def later(day) :
+            for i in range(bisect.bisect_left(departures, (time - day * DAY,)), len(departures)) :
+                yield departures[i][0] + day * DAY, departures[i][1], day
+        for departure, trip, day in heapq.merge(later(-1), later(0), later(1)) :
+            if departure > time + DAY or mask == 0 :
+                break
+            m = trip_masks[idx][trip]
+            days = (m >> day if day >= 0 else m << -day) & mask
+            if days :
+                mask &= ~days
+                yield trip, day, days
+    for idx, stops in enumerate(route_stops) :
+        attributes = route_stop_attributes[idx]
+        for trip, (arrivals, departures) in enumerate(trip_times[idx]) :
+            mask = trip_masks[idx][trip]
+            best = {} # per stop, the soonest time it is reached after leaving the trip at or after the current stop
+            events = [[] for s in stops]
+            for i in range(len(stops) - 1, 0, -1) :
+                stop = stops[i]
+                if stop == 0xFFFFFFFF or not attributes[i] & 4 or mask == 0 :
+                    continue
+                for q, walk in walks_from[stop] :
+                    best[q] = min(best.get(q, 0xFFFFFFFF), arrivals[i] + walk)
+                for q, walk in walks_from[stop] :
+                    for idx2, j in boardings_at[q] :
+                        if idx2 == idx and j >= i :
+                            continue
+                        stops2 = route_stops[idx2]
+                        attributes2 = route_stop_attributes[idx2]
+                        for trip2, day, days in soonest_trips(idx2, j, arrivals[i] + walk, mask) :
+                            arrivals2, departures2 = trip_times[idx2][trip2]
+                            # a U-turn, when the trip could have been left at the stop where the other one goes next
+                            if (stops2[j + 1] == stops[i - 1] and attributes[i - 1] & 4 and attributes2[j + 1] & 2
+                                and arrivals[i - 1] <= departures2[j + 1] + day * DAY) :
+                                continue
+                            improves = False
+                            for k in range(j + 1, len(stops2)) :
+                                if stops2[k] == 0xFFFFFFFF or not attributes2[k] & 4 :
+                                    continue
+                                for q2, walk2 in walks_from[stops2[k]] :
+                                    if arrivals2[k] + day * DAY + walk2 < best.get(q2, 0xFFFFFFFF) :
+                                        improves = True
+                                        if days == mask :
+                                            best[q2] = arrivals2[k] + day * DAY + walk2
+                            if improves :
+                                events[i].append((idx2, trip2, j, day))
+            for transfers in events :
+                yield transfers
+
+print "computing trip-to-trip transfers"
+walks_from = [[(stop, 0)] for stop in range(nstops)] # (stop, time in 4-second units) walking from each stop
+for from_idx, to_idx, dist_meters in all_transfers :
+    if from_idx != to_idx :
+        walks_from[from_idx].append((to_idx, int(dist_meters / TRIP_TRANSFER_WALK_SPEED) >> 2))
+trip_times = []
+trip_masks = []
+for idx in range(nroutes) :
+    trip_times.append([([begin_time + stoptimes_written[stoptimes_offset + s][0] for s in range(route_n_stops[idx])],
+                        [begin_time + stoptimes_written[stoptimes_offset + s][1] for s in range(route_n_stops[idx])])
+                       for stoptimes_offset, begin_time in trips_for_route[idx]])
+    trip_masks.append([bitmask_for_sid.get(service_id_for_trip_id[tid], 0)
+                       for tid in all_trip_ids[trip_ids_offsets[idx]:trip_ids_offsets[idx + 1]]])
+write_text_comment("TRIP TRANSFERS")
+loc_trip_transfers = tell()
+out.write(struct.pack('f', TRIP_TRANSFER_WALK_SPEED))
+offset = 0
+for idx in range(nroutes) :
+    writeint(offset)
+    offset += route_n_stops[idx] * route_n_trips[idx]
+writeint(offset) # sentinel
+offset = 0
+trip_transfers = []
+for transfers in reduced_trip_transfers([all_route_stops[route_stops_offsets[idx]:route_stops_offsets[idx + 1]] for idx in range(nroutes)],
+                                        [all_route_stop_attributes[route_stops_offsets[idx]:route_stops_offsets[idx + 1]] for idx in range(nroutes)],
+                                        trip_times, trip_masks, walks_from) :
+    writeint(offset)
+    offset += len(transfers)
+    trip_transfers.extend(transfers)
+writeint(offset) # sentinel
+for idx, trip, route_stop, day in trip_transfers :
+    out.write(struct.pack('IHH', idx, trip, route_stop | ((day + 1) << 14)))
+print '%d trip-to-trip transfers' % len(trip_transfers)
+del trip_transfers
+
+# Optional section: the rides of all trips between consecutive stops, sorted by their departure time on the service day
+# of their trip, for the Connection Scan Algorithm. A query scans the same array once per service day. Ties are broken
+# by arrival time, so that a trip's connections stay in order when they take no time. Trips that never run are left out.
+# Layout, which must match tdata_load and connection_t:
+#   uint32 n_connections, then per connection uint32 departure stop, uint32 arrival stop, uint16 departure time,
+#   uint16 arrival time in 4-second units, uint32 global trip index with 1 << 31 when boarding is allowed at the
+#   departure stop and 1 << 30 when alighting is allowed at the arrival stop
+print "sorting connections"
+connections = []
+for idx in range(nroutes) :
+    stops = all_route_stops[route_stops_offsets[idx]:route_stops_offsets[idx + 1]]
+    attributes = all_route_stop_attributes[route_stops_offsets[idx]:route_stops_offsets[idx + 1]]
+    for trip, (arrivals, departures) in enumerate(trip_times[idx]) :
+        if not trip_masks[idx][trip] :
+            continue
+        trip_ref = trip_ids_offsets[idx] + trip
+        for s in range(len(stops) - 1) :
+            if stops[s] == 0xFFFFFFFF or stops[s + 1] == 0xFFFFFFFF or max(departures[s], arrivals[s + 1]) >= 0xFFFF :
+                continue
+            flags = (1 << 31 if attributes[s] & 2 else 0) | (1 << 30 if attributes[s + 1] & 4 else 0)
+            connections.append((departures[s], arrivals[s + 1], trip_ref, s, stops[s], stops[s + 1], flags))
+connections.sort()
+write_text_comment("CONNECTIONS")
+loc_connections = tell()
+writeint(len(connections))
+for departure, arrival, trip_ref, s, from_idx, to_idx, flags in connections :
+    out.write(struct.pack('IIHHI', from_idx, to_idx, departure, arrival, trip_ref | flags))
+print '%d connections' % len(connections)
+del trips_for_route, stoptimes_written, all_transfers, walks_from, trip_times, trip_masks, connections
+
+# Optional section: where each route serving a stop passes it, so that a search can begin scanning a route at the first
+# stop where it was reached rather than at its beginning. Layout, which must match tdata_load:
+#   uint16 route stop of each entry in ROUTES BY STOP, in the same order, padding to 4 bytes
+write_text_comment("ROUTE STOP POSITIONS BY STOP")
+loc_stop_route_positions = tell()
+out.write(struct.pack('%dH' % len(stop_route_positions), *stop_route_positions))
+align(4)
+del stop_route_positions
+
 print "reached end of timetable file"
-write_text_comment("END TTABLEV2")
+write_text_comment("END TTABLEV3")
 loc_eof = tell()
 print "rewinding and writing header... ",
 write_header()
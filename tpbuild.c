@@ -0,0 +1,165 @@
+/* Copyright 2013 Bliksem Labs. See the LICENSE file at the top-level directory of this distribution and at https://github.com/bliksemlabs/rrrr/. */
+
+/* tpbuild.c : precompute the transfer patterns between pairs of stops with profile searches over every calendar day */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "config.h"
+#include "tdata.h"
+#include "router.h"
+#include "transferpatterns.h"
+
+static struct option long_options[] = {
+    { "timetable", required_argument, NULL, 'T' },
+    { "output",    required_argument, NULL, 'o' },
+    { "pairs",     required_argument, NULL, 'p' },
+    { "days",      required_argument, NULL, 'n' },
+    { "help",      no_argument, NULL, 'h' },
+    { NULL, 0, 0, 0 } /* end */
+};
+
+typedef struct { uint32_t from, to; } od_t;
+
+static int compare_od (const void *a, const void *b) {
+    const od_t *x = a, *y = b;
+    if (x->from != y->from) return x->from < y->from ? -1 : 1;
+    if (x->to != y->to) return x->to < y->to ? -1 : 1;
+    return 0;
+}
+
+/* The pattern words of the pairs built so far. */
+static uint32_t *words = NULL;
+static uint32_t n_words = 0, words_capacity = 0;
+
+/* Append the pattern of an itinerary to the words, unless the pair already has it. Rides are the odd legs. */
+static void add_pattern (struct itinerary *itin, uint32_t pair_offset) {
+    uint32_t length = 1 + 2 * itin->n_rides;
+    if (n_words + length > words_capacity) {
+        words_capacity = words_capacity ? words_capacity * 2 : 4096;
+        words = (uint32_t *) realloc (words, sizeof(uint32_t) * words_capacity);
+        if (words == NULL) die ("failed to allocate transfer patterns");
+    }
+    uint32_t *pattern = words + n_words;
+    pattern[0] = itin->n_rides;
+    for (uint32_t r = 0; r < itin->n_rides; ++r) {
+        pattern[1 + 2 * r] = itin->legs[1 + 2 * r].s0;
+        pattern[2 + 2 * r] = itin->legs[1 + 2 * r].s1;
+    }
+    for (uint32_t *p = words + pair_offset; p < pattern; p += 1 + 2 * p[0]) {
+        if (memcmp (p, pattern, sizeof(uint32_t) * length) == 0) return;
+    }
+    n_words += length;
+}
+
+int main (int argc, char **argv) {
+    char *tdata_file = RRRR_INPUT_FILE;
+    char *output_file = RRRR_PATTERNS_FILE;
+    char *pairs_file = NULL;
+    uint32_t n_days = 32;
+    int opt = 0;
+    while (opt >= 0) {
+        opt = getopt_long (argc, argv, "T:o:p:n:h", long_options, NULL);
+        switch (opt) {
+        case 'T':
+            tdata_file = optarg;
+            break;
+        case 'o':
+            output_file = optarg;
+            break;
+        case 'p':
+            pairs_file = optarg;
+            break;
+        case 'n':
+            n_days = strtol (optarg, NULL, 10);
+            if (n_days > 32) n_days = 32;
+            break;
+        case 'h':
+            goto usage;
+        }
+    }
+
+    tdata_t tdata;
+    tdata_load (tdata_file, &tdata);
+    router_t router;
+    router_setup (&router, &tdata, RRRR_DEFAULT_ROUNDS);
+
+    /* The pairs to build patterns for, one "from_idx to_idx" per line, or else every pair of stops. */
+    od_t *pairs = NULL;
+    uint32_t n_pairs = 0;
+    if (pairs_file != NULL) {
+        FILE *f = fopen (pairs_file, "r");
+        if (f == NULL) die ("could not open pairs file");
+        uint32_t capacity = 1024, from, to;
+        pairs = (od_t *) malloc (sizeof(od_t) * capacity);
+        while (pairs != NULL && fscanf (f, "%u %u", &from, &to) == 2) {
+            if (from >= tdata.n_stops || to >= tdata.n_stops || from == to) continue;
+            if (n_pairs == capacity) pairs = (od_t *) realloc (pairs, sizeof(od_t) * (capacity *= 2));
+            if (pairs != NULL) pairs[n_pairs++] = (od_t) { from, to };
+        }
+        fclose (f);
+    } else {
+        fprintf (stderr, "no pairs file given, building patterns between all %d stops.\n", tdata.n_stops);
+        pairs = (od_t *) malloc (sizeof(od_t) * tdata.n_stops * (tdata.n_stops - 1));
+        for (uint32_t from = 0; pairs != NULL && from < tdata.n_stops; ++from)
+            for (uint32_t to = 0; to < tdata.n_stops; ++to)
+                if (from != to) pairs[n_pairs++] = (od_t) { from, to };
+    }
+    if (pairs == NULL) die ("failed to allocate pairs");
+    qsort (pairs, n_pairs, sizeof(od_t), compare_od);
+
+    transfer_patterns_t tp;
+    tp.calendar_start_time = tdata.calendar_start_time;
+    tp.n_stops = tdata.n_stops;
+    tp.n_pairs = 0;
+    tp.origins = (uint32_t *) malloc (sizeof(uint32_t) * (tdata.n_stops + 1));
+    tp.pairs = (tp_pair_t *) malloc (sizeof(tp_pair_t) * (n_pairs + 1));
+    if (tp.origins == NULL || tp.pairs == NULL) die ("failed to allocate transfer patterns");
+    uint32_t origin = 0;
+    struct profile profile = { .n_itineraries = 0, .capacity = 0, .itineraries = NULL };
+    for (uint32_t i = 0; i < n_pairs; ++i) {
+        if (i > 0 && compare_od (pairs + i, pairs + i - 1) == 0) continue;
+        while (origin <= pairs[i].from) tp.origins[origin++] = tp.n_pairs;
+        uint32_t pair_offset = n_words;
+        /* Every departure of every day, so that the patterns hold whenever the pair is queried. */
+        for (uint32_t day = 0; day < n_days; ++day) {
+            router_request_t req;
+            router_request_initialize (&req);
+            req.from = pairs[i].from;
+            req.to = pairs[i].to;
+            req.arrive_by = false;
+            req.day_mask = 1u << day;
+            req.time = RTIME_ONE_DAY;
+            req.time_window = RTIME_ONE_DAY - 1;
+            if ( ! router_route_profile (&router, &req, &profile)) continue;
+            for (uint32_t p = 0; p < profile.n_itineraries; ++p) add_pattern (profile.itineraries + p, pair_offset);
+        }
+        if (n_words == pair_offset) continue; // no patterns, so queries for this pair fall back to routing
+        tp.pairs[tp.n_pairs].to = pairs[i].to;
+        tp.pairs[tp.n_pairs].patterns_offset = pair_offset;
+        tp.n_pairs += 1;
+        if (i % 100 == 0) fprintf (stderr, "%d / %d pairs, %d words of patterns\n", i, n_pairs, n_words);
+    }
+    while (origin <= tdata.n_stops) tp.origins[origin++] = tp.n_pairs;
+    tp.pairs[tp.n_pairs].to = NONE;
+    tp.pairs[tp.n_pairs].patterns_offset = n_words;
+    tp.words = words;
+    tp.n_words = n_words;
+    tp_write (output_file, &tp);
+    printf ("wrote %d pairs with %d words of patterns to %s\n", tp.n_pairs, tp.n_words, output_file);
+
+    router_profile_free (&profile);
+    free (tp.origins);
+    free (tp.pairs);
+    free (words);
+    free (pairs);
+    router_teardown (&router);
+    tdata_close (&tdata);
+    exit (EXIT_SUCCESS);
+
+    usage:
+    printf ("Usage:\n%s [--timetable timetable.dat] [--output transferpatterns.dat] [--pairs pairs.txt] [--days n]\n", argv[0]);
+    exit (-2);
+}
+
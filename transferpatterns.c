@@ -0,0 +1,102 @@
+/* Copyright 2013 Bliksem Labs. See the LICENSE file at the top-level directory of this distribution and at https://github.com/bliksemlabs/rrrr/. */
+
+/* transferpatterns.c : reads and writes the precomputed transfer patterns file */
+
+#include "transferpatterns.h" // make sure it works alone
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "util.h"
+
+#define TP_VERSION "TPATTV01"
+
+// file-visible struct, followed by the origins, the pairs and the pattern words in that order
+typedef struct tp_header tp_header_t;
+struct tp_header {
+    char version_string[8]; // should read "TPATTV01"
+    uint64_t calendar_start_time;
+    uint32_t n_stops;
+    uint32_t n_pairs;
+    uint32_t n_words;
+    uint32_t loc_origins;
+    uint32_t loc_pairs;
+    uint32_t loc_words;
+};
+
+bool tp_load (char *filename, transfer_patterns_t *tp, tdata_t *tdata) {
+    tp->base = NULL;
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) return false;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < sizeof(tp_header_t)) {
+        close(fd);
+        return false;
+    }
+    void *b = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (b == (void*)(-1)) return false;
+    tp_header_t *header = b;
+    if (strncmp(TP_VERSION, header->version_string, 8) ||
+        header->n_stops != tdata->n_stops || header->calendar_start_time != tdata->calendar_start_time) {
+        fprintf(stderr, "transfer patterns in %s were not built for this timetable.\n", filename);
+        munmap(b, st.st_size);
+        return false;
+    }
+    tp->base = b;
+    tp->size = st.st_size;
+    tp->calendar_start_time = header->calendar_start_time;
+    tp->n_stops = header->n_stops;
+    tp->n_pairs = header->n_pairs;
+    tp->n_words = header->n_words;
+    tp->origins = (uint32_t *) (b + header->loc_origins);
+    tp->pairs = (tp_pair_t *) (b + header->loc_pairs);
+    tp->words = (uint32_t *) (b + header->loc_words);
+    return true;
+}
+
+void tp_close (transfer_patterns_t *tp) {
+    if (tp->base != NULL) munmap(tp->base, tp->size);
+    tp->base = NULL;
+}
+
+void tp_write (char *filename, transfer_patterns_t *tp) {
+    FILE *f = fopen(filename, "wb");
+    if (f == NULL) die("could not open transfer patterns output file");
+    tp_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.version_string, TP_VERSION, 8);
+    header.calendar_start_time = tp->calendar_start_time;
+    header.n_stops = tp->n_stops;
+    header.n_pairs = tp->n_pairs;
+    header.n_words = tp->n_words;
+    header.loc_origins = sizeof(header);
+    header.loc_pairs = header.loc_origins + sizeof(uint32_t) * (tp->n_stops + 1);
+    header.loc_words = header.loc_pairs + sizeof(tp_pair_t) * (tp->n_pairs + 1);
+    if (fwrite(&header, sizeof(header), 1, f) != 1 ||
+        fwrite(tp->origins, sizeof(uint32_t), tp->n_stops + 1, f) != tp->n_stops + 1 ||
+        fwrite(tp->pairs, sizeof(tp_pair_t), tp->n_pairs + 1, f) != tp->n_pairs + 1 ||
+        fwrite(tp->words, sizeof(uint32_t), tp->n_words, f) != tp->n_words)
+        die("could not write transfer patterns output file");
+    fclose(f);
+}
+
+bool tp_patterns (transfer_patterns_t *tp, uint32_t from, uint32_t to, uint32_t **begin, uint32_t **end) {
+    if (tp->base == NULL || from >= tp->n_stops) return false;
+    /* binary search the targets of the origin */
+    uint32_t lo = tp->origins[from], hi = tp->origins[from + 1];
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (tp->pairs[mid].to < to) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == tp->origins[from + 1] || tp->pairs[lo].to != to) return false;
+    *begin = tp->words + tp->pairs[lo].patterns_offset;
+    *end   = tp->words + tp->pairs[lo + 1].patterns_offset;
+    return true;
+}
+
@@ -0,0 +1,52 @@
+/* Copyright 2013 Bliksem Labs. See the LICENSE file at the top-level directory of this distribution and at https://github.com/bliksemlabs/rrrr/. */
+
+/* transferpatterns.h : precomputed optimal transfer patterns between pairs of stops, in a memory mapped file */
+
+#ifndef _TRANSFERPATTERNS_H
+#define _TRANSFERPATTERNS_H
+
+#include "tdata.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+  A transfer pattern is the sequence of stops where the rides of an optimal itinerary begin and end, without the times,
+  routes or trips. The patterns file holds the patterns of every pair of stops it was built for, grouped by origin.
+  It is only valid for the timetable it was built from, whose stop count and calendar start are recorded in it.
+*/
+
+/* One target of an origin stop. Its patterns run up to the patterns_offset of the next pair. */
+typedef struct tp_pair tp_pair_t;
+struct tp_pair {
+    uint32_t to;
+    uint32_t patterns_offset; // into the pattern words
+};
+
+typedef struct transfer_patterns transfer_patterns_t;
+struct transfer_patterns {
+    void *base;
+    size_t size;
+    uint64_t calendar_start_time;
+    uint32_t n_stops;
+    uint32_t n_pairs;
+    uint32_t n_words;
+    uint32_t *origins; // per origin stop, the index of its first pair, with a sentinel: n_stops + 1 entries
+    tp_pair_t *pairs;  // sorted by target within each origin, with a sentinel: n_pairs + 1 entries
+    uint32_t *words;   // per pattern, the number of rides followed by the board and alight stop of each ride
+};
+
+/* Map a patterns file into memory. Returns false if it cannot be read or was not built for the given timetable. */
+bool tp_load (char *filename, transfer_patterns_t *tp, tdata_t *tdata);
+
+void tp_close (transfer_patterns_t *tp);
+
+/* Write patterns held in memory (base is unused) to a file that tp_load can map. */
+void tp_write (char *filename, transfer_patterns_t *tp);
+
+/* Find the patterns from one stop to another, as words from *begin up to *end. Returns false if none were built. */
+bool tp_patterns (transfer_patterns_t *tp, uint32_t from, uint32_t to, uint32_t **begin, uint32_t **end);
+
+#endif // _TRANSFERPATTERNS_H
+
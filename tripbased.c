@@ -0,0 +1,249 @@
+/* Copyright 2013 Bliksem Labs. See the LICENSE file at the top-level directory of this distribution and at https://github.com/bliksemlabs/rrrr/. */
+
+/* tripbased.c : Trip-Based routing over the trip transfers of the timetable */
+
+#include "tripbased.h"
+#include "router_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Part of a trip reached in a Trip-Based search: it is boarded at one route stop and can be left at the following ones
+   up to and including the end stop, from where a sooner segment of the same trip already continues. */
+typedef struct tb_segment tb_segment_t;
+struct tb_segment {
+    uint32_t route_idx;
+    uint32_t parent;      // the segment left to board this one, NONE when it was boarded after walking from the origin
+    uint16_t trip;
+    uint16_t board;       // the route stop where the trip is boarded
+    uint16_t end;         // the last route stop where the trip can be left in this segment
+    uint16_t parent_stop; // the route stop where the parent segment was left
+    uint8_t  serviceday;  // the index of the service day in router->servicedays
+};
+
+/* The soonest arrival found for one number of rides, by leaving a segment at a route stop and walking to the target. */
+typedef struct tb_journey tb_journey_t;
+struct tb_journey {
+    uint32_t segment;
+    uint16_t alight;
+    rtime_t  arrival;
+};
+
+/* Queue the part of a trip not reached yet from the given route stop on. Trips later in the FIFO chain of the route on
+   the same service day can only do worse from that stop on, so they are marked as reached there too. */
+static void tb_enqueue (router_t *router, uint32_t *n_segments, uint32_t route_idx, uint32_t trip, uint32_t serviceday,
+                        uint32_t board, uint32_t parent, uint32_t parent_stop) {
+    tdata_t *tdata = router->tdata;
+    route_t *route = tdata->routes + route_idx;
+    uint16_t *reached = router->trip_reached + serviceday * tdata->n_trips + route->trip_ids_offset;
+    if (board >= reached[trip]) return;
+    if (*n_segments == router->segments_capacity) {
+        router->segments_capacity *= 2;
+        router->segments = (tb_segment_t *) realloc (router->segments, sizeof(tb_segment_t) * router->segments_capacity);
+        if (router->segments == NULL) die ("failed to allocate Trip-Based segments");
+    }
+    tb_segment_t *segment = router->segments + (*n_segments)++;
+    segment->route_idx = route_idx;
+    segment->parent = parent;
+    segment->trip = trip;
+    segment->board = board;
+    segment->end = reached[trip] < route->n_stops ? reached[trip] : route->n_stops - 1;
+    segment->parent_stop = parent_stop;
+    segment->serviceday = serviceday;
+    reached[trip] = board;
+    uint16_t *trip_order = tdata->departure_index + route->trip_ids_offset;
+    uint32_t n_fifo = tdata->n_fifo_trips[route_idx];
+    uint32_t pos = 0;
+    while (pos < n_fifo && trip_order[pos] != trip) ++pos;
+    for (++pos; pos < n_fifo; ++pos) {
+        if (reached[trip_order[pos]] > board) reached[trip_order[pos]] = board;
+    }
+}
+
+/* Board the soonest trip of every usable route at a stop reached at the given time, as the first ride. */
+static void tb_board_at (router_t *router, router_request_t *req, uint32_t *n_segments, uint32_t stop, rtime_t time) {
+    if (stop_banned (router, req, stop)) return;
+    if (stop_banned_hard (router, req, stop)) return;
+    uint32_t *routes;
+    uint32_t n_routes = tdata_routes_for_stop (router->tdata, stop, &routes);
+    for (uint32_t i = 0; i < n_routes; ++i) {
+        uint32_t route_idx = routes[i];
+        if ( ! route_usable (router, route_idx)) continue;
+        route_t *route = router->tdata->routes + route_idx;
+        route_view_t view;
+        route_view_setup (router, req, route_idx, &view);
+        for (uint32_t route_stop = 0; route_stop + 1 < route->n_stops; ++route_stop) {
+            if (view.stops[route_stop] != stop || ! (view.stop_attributes[route_stop] & rsa_boarding)) continue;
+            rtime_t board_time;
+            serviceday_t *serviceday = NULL;
+            uint32_t trip = route_earliest_trip (router, req, route_idx, &view, route_stop, time, &board_time, &serviceday);
+            if (trip == NONE) continue;
+            tb_enqueue (router, n_segments, route_idx, trip, serviceday - router->servicedays, route_stop, NONE, 0);
+        }
+    }
+}
+
+/* Follow the transfers found for leaving a segment's trip at one of its route stops at the given time. The transfers
+   were found at the timetable's walk speed without delays, so when one cannot be made with the request's walk speed
+   or filters, or because of delays or a skipped stop, the soonest trip that can be boarded at that route stop is taken
+   instead. */
+static void tb_transfer (router_t *router, router_request_t *req, uint32_t *n_segments, uint32_t segment_idx,
+                         uint32_t route_stop, rtime_t arrival) {
+    tdata_t *tdata = router->tdata;
+    tb_segment_t segment = router->segments[segment_idx];
+    uint32_t stop = tdata_stops_for_route (tdata, segment.route_idx)[route_stop];
+    trip_transfer_t *transfers;
+    uint32_t n_transfers = tdata_trip_transfers (tdata, segment.route_idx, segment.trip, route_stop, &transfers);
+    for (trip_transfer_t *tt = transfers; tt < transfers + n_transfers; ++tt) {
+        int32_t serviceday = segment.serviceday + TRIP_TRANSFER_DAY(tt);
+        if (serviceday < 0 || serviceday > 2 || ! route_usable (router, tt->route_idx)) continue;
+        uint32_t board = TRIP_TRANSFER_STOP(tt);
+        route_view_t view;
+        route_view_setup (router, req, tt->route_idx, &view);
+        uint32_t stop_to = view.stops[board];
+        if (stop_banned (router, req, stop_to)) continue;
+        if (stop_banned_hard (router, req, stop_to)) continue;
+        rtime_t walk = transfer_duration (router, stop, stop_to);
+        if (walk == UNREACHED || (uint32_t) arrival + walk > RTIME_THREE_DAYS) continue;
+        uint32_t trip = tt->trip;
+        serviceday_t *board_serviceday = router->servicedays + serviceday;
+        rtime_t departure = route_stoptime (&view.times, trip, board, false, board_serviceday);
+        if ( ! trip_usable (router, req, tt->route_idx, trip, view.times.trips, view.scan.trip_masks, view.scan.trip_attributes, board_serviceday) ||
+             departure == UNREACHED || departure < arrival + walk) {
+            rtime_t board_time;
+            trip = route_earliest_trip (router, req, tt->route_idx, &view, board, arrival + walk, &board_time, &board_serviceday);
+            if (trip == NONE) continue;
+        }
+        tb_enqueue (router, n_segments, tt->route_idx, trip, board_serviceday - router->servicedays, board, segment_idx, route_stop);
+    }
+}
+
+/* Turn the chain of segments ending in a journey into an itinerary, walking before every ride and after the last. */
+static void tb_journey_to_itinerary (router_t *router, router_request_t *req, tb_journey_t *journey, struct itinerary *itin) {
+    tdata_t *tdata = router->tdata;
+    uint32_t chain[RRRR_MAX_ROUNDS];
+    uint32_t n_rides = 0;
+    for (uint32_t s = journey->segment; s != NONE && n_rides < RRRR_MAX_ROUNDS; s = router->segments[s].parent) chain[n_rides++] = s;
+    itin->n_rides = n_rides;
+    itin->n_legs = n_rides * 2 + 1;
+    struct leg *l = itin->legs;
+    uint32_t stop = req->from;
+    rtime_t time = req->time;
+    for (uint32_t r = n_rides; r-- > 0; ) {
+        tb_segment_t *segment = router->segments + chain[r];
+        uint32_t alight = r > 0 ? router->segments[chain[r - 1]].parent_stop : journey->alight;
+        uint32_t *route_stops = tdata_stops_for_route (tdata, segment->route_idx);
+        trip_t *trip = tdata_trips_for_route (tdata, segment->route_idx) + segment->trip;
+        serviceday_t *serviceday = router->servicedays + segment->serviceday;
+        l->s0 = stop;
+        l->s1 = route_stops[segment->board];
+        l->t0 = time;
+        l->t1 = time + transfer_duration (router, stop, l->s1);
+        l->route = WALK;
+        l->trip  = WALK;
+        l += 1;
+        l->s0 = route_stops[segment->board];
+        l->s1 = route_stops[alight];
+        l->t0 = tdata_stoptime (tdata, trip, segment->board, false, serviceday);
+        l->t1 = tdata_stoptime (tdata, trip, alight, true, serviceday);
+        l->route = segment->route_idx;
+        l->trip  = segment->trip;
+        stop = l->s1;
+        time = l->t1;
+        l += 1;
+    }
+    l->s0 = stop;
+    l->s1 = req->to;
+    l->t0 = time;
+    l->t1 = journey->arrival;
+    l->route = WALK;
+    l->trip  = WALK;
+}
+
+/*
+  Answer a request with Trip-Based routing: a breadth-first search over segments of trips, where each level holds the
+  segments reached with one more ride, following the trip-to-trip transfers precomputed in the timetable instead of
+  looking up boardings at every stop. The plan holds the soonest arrival for each number of rides that improves on
+  fewer rides, like router_result_to_plan. Returns false if the timetable has no trip transfers or the request is not
+  supported, which is the case for arrive-by and on-board requests, those with a via stop and those walking at another
+  speed than the transfers were computed for, or if nothing is found. The transfers were reduced without the filters
+  of the request, so a filtered search may miss a transfer that was dropped in favour of one it now excludes.
+*/
+bool router_route_trips (router_t *router, router_request_t *req, struct plan *plan) {
+    tdata_t *tdata = router->tdata;
+    plan->req = *req;
+    plan->n_itineraries = 0;
+    if (tdata->trip_transfers == NULL || req->arrive_by || req->start_trip_trip != NONE || req->via != NONE) return false;
+    if (req->walk_speed != tdata->tt_walk_speed) return false;
+    if (router->trip_reached == NULL) {
+        router->trip_reached = (uint16_t *) malloc (sizeof(uint16_t) * tdata->n_trips * 3);
+        router->segments_capacity = 1024;
+        router->segments = (tb_segment_t *) malloc (sizeof(tb_segment_t) * router->segments_capacity);
+        if (router->trip_reached == NULL || router->segments == NULL) die ("failed to allocate Trip-Based scratch space");
+    }
+    memset (router->trip_reached, 0xFF, sizeof(uint16_t) * tdata->n_trips * 3);
+    router_setup_servicedays (router, req);
+    router_compile_request (router, req);
+    router->origin = req->from;
+    router->target = req->to;
+
+    /* The stops from which the target can be reached on foot, reset again when the search is done. */
+    walk_to_target_setup (router, req);
+
+    /* The first rides, boarded at the origin or after walking from it. */
+    uint32_t n_segments = 0;
+    tb_board_at (router, req, &n_segments, req->from, req->time);
+    if ( ! stop_banned (router, req, req->from)) {
+        uint32_t tr     = tdata->stops[req->from    ].transfers_offset;
+        uint32_t tr_end = tdata->stops[req->from + 1].transfers_offset;
+        for ( ; tr < tr_end ; ++tr) {
+            uint32_t time = req->time + router->walk_durations[tr];
+            if (time > RTIME_THREE_DAYS) continue;
+            tb_board_at (router, req, &n_segments, tdata->transfer_target_stops[tr], time);
+        }
+    }
+
+    uint32_t n_rides = request_rounds (router, req);
+    rtime_t best_arrival = req->time_cutoff == UNREACHED ? UNREACHED : req->time_cutoff + 1;
+    /* Rides must beat walking straight to the target, as in router_route. */
+    if (router->walk_to_target[req->from] != UNREACHED && req->time + router->walk_to_target[req->from] < best_arrival)
+        best_arrival = req->time + router->walk_to_target[req->from];
+    tb_journey_t best[RRRR_MAX_ROUNDS];
+    for (uint32_t r = 0; r < RRRR_MAX_ROUNDS; ++r) best[r].segment = NONE;
+    uint32_t level_begin = 0;
+    for (uint32_t ride = 0; ride < n_rides && level_begin < n_segments; ++ride) {
+        uint32_t level_end = n_segments;
+        for (uint32_t s = level_begin; s < level_end; ++s) {
+            tb_segment_t segment = router->segments[s];
+            route_view_t view;
+            route_view_setup (router, req, segment.route_idx, &view);
+            serviceday_t *serviceday = router->servicedays + segment.serviceday;
+            for (uint32_t route_stop = segment.board + 1; route_stop <= segment.end; ++route_stop) {
+                uint32_t stop = view.stops[route_stop];
+                if (stop_banned_hard (router, req, stop)) break;
+                if ( ! (view.stop_attributes[route_stop] & rsa_alighting)) continue;
+                rtime_t arrival = route_stoptime (&view.times, segment.trip, route_stop, true, serviceday);
+                /* The trip cannot be left where it skips the stop. Otherwise arrivals along a trip never decrease, so nothing
+                   further along can improve on the best arrival. */
+                if (arrival == UNREACHED) continue;
+                if (arrival >= best_arrival) break;
+                if (router->walk_to_target[stop] != UNREACHED && arrival + router->walk_to_target[stop] < best_arrival &&
+                    ! stop_banned (router, req, stop)) {
+                    best_arrival = arrival + router->walk_to_target[stop];
+                    best[ride] = (tb_journey_t) { s, route_stop, best_arrival };
+                }
+                if (ride + 1 == n_rides || stop_banned (router, req, stop)) continue;
+                tb_transfer (router, req, &n_segments, s, route_stop, arrival);
+            }
+        }
+        level_begin = level_end;
+    }
+
+    walk_to_target_reset (router, req);
+    for (uint32_t r = 0; r < RRRR_MAX_ROUNDS; ++r) {
+        if (best[r].segment == NONE) continue;
+        tb_journey_to_itinerary (router, req, best + r, plan->itineraries + plan->n_itineraries++);
+    }
+    return plan->n_itineraries > 0;
+}
+
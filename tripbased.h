@@ -0,0 +1,17 @@
+/* Copyright 2013 Bliksem Labs. See the LICENSE file at the top-level directory of this distribution and at https://github.com/bliksemlabs/rrrr/. */
+
+/* tripbased.h : Trip-Based routing, following the precomputed transfers between trips */
+
+#ifndef _TRIPBASED_H
+#define _TRIPBASED_H
+
+#include "router.h"
+
+#include <stdbool.h>
+
+/* Fill in a plan with the soonest arrival for every number of rides of a depart-after request. Requires the trip
+   transfers in the timetable. */
+bool router_route_trips (router_t*, router_request_t*, struct plan*);
+
+#endif // _TRIPBASED_H
+
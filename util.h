@@ -37,6 +37,7 @@ typedef uint16_t rtime_t;
 #define WALK      (UINT32_MAX - 1)
 #define ONBOARD   (UINT32_MAX - 2)
 #define CANCELED  INT16_MAX
+#define STOP_UPDATES INT16_MIN // in place of the delay of a trip: its delays are given per stop
 
 #define AGENCY_UNFILTERED (UINT16_MAX)
 
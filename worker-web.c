@@ -4,6 +4,7 @@
 
 #include <syslog.h>
 #include <stdlib.h>
+#include <string.h>
 #include <zmq.h>
 #include <czmq.h>
 #include <assert.h>
@@ -15,6 +16,23 @@
 #include "parse.h"
 #include "json.h"
 
+/* Apply the batches of real-time deltas that came in since the last request, remembering the version they led to. */
+static void apply_realtime (tdata_t *tdata, void *zsub, uint32_t *version) {
+    zframe_t *frame;
+    while ((frame = zframe_recv_nowait (zsub)) != NULL) {
+        tdata_realtime_batch_t *batch = (tdata_realtime_batch_t *) zframe_data (frame);
+        if ( ! tdata_realtime_apply_deltas (tdata, batch, zframe_size (frame))) {
+            syslog (LOG_WARNING, "worker received malformed real-time deltas");
+        } else {
+            if ( ! batch->full && *version != NONE && batch->version != *version + 1)
+                syslog (LOG_WARNING, "worker missed real-time versions %d to %d, catching up at the next full batch",
+                        *version + 1, batch->version - 1);
+            *version = batch->version;
+        }
+        zframe_destroy (&frame);
+    }
+}
+
 int main(int argc, char **argv) {
 
     /* SETUP */
@@ -36,9 +54,11 @@ int main(int argc, char **argv) {
     }
     HashGrid_init (&hg, 100, 500.0, coords, tdata.n_stops);
 
-    // initialize router
+    // initialize router, searching as many rounds as the timetable needs: its only argument, if given
+    uint32_t max_rounds = argc > 1 ? strtol(argv[1], NULL, 10) : RRRR_DEFAULT_ROUNDS;
     router_t router;
-    router_setup(&router, &tdata);
+    router_setup(&router, &tdata, max_rounds);
+    syslog(LOG_INFO, "worker searches up to %d rounds", router.max_rounds);
     //tdata_dump(&tdata); // debug timetable file format
 
     // establish zmq connection
@@ -47,6 +67,13 @@ int main(int argc, char **argv) {
     uint32_t zrc = zsocket_connect(zsock, WORKER_ENDPOINT);
     if (zrc != 0) exit(1);
 
+    // follow the real-time deltas published by rrrrealtime, applied between requests
+    void *zsub = zsocket_new(zctx, ZMQ_SUB);
+    zsocket_set_subscribe(zsub, "");
+    zrc = zsocket_connect(zsub, REALTIME_ENDPOINT);
+    if (zrc != 0) exit(1);
+    uint32_t realtime_version = NONE;
+
     // signal to the broker/load balancer that this worker is ready
     zframe_t *frame = zframe_new (WORKER_READY, 1);
     zframe_send (&frame, zsock, 0);
@@ -56,6 +83,13 @@ int main(int argc, char **argv) {
     uint32_t request_count = 0;
     char result_buf[8000];
     while (true) {
+        zmq_pollitem_t items [] = {
+            { zsock, 0, ZMQ_POLLIN, 0 },
+            { zsub,  0, ZMQ_POLLIN, 0 }
+        };
+        if (zmq_poll (items, 2, -1) == -1) break; // interrupted (signal)
+        if (items [1].revents & ZMQ_POLLIN) apply_realtime (&tdata, zsub, &realtime_version);
+        if ( ! (items [0].revents & ZMQ_POLLIN)) continue;
         zmsg_t *msg = zmsg_recv (zsock);
         if (!msg) // interrupted (signal)
             break;
@@ -66,29 +100,40 @@ int main(int argc, char **argv) {
         char *qstring = (char *) zframe_data (frame);
         printf("%s\n", qstring);
         router_request_t preq;
-        parse_request_from_qstring(&preq, &tdata, &hg, qstring);
-        router_request_t req;
-        req = preq;
-
-        router_route (&router, &req);
-
-        // repeat search in reverse to compact transfers
-        uint32_t n_reversals = req.arrive_by ? 1 : 2;
-        if (req.start_trip_trip != NONE) n_reversals = 0;
-        // n_reversals = 0; // DEBUG turn off reversals
+        router_request_initialize (&preq);
+        if ( ! parse_request_from_qstring(&preq, &tdata, &hg, qstring)) {
+            char *error = "{\"error\":\"request could not be honoured\"}";
+            zframe_reset (frame, error, strlen (error));
+            zmsg_send (&msg, zsock);
+            continue;
+        }
+        // route on one version of the real-time data, again if the updater overwrote it in the meantime
+        uint32_t version, result_length;
+        do {
+            version = tdata_realtime_snapshot (&tdata);
+            router_request_t req;
+            req = preq;
 
-        for (uint32_t i = 0; i < n_reversals; ++i) {
-            router_request_reverse (&router, &req); // handle case where route is not reversed
             router_route (&router, &req);
-        }
-        router_request_dump (&router, &preq);
-        router_result_dump(&router, &req, result_buf, 8000);
-        printf("%s", result_buf);
-
-        struct plan plan;
-        router_result_to_plan (&plan, &router, &req);
-        plan.req.time = preq.time; // restore the original request time
-        uint32_t result_length = render_plan_json (&plan, router.tdata, result_buf, 8000);
+
+            // repeat search in reverse to compact transfers
+            uint32_t n_reversals = req.arrive_by ? 1 : 2;
+            if (req.start_trip_trip != NONE) n_reversals = 0;
+            // n_reversals = 0; // DEBUG turn off reversals
+
+            for (uint32_t i = 0; i < n_reversals; ++i) {
+                router_request_reverse (&router, &req); // handle case where route is not reversed
+                router_route (&router, &req);
+            }
+            router_request_dump (&router, &preq);
+            router_result_dump(&router, &req, result_buf, 8000);
+            printf("%s", result_buf);
+
+            struct plan plan;
+            router_result_to_plan (&plan, &router, &req);
+            plan.req.time = preq.time; // restore the original request time
+            result_length = render_plan_json (&plan, router.tdata, result_buf, 8000);
+        } while ( ! tdata_realtime_consistent (&tdata, version));
 
         zframe_reset (frame, result_buf, result_length);
         // send response to broker, thereby requesting more work
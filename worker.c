@@ -11,10 +11,56 @@
 #include "rrrr.h"
 #include "tdata.h"
 #include "router.h"
+#include "tripbased.h"
+#include "csa.h"
 #include "json.h"
 
 #define OUTPUT_LEN 64000
 
+/* Apply the batches of real-time deltas that came in since the last request, remembering the version they led to. */
+static void apply_realtime (tdata_t *tdata, void *zsub, uint32_t *version) {
+    zframe_t *frame;
+    while ((frame = zframe_recv_nowait (zsub)) != NULL) {
+        tdata_realtime_batch_t *batch = (tdata_realtime_batch_t *) zframe_data (frame);
+        if ( ! tdata_realtime_apply_deltas (tdata, batch, zframe_size (frame))) {
+            syslog (LOG_WARNING, "worker received malformed real-time deltas");
+        } else {
+            if ( ! batch->full && *version != NONE && batch->version != *version + 1)
+                syslog (LOG_WARNING, "worker missed real-time versions %d to %d, catching up at the next full batch",
+                        *version + 1, batch->version - 1);
+            *version = batch->version;
+        }
+        zframe_destroy (&frame);
+    }
+}
+
+/* Route one request and render its plan into the buffer, returning its length. */
+static uint32_t handle_request (router_t *router, transfer_patterns_t *tp, router_request_t *preq, char *result_buf) {
+    router_request_t req = *preq; // protective copy, since we're going to reverse it
+    D printf ("Searching with request: \n");
+    I router_request_dump (router, &req);
+    struct plan plan;
+    if ((req.engine == e_trip_based && router_route_trips (router, &req, &plan)) ||
+        (req.engine == e_csa && router_route_csa (router, &req, &plan)) ||
+        router_route_patterns (router, &req, tp, &plan)) {
+        return render_plan_json (&plan, router->tdata, result_buf, OUTPUT_LEN);
+    }
+    router_route (router, &req);
+    // repeat search in reverse to compact transfers
+    uint32_t n_reversals = req.arrive_by ? 1 : 2;
+    //n_reversals = 0; // DEBUG turn off reversals
+    for (uint32_t i = 0; i < n_reversals; ++i) {
+        router_request_reverse (router, &req); // handle case where route is not reversed
+        D printf ("Repeating search with reversed request: \n");
+        D router_request_dump (router, &req);
+        router_route (router, &req);
+    }
+    // uint32_t result_length = router_result_dump(router, &req, result_buf, OUTPUT_LEN);
+    router_result_to_plan (&plan, router, &req);
+    plan.req.time = preq->time; // restore the original request time
+    return render_plan_json (&plan, router->tdata, result_buf, OUTPUT_LEN);
+}
+
 int main(int argc, char **argv) {
 
     /* SETUP */
@@ -28,17 +74,31 @@ int main(int argc, char **argv) {
     tdata_t tdata;
     tdata_load(RRRR_INPUT_FILE, &tdata);
 
-    // initialize router
+    // initialize router, searching as many rounds as the timetable needs: its only argument, if given
+    uint32_t max_rounds = argc > 1 ? strtol(argv[1], NULL, 10) : RRRR_DEFAULT_ROUNDS;
     router_t router;
-    router_setup(&router, &tdata);
+    router_setup(&router, &tdata, max_rounds);
+    syslog(LOG_INFO, "worker searches up to %d rounds", router.max_rounds);
     //tdata_dump(&tdata); // debug timetable file format
 
+    // precomputed transfer patterns answer the pairs they were built for, when present
+    transfer_patterns_t tp;
+    if (tp_load(RRRR_PATTERNS_FILE, &tp, &tdata))
+        syslog(LOG_INFO, "worker loaded transfer patterns for %d pairs of stops", tp.n_pairs);
+
     // establish zmq connection
     zctx_t *zctx = zctx_new ();
     void *zsock = zsocket_new(zctx, ZMQ_REQ);
     uint32_t zrc = zsocket_connect(zsock, WORKER_ENDPOINT);
     if (zrc != 0) exit(1);
 
+    // follow the real-time deltas published by rrrrealtime, applied between requests
+    void *zsub = zsocket_new(zctx, ZMQ_SUB);
+    zsocket_set_subscribe(zsub, "");
+    zrc = zsocket_connect(zsub, REALTIME_ENDPOINT);
+    if (zrc != 0) exit(1);
+    uint32_t realtime_version = NONE;
+
     // signal to the broker/load balancer that this worker is ready
     zframe_t *frame = zframe_new (WORKER_READY, 1);
     zframe_send (&frame, zsock, 0);
@@ -48,6 +108,13 @@ int main(int argc, char **argv) {
     uint32_t request_count = 0;
     char result_buf[OUTPUT_LEN];
     while (true) {
+        zmq_pollitem_t items [] = {
+            { zsock, 0, ZMQ_POLLIN, 0 },
+            { zsub,  0, ZMQ_POLLIN, 0 }
+        };
+        if (zmq_poll (items, 2, -1) == -1) break; // interrupted (signal)
+        if (items [1].revents & ZMQ_POLLIN) apply_realtime (&tdata, zsub, &realtime_version);
+        if ( ! (items [0].revents & ZMQ_POLLIN)) continue;
         zmsg_t *msg = zmsg_recv (zsock);
         if (!msg) // interrupted (signal)
             break;
@@ -58,25 +125,12 @@ int main(int argc, char **argv) {
         if (zframe_size (frame) == sizeof (router_request_t)) {
             router_request_t *preq;
             preq = (router_request_t*) zframe_data (frame);
-            router_request_t req = *preq; // protective copy, since we're going to reverse it
-            D printf ("Searching with request: \n");
-            I router_request_dump (&router, &req);
-            router_route (&router, &req);
-            // repeat search in reverse to compact transfers
-            uint32_t n_reversals = req.arrive_by ? 1 : 2;
-            //n_reversals = 0; // DEBUG turn off reversals
-            for (uint32_t i = 0; i < n_reversals; ++i) {
-                router_request_reverse (&router, &req); // handle case where route is not reversed
-                D printf ("Repeating search with reversed request: \n");
-                D router_request_dump (&router, &req);
-                router_route (&router, &req);
-            }
-            // uint32_t result_length = router_result_dump(&router, &req, result_buf, OUTPUT_LEN);
-            struct plan plan;
-            router_result_to_plan (&plan, &router, &req);
-            plan.req.time = preq->time; // restore the original request time
-            uint32_t result_length = render_plan_json (&plan, router.tdata, result_buf, OUTPUT_LEN);
-
+            // route on one version of the real-time data, again if the updater overwrote it in the meantime
+            uint32_t version, result_length;
+            do {
+                version = tdata_realtime_snapshot (&tdata);
+                result_length = handle_request (&router, &tp, preq, result_buf);
+            } while ( ! tdata_realtime_consistent (&tdata, version));
             zframe_reset (frame, result_buf, result_length);
         } else {
             syslog (LOG_WARNING, "worker received reqeust with wrong length");
@@ -92,6 +146,7 @@ int main(int argc, char **argv) {
     // zframe_send (&frame, zmq_sock, 0);
     // syslog(LOG_INFO, "departure message sent to load balancer");
     // zmsg_t *msg = zmsg_recv (zmq_sock);
+    tp_close(&tp);
     router_teardown(&router);
     tdata_close(&tdata);
     zctx_destroy (&zctx); //zmq_close(socket) necessary before context destroy?